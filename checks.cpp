@@ -23,12 +23,22 @@
 #include <array>
 #include <cstdint>
 #include <unordered_map>
+#include <mutex>
+#include <set>
+#include <numeric>
+#include <algorithm>
+#include <fstream>
 #include <ftw.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "mmap_util.h"
 #include "bucket_array.hpp"
 #include "bucket_map.hpp"
+#include "bucket_set.hpp"
+#include "coroutine_lookup.hpp"
+#include "direct_reader.hpp"
+#include "frozen_map.hpp"
 
 using namespace ssdmap;
 
@@ -44,7 +54,7 @@ uint64_t xorshift128(void) {
     return w;
 }
 
-void correctness_check(const std::string &filename, size_t initial_size, size_t test_size, bool systematic_test, bool stop_fail = false)
+void correctness_check(const std::string &filename, size_t initial_size, size_t test_size, bool systematic_test, bool stop_fail = false, const bucket_map_options& options = bucket_map_options())
 {
     if (systematic_test) {
         std::cout << "Systematic correctness check:\n";
@@ -54,7 +64,7 @@ void correctness_check(const std::string &filename, size_t initial_size, size_t
     std::cout << "Initial size: " << initial_size;
     std::cout << ", test size: " << test_size << std::endl;
     
-    bucket_map<uint64_t,uint64_t> bm(filename,initial_size); // 700 => 4 buckets
+    bucket_map<uint64_t,uint64_t> bm(filename,initial_size,options); // 700 => 4 buckets
     std::map<uint64_t, uint64_t> ref_map;
     
     std::cout << "Fill the map ..." << std::flush;
@@ -183,12 +193,12 @@ void access_check(const std::string &filename, size_t initial_size, size_t test_
     }
 }
 
-void persistency_check(const std::string &filename, size_t test_size, bool stop_fail = false)
+void persistency_check(const std::string &filename, size_t test_size, bool stop_fail = false, const bucket_map_options& options = bucket_map_options())
 {
     std::cout << "Persistency check:\n";
     std::cout << "Test size: " << test_size << std::endl;
     
-    bucket_map<uint64_t,uint64_t> *bm = new bucket_map<uint64_t,uint64_t>(filename,700); // 700 => 4 buckets
+    bucket_map<uint64_t,uint64_t> *bm = new bucket_map<uint64_t,uint64_t>(filename,700,options); // 700 => 4 buckets
     std::map<uint64_t, uint64_t> ref_map;
     
     std::cout << "Fill the map ..." << std::flush;
@@ -244,6 +254,75 @@ void persistency_check(const std::string &filename, size_t test_size, bool stop_
     
 }
 
+void resize_persistency_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Resize persistency check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t,uint64_t> *bm = new bucket_map<uint64_t,uint64_t>(filename,700,options); // 700 => 4 buckets
+    std::map<uint64_t, uint64_t> ref_map;
+    
+    std::cout << "Fill the map and close it while resizing ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, k);
+        ref_map[k] = k;
+    }
+    
+    bm->start_resize();
+    
+    // a few additions split some of the buckets, but not all of them
+    for (size_t i = 0; i < 4; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, k);
+        ref_map[k] = k;
+    }
+    
+    delete bm;
+    
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Read from disk and keep filling ..." << std::flush;
+    
+    bm = new bucket_map<uint64_t,uint64_t>(filename,700); // 700 => 4 buckets
+    
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, k);
+        ref_map[k] = k;
+    }
+    
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Test consistency ..." << std::endl;
+    
+    size_t fail_count = 0;
+    for(auto &x : ref_map)
+    {
+        uint64_t v;
+        bool s = bm->get(x.first, v);
+        
+        if ((!s || v != x.second)) {
+            fail_count++;
+        }
+    }
+    
+    if (bm->size() != ref_map.size()) {
+        fail_count++;
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Resize persistency check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Resize persistency check passed\n\n";
+    }
+    
+    delete bm;
+}
+
 /* Call unlink or rmdir on the path, as appropriate. */
 int
 rm( const char *path, const struct stat *s, int flag, struct FTW *f )
@@ -295,46 +374,2256 @@ void iterator_check(const std::string &filename, size_t initial_size, size_t tes
     }
 }
 
-void clean(const std::list<std::string> &file_list)
+struct colliding_hash
 {
-    for (auto &fn : file_list) {
-        nftw( fn.data(), rm, 2, FTW_DEPTH );
+    size_t operator()(uint64_t k) const
+    {
+        return k & 0xFFF;
     }
-}
+};
 
-int main(int argc, const char * argv[]) {
+void collision_check(const std::string &filename, size_t test_size)
+{
+    std::cout << "Hash collision check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
     
-    srand ((unsigned int)time(NULL));
-    x = rand() + (((uint64_t)rand()) << 32);
-    y = rand() + (((uint64_t)rand()) << 32);
-    z = rand() + (((uint64_t)rand()) << 32);
-    w = rand() + (((uint64_t)rand()) << 32);
+    // only 4096 hash values: most of the elements end up in the overflow bucket
+    bucket_map<uint64_t,uint64_t,colliding_hash> bm(filename,700); // 700 => 4 buckets
+    std::map<uint64_t, uint64_t> ref_map;
     
-//    std::cout << "x = " << x << std::endl;
-//    std::cout << "y = " << y << std::endl;
-//    std::cout << "z = " << z << std::endl;
-//    std::cout << "w = " << w << std::endl;
+    std::cout << "Fill the map ..." << std::flush;
     
-    std::cout << "Pre-cleaning ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        
+        bm.add(k, k);
+        ref_map[k] = k;
+    }
+    
+    std::cout << " done\n";
+    std::cout << "Overflow: " << bm.overflow_size() << " elements, " << bm.overflow_memory_usage() << " bytes\n";
+    
+    size_t fail_count = 0;
+    
+    for(auto &x : ref_map)
+    {
+        uint64_t v;
+        bool s = bm.get(x.first, v);
+        
+        if ((!s || v != x.second)) {
+            fail_count++;
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Hash collision check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Hash collision check passed\n\n";
+    }
+}
 
-    clean({"correctness_map.dat", "systematic_correctness_map.dat", "access_test.dat", "persistency_test.dat", "it_test.dat"});
+void reserve_check(const std::string &filename, size_t initial_fill, size_t test_size, unsigned int threads, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Reserve check:\n";
+    std::cout << "Initial fill: " << initial_fill << ", test size: " << test_size << ", threads: " << threads << std::endl;
     
-    std::cout << " done\n\n" << std::endl;
+    bucket_map_options manual_options = options;
+    manual_options.resize.automatic = false;
     
+    bucket_map<uint64_t,uint64_t> *bm = new bucket_map<uint64_t,uint64_t>(filename,700,manual_options); // 700 => 4 buckets
+    std::map<uint64_t, uint64_t> ref_map;
     
-    correctness_check("correctness_map.dat", 700, 1<<20, false, false);
+    size_t fail_count = 0;
     
-    correctness_check("systematic_correctness_map.dat", 700, 1<<14, true, true);
+    std::cout << "Fill the map without resizing ..." << std::flush;
+    for (size_t i = 0; i < initial_fill; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, k);
+        ref_map[k] = k;
+    }
+    
+    if (bm->doublings_count() != 0 || !bm->needs_resize()) {
+        fail_count++;
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Resize a few buckets ..." << std::flush;
+    
+    size_t remaining = bm->advance_resize(3);
+    
+    if (!bm->is_resizing() || remaining == 0) {
+        fail_count++;
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Reserve and fill ..." << std::flush;
+    
+    bm->reserve(test_size, threads);
+    
+    size_t doublings = bm->doublings_count();
+    
+    for (size_t i = initial_fill; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, k);
+        ref_map[k] = k;
+    }
+    
+    // the reservation must be enough, even with the default policy
+    resize_policy policy;
+    policy.step_iterations = 2;
+    bm->set_resize_policy(policy);
+    
+    if (bm->doublings_count() != doublings || bm->is_resizing() || bm->load() > policy.target_load) {
+        fail_count++;
+    }
+    
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Reopen the map ..." << std::flush;
+    
+    delete bm;
+    bm = new bucket_map<uint64_t,uint64_t>(filename);
+    
+    if (bm->get_resize_policy().step_iterations != 2 || !bm->get_resize_policy().automatic) {
+        fail_count++;
+    }
+    
+    std::cout << " done" << std::endl;
+    
+    for(auto &x : ref_map)
+    {
+        uint64_t v;
+        bool s = bm->get(x.first, v);
+        
+        if ((!s || v != x.second)) {
+            fail_count++;
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Reserve check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Reserve check passed\n\n";
+    }
+    
+    delete bm;
+}
 
-    access_check("access_test.dat", 5000, 10000,true);
+void scan_check(const std::string &filename, size_t test_size, unsigned int threads, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Parallel scan check:\n";
+    std::cout << "Test size: " << test_size << ", threads: " << threads << std::endl;
     
-    persistency_check("persistency_test.dat", 1 << 20);
+    bucket_map<uint64_t,uint64_t> bm(filename,700,options); // 700 => 4 buckets
+    std::map<uint64_t, uint64_t> ref_map;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        
+        bm.add(k, k);
+        ref_map[k] = k;
+    }
+    
+    // scan in the middle of a resize
+    bm.start_resize();
+    
+    for (size_t i = 0; i < 4; i++) {
+        uint64_t k = xorshift128();
+        
+        bm.add(k, k);
+        ref_map[k] = k;
+    }
+    std::cout << " done" << std::endl;
+    
+    size_t fail_count = 0;
+    
+    // the partitions must cover all the buckets
+    std::vector<bucket_range> ranges = bm.partitions(threads);
+    size_t expected_begin = 0;
+    
+    for (auto &r : ranges) {
+        if (r.begin != expected_begin || r.end <= r.begin) {
+            fail_count++;
+        }
+        expected_begin = r.end;
+    }
+    if (expected_begin != bm.bucket_count()) {
+        fail_count++;
+    }
+    
+    std::cout << "Scan ..." << std::flush;
+    
+    std::mutex visited_mutex;
+    std::map<uint64_t, size_t> visited;
+    
+    bm.parallel_for_each([&](const std::pair<const uint64_t, uint64_t>& elt)
+    {
+        std::lock_guard<std::mutex> lock(visited_mutex);
+        
+        if (elt.second != elt.first) {
+            fail_count++;
+        }
+        visited[elt.first]++;
+    }, threads);
+    
+    std::cout << " done" << std::endl;
+    
+    // every element must be visited exactly once
+    for (auto &x : ref_map) {
+        auto it = visited.find(x.first);
+        
+        if (it == visited.end() || it->second != 1) {
+            fail_count++;
+        }
+    }
+    
+    if (visited.size() != ref_map.size()) {
+        fail_count++;
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Parallel scan check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Parallel scan check passed\n\n";
+    }
+}
 
-    iterator_check("it_test.dat", 100, 100000);
+void checkpoint_check(const std::string &filename, size_t test_size)
+{
+    std::cout << "Checkpoint check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t,uint64_t> *bm = new bucket_map<uint64_t,uint64_t>(filename,700); // 700 => 4 buckets
+    std::map<uint64_t, uint64_t> ref_map;
+    
+    size_t fail_count = 0;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0; i < test_size/2; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, k);
+        ref_map[k] = k;
+    }
+    std::cout << " done" << std::endl;
+    
+    // only the dirty pages are written
+    if (bm->dirty_bytes() == 0 || bm->checkpoint() == 0 || bm->dirty_bytes() != 0 || bm->checkpoint() != 0) {
+        fail_count++;
+    }
+    
+    // a write through at() is written back by the two next checkpoints
+    auto it = ref_map.begin();
+    
+    while (bm->get_overflow_map().find(it->first, std::hash<uint64_t>()(it->first)) != NULL) {
+        ++it;
+    }
+    bm->at(it->first) = it->second = 1;
+    
+    if (bm->checkpoint() != kOSPageSize || bm->checkpoint() != kOSPageSize || bm->checkpoint() != 0) {
+        fail_count++;
+    }
+    
+    // the map is still usable after a flush
+    bm->flush();
+    
+    std::cout << "Fill the map with the background checkpointer ..." << std::flush;
+    
+    checkpoint_options options;
+    options.interval = std::chrono::milliseconds(1);
+    options.max_bytes_per_second = 1 << 30;
+    
+    bm->start_checkpointer(options);
+    
+    for (size_t i = test_size/2; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, k);
+        ref_map[k] = k;
+    }
+    
+    bm->stop_checkpointer();
+    std::cout << " done" << std::endl;
+    
+    checkpoint_stats stats = bm->get_checkpoint_stats();
+    std::cout << stats.checkpoints << " checkpoints, " << stats.bytes_written << " bytes written, longest: " << stats.max_duration.count() << " us" << std::endl;
+    
+    if (stats.checkpoints <= 5 || stats.bytes_written == 0) {
+        fail_count++;
+    }
+    
+    delete bm;
+    bm = new bucket_map<uint64_t,uint64_t>(filename);
+    
+    for(auto &x : ref_map)
+    {
+        uint64_t v;
+        bool s = bm->get(x.first, v);
+        
+        if ((!s || v != x.second)) {
+            fail_count++;
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Checkpoint check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Checkpoint check passed\n\n";
+    }
+    
+    delete bm;
+}
+
+void set_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Set check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_set<uint64_t> *bs = new bucket_set<uint64_t>(filename,700,options);
+    std::set<uint64_t> ref_set;
+    
+    size_t fail_count = 0;
+    
+    // a page holds twice as many keys as pairs
+    if (bs->bucket_space() != bs->bucket_count() * bucket_array<uint64_t>::optimal_bucket_size(kPageSize)) {
+        fail_count++;
+    }
+    
+    std::cout << "Fill the set ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        
+        bs->insert(k);
+        ref_set.insert(k);
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Reopen the set ..." << std::flush;
+    delete bs;
+    bs = new bucket_set<uint64_t>(filename);
+    std::cout << " done" << std::endl;
+    
+    // the elements do not have the size of a map's elements
+    try {
+        bucket_map<uint64_t, uint64_t> bm(filename);
+        fail_count++;
+    } catch (std::runtime_error &e) {
+    }
+    
+    std::vector<uint64_t> keys;
+    
+    for (auto k : ref_set) {
+        keys.push_back(k);
+        keys.push_back(xorshift128()); // almost surely absent
+    }
+    
+    std::vector<bool> batch_results;
+    size_t found = bs->contains(keys.begin(), keys.end(), std::back_inserter(batch_results));
+    
+    if (found != ref_set.size() || batch_results.size() != keys.size()) {
+        fail_count++;
+    }
+    
+    for (size_t i = 0; i < keys.size() && i < batch_results.size(); i++) {
+        bool expected = (ref_set.find(keys[i]) != ref_set.end());
+        
+        if (bs->contains(keys[i]) != expected || batch_results[i] != expected) {
+            fail_count++;
+        }
+    }
+    
+    size_t count = 0;
+    for (auto it = bs->begin(); it != bs->end(); ++it) {
+        if (ref_set.find(*it) == ref_set.end()) {
+            fail_count++;
+        }
+        count++;
+    }
+    if (count != ref_set.size() || bs->size() != ref_set.size()) {
+        fail_count++;
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Set check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Set check passed\n\n";
+    }
+    
+    delete bs;
+}
+
+typedef std::array<uint8_t, 32> token_type;
+
+token_type random_token()
+{
+    token_type t;
+    
+    for (size_t i = 0; i < t.size(); i += sizeof(uint64_t)) {
+        uint64_t r = xorshift128();
+        memcpy(t.data() + i, &r, sizeof(uint64_t));
+    }
+    return t;
+}
+
+void byte_key_check(const std::string &filename, size_t test_size)
+{
+    std::cout << "Byte key check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<token_type, uint64_t> *bm = new bucket_map<token_type, uint64_t>(filename,700);
+    std::map<token_type, uint64_t> ref_map;
+    
+    size_t fail_count = 0;
+    
+    // the hash value is made of the first bytes of the key
+    token_type t = random_token();
+    uint64_t prefix;
+    memcpy(&prefix, t.data(), sizeof(uint64_t));
+    
+    if (key_hash<token_type>()(t) != prefix) {
+        fail_count++;
+    }
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        token_type k = random_token();
+        
+        bm->add(k, i);
+        ref_map[k] = i;
+        
+        // some keys only differ by their last byte: same hash, different keys
+        if (i % 64 == 0) {
+            k[31] ^= 1;
+            bm->add(k, i+1);
+            ref_map[k] = i+1;
+        }
+    }
+    std::cout << " done" << std::endl;
+    
+    delete bm;
+    bm = new bucket_map<token_type, uint64_t>(filename);
+    
+    for(auto &x : ref_map)
+    {
+        uint64_t v;
+        bool s = bm->get(x.first, v);
+        
+        if ((!s || v != x.second)) {
+            fail_count++;
+        }
+        
+        // flip a bit in each half of the key
+        for (size_t i : {3, 17}) {
+            token_type k = x.first;
+            k[i] ^= 0x10;
+            
+            if (ref_map.find(k) == ref_map.end() && bm->contains(k)) {
+                fail_count++;
+            }
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Byte key check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Byte key check passed\n\n";
+    }
+    
+    delete bm;
+}
+
+void multi_value_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Multi-value check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t, uint64_t> *bm = new bucket_map<uint64_t, uint64_t>(filename,700,options);
+    std::map<uint64_t, std::vector<uint64_t>> ref_map;
+    std::vector<uint64_t> keys;
+    
+    size_t fail_count = 0;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k;
+        
+        // most keys have a few values, some have long lists (longer than a bucket)
+        if (keys.empty() || i % 4 == 0) {
+            k = xorshift128();
+            keys.push_back(k);
+        }else if (i % 4 == 1) {
+            k = keys[i % 16];
+        }else{
+            k = keys[xorshift128() % keys.size()];
+        }
+        
+        bm->add(k, i);
+        ref_map[k].push_back(i);
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Reopen the map ..." << std::flush;
+    delete bm;
+    bm = new bucket_map<uint64_t, uint64_t>(filename);
+    std::cout << " done" << std::endl;
+    
+    if (bm->options().multi_value != options.multi_value) {
+        fail_count++;
+    }
+    
+    for(auto &x : ref_map)
+    {
+        std::vector<uint64_t> values;
+        size_t n = bm->get_all(x.first, std::back_inserter(values));
+        std::sort(values.begin(), values.end());
+        
+        if (n != x.second.size() || values != x.second || bm->count(x.first) != x.second.size()) {
+            fail_count++;
+        }
+        
+        uint64_t sum = 0;
+        bm->for_each_value(x.first, [&](const uint64_t& v) { sum += v; });
+        
+        if (sum != std::accumulate(x.second.begin(), x.second.end(), (uint64_t)0)) {
+            fail_count++;
+        }
+        
+        uint64_t v;
+        if (!bm->get(x.first, v) || std::find(x.second.begin(), x.second.end(), v) == x.second.end()) {
+            fail_count++;
+        }
+    }
+    
+    for (size_t i = 0; i < 1000; i++) {
+        uint64_t k = xorshift128();
+        std::vector<uint64_t> values;
+        
+        if (ref_map.find(k) == ref_map.end() && (bm->count(k) != 0 || bm->get_all(k, std::back_inserter(values)) != 0)) {
+            fail_count++;
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Multi-value check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Multi-value check passed\n\n";
+    }
+    
+    delete bm;
+}
+
+void batch_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Batch insertion check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t, uint64_t> *bm = new bucket_map<uint64_t, uint64_t>(filename,700,options);
+    std::map<uint64_t, uint64_t> ref_map;
+    
+    size_t fail_count = 0;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0, batch_size = 1; i < test_size; i += batch_size, batch_size = 1 + (xorshift128() % 8192)) {
+        std::vector<uint64_t> keys, values;
+        
+        for (size_t j = 0; j < batch_size; j++) {
+            keys.push_back(xorshift128());
+            values.push_back(i+j);
+            ref_map[keys.back()] = i+j;
+        }
+        bm->add_batch(keys, values);
+        
+        if (bm->size() != ref_map.size()) {
+            fail_count++;
+        }
+    }
+    std::cout << " done" << std::endl;
+    
+    try {
+        bm->add_batch(std::vector<uint64_t>(2), std::vector<uint64_t>(1));
+        fail_count++;
+    } catch (std::invalid_argument &e) {
+    }
+    
+    std::cout << "Reopen the map ..." << std::flush;
+    delete bm;
+    bm = new bucket_map<uint64_t, uint64_t>(filename);
+    std::cout << " done" << std::endl;
+    
+    for(auto &x : ref_map)
+    {
+        uint64_t v;
+        bool s = bm->get(x.first, v);
+        
+        if ((!s || v != x.second)) {
+            fail_count++;
+        }
+    }
+    
+    if (bm->size() != ref_map.size()) {
+        fail_count++;
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Batch insertion check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Batch insertion check passed\n\n";
+    }
+    
+    delete bm;
+}
+
+void insert_buffer_check(const std::string &filename, size_t test_size, const bucket_map_options& options)
+{
+    std::cout << "Insert buffer check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t, uint64_t> *bm = new bucket_map<uint64_t, uint64_t>(filename,700,options);
+    std::map<uint64_t, uint64_t> ref_map;
+    std::vector<uint64_t> keys;
+    
+    size_t fail_count = 0;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, i);
+        ref_map[k] = i;
+        keys.push_back(k);
+        
+        // read your writes, whether they are buffered or not
+        uint64_t v;
+        uint64_t k_old = keys[xorshift128() % keys.size()];
+        
+        if (!bm->get(k, v) || v != i || !bm->contains(k_old) || bm->at(k_old) != ref_map[k_old]) {
+            fail_count++;
+        }
+        
+        if (bm->buffered_size() >= options.insert_buffer_size) {
+            fail_count++;
+        }
+    }
+    std::cout << " done" << std::endl;
+    
+    // the iterators and the scans see the buffered elements
+    size_t count = 0;
+    for (auto it = bm->begin(); it != bm->end(); ++it) {
+        count++;
+    }
+    
+    size_t scan_count = 0;
+    for (auto &r : bm->partitions(3)) {
+        bm->for_each(r, [&](const std::pair<const uint64_t, uint64_t>&) { scan_count++; });
+    }
+    
+    if (bm->buffered_size() == 0 || count != ref_map.size() || scan_count != ref_map.size()) {
+        fail_count++;
+    }
+    
+    bm->drain_insert_buffer();
+    
+    if (bm->buffered_size() != 0 || bm->size() != ref_map.size()) {
+        fail_count++;
+    }
+    
+    // refill the buffer before closing: the destructor drains it
+    for (size_t i = 0; i < options.insert_buffer_size/2; i++) {
+        uint64_t k = xorshift128();
+        
+        bm->add(k, i);
+        ref_map[k] = i;
+    }
+    
+    std::cout << "Reopen the map ..." << std::flush;
+    delete bm;
+    bm = new bucket_map<uint64_t, uint64_t>(filename);
+    std::cout << " done" << std::endl;
+    
+    if (bm->options().insert_buffer_size != options.insert_buffer_size || bm->buffered_size() != 0) {
+        fail_count++;
+    }
+    
+    for(auto &x : ref_map)
+    {
+        uint64_t v;
+        bool s = bm->get(x.first, v);
+        
+        if ((!s || v != x.second)) {
+            fail_count++;
+        }
+    }
+    
+    if (bm->size() != ref_map.size()) {
+        fail_count++;
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Insert buffer check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Insert buffer check passed\n\n";
+    }
+    
+    delete bm;
+}
+
+void layout_check(size_t bucket_count, size_t test_size)
+{
+    std::cout << "Layout check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef std::pair<uint64_t, uint64_t> pair_type;
+    typedef bucket_array<pair_type> runtime_array_type;
+    typedef bucket_array<pair_type, uint16_t, static_layout<kPageSize>> static_array_type;
+    
+    std::vector<unsigned char> runtime_mem(bucket_count*kPageSize, 0);
+    std::vector<unsigned char> static_mem(bucket_count*kPageSize, 0);
+    
+    runtime_array_type runtime_array(runtime_mem.data(), bucket_count, kPageSize);
+    static_array_type static_array(static_mem.data(), bucket_count);
+    
+    size_t fail_count = 0;
+    
+    static_assert(static_array_type::geometry_type::kBucketSize == (kPageSize - 3)/sizeof(pair_type), "Unexpected static bucket size");
+    
+    if (static_array.bucket_size() != runtime_array.bucket_size() || static_array.page_size() != runtime_array.page_size()) {
+        fail_count++;
+    }
+    
+    // a static layout only accepts its own geometry
+    try {
+        static_array_type a(static_mem.data(), bucket_count, 2*kPageSize);
+        fail_count++;
+    } catch (std::runtime_error &e) {
+    }
+    try {
+        static_array_type a(static_mem.data(), bucket_count, 3, kPageSize);
+        fail_count++;
+    } catch (std::runtime_error &e) {
+    }
+    
+    for (size_t i = 0; i < test_size; i++) {
+        size_t n = xorshift128() % bucket_count;
+        pair_type v(xorshift128(), i);
+        
+        if (runtime_array.bucket(n).append(v) != static_array.bucket_unchecked(n).append(v)) {
+            fail_count++;
+        }
+    }
+    
+    // both layouts must produce the same bytes
+    if (runtime_mem != static_mem) {
+        fail_count++;
+    }
+    
+    for (size_t n = 0; n < bucket_count; n++) {
+        if (static_array.get_bucket_size(n) != runtime_array.bucket_unchecked(n).size()) {
+            fail_count++;
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Layout check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Layout check passed\n\n";
+    }
+}
+
+std::string file_content(const std::string &path)
+{
+    std::ifstream f(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+}
+
+void read_only_check(const std::string &filename, size_t test_size)
+{
+    std::cout << "Read-only check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t, uint64_t> *writer = new bucket_map<uint64_t, uint64_t>(filename,700);
+    std::map<uint64_t, uint64_t> ref_map;
+    
+    size_t fail_count = 0;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        writer->add(k, i);
+        ref_map[k] = i;
+    }
+    writer->flush();
+    std::cout << " done" << std::endl;
+    
+    std::string meta = file_content(filename + "/meta.bin");
+    std::string overflow = file_content(filename + "/overflow.bin");
+    
+    auto check_content = [&](const bucket_map<uint64_t, uint64_t>& bm)
+    {
+        size_t errors = 0;
+        for(auto &x : ref_map)
+        {
+            uint64_t v;
+            if (!bm.get(x.first, v) || v != x.second) {
+                errors++;
+            }
+        }
+        return errors + ((bm.size() == ref_map.size()) ? 0 : 1);
+    };
+    
+    // another process reads the map while it is opened by the writer
+    pid_t pid = fork();
+    if (pid == 0) {
+        bucket_map<uint64_t, uint64_t> reader(filename, kReadOnly);
+        _exit(check_content(reader) == 0 ? 0 : 1);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fail_count++;
+    }
+    
+    bucket_map<uint64_t, uint64_t> *reader = new bucket_map<uint64_t, uint64_t>(filename, kReadOnly);
+    
+    fail_count += check_content(*reader);
+    
+    if (!reader->is_read_only() || reader->refresh()) {
+        fail_count++;
+    }
+    
+    try {
+        reader->add(0, 0);
+        fail_count++;
+    } catch (std::runtime_error &e) {
+    }
+    try {
+        reader->at(ref_map.begin()->first) = 0;
+        fail_count++;
+    } catch (std::runtime_error &e) {
+    }
+    
+    // the writer goes on, and flushes a new version
+    std::cout << "Add elements and refresh ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        writer->add(k, test_size + i);
+        ref_map[k] = test_size + i;
+    }
+    writer->flush();
+    
+    if (!reader->refresh()) {
+        fail_count++;
+    }
+    std::cout << " done" << std::endl;
+    
+    fail_count += check_content(*reader);
+    
+    meta = file_content(filename + "/meta.bin");
+    overflow = file_content(filename + "/overflow.bin");
+    
+    // closing the reader does not modify the files
+    delete reader;
+    
+    if (file_content(filename + "/meta.bin") != meta || file_content(filename + "/overflow.bin") != overflow) {
+        fail_count++;
+    }
+    
+    delete writer;
+    
+    if (fail_count > 0) {
+        std::cout << "Read-only check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Read-only check passed\n\n";
+    }
+}
+
+void compaction_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Compaction check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    std::string compact_filename = "compact_" + filename;
+    std::string dedup_filename = "dedup_" + filename;
+    std::string multipass_filename = "multipass_" + filename;
+    
+    std::map<uint64_t, std::vector<uint64_t>> ref_map; // the values of every key, in insertion order
+    size_t element_count = 0;
+    size_t fail_count = 0;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    {
+        map_type bm(filename,700,options);
+        std::vector<uint64_t> keys;
+        
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k;
+            
+            // update a key every 4 insertions
+            if (i % 4 == 3) {
+                k = keys[xorshift128() % keys.size()];
+            }else{
+                k = xorshift128();
+                keys.push_back(k);
+            }
+            bm.add(k, i);
+            ref_map[k].push_back(i);
+        }
+        element_count = bm.size();
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Compact ..." << std::flush;
+    compaction_options compaction;
+    compaction.threads = 3;
+    
+    if (map_type::compact(filename, compact_filename, compaction) != element_count) {
+        fail_count++;
+    }
+    
+    compaction.drop_duplicates = true;
+    
+    // the last value of a key is only known when the storage order is the insertion order
+    bool insertion_order = (options.placement == kSingleChoicePlacement && options.overflow == kOverflowMap);
+    
+    if (!insertion_order) {
+        try {
+            map_type::compact(filename, dedup_filename, compaction);
+            fail_count++;
+        } catch (std::invalid_argument &e) {
+        }
+    }else{
+        if (map_type::compact(filename, dedup_filename, compaction) != ref_map.size()) {
+            fail_count++;
+        }
+        
+        // force several passes
+        compaction.memory_budget = element_count;
+        
+        if (map_type::compact(filename, multipass_filename, compaction) != ref_map.size()) {
+            fail_count++;
+        }
+        
+        try {
+            map_type::compact(filename, dedup_filename, compaction);
+            fail_count++;
+        } catch (std::runtime_error &e) {
+        }
+    }
+    std::cout << " done" << std::endl;
+    
+    {
+        map_type bm(compact_filename);
+        
+        if (bm.size() != element_count || bm.arrays_count() != 1 || bm.is_resizing()) {
+            fail_count++;
+        }
+        for (auto &x : ref_map) {
+            std::vector<uint64_t> values;
+            bm.get_all(x.first, std::back_inserter(values));
+            std::sort(values.begin(), values.end());
+            
+            if (values != x.second) {
+                fail_count++;
+            }
+        }
+    }
+    
+    if (insertion_order) {
+        for (auto &fn : {dedup_filename, multipass_filename}) {
+            map_type bm(fn);
+            
+            if (bm.size() != ref_map.size() || bm.arrays_count() != 1 || bm.options().placement != options.placement) {
+                fail_count++;
+            }
+            for (auto &x : ref_map) {
+                uint64_t v;
+                
+                if (bm.count(x.first) != 1 || !bm.get(x.first, v)) {
+                    fail_count++;
+                }else if (v != x.second.back()) {
+                    fail_count++;
+                }
+            }
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Compaction check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Compaction check passed\n\n";
+    }
+}
+
+void direct_reader_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Direct reader check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    map_type *bm = new map_type(filename,700,options);
+    std::map<uint64_t, uint64_t> ref_map;
+    std::vector<uint64_t> keys;
+    
+    size_t fail_count = 0;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        bm->add(k, i);
+        ref_map[k] = i;
+        keys.push_back(k);
+        keys.push_back(xorshift128()); // (most likely) absent key
+    }
+    std::cout << " done" << std::endl;
+    
+    auto check_lookups = [&](direct_reader<map_type>& reader)
+    {
+        size_t found = 0, calls = 0;
+        
+        reader.find_batch(keys.begin(), keys.end(), [&](const uint64_t& k, const map_type::value_type* elt)
+        {
+            auto it = ref_map.find(k);
+            
+            calls++;
+            if (it == ref_map.end()) {
+                fail_count += (elt != NULL);
+            }else if (elt == NULL || elt->second != it->second) {
+                fail_count++;
+            }else{
+                found++;
+            }
+        });
+        
+        if (calls != keys.size() || found != ref_map.size()) {
+            fail_count++;
+        }
+    };
+    
+    // the pages modified through the memory map are not flushed yet
+    {
+        direct_reader<map_type> reader(*bm, 7, kPreadEngine);
+        check_lookups(reader);
+    }
+    
+    bm->flush();
+    
+    {
+        direct_reader<map_type> reader(*bm);
+        check_lookups(reader);
+        
+        // the reader follows the growth of the map
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            bm->add(k, test_size + i);
+            ref_map[k] = test_size + i;
+            keys.push_back(k);
+        }
+        check_lookups(reader);
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Direct reader check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Direct reader check passed\n\n";
+    }
+    
+    delete bm;
+}
+
+void export_import_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Export/import check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    std::string export_filename = "exported_" + filename;
+    std::string import_filename = "imported_" + filename;
+    std::string rehash_filename = "rehashed_" + filename;
+    
+    std::map<uint64_t, uint64_t> ref_map;
+    size_t fail_count = 0;
+    size_t bucket_count = 0;
+    
+    bucket_map_options buffered = options;
+    buffered.insert_buffer_size = 1000;
+    
+    std::cout << "Fill and export the map ..." << std::flush;
+    {
+        map_type bm(filename,700,buffered);
+        
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            bm.add(k, i);
+            ref_map[k] = i;
+        }
+        
+        // the export covers the buckets, the overflow bucket and the insert buffer
+        if ((options.overflow == kOverflowMap && bm.overflow_size() == 0) || bm.buffered_size() == 0) {
+            fail_count++;
+        }
+        if (bm.export_to(export_filename, 3) != ref_map.size()) {
+            fail_count++;
+        }
+        bucket_count = bm.bucket_count();
+    }
+    std::cout << " done" << std::endl;
+    
+    auto check_content = [&](const map_type& bm)
+    {
+        if (bm.size() != ref_map.size()) {
+            fail_count++;
+        }
+        for (auto &x : ref_map) {
+            uint64_t v;
+            
+            if (!bm.get(x.first, v) || v != x.second) {
+                fail_count++;
+            }
+        }
+    };
+    
+    std::cout << "Import the map ..." << std::flush;
+    {
+        // an empty map takes the geometry of the exported map
+        map_type bm(import_filename,700,options);
+        
+        if (bm.import_from(export_filename, 3) != ref_map.size() || bm.bucket_count() != bucket_count) {
+            fail_count++;
+        }
+        check_content(bm);
+    }
+    {
+        map_type bm(import_filename);
+        check_content(bm);
+    }
+    
+    {
+        // a different placement: the elements are rehashed
+        bucket_map_options rehash_options = options;
+        rehash_options.placement = (options.placement == kSingleChoicePlacement) ? kTwoChoicePlacement : kSingleChoicePlacement;
+        
+        map_type bm(rehash_filename,700,rehash_options);
+        
+        if (bm.import_from(export_filename, 2) != ref_map.size()) {
+            fail_count++;
+        }
+        check_content(bm);
+    }
+    std::cout << " done" << std::endl;
+    
+    // flip a byte in the middle of the file
+    {
+        FILE* f = fopen(export_filename.data(), "r+b");
+        fseek(f, 0, SEEK_END);
+        long middle = ftell(f)/2;
+        int c;
+        
+        fseek(f, middle, SEEK_SET);
+        c = fgetc(f);
+        fseek(f, middle, SEEK_SET);
+        fputc(c ^ 0x10, f);
+        fclose(f);
+    }
+    
+    try {
+        map_type bm("corrupted_" + filename,700,options);
+        bm.import_from(export_filename, 2);
+        fail_count++;
+    } catch (std::runtime_error &e) {
+    }
+    
+    std::cout << "Export and import a resizing map ..." << std::flush;
+    {
+        // the new half of the map is only partly backed by its file
+        bucket_map_options manual = options;
+        manual.resize.automatic = false;
+        
+        ref_map.clear();
+        
+        map_type bm("resizing_" + filename,400000,manual);
+        
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            bm.add(k, i);
+            ref_map[k] = i;
+        }
+        
+        bm.start_resize();
+        bm.advance_resize(10);
+        
+        if (bm.export_to("exported_resizing_" + filename, 2) != ref_map.size()) {
+            fail_count++;
+        }
+        bucket_count = bm.bucket_count();
+    }
+    {
+        map_type bm("imported_resizing_" + filename,700,options);
+        
+        if (bm.import_from("exported_resizing_" + filename, 2) != ref_map.size() || !bm.is_resizing() || bm.bucket_count() != bucket_count) {
+            fail_count++;
+        }
+        check_content(bm);
+        
+        // the resize goes on in the imported map
+        bm.full_resize();
+        check_content(bm);
+    }
+    std::cout << " done" << std::endl;
+    
+    if (fail_count > 0) {
+        std::cout << "Export/import check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Export/import check passed\n\n";
+    }
+}
+
+void mutation_log_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Mutation log check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    std::string log_directory = "log_" + filename;
+    std::string replica_filename = "replica_" + filename;
+    
+    std::map<uint64_t, uint64_t> ref_map;
+    std::vector<uint64_t> keys;
+    size_t fail_count = 0;
+    
+    mutation_log_options log_options;
+    log_options.segment_size = 1 << 16; // rotate often
+    
+    // add elements, and update a key every 8 operations
+    auto mutate = [&](map_type& bm, size_t begin, size_t end)
+    {
+        std::vector<map_type::value_type> batch;
+        
+        for (size_t i = begin; i < end; i++) {
+            if (i % 8 == 7) {
+                // the key may be in the pending batch
+                bm.insert_batch(batch.begin(), batch.end());
+                batch.clear();
+                
+                uint64_t k = keys[xorshift128() % keys.size()];
+                bm.at(k) = i;
+                ref_map[k] = i;
+            }else if (i % 64 < 32) {
+                uint64_t k = xorshift128();
+                bm.add(k, i);
+                ref_map[k] = i;
+                keys.push_back(k);
+            }else{
+                uint64_t k = xorshift128();
+                batch.push_back(map_type::value_type(k, i));
+                ref_map[k] = i;
+                keys.push_back(k);
+                
+                if (batch.size() == 16) {
+                    bm.insert_batch(batch.begin(), batch.end());
+                    batch.clear();
+                }
+            }
+        }
+        bm.insert_batch(batch.begin(), batch.end());
+    };
+    
+    auto check_replica = [&](const map_type& replica)
+    {
+        if (replica.size() != ref_map.size()) {
+            fail_count++;
+        }
+        for (auto &x : ref_map) {
+            uint64_t v;
+            
+            if (!replica.get(x.first, v) || v != x.second) {
+                fail_count++;
+            }
+        }
+    };
+    
+    map_type replica(replica_filename,700,options);
+    log_follower<map_type> follower(replica, log_directory);
+    
+    std::cout << "Replicate ..." << std::flush;
+    {
+        map_type bm(filename,700,options);
+        bm.start_mutation_log(log_directory, log_options);
+        
+        keys.push_back(xorshift128());
+        bm.add(keys[0], 0);
+        ref_map[keys[0]] = 0;
+        
+        mutate(bm, 1, test_size/2);
+        
+        // nothing is visible before the log is synced
+        follower.catch_up();
+        bm.sync_mutation_log();
+        follower.catch_up();
+        
+        check_replica(replica);
+        
+        if (follower.next_sequence() != bm.mutation_log_sequence()) {
+            fail_count++;
+        }
+    }
+    
+    {
+        // the sequence numbers continue when the log is reopened
+        map_type bm(filename);
+        bm.start_mutation_log(log_directory, log_options);
+        
+        if (bm.mutation_log_sequence() != follower.next_sequence()) {
+            fail_count++;
+        }
+        
+        mutate(bm, test_size/2, test_size);
+        bm.flush();
+        
+        // a few records at a time
+        while (follower.poll(1000) > 0) {
+        }
+        check_replica(replica);
+    }
+    std::cout << " done" << std::endl;
+    
+    // a crash while a segment was created leaves it empty: the follower reports it, and the writer creates it again
+    {
+        std::ofstream(mutation_log<map_type::value_type>::segment_path(log_directory, follower.next_sequence()), std::ios::binary | std::ios::trunc);
+        
+        try {
+            follower.catch_up();
+            fail_count++;
+        } catch (std::runtime_error &e) {
+        }
+        
+        map_type bm(filename);
+        bm.start_mutation_log(log_directory, log_options);
+        
+        if (bm.mutation_log_sequence() != follower.next_sequence()) {
+            fail_count++;
+        }
+        
+        mutate(bm, test_size, test_size + 1024);
+        bm.flush();
+        
+        follower.catch_up();
+        check_replica(replica);
+    }
+    
+    // the keys returned by at() are logged once, and never pile up
+    {
+        map_type bm(filename);
+        bm.start_mutation_log(log_directory, log_options);
+        
+        size_t sequence = bm.mutation_log_sequence();
+        
+        for (size_t i = 0; i < 1000; i++) {
+            bm.at(keys[0]) = i;
+            ref_map[keys[0]] = i;
+        }
+        bm.sync_mutation_log();
+        
+        if (bm.mutation_log_sequence() != sequence + 1) {
+            fail_count++;
+        }
+        
+        for (size_t i = 0; i < 1000; i++) {
+            uint64_t k = keys[i % 100];
+            bm.at(k) = i;
+            ref_map[k] = i;
+        }
+        bm.flush();
+        
+        follower.catch_up();
+        check_replica(replica);
+    }
+    
+    // a follower that fell behind the retained segments
+    log_options.max_segments = 2;
+    {
+        map_type bm(filename);
+        bm.start_mutation_log(log_directory, log_options);
+        
+        // the follower keeps up with the writer
+        for (size_t i = test_size; i < test_size + (1 << 14); i += 1024) {
+            mutate(bm, i, i + 1024);
+            bm.sync_mutation_log();
+            follower.catch_up();
+        }
+        bm.flush();
+        
+        map_type late_replica("late_" + replica_filename,700,options);
+        log_follower<map_type> late_follower(late_replica, log_directory);
+        
+        try {
+            late_follower.catch_up();
+            fail_count++;
+        } catch (std::runtime_error &e) {
+        }
+        
+        follower.catch_up();
+        check_replica(replica);
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Mutation log check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Mutation log check passed\n\n";
+    }
+}
+
+void snapshot_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Snapshot check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    std::string snapshot_filename = "snapshot_" + filename;
+    std::string late_snapshot_filename = "late_snapshot_" + filename;
+    
+    std::map<uint64_t, uint64_t> ref_map;
+    std::vector<uint64_t> keys;
+    size_t fail_count = 0;
+    
+    // add elements, and update a key every 4 operations
+    auto mutate = [&](map_type& bm, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++) {
+            if (i % 4 == 3) {
+                uint64_t k = keys[xorshift128() % keys.size()];
+                bm.at(k) = i;
+                ref_map[k] = i;
+            }else{
+                uint64_t k = xorshift128();
+                bm.add(k, i);
+                ref_map[k] = i;
+                keys.push_back(k);
+            }
+        }
+    };
+    
+    auto check_snapshot = [&](const std::string& path, const std::map<uint64_t, uint64_t>& ref)
+    {
+        map_type snap(path, kReadOnly);
+        
+        if (snap.size() != ref.size()) {
+            fail_count++;
+        }
+        for (auto &x : ref) {
+            uint64_t v;
+            
+            if (!snap.get(x.first, v) || v != x.second) {
+                fail_count++;
+            }
+        }
+    };
+    
+    std::map<uint64_t, uint64_t> snapshot_ref, late_snapshot_ref;
+    
+    std::cout << "Snapshot while writing ..." << std::flush;
+    {
+        map_type bm(filename,700,options);
+        
+        keys.push_back(xorshift128());
+        bm.add(keys[0], 0);
+        ref_map[keys[0]] = 0;
+        
+        mutate(bm, 1, test_size/2);
+        
+        snapshot_ref = ref_map;
+        bm.snapshot(snapshot_filename);
+        
+        if (!bm.snapshot_in_progress()) {
+            fail_count++;
+        }
+        
+        // the writes go on, and resize the map
+        mutate(bm, test_size/2, 3*test_size/4);
+        bm.wait_snapshot();
+        
+        if (bm.snapshot_in_progress()) {
+            fail_count++;
+        }
+        
+        try {
+            bm.snapshot(snapshot_filename);
+            fail_count++;
+        } catch (std::runtime_error &e) {
+        }
+        
+        // completed by the destructor
+        late_snapshot_ref = ref_map;
+        bm.snapshot(late_snapshot_filename);
+        mutate(bm, 3*test_size/4, test_size);
+    }
+    std::cout << " done" << std::endl;
+    
+    // a map that mostly overflows: the overflow elements are modified, and extracted by a resize, while the snapshot is written
+    std::string overflow_filename = "overflow_" + filename;
+    std::string overflow_snapshot_filename = "overflow_snapshot_" + filename;
+    std::map<uint64_t, uint64_t> overflow_ref, overflow_snapshot_ref;
+    
+    std::cout << "Snapshot of the overflow bucket ..." << std::flush;
+    {
+        bucket_map_options manual_resize = options;
+        manual_resize.resize.automatic = false;
+        
+        map_type bm(overflow_filename,700,manual_resize);
+        std::vector<uint64_t> overflow_keys;
+        
+        for (size_t i = 0; i < test_size/8; i++) {
+            uint64_t k = xorshift128();
+            bm.add(k, i);
+            overflow_ref[k] = i;
+            overflow_keys.push_back(k);
+        }
+        
+        overflow_snapshot_ref = overflow_ref;
+        bm.snapshot(overflow_snapshot_filename);
+        
+        for (size_t i = 0; i < test_size/8; i++) {
+            uint64_t k = overflow_keys[xorshift128() % overflow_keys.size()];
+            bm.at(k) = test_size + i;
+            overflow_ref[k] = test_size + i;
+            
+            k = xorshift128();
+            bm.add(k, test_size + i);
+            overflow_ref[k] = test_size + i;
+        }
+        bm.start_resize();
+        bm.advance_resize(std::numeric_limits<size_t>::max());
+    }
+    std::cout << " done" << std::endl;
+    
+    check_snapshot(snapshot_filename, snapshot_ref);
+    check_snapshot(late_snapshot_filename, late_snapshot_ref);
+    check_snapshot(filename, ref_map);
+    check_snapshot(overflow_snapshot_filename, overflow_snapshot_ref);
+    check_snapshot(overflow_filename, overflow_ref);
+    
+    if (fail_count > 0) {
+        std::cout << "Snapshot check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Snapshot check passed\n\n";
+    }
+}
+
+void frozen_map_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Frozen map check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    typedef frozen_map<uint64_t, uint64_t> frozen_type;
+    
+    std::string frozen_filename = "frozen_" + filename;
+    
+    std::map<uint64_t, uint64_t> ref_map;
+    size_t fail_count = 0;
+    
+    std::cout << "Freeze ..." << std::flush;
+    {
+        map_type bm(filename,700,options);
+        
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            bm.add(k, i);
+            ref_map[k] = i;
+        }
+        
+        if (frozen_type::freeze(bm, frozen_filename) != ref_map.size()) {
+            fail_count++;
+        }
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Look up ..." << std::flush;
+    {
+        frozen_type fm(frozen_filename);
+        
+        if (fm.size() != ref_map.size()) {
+            fail_count++;
+        }
+        for (auto &x : ref_map) {
+            uint64_t v;
+            
+            if (!fm.get(x.first, v) || v != x.second) {
+                fail_count++;
+            }
+        }
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            
+            if (fm.count(k) != ref_map.count(k)) {
+                fail_count++;
+            }
+        }
+        
+        // the records are densely packed
+        size_t n = 0;
+        for (auto it = fm.begin(); it != fm.end(); ++it, n++) {
+            auto ref_it = ref_map.find(it->first);
+            
+            if (ref_it == ref_map.end() || ref_it->second != it->second) {
+                fail_count++;
+            }
+        }
+        if (n != ref_map.size() || fm.file_size() > kOSPageSize + ref_map.size()*(sizeof(frozen_type::value_type) + 2) + kOSPageSize) {
+            fail_count++;
+        }
+    }
+    std::cout << " done" << std::endl;
+    
+    // duplicate keys cannot be indexed
+    std::vector<frozen_type::value_type> elements(ref_map.begin(), ref_map.end());
+    elements.push_back(elements.front());
+    
+    try {
+        frozen_type::build(frozen_filename, elements.begin(), elements.end());
+        fail_count++;
+    } catch (std::runtime_error &e) {
+    }
+    
+    elements.clear();
+    frozen_type::build(frozen_filename, elements.begin(), elements.end());
+    {
+        frozen_type fm(frozen_filename);
+        
+        if (fm.size() != 0 || fm.find(ref_map.begin()->first) != NULL) {
+            fail_count++;
+        }
+    }
+    
+    // corrupted header
+    {
+        std::fstream f(frozen_filename, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(16);
+        f.put(0x42);
+    }
+    try {
+        frozen_type fm(frozen_filename);
+        fail_count++;
+    } catch (std::runtime_error &e) {
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Frozen map check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Frozen map check passed\n\n";
+    }
+}
+
+void preallocation_check(const std::string &filename, size_t test_size, const bucket_map_options& options)
+{
+    std::cout << "Preallocation check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    std::map<uint64_t, uint64_t> ref_map;
+    size_t fail_count = 0;
+    
+    // every data file must have all its blocks
+    auto check_allocated = [&]()
+    {
+        struct stat st;
+        
+        for (size_t i = 0; stat((filename + "/data." + std::to_string(i)).data(), &st) == 0; i++) {
+            if (static_cast<size_t>(st.st_blocks)*512 < static_cast<size_t>(st.st_size)) {
+                fail_count++;
+            }
+        }
+    };
+    
+    std::cout << "Fill the map ..." << std::flush;
+    {
+        map_type bm(filename,700,options);
+        
+        check_allocated();
+        
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            bm.add(k, i);
+            ref_map[k] = i;
+        }
+        
+        check_allocated();
+        
+        fault_stats stats = bm.get_fault_stats();
+        
+        if (stats.insertions != test_size || stats.max_faults > stats.minor_faults + stats.major_faults) {
+            fail_count++;
+        }
+        
+        bm.reset_fault_stats();
+        
+        if (bm.get_fault_stats().insertions != 0) {
+            fail_count++;
+        }
+        
+        // the zero-fill must not have overwritten the inserted elements
+        for (auto &x : ref_map) {
+            uint64_t v;
+            
+            if (!bm.get(x.first, v) || v != x.second) {
+                fail_count++;
+            }
+        }
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Reopen the map ..." << std::flush;
+    {
+        map_type bm(filename);
+        
+        // the policy is not stored with the map
+        if (bm.get_preallocation_policy().count_faults) {
+            fail_count++;
+        }
+        
+        for (auto &x : ref_map) {
+            uint64_t v;
+            
+            if (!bm.get(x.first, v) || v != x.second) {
+                fail_count++;
+            }
+        }
+    }
+    std::cout << " done" << std::endl;
+    
+    if (fail_count > 0) {
+        std::cout << "Preallocation check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Preallocation check passed\n\n";
+    }
+}
+
+void incremental_growth_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Incremental growth check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    bucket_map_options manual = options;
+    manual.resize.automatic = false;
+    
+    std::map<uint64_t, uint64_t> ref_map;
+    size_t fail_count = 0;
+    size_t N;
+    
+    // size (in bytes) of the new half of the map, backed by the files
+    auto new_half_size = [&]()
+    {
+        struct stat st;
+        
+        if (manual.addressing == kContiguousAddressing) {
+            stat((filename + "/data.0").data(), &st);
+            return static_cast<size_t>(st.st_size) - N*kPageSize;
+        }
+        
+        size_t i = 0;
+        while (stat((filename + "/data." + std::to_string(i+1)).data(), &st) == 0) {
+            i++;
+        }
+        stat((filename + "/data." + std::to_string(i)).data(), &st);
+        return static_cast<size_t>(st.st_size);
+    };
+    
+    auto check_content = [&](const map_type& bm)
+    {
+        size_t it_count = 0;
+        
+        for (auto it = bm.begin(); it != bm.end(); ++it) {
+            it_count++;
+        }
+        if (bm.size() != ref_map.size() || it_count != ref_map.size()) {
+            fail_count++;
+        }
+        for (auto &x : ref_map) {
+            uint64_t v;
+            
+            if (!bm.get(x.first, v) || v != x.second) {
+                fail_count++;
+            }
+        }
+    };
+    
+    std::cout << "Start a resize ..." << std::flush;
+    {
+        map_type bm(filename,test_size,manual);
+        
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            bm.add(k, i);
+            ref_map[k] = i;
+        }
+        
+        N = bm.bucket_count();
+        bm.start_resize();
+        
+        // only the first chunks of the new half are there
+        if (new_half_size() >= N*kPageSize/2) {
+            fail_count++;
+        }
+        
+        bm.advance_resize(N/2);
+        
+        size_t half_size = new_half_size();
+        
+        if (half_size < (N/2)*kPageSize || half_size >= N*kPageSize) {
+            fail_count++;
+        }
+        
+        check_content(bm);
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Finish the resize ..." << std::flush;
+    {
+        map_type bm(filename);
+        
+        if (!bm.is_resizing()) {
+            fail_count++;
+        }
+        check_content(bm);
+        
+        for (size_t i = test_size; i < 2*test_size; i++) {
+            uint64_t k = xorshift128();
+            bm.add(k, i);
+            ref_map[k] = i;
+        }
+        
+        bm.advance_resize(N);
+        
+        if (bm.is_resizing() || new_half_size() != N*kPageSize) {
+            fail_count++;
+        }
+        check_content(bm);
+    }
+    std::cout << " done" << std::endl;
+    
+    if (fail_count > 0) {
+        std::cout << "Incremental growth check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Incremental growth check passed\n\n";
+    }
+}
+
+void large_map_check(const std::string &filename, size_t test_size)
+{
+    std::cout << "Large map check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    // a sparse map of 2^32 buckets (2 TB): the files must not be allocated
+    bucket_map_options options;
+    options.preallocation.allocate = false;
+    options.resize.automatic = false;
+    
+    const size_t kLargeBucketCount = static_cast<size_t>(1) << 32;
+    const size_t split_count = 1 << 12;
+    
+    std::map<uint64_t, uint64_t> ref_map;
+    size_t fail_count = 0;
+    
+    auto check_content = [&](const map_type& bm)
+    {
+        // every element fits in its bucket: none is in the overflow bucket if the buckets are addressed with all their bits
+        if (bm.size() != ref_map.size() || bm.overflow_size() != 0) {
+            fail_count++;
+        }
+        for (auto &x : ref_map) {
+            uint64_t v;
+            
+            if (!bm.get(x.first, v) || v != x.second) {
+                fail_count++;
+            }
+        }
+    };
+    
+    std::cout << "Fill the map ..." << std::flush;
+    {
+        map_type bm(filename,3ULL << 35,options);
+        
+        if (bm.bucket_count() != kLargeBucketCount) {
+            fail_count++;
+        }
+        
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            bm.add(k, i);
+            ref_map[k] = i;
+        }
+        
+        // the last bucket of the map
+        bm.add(kLargeBucketCount-1, 0);
+        ref_map[kLargeBucketCount-1] = 0;
+        
+        // split the first buckets: the map has more than 2^32 buckets
+        bm.start_resize();
+        bm.advance_resize(split_count);
+        
+        if (bm.bucket_count() != kLargeBucketCount + split_count) {
+            fail_count++;
+        }
+        
+        // elements of the split buckets, on both sides
+        for (size_t i = 0; i < split_count; i++) {
+            uint64_t k = (xorshift128() & ~(2*kLargeBucketCount-1)) | (i & (kLargeBucketCount | (split_count-1)));
+            bm.add(k, i);
+            ref_map[k] = i;
+            
+            k = (k ^ kLargeBucketCount) | 0x1000000000000000ULL;
+            bm.add(k, i);
+            ref_map[k] = i;
+        }
+        
+        check_content(bm);
+    }
+    std::cout << " done" << std::endl;
+    
+    std::cout << "Reopen the map ..." << std::flush;
+    {
+        map_type bm(filename);
+        
+        if (!bm.is_resizing() || bm.bucket_count() != kLargeBucketCount + split_count) {
+            fail_count++;
+        }
+        check_content(bm);
+    }
+    {
+        map_type bm(filename, kReadOnly);
+        
+        check_content(bm);
+    }
+    std::cout << " done" << std::endl;
+    
+    if (fail_count > 0) {
+        std::cout << "Large map check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Large map check passed\n\n";
+    }
+}
+
+void bucket_size_check(const std::string &filename)
+{
+    std::cout << "Bucket size check:\n";
+    
+    // pairs of bytes: the hint byte takes one element of the buckets of the maps created before it was reserved
+    typedef bucket_map<uint8_t, uint8_t> map_type;
+    
+    size_t fail_count = 0;
+    
+    {
+        map_type bm(filename,100);
+        
+        for (size_t i = 0; i < 100; i++) {
+            bm.add(static_cast<uint8_t>(i), static_cast<uint8_t>(i));
+        }
+    }
+    
+    std::string meta = file_content(filename + "/meta.bin");
+    
+    // the metadata ends with the generation, the format version, the widths and the bucket size (and 4 bytes of padding)
+    uint32_t bucket_size;
+    memcpy(&bucket_size, &meta[meta.size() - 8], sizeof(uint32_t));
+    
+    if (bucket_size != (kPageSize - sizeof(uint16_t) - 1)/sizeof(map_type::value_type)) {
+        fail_count++;
+    }
+    
+    auto check_rejected = [&](const std::string& content)
+    {
+        std::ofstream(filename + "/meta.bin", std::ios::binary | std::ios::trunc) << content;
+        
+        try {
+            map_type bm(filename);
+            fail_count++;
+        } catch (std::runtime_error &e) {
+        }
+    };
+    
+    // a bucket size that does not match the layout
+    std::string wrong_size = meta;
+    bucket_size++;
+    memcpy(&wrong_size[wrong_size.size() - 8], &bucket_size, sizeof(uint32_t));
+    check_rejected(wrong_size);
+    
+    // a map created before the format version was stored, with larger buckets
+    check_rejected(meta.substr(0, meta.size() - 16));
+    
+    std::ofstream(filename + "/meta.bin", std::ios::binary | std::ios::trunc) << meta;
+    {
+        map_type bm(filename);
+        
+        if (bm.size() != 100 || bm.at(42) != 42) {
+            fail_count++;
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Bucket size check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Bucket size check passed\n\n";
+    }
+}
+
+#ifdef SSDMAP_HAS_COROUTINES
+void interleaved_lookup_check(const std::string &filename, size_t test_size, const bucket_map_options& options = bucket_map_options())
+{
+    std::cout << "Interleaved lookup check:\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t, uint64_t> map_type;
+    
+    map_type *bm = new map_type(filename,700,options);
+    std::map<uint64_t, uint64_t> ref_map;
+    std::vector<uint64_t> keys;
+    
+    size_t fail_count = 0;
+    
+    std::cout << "Fill the map ..." << std::flush;
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        bm->add(k, i);
+        ref_map[k] = i;
+        keys.push_back(k);
+        keys.push_back(xorshift128()); // (most likely) absent key
+    }
+    std::cout << " done" << std::endl;
+    
+    // the elements still being moved by a resize are found too
+    if (!bm->is_resizing()) {
+        bm->start_resize();
+        bm->advance_resize(100);
+    }
+    
+    for (size_t group_size : {1, 3, 16, 64}) {
+        size_t found = 0, calls = 0;
+        
+        interleaved_lookup<map_type>::find(*bm, keys.begin(), keys.end(), [&](const uint64_t& k, const map_type::value_type* elt)
+        {
+            auto it = ref_map.find(k);
+            
+            calls++;
+            if (it == ref_map.end()) {
+                fail_count += (elt != NULL);
+            }else if (elt == NULL || elt->second != it->second) {
+                fail_count++;
+            }else{
+                found++;
+            }
+        }, group_size);
+        
+        if (calls != keys.size() || found != ref_map.size()) {
+            fail_count++;
+        }
+    }
+    
+    if (fail_count > 0) {
+        std::cout << "Interleaved lookup check failed, " << fail_count << "errors\n";
+    }else{
+        std::cout << "Interleaved lookup check passed\n\n";
+    }
+    
+    delete bm;
+}
+#endif
+
+void clean(const std::list<std::string> &file_list)
+{
+    for (auto &fn : file_list) {
+        nftw( fn.data(), rm, 2, FTW_DEPTH );
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    
+    srand ((unsigned int)time(NULL));
+    x = rand() + (((uint64_t)rand()) << 32);
+    y = rand() + (((uint64_t)rand()) << 32);
+    z = rand() + (((uint64_t)rand()) << 32);
+    w = rand() + (((uint64_t)rand()) << 32);
+    
+//    std::cout << "x = " << x << std::endl;
+//    std::cout << "y = " << y << std::endl;
+//    std::cout << "z = " << z << std::endl;
+//    std::cout << "w = " << w << std::endl;
+    
+    std::cout << "Pre-cleaning ..." << std::flush;
+
+    clean({"correctness_map.dat", "systematic_correctness_map.dat", "access_test.dat", "persistency_test.dat", "it_test.dat", "collision_test.dat", "two_choice_map.dat", "systematic_two_choice_map.dat", "two_choice_persistency_test.dat", "spill_map.dat", "systematic_spill_map.dat", "spill_persistency_test.dat", "two_choice_spill_map.dat", "resize_persistency_test.dat", "contiguous_map.dat", "systematic_contiguous_map.dat", "contiguous_persistency_test.dat", "contiguous_resize_persistency_test.dat", "reserve_test.dat", "parallel_reserve_test.dat", "parallel_spill_reserve_test.dat", "parallel_two_choice_reserve_test.dat", "scan_test.dat", "spill_scan_test.dat", "contiguous_scan_test.dat", "checkpoint_test.dat", "set_test.dat", "two_choice_set_test.dat", "byte_key_test.dat", "multi_value_test.dat", "two_choice_multi_value_test.dat", "batch_test.dat", "two_choice_batch_test.dat", "contiguous_batch_test.dat", "buffer_test.dat", "two_choice_buffer_test.dat", "read_only_test.dat", "direct_reader_test.dat", "compaction_test.dat", "compact_compaction_test.dat", "dedup_compaction_test.dat", "multipass_compaction_test.dat", "two_choice_compaction_test.dat", "compact_two_choice_compaction_test.dat", "dedup_two_choice_compaction_test.dat", "multipass_two_choice_compaction_test.dat", "spill_compaction_test.dat", "compact_spill_compaction_test.dat", "dedup_spill_compaction_test.dat", "multipass_spill_compaction_test.dat", "two_choice_direct_reader_test.dat", "interleaved_test.dat", "two_choice_interleaved_test.dat", "export_test.dat", "exported_export_test.dat", "imported_export_test.dat", "rehashed_export_test.dat", "corrupted_export_test.dat", "contiguous_export_test.dat", "exported_contiguous_export_test.dat", "imported_contiguous_export_test.dat", "rehashed_contiguous_export_test.dat", "corrupted_contiguous_export_test.dat", "resizing_export_test.dat", "exported_resizing_export_test.dat", "imported_resizing_export_test.dat", "resizing_contiguous_export_test.dat", "exported_resizing_contiguous_export_test.dat", "imported_resizing_contiguous_export_test.dat", "log_test.dat", "log_log_test.dat", "replica_log_test.dat", "late_replica_log_test.dat", "two_choice_log_test.dat", "log_two_choice_log_test.dat", "replica_two_choice_log_test.dat", "late_replica_two_choice_log_test.dat", "snapshot_test.dat", "snapshot_snapshot_test.dat", "late_snapshot_snapshot_test.dat", "overflow_snapshot_test.dat", "overflow_snapshot_snapshot_test.dat", "contiguous_snapshot_test.dat", "snapshot_contiguous_snapshot_test.dat", "late_snapshot_contiguous_snapshot_test.dat", "overflow_contiguous_snapshot_test.dat", "overflow_snapshot_contiguous_snapshot_test.dat", "two_choice_snapshot_test.dat", "snapshot_two_choice_snapshot_test.dat", "late_snapshot_two_choice_snapshot_test.dat", "overflow_two_choice_snapshot_test.dat", "overflow_snapshot_two_choice_snapshot_test.dat", "frozen_test.dat", "frozen_frozen_test.dat", "two_choice_frozen_test.dat", "frozen_two_choice_frozen_test.dat", "preallocation_test.dat", "contiguous_preallocation_test.dat", "growth_test.dat", "contiguous_growth_test.dat", "large_map_test.dat", "bucket_size_test.dat"});
+    
+    std::cout << " done\n\n" << std::endl;
+    
+    
+    correctness_check("correctness_map.dat", 700, 1<<20, false, false);
+    
+    correctness_check("systematic_correctness_map.dat", 700, 1<<14, true, true);
+
+    access_check("access_test.dat", 5000, 10000,true);
+    
+    persistency_check("persistency_test.dat", 1 << 20);
+
+    iterator_check("it_test.dat", 100, 100000);
+
+    collision_check("collision_test.dat", 1 << 16);
+
+    bucket_map_options two_choice;
+    two_choice.placement = kTwoChoicePlacement;
+    
+    correctness_check("two_choice_map.dat", 700, 1<<20, false, false, two_choice);
+    
+    correctness_check("systematic_two_choice_map.dat", 700, 1<<12, true, true, two_choice);
+    
+    persistency_check("two_choice_persistency_test.dat", 1 << 18, false, two_choice);
+
+    bucket_map_options spill;
+    spill.overflow = kSiblingSpill;
+    
+    correctness_check("spill_map.dat", 700, 1<<20, false, false, spill);
+    
+    correctness_check("systematic_spill_map.dat", 700, 1<<12, true, true, spill);
+    
+    persistency_check("spill_persistency_test.dat", 1 << 18, false, spill);
+    
+    bucket_map_options two_choice_spill;
+    two_choice_spill.placement = kTwoChoicePlacement;
+    two_choice_spill.overflow = kSiblingSpill;
+
+    correctness_check("two_choice_spill_map.dat", 700, 1<<20, false, false, two_choice_spill);
+
+    resize_persistency_check("resize_persistency_test.dat", 1 << 16);
+    
+    bucket_map_options contiguous;
+    contiguous.addressing = kContiguousAddressing;
+    
+    correctness_check("contiguous_map.dat", 700, 1<<20, false, false, contiguous);
+    
+    correctness_check("systematic_contiguous_map.dat", 700, 1<<12, true, true, contiguous);
+    
+    persistency_check("contiguous_persistency_test.dat", 1 << 18, false, contiguous);
+    
+    resize_persistency_check("contiguous_resize_persistency_test.dat", 1 << 16, contiguous);
+    
+    reserve_check("reserve_test.dat", 1 << 14, 1 << 20, 1);
+    
+    reserve_check("parallel_reserve_test.dat", 1 << 14, 1 << 20, 4);
+    
+    reserve_check("parallel_spill_reserve_test.dat", 1 << 14, 1 << 20, 4, spill);
+    
+    reserve_check("parallel_two_choice_reserve_test.dat", 1 << 14, 1 << 20, 4, two_choice_spill);
+    
+    scan_check("scan_test.dat", 1 << 18, 4);
+    
+    scan_check("spill_scan_test.dat", 1 << 18, 3, two_choice_spill);
+    
+    scan_check("contiguous_scan_test.dat", 1 << 18, 4, contiguous);
+    
+    checkpoint_check("checkpoint_test.dat", 1 << 18);
+    
+    set_check("set_test.dat", 1 << 20);
+    
+    set_check("two_choice_set_test.dat", 1 << 18, two_choice_spill);
+    
+    byte_key_check("byte_key_test.dat", 1 << 18);
+    
+    multi_value_check("multi_value_test.dat", 1 << 18);
+    
+    bucket_map_options two_choice_multi_value = two_choice_spill;
+    two_choice_multi_value.multi_value = true;
+    
+    multi_value_check("two_choice_multi_value_test.dat", 1 << 18, two_choice_multi_value);
+    
+    batch_check("batch_test.dat", 1 << 20);
+    
+    batch_check("two_choice_batch_test.dat", 1 << 18, two_choice_spill);
+    
+    batch_check("contiguous_batch_test.dat", 1 << 18, contiguous);
+    
+    bucket_map_options buffered;
+    buffered.insert_buffer_size = 5000;
+    
+    insert_buffer_check("buffer_test.dat", 1 << 19, buffered);
+    
+    bucket_map_options two_choice_buffered = two_choice_spill;
+    two_choice_buffered.insert_buffer_size = 1000;
+    
+    insert_buffer_check("two_choice_buffer_test.dat", 1 << 18, two_choice_buffered);
+    
+    layout_check(1 << 10, 1 << 15);
+    
+    read_only_check("read_only_test.dat", 1 << 18);
+    
+    direct_reader_check("direct_reader_test.dat", 1 << 16);
+    
+    compaction_check("compaction_test.dat", 1 << 18);
+    
+    compaction_check("two_choice_compaction_test.dat", 1 << 16, two_choice_spill);
+    
+    compaction_check("spill_compaction_test.dat", 1 << 16, spill);
+    
+    direct_reader_check("two_choice_direct_reader_test.dat", 1 << 16, two_choice_spill);
+    
+    export_import_check("export_test.dat", 1 << 18);
+    
+    bucket_map_options contiguous_spill = two_choice_spill;
+    contiguous_spill.addressing = kContiguousAddressing;
+    
+    export_import_check("contiguous_export_test.dat", 1 << 18, contiguous_spill);
+    
+    mutation_log_check("log_test.dat", 1 << 18);
+    
+    mutation_log_check("two_choice_log_test.dat", 1 << 17, two_choice_buffered);
+    
+    snapshot_check("snapshot_test.dat", 1 << 18);
+    
+    snapshot_check("contiguous_snapshot_test.dat", 1 << 18, contiguous_spill);
+    
+    snapshot_check("two_choice_snapshot_test.dat", 1 << 17, two_choice_buffered);
+    
+    frozen_map_check("frozen_test.dat", 1 << 18);
+    
+    frozen_map_check("two_choice_frozen_test.dat", 1 << 17, two_choice_buffered);
+    
+    bucket_map_options synchronous_fill;
+    synchronous_fill.preallocation.zero_fill = kSynchronousZeroFill;
+    synchronous_fill.preallocation.count_faults = true;
+    
+    preallocation_check("preallocation_test.dat", 1 << 18, synchronous_fill);
+    
+    bucket_map_options background_fill = contiguous_spill;
+    background_fill.preallocation.zero_fill = kBackgroundZeroFill;
+    background_fill.preallocation.count_faults = true;
+    
+    preallocation_check("contiguous_preallocation_test.dat", 1 << 18, background_fill);
+    
+    incremental_growth_check("growth_test.dat", 1 << 19);
+    
+    incremental_growth_check("contiguous_growth_test.dat", 1 << 19, contiguous_spill);
+    
+    large_map_check("large_map_test.dat", 1 << 14);
+    
+    bucket_size_check("bucket_size_test.dat");
+    
+#ifdef SSDMAP_HAS_COROUTINES
+    interleaved_lookup_check("interleaved_test.dat", 1 << 18);
+    
+    interleaved_lookup_check("two_choice_interleaved_test.dat", 1 << 18, two_choice_spill);
+#endif
 
     std::cout << "Post-cleaning ..." << std::flush;
     
-    clean({"correctness_map.dat", "systematic_correctness_map.dat", "access_test.dat", "persistency_test.dat", "it_test.dat"});
+    clean({"correctness_map.dat", "systematic_correctness_map.dat", "access_test.dat", "persistency_test.dat", "it_test.dat", "collision_test.dat", "two_choice_map.dat", "systematic_two_choice_map.dat", "two_choice_persistency_test.dat", "spill_map.dat", "systematic_spill_map.dat", "spill_persistency_test.dat", "two_choice_spill_map.dat", "resize_persistency_test.dat", "contiguous_map.dat", "systematic_contiguous_map.dat", "contiguous_persistency_test.dat", "contiguous_resize_persistency_test.dat", "reserve_test.dat", "parallel_reserve_test.dat", "parallel_spill_reserve_test.dat", "parallel_two_choice_reserve_test.dat", "scan_test.dat", "spill_scan_test.dat", "contiguous_scan_test.dat", "checkpoint_test.dat", "set_test.dat", "two_choice_set_test.dat", "byte_key_test.dat", "multi_value_test.dat", "two_choice_multi_value_test.dat", "batch_test.dat", "two_choice_batch_test.dat", "contiguous_batch_test.dat", "buffer_test.dat", "two_choice_buffer_test.dat", "read_only_test.dat", "direct_reader_test.dat", "compaction_test.dat", "compact_compaction_test.dat", "dedup_compaction_test.dat", "multipass_compaction_test.dat", "two_choice_compaction_test.dat", "compact_two_choice_compaction_test.dat", "dedup_two_choice_compaction_test.dat", "multipass_two_choice_compaction_test.dat", "spill_compaction_test.dat", "compact_spill_compaction_test.dat", "dedup_spill_compaction_test.dat", "multipass_spill_compaction_test.dat", "two_choice_direct_reader_test.dat", "interleaved_test.dat", "two_choice_interleaved_test.dat", "export_test.dat", "exported_export_test.dat", "imported_export_test.dat", "rehashed_export_test.dat", "corrupted_export_test.dat", "contiguous_export_test.dat", "exported_contiguous_export_test.dat", "imported_contiguous_export_test.dat", "rehashed_contiguous_export_test.dat", "corrupted_contiguous_export_test.dat", "resizing_export_test.dat", "exported_resizing_export_test.dat", "imported_resizing_export_test.dat", "resizing_contiguous_export_test.dat", "exported_resizing_contiguous_export_test.dat", "imported_resizing_contiguous_export_test.dat", "log_test.dat", "log_log_test.dat", "replica_log_test.dat", "late_replica_log_test.dat", "two_choice_log_test.dat", "log_two_choice_log_test.dat", "replica_two_choice_log_test.dat", "late_replica_two_choice_log_test.dat", "snapshot_test.dat", "snapshot_snapshot_test.dat", "late_snapshot_snapshot_test.dat", "overflow_snapshot_test.dat", "overflow_snapshot_snapshot_test.dat", "contiguous_snapshot_test.dat", "snapshot_contiguous_snapshot_test.dat", "late_snapshot_contiguous_snapshot_test.dat", "overflow_contiguous_snapshot_test.dat", "overflow_snapshot_contiguous_snapshot_test.dat", "two_choice_snapshot_test.dat", "snapshot_two_choice_snapshot_test.dat", "late_snapshot_two_choice_snapshot_test.dat", "overflow_two_choice_snapshot_test.dat", "overflow_snapshot_two_choice_snapshot_test.dat", "frozen_test.dat", "frozen_frozen_test.dat", "two_choice_frozen_test.dat", "frozen_two_choice_frozen_test.dat", "preallocation_test.dat", "contiguous_preallocation_test.dat", "growth_test.dat", "contiguous_growth_test.dat", "large_map_test.dat", "bucket_size_test.dat"});
     
     std::cout << " done" << std::endl;
     
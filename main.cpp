@@ -23,13 +23,21 @@
 #include <fstream>
 
 #include <ftw.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <chrono>
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <thread>
 
 #include "mmap_util.h"
 #include "bucket_array.hpp"
 #include "bucket_map.hpp"
+#include "bucket_set.hpp"
+#include "coroutine_lookup.hpp"
+#include "direct_reader.hpp"
+#include "frozen_map.hpp"
 
 using namespace ssdmap;
 
@@ -108,6 +116,253 @@ void benchmark(const std::string &filename, const std::string &write_bench_file,
 }
 
 
+void placement_benchmark(const std::string &filename, const bucket_map_options& options, size_t initial_size, size_t test_size)
+{
+    std::cout << "Placement benchmark (" << ((options.placement == kTwoChoicePlacement) ? "two choices" : "single choice");
+    std::cout << ((options.overflow == kSiblingSpill) ? ", sibling spill" : "");
+    std::cout << ((options.addressing == kContiguousAddressing) ? ", contiguous" : "") << ")\n";
+    std::cout << "Initial size: " << initial_size;
+    std::cout << ", test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t,uint64_t> bm(filename,initial_size,options);
+    std::vector<uint64_t> keys(test_size);
+    
+    float first_resize_load = 0;
+    size_t doublings_count = bm.doublings_count();
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    
+    for (size_t i = 0; i < test_size; i++) {
+        keys[i] = xorshift128();
+        
+        float l = bm.load();
+        bm.add(keys[i], keys[i]);
+        
+        if (first_resize_load == 0 && bm.doublings_count() != doublings_count) {
+            first_resize_load = l;
+        }
+    }
+    
+    auto end = std::chrono::high_resolution_clock::now();
+    double insert_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    uint64_t v;
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        bm.get(keys[i], v);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double hit_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        bm.get(xorshift128(), v);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double miss_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::cout << "Load before the first doubling: " << first_resize_load << "\n";
+    std::cout << "Final load: " << bm.load() << ", doublings: " << bm.doublings_count() << "\n";
+    std::cout << "Overflow size: " << bm.overflow_size() << " (" << bm.overflow_memory_usage() << " bytes)\n";
+    std::cout << "Insertion: " << insert_time/test_size << " ns, ";
+    std::cout << "successful lookup: " << hit_time/test_size << " ns, ";
+    std::cout << "unsuccessful lookup: " << miss_time/test_size << " ns\n\n";
+}
+
+void scan_benchmark(const std::string &filename, size_t test_size, unsigned int max_threads)
+{
+    std::cout << "Scan benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t,uint64_t> bm(filename,test_size);
+    
+    for (size_t i = 0; i < test_size; i++) {
+        uint64_t k = xorshift128();
+        bm.add(k, k);
+    }
+    
+    uint64_t sum = 0;
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (auto it = bm.begin(); it != bm.end(); ++it) {
+        sum += it->second;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double it_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::cout << "Iterator: " << it_time/test_size << " ns/element\n";
+    
+    for (unsigned int t = 1; t <= max_threads; t *= 2) {
+        // one partial sum per partition, to avoid sharing a counter between threads
+        std::vector<bucket_range> ranges = bm.partitions(t);
+        std::vector<uint64_t> sums(ranges.size(), 0);
+        std::vector<std::thread> workers;
+        
+        begin = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < ranges.size(); i++) {
+            workers.push_back(std::thread([&bm, &ranges, &sums, i]()
+            {
+                uint64_t local_sum = 0;
+                bm.for_each(ranges[i], [&local_sum](const std::pair<const uint64_t, uint64_t>& elt)
+                {
+                    local_sum += elt.second;
+                });
+                sums[i] = local_sum;
+            }));
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+        end = std::chrono::high_resolution_clock::now();
+        double scan_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+        
+        uint64_t p_sum = 0;
+        for (auto x : sums) {
+            p_sum += x;
+        }
+        
+        std::cout << "Partitioned scan, " << t << " thread(s): " << scan_time/test_size << " ns/element";
+        std::cout << ((p_sum == sum) ? "" : " (wrong sum!)") << "\n";
+    }
+    std::cout << std::endl;
+}
+
+void batch_benchmark(const std::string &single_filename, const std::string &batch_filename, size_t initial_size, size_t test_size, size_t batch_size)
+{
+    std::cout << "Batch insertion benchmark\n";
+    std::cout << "Test size: " << test_size << ", batches of " << batch_size << std::endl;
+    
+    std::vector<uint64_t> keys(test_size);
+    std::vector<uint64_t> values(test_size);
+    
+    for (size_t i = 0; i < test_size; i++) {
+        keys[i] = xorshift128();
+        values[i] = i;
+    }
+    
+    bucket_map<uint64_t,uint64_t> single_map(single_filename,initial_size);
+    bucket_map<uint64_t,uint64_t> batch_map(batch_filename,initial_size);
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        single_map.add(keys[i], values[i]);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double single_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i += batch_size) {
+        size_t last = std::min(i + batch_size, test_size);
+        batch_map.add_batch(keys.begin() + i, keys.begin() + last, values.begin() + i);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double batch_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::cout << "add(): " << single_time/test_size << " ns/element, ";
+    std::cout << "add_batch(): " << batch_time/test_size << " ns/element";
+    std::cout << ((single_map.size() == batch_map.size()) ? "" : " (size mismatch!)") << "\n\n";
+}
+
+void membership_benchmark(const std::string &map_filename, const std::string &set_filename, size_t test_size)
+{
+    std::cout << "Membership benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t,uint8_t> bm(map_filename,test_size);
+    bucket_set<uint64_t> bs(set_filename,test_size);
+    std::vector<uint64_t> keys(test_size);
+    
+    for (size_t i = 0; i < test_size; i++) {
+        keys[i] = xorshift128();
+        bm.add(keys[i], 1);
+        bs.insert(keys[i]);
+    }
+    
+    std::cout << "bucket_map<uint64_t,uint8_t>: " << bm.bucket_count() << " buckets, bucket_set<uint64_t>: " << bs.bucket_count() << " buckets\n";
+    
+    size_t found = 0;
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        found += bm.contains(keys[i]) ? 1 : 0;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double map_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        found += bs.contains(keys[i]) ? 1 : 0;
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double set_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::vector<bool> results;
+    results.reserve(test_size);
+    
+    begin = std::chrono::high_resolution_clock::now();
+    found += bs.contains(keys.begin(), keys.end(), std::back_inserter(results));
+    end = std::chrono::high_resolution_clock::now();
+    double batch_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::cout << "map lookup: " << map_time/test_size << " ns, ";
+    std::cout << "set lookup: " << set_time/test_size << " ns, ";
+    std::cout << "batched set lookup: " << batch_time/test_size << " ns";
+    std::cout << ((found == 3*test_size) ? "" : " (missing keys!)") << "\n\n";
+}
+
+typedef std::array<uint8_t, 32> token_type;
+
+// what one had to write before key_hash<std::array<uint8_t,N>>
+struct fnv_token_hash
+{
+    size_t operator()(const token_type& t) const
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (uint8_t b : t) {
+            h = (h ^ b) * 1099511628211ULL;
+        }
+        return h;
+    }
+};
+
+template <class Map>
+void token_lookups(Map& bm, const std::vector<token_type>& keys, const std::string& name)
+{
+    for (size_t i = 0; i < keys.size(); i++) {
+        bm.add(keys[i], i);
+    }
+    
+    size_t found = 0;
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < keys.size(); i++) {
+        found += bm.contains(keys[i]) ? 1 : 0;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::cout << name << ": " << time/keys.size() << " ns/lookup" << ((found == keys.size()) ? "" : " (missing keys!)") << "\n";
+}
+
+void byte_key_benchmark(const std::string &generic_filename, const std::string &byte_filename, size_t test_size)
+{
+    std::cout << "Byte key benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    std::vector<token_type> keys(test_size);
+    
+    for (auto &k : keys) {
+        for (size_t i = 0; i < k.size(); i += sizeof(uint64_t)) {
+            uint64_t r = xorshift128();
+            memcpy(k.data() + i, &r, sizeof(uint64_t));
+        }
+    }
+    
+    bucket_map<token_type, uint64_t, fnv_token_hash, std::equal_to<token_type>> generic_map(generic_filename, test_size);
+    bucket_map<token_type, uint64_t> byte_map(byte_filename, test_size);
+    
+    token_lookups(generic_map, keys, "FNV hash, std::equal_to");
+    token_lookups(byte_map, keys, "key_hash, key_equal_to");
+    std::cout << std::endl;
+}
+
 /* Call unlink or rmdir on the path, as appropriate. */
 int
 rm( const char *path, const struct stat *s, int flag, struct FTW *f )
@@ -131,6 +386,376 @@ void clean(const std::list<std::string> &file_list)
     }
 }
 
+// drop the pages of the data files of a (closed) map from the page cache
+void evict_data_files(const std::string &filename)
+{
+    for (size_t i = 0; ; i++) {
+        int fd = open((filename + "/data." + std::to_string(i)).c_str(), O_RDONLY);
+        
+        if (fd == -1) {
+            break;
+        }
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+void direct_read_benchmark(const std::string &filename, size_t test_size, size_t lookup_count)
+{
+    std::cout << "Cold cache lookup benchmark\n";
+    std::cout << "Test size: " << test_size << ", " << lookup_count << " lookups" << std::endl;
+    
+    typedef bucket_map<uint64_t,uint64_t> map_type;
+    
+    std::vector<uint64_t> keys;
+    
+    {
+        map_type map(filename,1<<15);
+        
+        for (size_t i = 0; i < test_size; i++) {
+            uint64_t k = xorshift128();
+            map.add(k, i);
+            
+            if (i % (test_size/lookup_count) == 0 && keys.size() < lookup_count) {
+                keys.push_back(k);
+            }
+        }
+    }
+    
+    size_t found = 0;
+    
+    evict_data_files(filename);
+    
+    map_type map(filename, kReadOnly);
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (auto k : keys) {
+        uint64_t v;
+        found += map.get(k, v);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double mmap_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::cout << "mmap: " << mmap_time/keys.size() << " ns/lookup";
+    
+    for (read_engine engine : {kUringEngine, kPreadEngine}) {
+        try {
+            direct_reader<map_type> reader(map, kDirectReadQueueDepth, engine);
+            
+            evict_data_files(filename);
+            
+            begin = std::chrono::high_resolution_clock::now();
+            reader.find_batch(keys.begin(), keys.end(), [&found](const uint64_t&, const map_type::value_type* elt){ found += (elt != NULL); });
+            end = std::chrono::high_resolution_clock::now();
+            double direct_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+            
+            std::cout << ", " << ((engine == kUringEngine) ? "io_uring: " : "pread pool: ") << direct_time/keys.size() << " ns/lookup";
+        } catch (std::runtime_error &e) {
+            std::cout << ", io_uring not available";
+            found += keys.size();
+        }
+    }
+    
+    std::cout << ((found == 3*keys.size()) ? "" : " (missing keys!)") << "\n\n";
+}
+
+void export_import_benchmark(const std::string &filename, const std::string &export_filename, const std::string &import_filename, size_t test_size, unsigned int max_threads)
+{
+    std::cout << "Export/import benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t,uint64_t> map_type;
+    
+    map_type map(filename,1<<15);
+    
+    for (size_t i = 0; i < test_size; i++) {
+        map.add(xorshift128(), i);
+    }
+    map.flush();
+    
+    for (unsigned int threads = 1; threads <= max_threads; threads *= 2) {
+        clean({export_filename, import_filename});
+        
+        auto begin = std::chrono::high_resolution_clock::now();
+        map.export_to(export_filename, threads);
+        auto end = std::chrono::high_resolution_clock::now();
+        double export_time = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+        
+        size_t n;
+        {
+            // same geometry: the pages are copied
+            map_type imported(import_filename,1<<15);
+            
+            begin = std::chrono::high_resolution_clock::now();
+            n = imported.import_from(export_filename, threads);
+            end = std::chrono::high_resolution_clock::now();
+        }
+        double import_time = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+        
+        std::cout << threads << " threads: export " << export_time << " ms, import " << import_time << " ms" << ((n == map.size()) ? "" : " (missing elements!)") << std::endl;
+    }
+    
+    {
+        // different placement: the elements are rehashed
+        clean({import_filename});
+        
+        bucket_map_options two_choice;
+        two_choice.placement = kTwoChoicePlacement;
+        map_type imported(import_filename,1<<15,two_choice);
+        
+        auto begin = std::chrono::high_resolution_clock::now();
+        imported.import_from(export_filename, max_threads);
+        auto end = std::chrono::high_resolution_clock::now();
+        double import_time = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+        
+        std::cout << "rehashing import (" << max_threads << " threads): " << import_time << " ms\n\n";
+    }
+}
+
+void replication_benchmark(const std::string &filename, const std::string &log_directory, const std::string &replica_filename, size_t test_size)
+{
+    std::cout << "Replication benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef bucket_map<uint64_t,uint64_t> map_type;
+    
+    map_type map(filename,1<<15);
+    map.start_mutation_log(log_directory);
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        map.add(xorshift128(), i);
+    }
+    map.flush();
+    auto end = std::chrono::high_resolution_clock::now();
+    double ingest_time = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+    
+    map_type replica(replica_filename,1<<15);
+    log_follower<map_type> follower(replica, log_directory);
+    
+    begin = std::chrono::high_resolution_clock::now();
+    size_t n = follower.catch_up();
+    replica.flush();
+    end = std::chrono::high_resolution_clock::now();
+    double apply_time = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+    
+    std::cout << "logged ingestion: " << ingest_time << " ms, replica catch up: " << apply_time << " ms" << ((n == test_size && replica.size() == map.size()) ? "" : " (missing elements!)") << "\n\n";
+}
+
+void snapshot_benchmark(const std::string &filename, const std::string &snapshot_filename, size_t test_size)
+{
+    std::cout << "Snapshot benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map<uint64_t,uint64_t> map(filename,1<<15);
+    
+    for (size_t i = 0; i < test_size; i++) {
+        map.add(xorshift128(), i);
+    }
+    
+    // the writer keeps inserting while the snapshot is written
+    auto begin = std::chrono::high_resolution_clock::now();
+    map.snapshot(snapshot_filename);
+    auto end = std::chrono::high_resolution_clock::now();
+    double stall_time = std::chrono::duration_cast<std::chrono::microseconds>(end-begin).count();
+    
+    size_t n = test_size/4;
+    for (size_t i = 0; i < n; i++) {
+        map.add(xorshift128(), i);
+    }
+    map.wait_snapshot();
+    end = std::chrono::high_resolution_clock::now();
+    double total_time = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+    
+    std::cout << "snapshot() stall: " << stall_time << " us, snapshot written in " << total_time << " ms, " << n << " insertions meanwhile\n\n";
+}
+
+void frozen_map_benchmark(const std::string &filename, const std::string &frozen_filename, size_t test_size)
+{
+    std::cout << "Frozen map benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    typedef frozen_map<uint64_t,uint64_t> frozen_type;
+    
+    std::vector<uint64_t> keys(test_size);
+    
+    bucket_map<uint64_t,uint64_t> map(filename,1<<15);
+    
+    for (size_t i = 0; i < test_size; i++) {
+        keys[i] = xorshift128();
+        map.add(keys[i], i);
+    }
+    map.flush();
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    frozen_type::freeze(map, frozen_filename);
+    auto end = std::chrono::high_resolution_clock::now();
+    double build_time = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+    
+    frozen_type frozen(frozen_filename);
+    
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(test_size));
+    
+    size_t found = 0;
+    uint64_t v;
+    
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        found += map.get(keys[i], v);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double map_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        found += frozen.get(keys[i], v);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double frozen_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::cout << "freeze: " << build_time << " ms, ";
+    std::cout << "bucket_map: " << (map.bucket_count()*kPageSize >> 20) << " MB + " << (map.overflow_memory_usage() >> 20) << " MB in memory, " << map_time/test_size << " ns/lookup, ";
+    std::cout << "frozen_map: " << (frozen.file_size() >> 20) << " MB, " << frozen_time/test_size << " ns/lookup";
+    std::cout << ((found == 2*test_size) ? "" : " (missing keys!)") << "\n\n";
+}
+
+void preallocation_benchmark(const std::string &filename, size_t test_size, bool allocate, zero_fill_mode zero_fill)
+{
+    std::cout << "Preallocation benchmark\n";
+    std::cout << "Test size: " << test_size << ", " << (allocate ? "allocated" : "sparse") << " files, ";
+    std::cout << ((zero_fill == kSynchronousZeroFill) ? "synchronous" : ((zero_fill == kBackgroundZeroFill) ? "background" : "no")) << " zero-fill" << std::endl;
+    
+    bucket_map_options options;
+    options.preallocation.allocate = allocate;
+    options.preallocation.zero_fill = zero_fill;
+    options.preallocation.count_faults = true;
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    {
+        bucket_map<uint64_t,uint64_t> map(filename,1<<15,options);
+        
+        for (size_t i = 0; i < test_size; i++) {
+            map.add(xorshift128(), i);
+        }
+        
+        fault_stats stats = map.get_fault_stats();
+        auto end = std::chrono::high_resolution_clock::now();
+        double time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+        
+        std::cout << time_ms << " ms, " << static_cast<double>(stats.minor_faults + stats.major_faults)/stats.insertions << " faults/insertion (" << stats.major_faults << " major), at most " << stats.max_faults << " faults in an insertion\n\n";
+    }
+}
+
+void incremental_growth_benchmark(const std::string &filename, size_t test_size)
+{
+    std::cout << "Incremental growth benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map_options options;
+    options.resize.automatic = false;
+    options.preallocation.zero_fill = kSynchronousZeroFill;
+    
+    bucket_map<uint64_t,uint64_t> map(filename,test_size,options);
+    
+    for (size_t i = 0; i < test_size; i++) {
+        map.add(xorshift128(), i);
+    }
+    
+    size_t N = map.bucket_count();
+    std::string new_file = filename + "/data.1";
+    struct stat st;
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    map.start_resize();
+    auto end = std::chrono::high_resolution_clock::now();
+    double start_time = std::chrono::duration_cast<std::chrono::microseconds>(end-begin).count();
+    
+    stat(new_file.data(), &st);
+    size_t start_blocks = st.st_blocks;
+    
+    map.advance_resize(N/2);
+    stat(new_file.data(), &st);
+    
+    std::cout << "start_resize: " << start_time/1000 << " ms, new file: " << (start_blocks*512 >> 10) << " kB after start, " << (st.st_blocks*512 >> 10) << " kB half way, out of " << (N*kPageSize >> 10) << " kB\n\n";
+}
+
+void cold_resize_benchmark(const std::string &filename, size_t test_size)
+{
+    std::cout << "Cold resize benchmark\n";
+    std::cout << "Test size: " << test_size << std::endl;
+    
+    bucket_map_options options;
+    options.resize.automatic = false;
+    
+    size_t N;
+    {
+        bucket_map<uint64_t,uint64_t> map(filename,test_size,options);
+        
+        for (size_t i = 0; i < test_size; i++) {
+            map.add(xorshift128(), i);
+        }
+        N = map.bucket_count();
+    }
+    
+    // evict the (clean) pages of the data file from the page cache
+    std::string data_file = filename + "/data.0";
+    int fd = open(data_file.data(), O_RDONLY);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    
+    bucket_map<uint64_t,uint64_t> map(filename);
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    map.full_resize();
+    auto end = std::chrono::high_resolution_clock::now();
+    double time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+    
+    std::cout << "full_resize of " << (N*kPageSize >> 20) << " MB: " << time_ms << " ms, " << (N*kPageSize >> 20)/(time_ms/1000) << " MB/s read\n\n";
+}
+
+#ifdef SSDMAP_HAS_COROUTINES
+void interleaved_lookup_benchmark(const std::string &filename, size_t test_size, size_t group_size)
+{
+    std::cout << "Interleaved lookup benchmark\n";
+    std::cout << "Test size: " << test_size << ", " << group_size << " lookups in flight" << std::endl;
+    
+    std::vector<uint64_t> keys(test_size);
+    
+    bucket_map<uint64_t,uint64_t> map(filename,1<<15);
+    
+    for (size_t i = 0; i < test_size; i++) {
+        keys[i] = xorshift128();
+        map.add(keys[i], i);
+    }
+    
+    size_t found = 0;
+    uint64_t v;
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < test_size; i++) {
+        found += map.get(keys[i], v);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double single_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    begin = std::chrono::high_resolution_clock::now();
+    map.find_batch(keys.begin(), keys.end(), [&found](const uint64_t&, const bucket_map<uint64_t,uint64_t>::value_type* elt){ found += (elt != NULL); });
+    end = std::chrono::high_resolution_clock::now();
+    double batch_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    begin = std::chrono::high_resolution_clock::now();
+    interleaved_lookup<bucket_map<uint64_t,uint64_t>>::find(map, keys.begin(), keys.end(), [&found](const uint64_t&, const bucket_map<uint64_t,uint64_t>::value_type* elt){ found += (elt != NULL); }, group_size);
+    end = std::chrono::high_resolution_clock::now();
+    double interleaved_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    
+    std::cout << "get(): " << single_time/test_size << " ns/lookup, ";
+    std::cout << "find_batch(): " << batch_time/test_size << " ns/lookup, ";
+    std::cout << "interleaved: " << interleaved_time/test_size << " ns/lookup";
+    std::cout << ((found == 3*test_size) ? "" : " (missing keys!)") << "\n\n";
+}
+#endif
+
 int main(int argc, const char * argv[]) {
 
     srand ((unsigned int)time(NULL));
@@ -141,7 +766,7 @@ int main(int argc, const char * argv[]) {
     
     std::cout << "Pre-cleaning ..." << std::flush;
     
-    clean({"bench.dat","bench"});
+    clean({"bench.dat","bench","placement_single.dat","placement_two.dat","placement_spill.dat","placement_contiguous.dat","scan.dat","membership_map.dat","membership_set.dat","byte_key_generic.dat","byte_key.dat","batch_single.dat","batch.dat","direct_read.dat","interleaved.dat","export.dat","export.bin","import.dat","replication.dat","replication.log","replica.dat","snapshot.dat","snapshot_copy.dat","frozen_source.dat","frozen.bin","prealloc_sparse.dat","prealloc_allocated.dat","prealloc_sync.dat","prealloc_background.dat","growth.dat","cold_resize.dat"});
     
     std::cout << " done\n\n" << std::endl;
     
@@ -152,9 +777,56 @@ int main(int argc, const char * argv[]) {
 
     benchmark("bench.dat", "bench/write_bench.out", "bench/read_bench.out", 1<<15, 1<<20);
     
+    bucket_map_options two_choice;
+    two_choice.placement = kTwoChoicePlacement;
+    
+    placement_benchmark("placement_single.dat", bucket_map_options(), 1<<15, 1<<20);
+    placement_benchmark("placement_two.dat", two_choice, 1<<15, 1<<20);
+    
+    bucket_map_options spill;
+    spill.overflow = kSiblingSpill;
+    
+    placement_benchmark("placement_spill.dat", spill, 1<<15, 1<<20);
+    
+    bucket_map_options contiguous;
+    contiguous.addressing = kContiguousAddressing;
+    
+    placement_benchmark("placement_contiguous.dat", contiguous, 1<<15, 1<<20);
+    
+    scan_benchmark("scan.dat", 1<<22, 8);
+    
+    membership_benchmark("membership_map.dat", "membership_set.dat", 1<<22);
+    
+    byte_key_benchmark("byte_key_generic.dat", "byte_key.dat", 1<<21);
+    
+    batch_benchmark("batch_single.dat", "batch.dat", 1<<15, 1<<22, 4096);
+    
+    direct_read_benchmark("direct_read.dat", 1<<22, 1<<16);
+    
+    export_import_benchmark("export.dat", "export.bin", "import.dat", 1<<22, 4);
+    
+    replication_benchmark("replication.dat", "replication.log", "replica.dat", 1<<22);
+    
+    snapshot_benchmark("snapshot.dat", "snapshot_copy.dat", 1<<22);
+    
+    frozen_map_benchmark("frozen_source.dat", "frozen.bin", 1<<22);
+    
+    preallocation_benchmark("prealloc_sparse.dat", 1<<22, false, kNoZeroFill);
+    preallocation_benchmark("prealloc_allocated.dat", 1<<22, true, kNoZeroFill);
+    preallocation_benchmark("prealloc_sync.dat", 1<<22, true, kSynchronousZeroFill);
+    preallocation_benchmark("prealloc_background.dat", 1<<22, true, kBackgroundZeroFill);
+    
+    incremental_growth_benchmark("growth.dat", 1<<22);
+    
+    cold_resize_benchmark("cold_resize.dat", 1<<22);
+    
+#ifdef SSDMAP_HAS_COROUTINES
+    interleaved_lookup_benchmark("interleaved.dat", 1<<22, kInterleavedLookupGroupSize);
+    
+#endif
     std::cout << "Post-cleaning ..." << std::flush;
     
-    clean({"bench.dat"});
+    clean({"bench.dat","placement_single.dat","placement_two.dat","placement_spill.dat","placement_contiguous.dat","scan.dat","membership_map.dat","membership_set.dat","byte_key_generic.dat","byte_key.dat","batch_single.dat","batch.dat","direct_read.dat","interleaved.dat","export.dat","export.bin","import.dat","replication.dat","replication.log","replica.dat","snapshot.dat","snapshot_copy.dat","frozen_source.dat","frozen.bin","prealloc_sparse.dat","prealloc_allocated.dat","prealloc_sync.dat","prealloc_background.dat","growth.dat","cold_resize.dat"});
     
     std::cout << " done" << std::endl;
     
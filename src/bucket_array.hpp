@@ -26,6 +26,10 @@
 
 #include <exception>
 #include <stdexcept>
+#include <cassert>
+
+#include "dirty_tracker.hpp"
+#include "page_snapshot.hpp"
 
 /** @file bucket_array.hpp
  * @brief Header that defines the bucket_array representation class.
@@ -41,18 +45,107 @@
  						Page (sector) size
  <------------------------------------------------------------------------------------>
 
- |==========|==========|==========|==========|==========|==========|=======|==========|
- |          |          |          |          |          |          |       |          |
- |  Data 0  |  Data 1  |  Data 3  |   ...    |   ...    |  Data k  | Empty |  Counter |
- |          |          |          |          |          |          |       |          |
- |==========|==========|==========|==========|==========|==========|=======|==========|
+ |==========|==========|==========|==========|==========|==========|=======|====|==========|
+ |          |          |          |          |          |          |       |    |          |
+ |  Data 0  |  Data 1  |  Data 3  |   ...    |   ...    |  Data k  | Empty |Hint|  Counter |
+ |          |          |          |          |          |          |       |    |          |
+ |==========|==========|==========|==========|==========|==========|=======|====|==========|
+ 
+ <---------->															   <--><---------->
+  sizeof(T)															 		 1    sizeof(C)
  
- <---------->															   <---------->
-  sizeof(T)															 		 sizeof(C)
+ The hint byte is not interpreted by the bucket_array: it is free for use by the containers built on top of it.
  */
 
 namespace ssdmap {
     
+constexpr size_t kCacheLineSize = 64; /**< @brief Size (in bytes) of a CPU cache line. */
+
+/** @struct runtime_layout
+ *  @brief Layout policy of a bucket_array whose page size and bucket size are chosen at runtime.
+ *
+ *  This is the default layout: the geometry is given to the constructor of the bucket_array and stored in it.
+ */
+struct runtime_layout
+{
+    /** @brief The geometry of the buckets of a bucket_array<T,C,runtime_layout>. */
+    template <class T, class C>
+    class geometry
+    {
+    public:
+        static constexpr bool kStatic = false; /**< @brief The geometry is not known at compile time	*/
+        
+        geometry(size_t page_size, size_t bucket_size)
+        : page_size_(page_size), bucket_size_(bucket_size)
+        {}
+        
+        inline size_t page_size() const
+        {
+            return page_size_;
+        }
+        
+        inline C bucket_size() const
+        {
+            return bucket_size_;
+        }
+        
+    private:
+        size_t page_size_;
+        C bucket_size_;
+    };
+};
+
+/** @struct static_layout
+ *  @brief Layout policy of a bucket_array whose page size is a compile-time constant.
+ *
+ *  The buckets have the optimal size for the page (see bucket_array::optimal_bucket_size()).
+ *  The page size, the bucket size and the offset of the counter are constant expressions: the address computations are shifts and masks instead of multiplications by stored values.
+ *
+ *  @tparam PageSize    The size (in bytes) of a page. It must be a power of 2.
+ */
+template <size_t PageSize>
+struct static_layout
+{
+    static_assert(PageSize > 0 && (PageSize & (PageSize-1)) == 0, "The page size must be a power of 2");
+    
+    /** @brief The geometry of the buckets of a bucket_array<T,C,static_layout<PageSize>>. */
+    template <class T, class C>
+    class geometry
+    {
+    public:
+        static constexpr bool kStatic = true; /**< @brief The geometry is known at compile time	*/
+        static constexpr size_t kPageSize = PageSize; /**< @brief Size (in bytes) of a page	*/
+        static constexpr size_t kBucketSize = (PageSize - sizeof(C) - 1)/sizeof(T); /**< @brief Number of elements of a bucket	*/
+        
+        static_assert(kBucketSize > 0, "The page is too small to contain an element");
+        
+        /**
+         *  @brief Constructor
+         *
+         *  @exception std::runtime_error("Invalid page size.") @a page_size is not PageSize.
+         *  @exception std::runtime_error("Invalid bucket size.") @a bucket_size is not kBucketSize.
+         */
+        geometry(size_t page_size, size_t bucket_size)
+        {
+            if (page_size != kPageSize) {
+                throw std::runtime_error("Invalid page size.");
+            }
+            if (bucket_size != kBucketSize) {
+                throw std::runtime_error("Invalid bucket size.");
+            }
+        }
+        
+        static constexpr size_t page_size()
+        {
+            return kPageSize;
+        }
+        
+        static constexpr C bucket_size()
+        {
+            return kBucketSize;
+        }
+    };
+};
     
 /** @class bucket_array
  *  @brief An array of bucket representation of memory.
@@ -62,9 +155,10 @@ namespace ssdmap {
  *
  *  @tparam T   Type of the content values.  Aliased as member type bucket_map::value_type.
  *  @tparam C   Type of the counter values.  It must be a PoD type. This defaults to uint16_t, so the buckets can store 2^16-1 elements. Aliased as member type bucket_map::counter_type.
+ *  @tparam Layout  The layout policy, giving the page size and the bucket size: runtime_layout (the default) or static_layout<PageSize>.
  */
     
-template <class T, class C = uint16_t>
+template <class T, class C = uint16_t, class Layout = runtime_layout>
 class bucket_array {
 public:
     typedef T                                 value_type;       /**< @brief The first template parameter (T)	*/
@@ -79,6 +173,10 @@ public:
     typedef const C&                          const_counter_ref;/**< @brief const counter_type&	*/
     typedef C*                                counter_ptr;      /**< @brief counter_type*	*/
     typedef const C*                          const_counter_ptr;/**< @brief const counter_type*	*/
+    typedef Layout                            layout_type;      /**< @brief The third template parameter (Layout)	*/
+    typedef typename Layout::template geometry<T, C> geometry_type; /**< @brief The geometry of the buckets	*/
+
+    static constexpr size_t kTrailerSize = sizeof(counter_type) + 1; /**< @brief Size of the trailer of a bucket: the hint byte and the counter	*/
 
 
     /** @class bucket
@@ -122,6 +220,32 @@ public:
             return c_ptr[0];
         }
         
+        /**
+         *  @brief Return the hint byte.
+         *
+         *  Returns the byte stored in the trailer of the bucket, just before the counter.
+         *
+         *  @return The hint byte of the bucket.
+         */
+        inline uint8_t hint() const
+        {
+            return addr_[array_->page_size() - sizeof(counter_type) - 1];
+        }
+        
+        /**
+         *  @brief Set the hint byte.
+         *
+         *  Sets the hint byte of the bucket to @a h.
+         *
+         *  @param  h   The new hint byte.
+         */
+        inline void set_hint(uint8_t h)
+        {
+            array_->preserve(addr_);
+            addr_[array_->page_size() - sizeof(counter_type) - 1] = h;
+            array_->mark_dirty(addr_);
+        }
+        
         /**
          *  @brief Set the size counter.
          * 
@@ -131,8 +255,10 @@ public:
          */
         inline void set_size(counter_type c)
         {
+            array_->preserve(addr_);
             counter_ptr c_ptr = reinterpret_cast<counter_ptr>(addr_ + array_->page_size() - sizeof(counter_type));
             *c_ptr = c;
+            array_->mark_dirty(addr_);
         }
 
         //@{
@@ -224,9 +350,11 @@ public:
                 return false;
             }
 
+            array_->preserve(addr_);
             value_type *ptr = reinterpret_cast<pointer>(addr_) + size();
             memcpy(ptr, &v, sizeof(value_type));
             *c_ptr = (*c_ptr) + 1;
+            array_->mark_dirty(addr_);
 
             return true;
         }
@@ -244,6 +372,20 @@ public:
                 printf("Bad advice ...\n");
             }
         }
+
+        /**
+         *  @brief Prefetch the bucket in the CPU caches.
+         *
+         *  Issues a software prefetch for every cache line of the bucket's page.
+         *  Contrary to prefetch(), this does not involve a system call, but it does not help if the page is not resident.
+         *
+         */
+        inline void prefetch_lines() const
+        {
+            for (size_type offset = 0; offset < array_->page_size(); offset += kCacheLineSize) {
+                __builtin_prefetch(addr_ + offset);
+            }
+        }
     private:
         unsigned char* addr_;
         bucket_array* array_;
@@ -381,14 +523,14 @@ public:
      */
     inline static size_t optimal_bucket_size(const size_t page_size)
     {
-        return (page_size - sizeof(counter_type))/sizeof(value_type);
+        return (page_size - kTrailerSize)/sizeof(value_type);
     }
 
     /**
      *  @brief Constructor
      *
      *  Constructs a new bucket array representation of the memory at address @a ptr.
-     *  The constructor will raise exceptions if the buckets cannot fit in a single page (i.e. if bucket_size*sizeof(value_type)+sizeof(counter_type) >  page_size) or if the counter type is too small to address the bucket (i.e. if bucket_size_ > 2^(8*sizeof(counter_type)).
+     *  The constructor will raise exceptions if the buckets cannot fit in a single page (i.e. if bucket_size*sizeof(value_type)+sizeof(counter_type)+1 >  page_size) or if the counter type is too small to address the bucket (i.e. if bucket_size_ > 2^(8*sizeof(counter_type)).
      *
      *  @param  ptr         The memory address that will be represented as a bucket array.
      *  @param  N           The number of buckets.
@@ -399,15 +541,15 @@ public:
      *  @exception std::runtime_error("Invalid bucket size.") The range of the bucket cannot be addressed with the counter_type.
      */
     inline bucket_array(void* ptr, const size_type N, const_counter_ref bucket_size, const size_t& page_size) :
-     N_(N), mem_(static_cast<unsigned char*>(ptr)), bucket_size_(bucket_size), page_size_(page_size)
+     N_(N), mem_(static_cast<unsigned char*>(ptr)), geometry_(page_size, bucket_size), tracker_(NULL), snapshot_(NULL)
     {
-        // check that the page can contain bucket_size_ elements plus a counter
-        if(bucket_size_*sizeof(value_type)+sizeof(counter_type) >  page_size_)
+        // check that the page can contain bucket_size elements plus a counter
+        if(bucket_size*sizeof(value_type)+kTrailerSize >  page_size)
         {
             throw std::runtime_error("Invalid page size.");
         }
         
-        if(bucket_size_ > (1ULL<<(8*sizeof(counter_type))))
+        if(bucket_size > (1ULL<<(8*sizeof(counter_type))))
         {
             throw std::runtime_error("Invalid bucket size.");
         }
@@ -426,20 +568,35 @@ public:
      *  @exception std::runtime_error("Invalid bucket size.") The range of the bucket cannot be addressed with the counter_type.
      */
     inline bucket_array(void* ptr, const size_type N, const size_t& page_size) :
-    N_(N), mem_(static_cast<unsigned char*>(ptr)), bucket_size_((page_size - sizeof(counter_type))/sizeof(value_type)), page_size_(page_size)
+    N_(N), mem_(static_cast<unsigned char*>(ptr)), geometry_(page_size, optimal_bucket_size(page_size)), tracker_(NULL), snapshot_(NULL)
     {
         
-        // check that the page can contain bucket_size_ elements plus a counter
-        if(bucket_size_*sizeof(value_type)+sizeof(counter_type) >  page_size_)
+        // check that the page can contain bucket_size elements plus a counter
+        if(bucket_size()*sizeof(value_type)+kTrailerSize >  page_size)
         {
             throw std::runtime_error("Invalid page size.");
         }
-        if(bucket_size_ > (1ULL<<(8*sizeof(counter_type))))
+        if(optimal_bucket_size(page_size) > (1ULL<<(8*sizeof(counter_type))))
         {
             throw std::runtime_error("Invalid bucket size.");
         }
     };
     
+    /**
+     *  @brief Constructor
+     *
+     *  Constructs a new bucket array representation of the memory at address @a ptr, with the page size of the static layout.
+     *  Only available with static_layout.
+     *
+     *  @param  ptr         The memory address that will be represented as a bucket array.
+     *  @param  N           The number of buckets.
+     */
+    inline bucket_array(void* ptr, const size_type N) :
+    N_(N), mem_(static_cast<unsigned char*>(ptr)), geometry_(geometry_type::page_size(), geometry_type::bucket_size()), tracker_(NULL), snapshot_(NULL)
+    {
+        static_assert(geometry_type::kStatic, "The page size must be given to the constructor of a bucket_array with a runtime layout");
+    };
+    
     /**
      *  @brief Return the bucket size.
      *
@@ -449,7 +606,7 @@ public:
      */
     inline counter_type bucket_size() const
     {
-        return bucket_size_;
+        return geometry_.bucket_size();
     }
     
     /**
@@ -461,7 +618,7 @@ public:
      */
     inline size_type page_size() const
     {
-        return page_size_;
+        return geometry_.page_size();
     }
 
     /**
@@ -476,6 +633,64 @@ public:
         return N_;
     }
     
+    /**
+     *  @brief Set the dirty page tracker.
+     *
+     *  Once set, every modification of a bucket (through bucket::append(), bucket::set_size() or bucket::set_hint()) marks the modified page in @a t.
+     *  The tracker is not owned by the bucket array.
+     *
+     *  @param  t   The tracker of the memory range of the array, or NULL to disable tracking.
+     */
+    inline void set_dirty_tracker(dirty_tracker* t)
+    {
+        tracker_ = t;
+    }
+    
+    /**
+     *  @brief Mark the page containing an address as modified.
+     *
+     *  Does nothing if no dirty page tracker is set, or if @a ptr is not in the array.
+     *
+     *  @param  ptr An address in the array.
+     */
+    inline void mark_dirty(const void* ptr)
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(ptr);
+        
+        if (tracker_ != NULL && p >= mem_ && p < mem_ + N_*page_size()) {
+            tracker_->mark_dirty(p - mem_);
+        }
+    }
+    
+    /**
+     *  @brief Set the snapshot of the array.
+     *
+     *  Once set, every modification of a bucket (through bucket::append(), bucket::set_size() or bucket::set_hint()) first preserves the modified page in @a s (see page_snapshot::preserve()).
+     *  The snapshot is not owned by the bucket array.
+     *
+     *  @param  s   The snapshot of the memory range of the array, or NULL when no snapshot is being taken.
+     */
+    inline void set_snapshot(page_snapshot* s)
+    {
+        snapshot_ = s;
+    }
+    
+    /**
+     *  @brief Preserve the page containing an address before it is modified.
+     *
+     *  Does nothing if no snapshot is set, or if @a ptr is not in the array.
+     *
+     *  @param  ptr An address in the array.
+     */
+    inline void preserve(const void* ptr)
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(ptr);
+        
+        if (snapshot_ != NULL && p >= mem_ && p < mem_ + N_*page_size()) {
+            snapshot_->preserve(p - mem_);
+        }
+    }
+    
     //@{
     /**
      *  @brief Get the memory address of a bucket.
@@ -556,6 +771,27 @@ public:
     }
     //@}
     
+    //@{
+    /**
+     *  @brief Access a bucket without range check.
+     *
+     *  Returns the @a n -th bucket. Contrary to bucket(), @a n is only checked by an assertion: this is meant for callers computing in-range indices by construction.
+     *
+     *  @return A bucket instance representing the @a n -th bucket.
+     */
+    inline bucket_type bucket_unchecked(size_type n)
+    {
+        assert(n < N_);
+        return bucket_type(mem_ + (n*page_size()), this);
+    }
+    
+    inline const bucket_type bucket_unchecked(size_type n) const
+    {
+        assert(n < N_);
+        return bucket_type(mem_ + (n*page_size()), const_cast<bucket_array*>(this));
+    }
+    //@}
+    
     /**
      *  @brief Prefetch a bucket in memory.
      *
@@ -569,7 +805,7 @@ public:
             throw std::out_of_range("bucket_array::prefetch_bucket");
         }
         void* ptr = mem_ + (n*page_size());
-        if(madvise(ptr, page_size_, MADV_WILLNEED) == -1)
+        if(madvise(ptr, page_size(), MADV_WILLNEED) == -1)
         {
             printf("Bad advice ...\n");
         }
@@ -603,8 +839,9 @@ public:
 private:
     const size_type N_;
     unsigned char* mem_;
-    const counter_type bucket_size_;
-    const size_type page_size_;
+    const geometry_type geometry_;
+    dirty_tracker* tracker_;
+    page_snapshot* snapshot_;
 };
 
 } // namespace ssdmap
\ No newline at end of file
@@ -30,21 +30,39 @@
 #pragma once
 
 #include "bucket_array.hpp"
+#include "overflow_table.hpp"
+#include "dirty_tracker.hpp"
+#include "slot_traits.hpp"
+#include "key_traits.hpp"
 #include "mmap_util.h"
+#include "checksum.h"
+#include "mutation_log.hpp"
 
 #include <utility>
-#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <algorithm>
 #include <map>
 #include <vector>
 #include <list>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <sstream>
 #include <random>
+#include <stdexcept>
+#include <atomic>
 
 #include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <cassert>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace ssdmap {
     
@@ -53,10 +71,215 @@ constexpr float kBucketMapResizeThresholdLoad = 0.95; /**< @brief Maximum load o
 constexpr size_t kBucketMapResizeMaxOverflowSize = 5e5; /**< @brief Maximum size of the overflow bucket. */
 constexpr float kBucketMapResizeMaxOverflowRatio = 0.1; /**< @brief Maximum value of the ratio between the size of the overflow bucket and the size of the map. */
 constexpr size_t kBucketMapResizeStepIterations = 4; /**< @brief Number of buckets rebuilt at every insertion during the rebuild phase.  */
+constexpr float kBucketMapTargetLoad = 0.90; /**< @brief Load of a newly created (or reserved) map. */
 
 constexpr size_t kPageSize = 512; /**< @brief Size (in bytes) of a bucket. */
+constexpr size_t kOSPageSize = 4096; /**< @brief Size (in bytes) of the pages of the page cache. */
+constexpr size_t kSiblingGroupSize = kOSPageSize/kPageSize; /**< @brief Number of buckets sharing the same OS page. */
 
+static_assert(kSiblingGroupSize <= 8, "The sibling buckets must be addressable by the bits of the hint byte");
+
+constexpr size_t kContiguousReservationSize = 1ULL << 40; /**< @brief Size (in bytes) of the address space reserved for a map using contiguous addressing. */
+
+constexpr size_t kResizeGrowthChunkSize = 1 << 20; /**< @brief Minimum size (in bytes) by which the data file filled by an online resize is extended at once. */
+constexpr size_t kResizeGrowthChunks = 64; /**< @brief Maximum number of extensions of the data file filled by an online resize: larger maps are extended by larger chunks. */
+
+constexpr size_t kScanReadaheadSize = 1 << 20; /**< @brief Size (in bytes) of the window read ahead of a scan. */
+
+constexpr size_t kResizeReadaheadSize = 1 << 20; /**< @brief Size (in bytes) of the windows of buckets read ahead of the splits of a resize. */
+
+constexpr size_t kMaxPendingUpdates = 64; /**< @brief Maximum number of keys returned by the non-const bucket_map::at() whose values wait for the next mutation to be logged. */
+
+constexpr size_t kBatchLookupWindow = 16; /**< @brief Number of keys whose buckets are prefetched together by a batched lookup. */
+
+constexpr size_t kCompactionMemoryBudget = 1 << 28; /**< @brief Default size (in bytes) of the element index built by a compaction pass. */
+
+constexpr size_t kExportChunkSize = 1 << 20; /**< @brief Size (in bytes) of the payload of a chunk of an export file (see bucket_map::export_to()). A multiple of kOSPageSize. */
+constexpr uint64_t kExportMagic = 0x3150584550414d53ULL; /**< @brief First bytes of an export file ("SMAPEXP1"). */
+constexpr uint32_t kExportChunkMagic = 0x4b4e4843; /**< @brief First bytes of a chunk of an export file ("CHNK"). */
+constexpr uint32_t kExportFormatVersion = 1; /**< @brief Version of the format of the export files. */
+
+/**
+ *  @brief Strategies used to choose the bucket of an element.
+ */
+enum placement_strategy : uint8_t {
+    kSingleChoicePlacement = 0, /**< @brief Every key has a single candidate bucket. */
+    kTwoChoicePlacement = 1     /**< @brief Every key has two candidate buckets (computed from independent hash bits), and is inserted in the less loaded one. Lookups have to read both buckets. */
+};
+
+/**
+ *  @brief Strategies used when the bucket of an element is full.
+ */
+enum overflow_strategy : uint8_t {
+    kOverflowMap = 0,   /**< @brief The element is put in the in-memory overflow bucket. */
+    kSiblingSpill = 1   /**< @brief The element is first put in one of the buckets sharing the same OS page (which costs no additional I/O), and only goes to the overflow bucket if they are all full. The bucket's hint byte records which siblings contain its elements. */
+};
+
+/**
+ *  @brief How the buckets are laid out on disk and in memory.
+ */
+enum addressing_mode : uint8_t {
+    kSegmentedAddressing = 0,   /**< @brief Every doubling of the map creates a new data.N file, mapped separately. Finding the file of a bucket costs a count-leading-zeros computation. */
+    kContiguousAddressing = 1   /**< @brief The whole map lives in a single data.0 file, mapped in one large address space reservation (kContiguousReservationSize bytes) and grown in place. A bucket's address is a single shift-and-add. */
+};
+
+/**
+ *  @brief How an existing bucket_map is opened.
+ */
+enum open_mode : uint8_t {
+    kReadWrite = 0, /**< @brief The map can be modified, and is flushed when it is destroyed. */
+    kReadOnly = 1   /**< @brief The files are opened with O_RDONLY and mapped with PROT_READ: they are never modified, and several processes can read the same map through the same page cache, while a single writer process modifies it. See bucket_map::refresh(). */
+};
+
+/**
+ *  @brief How the pages of a new data file are faulted in.
+ */
+enum zero_fill_mode : uint8_t {
+    kNoZeroFill = 0,            /**< @brief The pages are faulted in by the insertions and the resize steps that first write to them. */
+    kSynchronousZeroFill = 1,   /**< @brief All the pages are faulted in when the file is created, before the map is used (or before the resize is started). */
+    kBackgroundZeroFill = 2     /**< @brief The pages are faulted in by a background thread, in chunks of kZeroFillChunkSize bytes, while the map is used. */
+};
+
+constexpr size_t kZeroFillChunkSize = 1 << 20; /**< @brief Number of bytes faulted in at once by the background zero-fill thread. */
+
+constexpr uint32_t kBucketMapFormatVersion = 2; /**< @brief Version of the format of the metadata file of a bucket_map (the maps created before it was stored have version 0, version 2 stores the bucket size). */
+
+constexpr size_t kReadOnlyLoadAttempts = 16; /**< @brief Number of times a read-only map tries to load a consistent version of files that a writer keeps replacing. */
+
+/**
+ *  @brief When and how a bucket_map resizes itself.
+ *
+ *  The policy is stored with the map, and can be changed at any time with bucket_map::set_resize_policy().
+ */
+struct resize_policy
+{
+    float threshold_load;       /**< @brief Load above which the overflow bucket size is checked. Defaults to kBucketMapResizeThresholdLoad. */
+    size_t max_overflow_size;   /**< @brief Maximum size of the overflow bucket (a resize is always started at 10 times this value). Defaults to kBucketMapResizeMaxOverflowSize. */
+    float max_overflow_ratio;   /**< @brief Maximum ratio between the size of the overflow bucket and the size of the map. Defaults to kBucketMapResizeMaxOverflowRatio. */
+    size_t step_iterations;     /**< @brief Number of buckets split at every insertion during an online resize. Defaults to kBucketMapResizeStepIterations. */
+    float target_load;          /**< @brief Load used to size a new map, and by bucket_map::reserve(). Defaults to kBucketMapTargetLoad. */
+    bool automatic;             /**< @brief If false, insertions never start nor advance a resize: it is up to the user to call bucket_map::advance_resize() or bucket_map::reserve(). Defaults to true. */
+    
+    resize_policy()
+    : threshold_load(kBucketMapResizeThresholdLoad), max_overflow_size(kBucketMapResizeMaxOverflowSize), max_overflow_ratio(kBucketMapResizeMaxOverflowRatio), step_iterations(kBucketMapResizeStepIterations), target_load(kBucketMapTargetLoad), automatic(true)
+    {}
+};
+
+/**
+ *  @brief How the disk space and the pages of new data files are prepared.
+ *
+ *  The data files are created sparse: without preallocation, the first write to every page allocates its disk blocks in a page fault, on the insertion path.
+ *  The policy is not stored with the map: it applies to the files created after it is set (see bucket_map::set_preallocation_policy()).
+ */
+struct preallocation_policy
+{
+    bool allocate;              /**< @brief If true, the disk blocks of the new files are allocated with fallocate(2) when they are created. Defaults to true. */
+    zero_fill_mode zero_fill;   /**< @brief How the pages of the new files are faulted in. The content of the pages is never modified: they are write faulted in place, so that a background zero-fill can run concurrently with the insertions. Defaults to kNoZeroFill. */
+    bool count_faults;          /**< @brief If true, the page faults taken by the insertions are counted (see bucket_map::get_fault_stats()). This costs two getrusage(2) calls per insertion. Defaults to false. */
+    
+    preallocation_policy()
+    : allocate(true), zero_fill(kNoZeroFill), count_faults(false)
+    {}
+};
+
+/**
+ *  @brief Layout options of a bucket_map.
+ *
+ *  These options are chosen when the map is created, and are stored with the map: when an existing map is opened, the options given to the constructor are ignored.
+ */
+struct bucket_map_options
+{
+    placement_strategy placement; /**< @brief How the elements are placed in the buckets. Defaults to kSingleChoicePlacement. */
+    overflow_strategy overflow; /**< @brief What to do with the elements of full buckets. Defaults to kOverflowMap. */
+    addressing_mode addressing; /**< @brief How the buckets are stored. Defaults to kSegmentedAddressing. */
+    resize_policy resize; /**< @brief The initial resize policy. */
+    size_t insert_buffer_size; /**< @brief Maximum number of elements held in the in-memory insert buffer, or 0 for no buffer. Buffered elements are found by the lookups, and are written to their buckets, in bucket order, when the buffer is full, before a resize, and by bucket_map::flush(). Defaults to 0. */
+    bool multi_value; /**< @brief If true, the map is used as a multimap: with kTwoChoicePlacement, an element is put in the candidate bucket already holding its key (if any), so that bucket_map::get_all() finds all the values of a key in as few pages as possible. Defaults to false. */
+    preallocation_policy preallocation; /**< @brief The initial preallocation policy. Unlike the other options, it is not stored with the map. */
+    
+    bucket_map_options()
+    : placement(kSingleChoicePlacement), overflow(kOverflowMap), addressing(kSegmentedAddressing), resize(), insert_buffer_size(0), multi_value(false), preallocation()
+    {}
+};
+
+/**
+ *  @brief Parameters of the background checkpointer of a bucket_map.
+ */
+struct checkpoint_options
+{
+    std::chrono::milliseconds interval; /**< @brief Time between the end of a checkpoint and the start of the next one. Defaults to 5 seconds. */
+    size_t max_bytes_per_second;        /**< @brief Maximum write rate of a checkpoint, or 0 for no limit. Defaults to 0. */
+    
+    checkpoint_options()
+    : interval(5000), max_bytes_per_second(0)
+    {}
+};
+
+/**
+ *  @brief Statistics about the checkpoints of a bucket_map.
+ */
+struct checkpoint_stats
+{
+    size_t checkpoints;                         /**< @brief Number of checkpoints. */
+    size_t bytes_written;                       /**< @brief Total number of bytes written back by the checkpoints. */
+    size_t last_bytes_written;                  /**< @brief Number of bytes written back by the last checkpoint. */
+    std::chrono::microseconds last_duration;    /**< @brief Duration of the last checkpoint. */
+    std::chrono::microseconds max_duration;     /**< @brief Duration of the longest checkpoint. */
+    
+    checkpoint_stats()
+    : checkpoints(0), bytes_written(0), last_bytes_written(0), last_duration(0), max_duration(0)
+    {}
+};
+
+/**
+ *  @brief Statistics about the page faults taken by the insertions of a bucket_map.
+ *
+ *  Only collected when preallocation_policy::count_faults is set.
+ */
+struct fault_stats
+{
+    size_t insertions;      /**< @brief Number of counted calls to bucket_map::insert() and bucket_map::insert_batch(). */
+    size_t minor_faults;    /**< @brief Number of page faults served without I/O (including the allocation of a page of a sparse file). */
+    size_t major_faults;    /**< @brief Number of page faults that required I/O. */
+    size_t max_faults;      /**< @brief Largest number of faults taken by a single call. */
+    
+    fault_stats()
+    : insertions(0), minor_faults(0), major_faults(0), max_faults(0)
+    {}
+};
+
+/**
+ *  @brief Parameters of bucket_map::compact().
+ */
+struct compaction_options
+{
+    bool drop_duplicates;   /**< @brief If true, only the last value of every key is kept (see bucket_map::compact()). Only supported by the maps with kSingleChoicePlacement and kOverflowMap. Defaults to false. */
+    float target_load;      /**< @brief Load of the compacted map. Defaults to kBucketMapTargetLoad. */
+    unsigned int threads;   /**< @brief Number of threads scanning the source map. Defaults to the number of hardware threads. */
+    size_t memory_budget;   /**< @brief Maximum size (in bytes) of the element index built by a pass. Larger maps are compacted in several passes, each of them writing a range of the buckets of the new map. Defaults to kCompactionMemoryBudget. */
     
+    compaction_options()
+    : drop_duplicates(false), target_load(kBucketMapTargetLoad), threads(std::max(1u, std::thread::hardware_concurrency())), memory_budget(kCompactionMemoryBudget)
+    {}
+};
+
+/**
+ *  @brief A range of buckets.
+ *
+ *  The buckets are identified by their linear index: the index they would have if all the data files were concatenated. A range also covers the elements of the overflow bucket attached to its buckets.
+ */
+struct bucket_range
+{
+    size_t begin;   /**< @brief Linear index of the first bucket of the range. */
+    size_t end;     /**< @brief Linear index following the last bucket of the range. */
+};
+    
+// the coroutine lookup engine (see coroutine_lookup.hpp, C++20 only)
+template <class Map> class interleaved_lookup;
+
+// the direct I/O lookup engine (see direct_reader.hpp)
+template <class Map> class direct_reader;
+
 /** @class bucket_map
  *  @brief An on-disk associative map implementation allowing for fast retrieval
  and efficient updates.
@@ -66,6 +289,7 @@ constexpr size_t kPageSize = 512; /**< @brief Size (in bytes) of a bucket. */
  *  Inside each bucket, the elements are organized as an unordered list. 
  *  When a bucket is full, any additionally inserted element is put in an overflow bucket.
  *  Deletion are not supported.
+ *  A key can be inserted several times: at() and get() return one of its values, and get_all(), for_each_value() and count() see all of them (see bucket_map_options::multi_value).
  *
  *  bucket_map are stored on disk, in a directory specified in the constructor.
  *  The organisation of the directory is as follows: a metadata.bin files contains all the necessary metadata needed by the data structure, such as the overflow bucket size, the number of inserted elements, the mask size, or a flag signaling if the structure is resizing; an overflow.bin file encodes the overflow bucket (if non empty), and data.* files encode the data structure itself.
@@ -77,24 +301,28 @@ constexpr size_t kPageSize = 512; /**< @brief Size (in bytes) of a bucket. */
  *  @tparam T       Type of the mapped value. Each element in an bucket_map is used to store some data as its mapped value.
  Aliased as member type bucket_map::mapped_type. Note that this is not the same as bucket_map::value_type (see below).
  *
- *  @tparam Hash    A unary function object type that takes an object of type key type as argument and returns a unique value of type size_t based on it. This can either be a class implementing a function call operator or a pointer to a function (see constructor for an example). This defaults to hash<Key>, which returns a hash value with a probability of collision approaching 1.0/std::numeric_limits<size_t>::max().
+ *  @tparam Hash    A unary function object type that takes an object of type key type as argument and returns a unique value of type size_t based on it. This can either be a class implementing a function call operator or a pointer to a function (see constructor for an example). This defaults to key_hash<Key>, which is hash<Key> (returning a hash value with a probability of collision approaching 1.0/std::numeric_limits<size_t>::max()), except for std::array<uint8_t,N> keys, whose first 8 bytes are used as the hash value.
  The unordered_map object uses the hash values returned by this function to organize its elements internally, speeding up the process of locating individual elements.
  Aliased as member type bucket_map::hasher.
  *
- *  @tparam Pred    A binary predicate that takes two arguments of the key type and returns a bool. The expression pred(a,b), where pred is an object of this type and a and b are key values, shall return true if a is to be considered equivalent to b. This can either be a class implementing a function call operator or a pointer to a function (see constructor for an example). This defaults to equal_to<Key>, which returns the same as applying the equal-to operator (a==b).
+ *  @tparam Pred    A binary predicate that takes two arguments of the key type and returns a bool. The expression pred(a,b), where pred is an object of this type and a and b are key values, shall return true if a is to be considered equivalent to b. This can either be a class implementing a function call operator or a pointer to a function (see constructor for an example). This defaults to key_equal_to<Key>, which returns the same as applying the equal-to operator (a==b), and compares std::array<uint8_t,N> keys with vector instructions.
  The unordered_map object uses this expression to determine whether two element keys are equivalent. No two elements in an unordered_map container can have keys that yield true using this predicate.
  Aliased as member type unordered_map::key_equal.
+ *
+ *  @tparam Traits  The slot traits, describing what is stored in the buckets. This defaults to map_slot_traits<Key,T>, storing pair<const Key,T>. bucket_set uses set_slot_traits<Key> to store the keys only (the methods using the mapped values are then unavailable).
 
  */
+
     
-template <class Key, class T, class Hash = std::hash<Key>, class Pred = std::equal_to<Key>>
+template <class Key, class T, class Hash = key_hash<Key>, class Pred = key_equal_to<Key>, class Traits = map_slot_traits<Key, T>>
 class bucket_map {
 public:
     typedef Key                                                        key_type;        /**< @brief The first template parameter (Key)	*/
     typedef T                                                          mapped_type;     /**< @brief The second template parameter (T)	*/
     typedef Hash                                                       hasher;          /**< @brief The third template parameter (Hash)	*/
     typedef Pred                                                       key_equal;       /**< @brief The fourth template parameter (Pred)*/
-    typedef std::pair<const key_type, mapped_type>                     value_type;      /**< @brief pair<const key_type,mapped_type>	*/
+    typedef Traits                                                     slot_traits;     /**< @brief The fifth template parameter (Traits)*/
+    typedef typename slot_traits::value_type                           value_type;      /**< @brief pair<const key_type,mapped_type> with the default traits	*/
     typedef value_type&                                                reference;       /**< @brief value_type&	*/
     typedef const value_type&                                          const_reference; /**< @brief const value_type&	*/
 
@@ -102,16 +330,18 @@ public:
     typedef ptrdiff_t       difference_type;
     
     
-    typedef std::pair<const key_type, mapped_type>                        bucket_value_type;
-    typedef bucket_array<bucket_value_type>                         bucket_array_type;
+    typedef value_type                                              bucket_value_type;
+    typedef bucket_array<bucket_value_type, uint16_t, static_layout<kPageSize>> bucket_array_type;
     typedef typename bucket_array_type::bucket_type                 bucket_type;
     
-    typedef std::unordered_map<size_t, value_type>                  overflow_submap_type;
-    typedef std::unordered_map<size_t, overflow_submap_type>           overflow_map_type;
+    typedef overflow_table<value_type, key_type, key_equal, slot_traits> overflow_map_type;
     
 private:
     overflow_map_type overflow_map_;
     
+    // elements not written to their buckets yet, attached to their bucket index
+    overflow_map_type insert_buffer_;
+    
     std::vector<std::pair<bucket_array_type, mmap_st> > bucket_arrays_;
     
     
@@ -134,6 +364,15 @@ private:
     hasher hf_;
     key_equal eql_;
     
+    // layout options
+    bucket_map_options options_;
+    
+    // read-only maps never modify the files
+    bool read_only_;
+    
+    // number of flushes of the map: a read-only map reloads the files when it changes
+    uint64_t generation_;
+    
     typedef struct
     {
         uint8_t original_mask_size;
@@ -142,7 +381,151 @@ private:
         size_t resize_counter;
         size_t e_count;
         size_t overflow_count;
+        uint8_t placement;
+        uint8_t overflow;
+        uint8_t addressing;
+        float resize_threshold_load;
+        size_t resize_max_overflow_size;
+        float resize_max_overflow_ratio;
+        size_t resize_step_iterations;
+        float resize_target_load;
+        bool resize_automatic;
+        uint32_t slot_size;
+        bool multi_value;
+        size_t insert_buffer_size;
+        uint64_t generation;
+        uint32_t format_version;
+        uint8_t size_width; // bits of the counters and bucket indices (the width of size_t)
+        uint8_t mask_size;
+        uint32_t bucket_size; // number of elements of a bucket
     } metadata_type;
+    
+    // header of an export file (see export_to()), followed by the chunks
+    typedef struct
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t slot_size;
+        uint32_t page_size;
+        uint8_t placement;
+        uint8_t overflow;
+        uint8_t multi_value;
+        uint8_t is_resizing;
+        uint8_t original_mask_size;
+        uint8_t mask_size;
+        uint8_t reserved[6];
+        uint64_t resize_counter;
+        uint64_t bucket_count;
+        uint64_t chunk_buckets;     // number of buckets of a page chunk
+        uint64_t overflow_records;  // number of elements of the overflow bucket
+        uint64_t buffered_records;  // number of elements of the insert buffer
+        uint64_t stored_count;      // number of elements in the buckets and in the overflow bucket
+        uint32_t crc;               // of the preceding fields
+    } export_header;
+    
+    // the chunks carry, in that order: the pages of ranges of buckets, and the records
+    // (bucket index, hash value, element) of the overflow bucket and of the insert buffer
+    enum export_chunk_type : uint32_t
+    {
+        kPageChunk = 0,
+        kOverflowChunk = 1,
+        kBufferChunk = 2
+    };
+    
+    // prefix of a chunk
+    typedef struct
+    {
+        uint32_t magic;
+        uint32_t type;
+        uint64_t begin;         // first bucket, or first record of its kind
+        uint64_t count;         // number of buckets or records
+        uint64_t length;        // length (in bytes) of the payload
+        uint32_t payload_crc;
+        uint32_t header_crc;    // of the preceding fields
+    } export_chunk_header;
+    
+    // position of a chunk in an export file
+    struct export_chunk
+    {
+        export_chunk_type type;
+        size_t begin;
+        size_t count;
+        size_t length;
+        size_t offset;
+    };
+    
+    static constexpr size_t kExportRecordSize = 2*sizeof(uint64_t) + sizeof(value_type);
+    static constexpr size_t kExportPayloadOffset = 64; // the payloads are read at an aligned address
+    
+    // state of the split of one bucket
+    struct split_context
+    {
+        size_t index; // index of the bucket being split
+        size_t mask; // 1 << mask_size_
+        std::vector<std::pair<size_t, value_type>> buffer; // elements moved out of the bucket
+        std::mutex *overflow_mutex; // not NULL if several buckets are split concurrently
+    };
+    
+    // scratch space for the online resize
+    split_context split_context_;
+    
+    // dirty pages of every bucket array
+    std::vector<std::unique_ptr<dirty_tracker>> dirty_trackers_;
+    
+    // held while the bucket arrays are added or remapped, and while they are synced by a checkpoint
+    mutable std::mutex mapping_mutex_;
+    
+    // background checkpointer
+    std::thread checkpointer_;
+    std::mutex checkpointer_mutex_;
+    std::condition_variable checkpointer_cv_;
+    bool stop_checkpointer_;
+    
+    mutable std::mutex stats_mutex_;
+    checkpoint_stats checkpoint_stats_;
+    
+    // stream of the mutations, and keys returned by at() whose values are logged at the next mutation
+    typedef mutation_log<value_type> mutation_log_type;
+    std::unique_ptr<mutation_log_type> log_;
+    std::vector<key_type> pending_updates_;
+    
+    // snapshot being written by a background thread (see snapshot()):
+    // everything it needs is captured when it is taken, it never reads the map
+    typedef std::pair<size_t, std::pair<size_t,value_type>> overflow_record;
+    
+    struct snapshot_job
+    {
+        std::string path;
+        std::vector<int> fds; // data files, created by the snapshot thread
+        std::vector<size_t> lengths; // of the data files
+        std::vector<std::unique_ptr<page_snapshot>> pages; // one per bucket array
+        std::unique_ptr<typename overflow_map_type::frozen_image> overflow;
+        std::unique_ptr<typename overflow_map_type::frozen_image> buffer;
+        std::vector<mmap_st> retired_mappings; // moved by extend_bucket_array(), still read by the pages
+        metadata_type meta;
+        std::string error;
+        
+        ~snapshot_job()
+        {
+            for (int fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            for (auto &mmap : retired_mappings) {
+                close_mmap(mmap);
+            }
+        }
+    };
+    std::unique_ptr<snapshot_job> snapshot_;
+    std::thread snapshot_thread_;
+    std::string snapshot_error_;
+    
+    // background zero-fill of the last created data file (see preallocation_policy)
+    std::thread zero_fill_thread_;
+    std::atomic<bool> stop_zero_fill_;
+    
+    fault_stats fault_stats_; // protected by stats_mutex_
 
 public:
     
@@ -157,26 +540,26 @@ public:
         typedef     std::forward_iterator_tag   iterator_category;
         
         bool is_iterating_overflow_map_;
+        bool is_iterating_buffer_; // the insert buffer is iterated after the overflow map
         typename overflow_map_type::const_iterator      om_it_;
-        typename overflow_submap_type::const_iterator   sub_om_it_;
+        
+        // move to the insert buffer if the end of the overflow map is reached
+        void reach_buffer()
+        {
+            if (!is_iterating_buffer_ && om_it_ == map_->overflow_map_.end()) {
+                is_iterating_buffer_ = true;
+                om_it_ = map_->insert_buffer_.begin();
+            }
+        }
         
         void increment()
         {
             if (is_iterating_overflow_map_) {
                 
-                if(sub_om_it_ != om_it_->second.end()){
-                    sub_om_it_++;
-                }else{
-                    return;
-                }
-                
-                if(sub_om_it_ == om_it_->second.end())
-                {
+                if(om_it_ != (is_iterating_buffer_ ? map_->insert_buffer_.end() : map_->overflow_map_.end())){
                     om_it_++;
-                    if (om_it_ != map_->overflow_map_.end()) {
-                        sub_om_it_ = om_it_->second.begin();
-                    }
                 }
+                reach_buffer();
             }else{
                 ba_it_++;
                 
@@ -186,7 +569,7 @@ public:
         
     public:
         const_iterator(const bucket_map* m, size_t ai)
-        : map_(m), array_index_(ai), is_iterating_overflow_map_(false)
+        : map_(m), array_index_(ai), is_iterating_overflow_map_(false), is_iterating_buffer_(false)
         {
             if(ai < map_->arrays_count())
             {
@@ -195,12 +578,13 @@ public:
         }
 
         const_iterator(const bucket_map* m, size_t ai, bool point_end)
-        : map_(m), array_index_(ai), is_iterating_overflow_map_(false)
+        : map_(m), array_index_(ai), is_iterating_overflow_map_(false), is_iterating_buffer_(false)
         {
             if(point_end)
             {
                 is_iterating_overflow_map_ = true;
-                om_it_ = map_->overflow_map_.end();
+                is_iterating_buffer_ = true;
+                om_it_ = map_->insert_buffer_.end();
             }else{
                 if(ai < map_->arrays_count())
                 {
@@ -228,7 +612,7 @@ public:
         const_reference operator*() const
         {
             if(is_iterating_overflow_map_)
-                return sub_om_it_->second;
+                return *om_it_;
             
             return ba_it_.operator*();
         }
@@ -236,7 +620,7 @@ public:
         const value_type* operator->() const
         {
             if(is_iterating_overflow_map_)
-                return &(sub_om_it_->second);
+                return om_it_.operator->();
             
             return ba_it_.operator->();
         }
@@ -266,9 +650,7 @@ public:
                 {
                     is_iterating_overflow_map_ = true;
                     om_it_ = map_->overflow_map_.begin();
-                    if (om_it_ != map_->overflow_map_.end()) {
-                        sub_om_it_ = om_it_->second.begin();
-                    }
+                    reach_buffer();
                 }
 
             }
@@ -284,18 +666,13 @@ public:
                 return false;
             }
             
+            if (a.is_iterating_buffer_ != b.is_iterating_buffer_) {
+                return false;
+            }
+            
             if (a.is_iterating_overflow_map_ == true)
             {
-                if (a.om_it_ != b.om_it_)
-                {
-                    return false;
-                }
-                if (a.om_it_ == a.map_->get_overflow_map().end()) {
-                    return true;
-                }
-                    
-                    
-                return (a.sub_om_it_ == b.sub_om_it_);
+                return (a.om_it_ == b.om_it_);
             }
             
             if (a.array_index_ != b.array_index_) {
@@ -315,6 +692,9 @@ public:
     };
     
     friend const_iterator;
+    friend class interleaved_lookup<bucket_map>;
+    friend class direct_reader<bucket_map>;
+    friend class log_follower<bucket_map>;
     
     /** 
      *  @brief Constructor
@@ -333,7 +713,29 @@ public:
      */
     bucket_map(const std::string &path, const size_type setup_size, const hasher& hf = hasher(),
                const key_equal& eql = key_equal())
-    : overflow_map_(), bucket_arrays_(), base_filename_(path), e_count_(0), overflow_count_(0),  is_resizing_(false), hf_(hf), eql_(eql)
+    : bucket_map(path, setup_size, bucket_map_options(), hf, eql)
+    {
+    }
+
+    /**
+     *  @brief Constructor
+     *
+     *  @param path         The path to the directory where the map will be stored.
+     *  @param setup_size   The initial size of the map.
+     *  @param options      The layout options of the map. They are only used if a new map is created.
+     *  @param hf           Hasher function object. A hasher is a function that returns an integral value based on the container object key passed to it as argument.
+     Member type hasher is defined in bucket_map as an alias of its third template parameter (Hash).
+     *  @param eql          Comparison function object, that returns true if the two container object keys passed as arguments are to be considered equal.
+     Member type key_equal is defined in bucket_map as an alias of its fourth template parameter (Pred).
+     *
+     *  If a valid input directory is given by the constructor, the data structure will be initialized from its content, and @a options is ignored.
+     *  Otherwise, a new structure will be initialized, such that it is able to contain @a setup_size elements, and will be stored at @a path.
+     *
+     *  @exception std::runtime_error The input path is invalid.
+     */
+    bucket_map(const std::string &path, const size_type setup_size, const bucket_map_options& options, const hasher& hf = hasher(),
+               const key_equal& eql = key_equal())
+    : overflow_map_(eql), insert_buffer_(eql), bucket_arrays_(), base_filename_(path), e_count_(0), overflow_count_(0),  is_resizing_(false), resize_counter_(0), hf_(hf), eql_(eql), options_(options), read_only_(false), generation_(0), stop_checkpointer_(false), stop_zero_fill_(false)
     {
 
         // check is there already is a directory at path
@@ -353,7 +755,7 @@ public:
             
             
             size_t b_size = bucket_array_type::optimal_bucket_size(kPageSize);
-            float target_load = 0.90;
+            float target_load = options_.resize.target_load;
             size_t N;
             
             if(target_load*b_size >= setup_size)
@@ -365,16 +767,23 @@ public:
             }
             
             mask_size_ = original_mask_size_;
-            N = 1 << mask_size_;
+            N = static_cast<size_t>(1) << mask_size_;
 
             size_t length = N  * kPageSize;
             
             std::ostringstream string_stream;
             string_stream << base_filename_ << "/data." << std::dec << 0;
             
-            mmap_st mmap = create_mmap(string_stream.str().data(),length);
+            mmap_st mmap;
+            
+            if (options_.addressing == kContiguousAddressing) {
+                mmap = create_reserved_mmap(string_stream.str().data(), length, kContiguousReservationSize);
+            }else{
+                mmap = create_mmap(string_stream.str().data(),length);
+            }
             
-            bucket_arrays_.push_back(std::make_pair(bucket_array_type(mmap.mmap_addr, N, kPageSize), mmap));
+            push_bucket_array(mmap, N);
+            prepare_data_range(mmap, 0, length);
             bucket_space_ = bucket_arrays_[0].first.bucket_size() * bucket_arrays_[0].first.bucket_count();
         }
     }
@@ -395,7 +804,28 @@ public:
      */
     bucket_map(const std::string &path, const hasher& hf = hasher(),
                const key_equal& eql = key_equal())
-    : overflow_map_(), bucket_arrays_(), base_filename_(path), e_count_(0), overflow_count_(0),  is_resizing_(false), hf_(hf), eql_(eql)
+    : bucket_map(path, kReadWrite, hf, eql)
+    {
+    }
+    
+    /**
+     *  @brief Constructor
+     *
+     *  @param path         The path to the directory where the map is stored.
+     *  @param mode         Whether the map is opened for reading and writing, or for reading only.
+     *  @param hf           Hasher function object. A hasher is a function that returns an integral value based on the container object key passed to it as argument.
+     Member type hasher is defined in bucket_map as an alias of its third template parameter (Hash).
+     *  @param eql          Comparison function object, that returns true if the two container object keys passed as arguments are to be considered equal.
+     Member type key_equal is defined in bucket_map as an alias of its fourth template parameter (Pred).
+     *
+     *  This constructor initializes the container from the data stored at @a path. If no valid directory is found, an exception is raised.
+     *  With kReadOnly, the files are not modified, neither by this constructor nor by the destructor, and all the functions modifying the map throw std::runtime_error.
+     *
+     *  @exception std::runtime_error The input path is invalid.
+     */
+    bucket_map(const std::string &path, open_mode mode, const hasher& hf = hasher(),
+               const key_equal& eql = key_equal())
+    : overflow_map_(eql), insert_buffer_(eql), bucket_arrays_(), base_filename_(path), e_count_(0), overflow_count_(0),  is_resizing_(false), resize_counter_(0), hf_(hf), eql_(eql), options_(), read_only_(mode == kReadOnly), generation_(0), stop_checkpointer_(false), stop_zero_fill_(false)
     {
         
         // check is there already is a directory at path
@@ -406,7 +836,11 @@ public:
                 throw std::runtime_error("bucket_map constructor: Invalid path. " + path + " is not a directory");
             }
             
-            init_from_file();
+            if (read_only_) {
+                load_read_only();
+            }else{
+                init_from_file();
+            }
         }else{
             // throw an error, we were suppose to find a path
             throw std::runtime_error("bucket_map constructor: " + path + ": no such file or directory");
@@ -417,12 +851,19 @@ public:
     /**
      *  @brief Destructor
      *
-     *  The destructor also flushes the data structure to the disk,and this may take some time.
+     *  The destructor stops the background checkpointer, and flushes the data structure to the disk,and this may take some time.
+     *  A read-only map is not flushed.
      */
     
     ~bucket_map()
     {
-        flush();
+        stop_checkpointer();
+        
+        if (!read_only_) {
+            flush();
+        }
+        
+        unmap_bucket_arrays();
     }
     
     /**
@@ -472,8 +913,8 @@ public:
     const_reference random_element() const
     {
         std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dis(0, (int)((1<<mask_size_) + resize_counter_-1));
+        std::mt19937_64 gen(rd());
+        std::uniform_int_distribution<size_t> dis(0, bucket_count()-1);
         size_t rnd;
         
         while(true)
@@ -484,7 +925,7 @@ public:
             size_t s = b.size();
             if(s > 0)
             {
-                std::uniform_int_distribution<> loc_dis(0, (int)(s-1));
+                std::uniform_int_distribution<size_t> loc_dis(0, s-1);
                 size_t c = loc_dis(gen);
                 return *(b.begin()+c);
             }
@@ -558,78 +999,42 @@ public:
      *              If the map object is const-qualified, the function returns a reference to const mapped_type. Otherwise, it returns a reference to mapped_type.
      *              Member type mapped_type is the type to the mapped values in the container, i.e. an alias of its second template parameter (T).
      *
+     *  The non-const version assumes that the value will be modified: with a mutation log, the value is logged again.
+     *  Reads should go through the const version or get().
+     *
      *  @exception std::out_of_range @a key is not the key of an element in the map.
+     *  @exception std::runtime_error The non-const version is called on a read-only map.
      */
 
     mapped_type& at(key_type key)
     {
-        size_t h = hf_(key);
-        
-        // first, look if it is not in the overflow map
-        
-        try {
-            return at_overflow_bucket(h);
-        } catch (std::out_of_range &e) {
-            
+        check_writable("at");
         
+        value_type* elt = find_element(key, hf_(key));
         
+        if (elt == NULL) {
+            throw std::out_of_range("Key not found");
+        }
         
-        // otherwise, get the bucket index
-        
-        // get the appropriate coordinates
-        std::pair<uint8_t, size_t> coords = bucket_coordinates(h);
-        
-        // get the bucket and prefetch it
-        auto bucket = get_bucket(coords);
-        //        bucket.prefetch();
+        // the element will be modified after we return
+        preserve_element(elt);
+        mark_deferred(elt);
         
-        // scan throught the bucket to find the element
-        for (auto it = bucket.begin(); it != bucket.end(); ++it) {
-            if(eql_(it->first, key))
-            {
-                return it->second;
-            }
+        if (log_) {
+            add_pending_update(key);
         }
         
-        throw std::out_of_range("Key not found");
-
-        }
-
+        return elt->second;
     }
 
     const mapped_type& at(key_type key) const
     {
-        size_t h = hf_(key);
+        const value_type* elt = find_element(key, hf_(key));
         
-        // first, look if it is not in the overflow map
-        
-        try {
-            return at_overflow_bucket(h);
-        } catch (std::out_of_range &e) {
-            
-            
-            
-            
-            // otherwise, get the bucket index
-            
-            // get the appropriate coordinates
-            std::pair<uint8_t, size_t> coords = bucket_coordinates(h);
-            
-            // get the bucket and prefetch it
-            auto bucket = get_bucket(coords);
-            //        bucket.prefetch();
-            
-            // scan throught the bucket to find the element
-            for (auto it = bucket.begin(); it != bucket.end(); ++it) {
-                if(eql_(it->first, key))
-                {
-                    return it->second;
-                }
-            }
-            
+        if (elt == NULL) {
             throw std::out_of_range("Key not found");
-            
         }
+        return elt->second;
     }
     //@}
 
@@ -649,74 +1054,367 @@ public:
      */
     bool get(key_type key, mapped_type& v) const
     {
-        try {
-            v = at(key);
-            return true;
-        } catch (std::out_of_range &e) {
+        const value_type* elt = find_element(key, hf_(key));
+        
+        if (elt == NULL) {
             return false;
         }
+        v = elt->second;
+        return true;
     }
     
     /**
-     *  @brief Insert element
+     *  @brief Check if an element is in the container
      *
-     *  Add the element with key @a key and value @a v in the data structure.
+     *  @param[in]  key     Key to be searched for.
      *
-     *  @param[in]  key     Key of the element to be inserted.
-     Member type key_type is the type of the keys for the elements in the container, defined in bucket_map as an alias of its first template parameter (Key).
-     *  @param[in] v        Value of the element to be inserted. A mapped_type object, defined in bucket_map as an alias of its second template parameter (Value).
+     *  @retval true    if @a key was found
+     *  @retval false   if @a key was not found
      */
-    void add(key_type key, const mapped_type& v)
+    bool contains(const key_type& key) const
     {
-        value_type value(key,v);
-        
-        // get the bucket index
-        size_t h = hf_(key);
-        
-        // get the appropriate coordinates
-        std::pair<uint8_t, size_t> coords = bucket_coordinates(h);
-        
-        // try to append the value to the bucket
-        auto bucket = get_bucket(coords);
-        
-        bool success = bucket.append(value);
+        return find_element(key, hf_(key)) != NULL;
+    }
+    
+    /**
+     *  @brief Look up several keys at once
+     *
+     *  Calls @a fn(key, elt) on every key of the range [@a first, @a last), in order, where @a elt is a pointer to the element with that key, or NULL if there is none.
+     *  The buckets of kBatchLookupWindow consecutive keys are prefetched before any of them is searched, so that their memory accesses overlap instead of being serialized.
+     *
+     *  @param[in]  first   Forward iterator to the first key.
+     *  @param[in]  last    Forward iterator following the last key.
+     *  @param[in]  fn      A function object taking a key and a const value_type*.
+     */
+    template <class ForwardIt, class F>
+    void find_batch(ForwardIt first, ForwardIt last, F fn) const
+    {
+        size_t hashes[kBatchLookupWindow];
         
-        if (!success) {
-            // add to the overflow bucket
-            append_overflow_bucket(h, value);
+        while (first != last) {
+            size_t n = 0;
             
+            // compute the hashes and prefetch the buckets of the window
+            for (ForwardIt it = first; it != last && n < kBatchLookupWindow; ++it, ++n) {
+                hashes[n] = hf_(*it);
+                prefetch_candidates(hashes[n]);
+            }
             
-            //            std::cout << "Full bucket. " << size() << " elements (load factor " << load() << ")\n size of overflow bucket: " << overflow_size() << ", overflow proportion: " << overflow_ratio() << "\n" << std::endl;
-        }
-        
-        e_count_++;
-        
-        if (is_resizing_) {
-            online_resize();
-        }else{
-            if (should_resize()) {
-                start_resize();
+            for (size_t i = 0; i < n; ++i, ++first) {
+                fn(*first, find_element(*first, hashes[i]));
             }
         }
-        
     }
 
     /**
-     *  @brief Flush the container to disk.
+     *  @brief Visit all the values of a key
      *
-     *  Writes the content of the container, with its metadata to disk, in the directory specified by the constructor.
+     *  Calls @a fn(v) on the mapped value of every element with key @a key, in no particular order.
+     *  The candidate buckets of @a key, the siblings they spilled into, and the overflow bucket are all searched in a single pass.
+     *
+     *  @param[in]  key     Key to be searched for.
+     *  @param[in]  fn      A function object taking a const mapped_type&.
      *
+     *  @return The number of values of @a key.
      */
+    template <class F>
+    size_t for_each_value(const key_type& key, F fn) const
+    {
+        return for_each_element(key, hf_(key), [&](const value_type& elt)
+        {
+            fn(static_cast<const mapped_type&>(elt.second));
+        });
+    }
 
-    void flush() const
+    /**
+     *  @brief Access all the values of a key
+     *
+     *  Writes the mapped value of every element with key @a key to @a out, in no particular order.
+     *
+     *  @param[in]  key     Key to be searched for.
+     *  @param[out] out     Output iterator to which the values are written (e.g. a std::back_insert_iterator).
+     *
+     *  @return The number of values of @a key.
+     */
+    template <class OutputIt>
+    size_t get_all(const key_type& key, OutputIt out) const
     {
-        // flush the data to the disk
-        
-        // start by syncing the bucket arrays
-        // do it asynchronously for now
-        for (auto it = bucket_arrays_.rbegin(); it != bucket_arrays_.rend(); ++it) {
-            flush_mmap(it->second,ASYNC_FLAG);
-        }
+        return for_each_value(key, [&](const mapped_type& v)
+        {
+            *out = v;
+            ++out;
+        });
+    }
+
+    /**
+     *  @brief Count the elements with a key
+     *
+     *  @param[in]  key     Key to be searched for.
+     *
+     *  @return The number of elements with key @a key.
+     */
+    size_t count(const key_type& key) const
+    {
+        return for_each_element(key, hf_(key), [](const value_type&) {});
+    }
+
+    /**
+     *  @brief Insert element
+     *
+     *  Add the element with key @a key and value @a v in the data structure.
+     *
+     *  @param[in]  key     Key of the element to be inserted.
+     Member type key_type is the type of the keys for the elements in the container, defined in bucket_map as an alias of its first template parameter (Key).
+     *  @param[in] v        Value of the element to be inserted. A mapped_type object, defined in bucket_map as an alias of its second template parameter (Value).
+     */
+    void add(key_type key, const mapped_type& v)
+    {
+        insert(value_type(key,v));
+    }
+    
+    /**
+     *  @brief Insert element
+     *
+     *  Add the element @a value in the data structure.
+     *
+     *  @param[in] value    The element to be inserted.
+     */
+    void insert(const value_type& value)
+    {
+        check_writable("insert");
+        fault_counter faults(*this);
+        
+        if (log_) {
+            log_pending_updates();
+            log_->append(kAddMutation, value);
+        }
+        
+        // get the bucket index
+        size_t h = hf_(slot_traits::key(value));
+        
+        if (options_.insert_buffer_size > 0) {
+            insert_buffer_.insert(linear_bucket_index(h), h, value);
+            e_count_++;
+            
+            if (insert_buffer_.size() >= options_.insert_buffer_size) {
+                drain_insert_buffer();
+            }
+            return;
+        }
+        
+        insert_element(h, value);
+        
+        e_count_++;
+        
+        if (!options_.resize.automatic) {
+            return;
+        }
+        
+        if (is_resizing_) {
+            online_resize();
+        }else{
+            if (should_resize()) {
+                start_resize();
+            }
+        }
+        
+    }
+
+    /**
+     *  @brief Insert several elements
+     *
+     *  Adds the elements of the range [@a first, @a last) in the data structure.
+     *  The elements are hashed first, sorted by bucket, and then inserted in bucket order, so that every page is modified by a single run of insertions.
+     *  The resize work the elements would have triggered one by one is done once, before the insertions, and the need for a new resize is only checked after the whole batch is inserted.
+     *  A batch much larger than the map therefore ends up in the overflow bucket: call reserve() first.
+     *
+     *  @param[in] first    Forward iterator to the first element.
+     *  @param[in] last     Forward iterator following the last element.
+     */
+    template <class ForwardIt>
+    void insert_batch(ForwardIt first, ForwardIt last)
+    {
+        size_t n = std::distance(first, last);
+
+        if (n == 0) {
+            return;
+        }
+
+        check_writable("insert_batch");
+        fault_counter faults(*this);
+        
+        if (log_) {
+            log_pending_updates();
+            
+            for (ForwardIt it = first; it != last; ++it) {
+                log_->append(kAddMutation, *it);
+            }
+        }
+        
+        drain_insert_buffer();
+
+        if (options_.resize.automatic && is_resizing_) {
+            // the coordinates of the buckets must not change during the insertions
+            for (size_t i = 0; i < n*options_.resize.step_iterations && is_resizing_; i++) {
+                resize_step();
+            }
+        }
+
+        std::vector<batch_entry<ForwardIt>> batch;
+        batch.reserve(n);
+
+        for (ForwardIt it = first; it != last; ++it) {
+            size_t h = hf_(slot_traits::key(*it));
+            batch.push_back(batch_entry<ForwardIt>{linear_bucket_index(h), h, it});
+        }
+
+        sort_by_bucket(batch, mask_size_ + (is_resizing_ ? 1 : 0));
+
+        for (auto &e : batch) {
+            insert_element(e.hash, *e.it);
+        }
+        e_count_ += n;
+
+        if (options_.resize.automatic && !is_resizing_ && should_resize()) {
+            start_resize();
+        }
+    }
+
+    /**
+     *  @brief Insert several elements
+     *
+     *  Adds the elements with keys [@a first_key, @a last_key) and the values starting at @a first_value, as insert_batch() does.
+     *
+     *  @param[in] first_key    Forward iterator to the first key.
+     *  @param[in] last_key     Forward iterator following the last key.
+     *  @param[in] first_value  Input iterator to the value of the first key.
+     */
+    template <class KeyIt, class ValueIt>
+    void add_batch(KeyIt first_key, KeyIt last_key, ValueIt first_value)
+    {
+        std::vector<value_type> elements;
+        elements.reserve(std::distance(first_key, last_key));
+
+        for (; first_key != last_key; ++first_key, ++first_value) {
+            elements.push_back(value_type(*first_key, *first_value));
+        }
+        insert_batch(elements.begin(), elements.end());
+    }
+
+    /**
+     *  @brief Insert several elements
+     *
+     *  Adds the elements (@a keys[i], @a values[i]), as insert_batch() does.
+     *
+     *  @param[in] keys     The keys of the elements.
+     *  @param[in] values   The values of the elements. Must have the same size as @a keys.
+     *
+     *  @exception std::invalid_argument @a keys and @a values do not have the same size.
+     */
+    void add_batch(const std::vector<key_type>& keys, const std::vector<mapped_type>& values)
+    {
+        if (keys.size() != values.size()) {
+            throw std::invalid_argument("bucket_map::add_batch: keys and values do not have the same size");
+        }
+        add_batch(keys.begin(), keys.end(), values.begin());
+    }
+    
+    /**
+     *  @brief Write the insert buffer to the buckets
+     *
+     *  Inserts the buffered elements in their buckets, in bucket order, and then does the resize work their insertions would have triggered.
+     *  This is done automatically when the buffer is full, before a resize, and by flush().
+     */
+    void drain_insert_buffer()
+    {
+        size_t n = insert_buffer_.size();
+        
+        if (n == 0) {
+            return;
+        }
+        
+        // no resize happened since the elements were buffered: their bucket indices are still valid
+        std::vector<batch_entry<typename overflow_map_type::const_iterator>> batch;
+        batch.reserve(n);
+        
+        for (auto it = insert_buffer_.begin(); it != insert_buffer_.end(); ++it) {
+            batch.push_back(batch_entry<typename overflow_map_type::const_iterator>{it.bucket(), it.hash(), it});
+        }
+        
+        sort_by_bucket(batch, mask_size_ + (is_resizing_ ? 1 : 0));
+        
+        for (auto &e : batch) {
+            insert_element(e.hash, *e.it);
+        }
+        batch.clear();
+        insert_buffer_.clear();
+        
+        if (!options_.resize.automatic) {
+            return;
+        }
+        
+        if (is_resizing_) {
+            for (size_t i = 0; i < n*options_.resize.step_iterations && is_resizing_; i++) {
+                resize_step();
+            }
+        }else if (should_resize()) {
+            start_resize();
+        }
+    }
+    
+    /**
+     *  @brief Return the number of elements in the insert buffer.
+     */
+    inline size_t buffered_size() const
+    {
+        return insert_buffer_.size();
+    }
+    
+    /**
+     *  @brief Change the capacity of the insert buffer.
+     *
+     *  The new capacity is stored with the map at the next flush. If the buffer holds at least @a n elements, it is drained.
+     *
+     *  @param n    The maximum number of buffered elements, or 0 to disable the buffer.
+     */
+    void set_insert_buffer_size(size_t n)
+    {
+        options_.insert_buffer_size = n;
+        
+        if (insert_buffer_.size() >= n) {
+            drain_insert_buffer();
+        }
+    }
+
+    /**
+     *  @brief Flush the container to disk.
+     *
+     *  Writes the content of the container, with its metadata to disk, in the directory specified by the constructor.
+     *  The insert buffer is drained first. The overflow bucket and the metadata are written to temporary files, renamed when complete, so that read-only maps opened by other processes never see a partial write.
+     *
+     *  @exception std::runtime_error The map is opened read-only.
+     *
+     */
+
+    void flush()
+    {
+        check_writable("flush");
+        drain_insert_buffer();
+        
+        if (log_) {
+            log_pending_updates();
+            log_->sync(true);
+        }
+        
+        generation_++;
+        
+        // flush the data to the disk
+        
+        // start by syncing the bucket arrays
+        // do it asynchronously for now
+        for (auto it = bucket_arrays_.rbegin(); it != bucket_arrays_.rend(); ++it) {
+            flush_mmap(it->second,ASYNC_FLAG);
+        }
         
         // create a new memory map for the overflow bucket
         typedef std::pair<size_t, std::pair<size_t,value_type>> pair_type;
@@ -724,60 +1422,104 @@ public:
         std::string overflow_temp_path = base_filename_ + "/overflow.tmp";
         
         if(overflow_count_ > 0){
-            mmap_st over_mmap = create_mmap(overflow_temp_path.data(), overflow_count_*sizeof(pair_type));
+            // the elements are followed by the generation of the flush,
+            // so that a reader can check that the file matches the metadata
+            remove(overflow_temp_path.data());
+            mmap_st over_mmap = create_mmap(overflow_temp_path.data(), overflow_count_*sizeof(pair_type) + sizeof(uint64_t));
             
             
             pair_type* elt_ptr = (pair_type*) over_mmap.mmap_addr;
             size_t i = 0;
             
-            for (auto &sub_map : overflow_map_) {
-                // submap is a map
-                
-                for (auto &x : sub_map.second) {
-                    pair_type tmp = std::make_pair(sub_map.first, x);
-                    memcpy(elt_ptr+i, &tmp, sizeof(pair_type));
-                    i++;
-                }
-            }
+            // chain by chain, so that the elements of a bucket are reloaded in insertion order
+            overflow_map_.for_each_chained([&](size_t bucket, size_t hash, const value_type& v)
+            {
+                pair_type tmp(bucket, std::pair<size_t,value_type>(hash, v));
+                memcpy(elt_ptr+i, &tmp, sizeof(pair_type));
+                i++;
+            });
+            memcpy(reinterpret_cast<unsigned char*>(elt_ptr + i), &generation_, sizeof(uint64_t));
             
             // flush it to the disk
             close_mmap(over_mmap);
         }
-        // erase the old overflow file and replace it by the temp file
+        // replace the old overflow file by the temp file
         std::string overflow_path = base_filename_ + "/overflow.bin";
-        remove(overflow_path.data());
         
         if(overflow_count_ > 0){
             if (rename(overflow_temp_path.data(), overflow_path.data()) != 0) {
                 throw std::runtime_error("Unable to rename overflow.tmp to overflow.bin");
             }
+        }else{
+            remove(overflow_path.data());
         }
         
+        // the metadata are also written to a temp file, and renamed:
+        // readers always see a complete version
+        std::string meta_temp_path = base_filename_ + "/meta.tmp";
         std::string meta_path = base_filename_ + "/meta.bin";
-        mmap_st meta_mmap = create_mmap(meta_path.data(), sizeof(metadata_type));
+        
+        remove(meta_temp_path.data());
+        mmap_st meta_mmap = create_mmap(meta_temp_path.data(), sizeof(metadata_type));
         metadata_type *meta_ptr = (metadata_type *)meta_mmap.mmap_addr;
         
-        meta_ptr->original_mask_size = original_mask_size_;
-        meta_ptr->is_resizing = is_resizing_;
-        meta_ptr->resize_counter = resize_counter_;
-        meta_ptr->overflow_count = overflow_count_;
-        meta_ptr->e_count = e_count_;
-        meta_ptr->bucket_arrays_count = bucket_arrays_.size();
+        fill_metadata(*meta_ptr);
         
         close_mmap(meta_mmap);
         
-        for (auto it = bucket_arrays_.rbegin(); it != bucket_arrays_.rend(); ++it) {
-            close_mmap(it->second);
+        if (rename(meta_temp_path.data(), meta_path.data()) != 0) {
+            throw std::runtime_error("Unable to rename meta.tmp to meta.bin");
+        }
+    }
+    
+    /**
+     *  @brief Load the last version flushed by the writer.
+     *
+     *  Only for read-only maps. If the writer process flushed the map since it was opened or last refreshed, the metadata and the overflow bucket are reloaded, and the data files are mapped again.
+     *  The buckets themselves are shared with the writer through the page cache: between two refreshes, the elements it appends are visible as soon as they are written, but the elements that went to the overflow bucket or were moved by a resize are only found after the next refresh.
+     *  The references and iterators obtained before the refresh are invalidated.
+     *
+     *  @return True if a newer version was loaded, false if the map did not change.
+     *
+     *  @exception std::runtime_error The map is not read-only, or the writer replaced the files kReadOnlyLoadAttempts times while they were loaded.
+     */
+    bool refresh()
+    {
+        if (!read_only_) {
+            throw std::runtime_error("bucket_map::refresh: the map is not opened read-only");
         }
+        
+        metadata_type meta;
+        read_metadata(meta);
+        
+        if (meta.generation == generation_) {
+            return false;
+        }
+        
+        load_read_only();
+        return true;
+    }
+    
+    /**
+     *  @brief Check if the map was opened read-only.
+     */
+    inline bool is_read_only() const
+    {
+        return read_only_;
     }
     
     /**
      *  @brief Start the online resizing process.
      *
-     *  Initiates the online resizing by doubling the number of buckets, and setting the necessary flags so that, at every insertion of a new element, kBucketMapResizeStepIterations buckets are splitted in two according to the hashed key value of the contained elements.
+     *  Initiates the online resizing by doubling the number of buckets, and setting the necessary flags so that, at every insertion of a new element, resize_policy::step_iterations buckets are splitted in two according to the hashed key value of the contained elements.
      */
     void start_resize()
     {
+        check_writable("start_resize");
+        
+        // the buffered elements are attached to the current bucket indices
+        drain_insert_buffer();
+        
         if (is_resizing_) {
             // Useless call
             return;
@@ -785,19 +1527,41 @@ public:
         
         //        std::cout << "Start resizing!" << std::endl;
         
-        // create a new bucket_array of double the size of the previous one
+        size_t N = static_cast<size_t>(1) << (mask_size_);
         
-        size_t ba_count = bucket_arrays_.size();
+        size_t length = N  * kPageSize;
         
-        size_t N = 1 << (mask_size_);
+        std::lock_guard<std::mutex> lock(mapping_mutex_);
         
-        size_t length = N  * kPageSize;
+        // the buckets of the new half are backed by the file as the split progresses (see grow_resizing_array())
+        size_t count = resize_backing_count(0, N);
+        
+        if (options_.addressing == kContiguousAddressing) {
+            // double the size of the single bucket array
+            dirty_trackers_.back()->resize(2*length);
+            
+            if (2*length > bucket_arrays_.back().second.reserved_length) {
+                // the mapping has to move: move it once, to its final size
+                count = N;
+            }
+            extend_bucket_array(N + count);
+            
+            resize_counter_ = 0;
+            is_resizing_ = true;
+            return;
+        }
+        
+        // create a new bucket_array of double the size of the previous one
+        
+        size_t ba_count = bucket_arrays_.size();
         
         std::ostringstream string_stream;
         string_stream << base_filename_ << "/data." << std::dec << ba_count;
         
-        mmap_st mmap = create_mmap(string_stream.str().data(),length);
-        bucket_arrays_.push_back(std::make_pair(bucket_array_type(mmap.mmap_addr, N, kPageSize), mmap));
+        mmap_st mmap = create_reserved_mmap(string_stream.str().data(), count*kPageSize, length);
+        push_bucket_array(mmap, count);
+        dirty_trackers_.back()->resize(length);
+        prepare_data_range(mmap, 0, count*kPageSize);
         
         resize_counter_ = 0;
         is_resizing_ = true;
@@ -811,6 +1575,9 @@ public:
      */
     void full_resize()
     {
+        check_writable("full_resize");
+        drain_insert_buffer();
+        
         if(!is_resizing_)
         {
             start_resize();
@@ -822,280 +1589,2297 @@ public:
     }
 
     /**
-     *  @brief   Return the overflow map.
+     *  @brief   Write back the modified buckets.
      *
-     *  Getter of the overflow map.
+     *  Synchronously writes back the OS pages of the buckets modified since the last checkpoint, and only them.
+     *  Contrary to flush(), neither the overflow bucket nor the metadata are written: a checkpoint bounds the amount of data flush() will have to write, and the amount of data lost if the process crashes.
+     *  This function can be called from another thread than the one modifying the map, which is what the background checkpointer does.
      *
-     *  @return A const reference to the overflow map.
+     *  @param max_bytes_per_second The maximum write rate, or 0 for no limit.
+     *
+     *  @return The number of bytes written back.
      */
-    const overflow_map_type& get_overflow_map() const
-    {
-        return overflow_map_;
-    }
-    
-    size_t arrays_count() const
-    {
-        return bucket_arrays_.size();
-    }
-
-private:
-    inline std::pair<uint8_t, size_t> bucket_coordinates(size_t h) const
+    size_t checkpoint(size_t max_bytes_per_second = 0)
     {
-        if (is_resizing_) {
-            // we must be careful here
-            // the coordinates depend on the value of resize_counter_
-            // if h & (1 << mask_size_)-1 is less than resize_counter_, it means that the
-            // bucket, before rebuild, was splitted
-            // otherwise, do as before
-            size_t masked_h = (h & ((1 << mask_size_)-1));
-            if (masked_h < resize_counter_) {
-                // if the mask_size_-th bit is 0, do as before,
-                // otherwise, we know that the bucket is in the last array
-                
-                if ((h & ((1 << mask_size_))) != 0) {
-                    return std::make_pair(mask_size_- original_mask_size_+1, masked_h);
-                }
+        auto begin = std::chrono::steady_clock::now();
+        
+        // (array, (offset, length)) of the dirty ranges
+        std::vector<std::pair<size_t, std::pair<size_t, size_t>>> runs;
+        {
+            std::lock_guard<std::mutex> lock(mapping_mutex_);
+            
+            for (size_t i = 0; i < dirty_trackers_.size(); i++) {
+                dirty_trackers_[i]->extract_runs([&](size_t offset, size_t length)
+                {
+                    runs.push_back(std::make_pair(i, std::make_pair(offset, length)));
+                });
             }
         }
-        h &= (1 << mask_size_)-1;
-
-        uint8_t c = mask_size_-1;
-        size_t mask = (1 << c);
         
-        for (; c >= original_mask_size_; c--, mask >>= 1) { // mask = 2^c
-            if ((mask & h) != 0) {
-                return std::make_pair(c - original_mask_size_+1, h ^ mask);
+        size_t bytes = 0;
+        
+        for (auto &r : runs) {
+            {
+                // the mapping can move between two runs
+                std::lock_guard<std::mutex> lock(mapping_mutex_);
+                flush_mmap_range(bucket_arrays_[r.first].second, r.second.first, r.second.second, SYNC_FLAG);
+            }
+            bytes += r.second.second;
+            
+            if (max_bytes_per_second > 0) {
+                std::this_thread::sleep_until(begin + std::chrono::microseconds(static_cast<uint64_t>(1e6*bytes/max_bytes_per_second)));
             }
         }
         
-        return std::make_pair(0, h);
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+        
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        checkpoint_stats_.checkpoints++;
+        checkpoint_stats_.bytes_written += bytes;
+        checkpoint_stats_.last_bytes_written = bytes;
+        checkpoint_stats_.last_duration = duration;
+        checkpoint_stats_.max_duration = std::max(checkpoint_stats_.max_duration, duration);
+        
+        return bytes;
     }
     
-    inline size_t get_overflow_bucket_index(size_t h) const
+    /**
+     *  @brief   Start the background checkpointer.
+     *
+     *  Starts a thread calling checkpoint() periodically, until stop_checkpointer() is called or the map is destroyed.
+     *  If the checkpointer was already running, it is restarted with the new options.
+     *
+     *  @param options  The interval and the write rate of the checkpoints.
+     */
+    void start_checkpointer(const checkpoint_options& options = checkpoint_options())
     {
-        size_t index = (h&((1 << mask_size_)-1));
+        check_writable("start_checkpointer");
+        stop_checkpointer();
         
-        if (is_resizing_) {
-            // we must be careful here
-            // the coordinates depend on the value of resize_counter_
-            // if index is less than resize_counter_, it means that the
-            // bucket, before rebuild, was splitted
-            // otherwise, do as before
-            if (index < resize_counter_) {
-                // if the mask_size_-th bit is 0, do as before,
-                // otherwise, recompute the index accordingly
-                
-                if ((h & ((1 << mask_size_))) != 0) {
-                    return (h&((1 << (mask_size_+1))-1));
+        stop_checkpointer_ = false;
+        checkpointer_ = std::thread([this, options]()
+        {
+            std::unique_lock<std::mutex> lock(checkpointer_mutex_);
+            
+            while (!checkpointer_cv_.wait_for(lock, options.interval, [this](){ return stop_checkpointer_; })) {
+                lock.unlock();
+                checkpoint(options.max_bytes_per_second);
+                lock.lock();
+            }
+        });
+    }
+    
+    /**
+     *  @brief   Stop the background checkpointer.
+     *
+     *  Waits for the running checkpoint (if any) to finish. Does nothing if the checkpointer is not running.
+     */
+    void stop_checkpointer()
+    {
+        if (!checkpointer_.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(checkpointer_mutex_);
+            stop_checkpointer_ = true;
+        }
+        checkpointer_cv_.notify_all();
+        checkpointer_.join();
+    }
+    
+    /**
+     *  @brief   Return the checkpoint statistics.
+     *
+     *  @return A copy of the statistics of the checkpoints made so far.
+     */
+    checkpoint_stats get_checkpoint_stats() const
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        return checkpoint_stats_;
+    }
+    
+    /**
+     *  @brief   Take a point-in-time snapshot of the map.
+     *
+     *  Writes a copy of the map, as it is when the function is called, to the directory @a path: data files, overflow bucket and metadata, that can be opened as any other map.
+     *  The writers are not paused. The function only copies the metadata, and sets copy-on-write hooks on the bucket arrays, the overflow bucket and the insert buffer, before returning.
+     *  A background thread then creates the files of the snapshot and writes the bucket pages to them, while a modification of a page that was not written yet first copies its old content (in memory, until its file is created).
+     *  The overflow bucket and the insert buffer are copied the same way, by blocks of elements.
+     *  The metadata are written last: the snapshot is complete once wait_snapshot() returns.
+     *  Only one snapshot is taken at a time: a snapshot in progress is completed first.
+     *
+     *  @param path The directory of the snapshot. It must not exist.
+     *
+     *  @exception std::runtime_error The map is opened read-only, the directory exists or cannot be created, or the previous snapshot failed.
+     */
+    void snapshot(const std::string& path)
+    {
+        check_writable("snapshot");
+        wait_snapshot();
+        
+        struct stat buffer;
+        
+        if (stat(path.data(), &buffer) == 0) {
+            throw std::runtime_error("bucket_map::snapshot: " + path + " already exists");
+        }
+        if (mkdir(path.data(), (mode_t)0700) != 0) {
+            throw std::runtime_error("bucket_map::snapshot: unable to create " + path);
+        }
+        
+        std::unique_ptr<snapshot_job> job(new snapshot_job());
+        job->path = path;
+        
+        // copied by the snapshot thread, or by the writers before they modify them
+        job->overflow.reset(new typename overflow_map_type::frozen_image(overflow_map_));
+        job->buffer.reset(new typename overflow_map_type::frozen_image(insert_buffer_));
+        
+        memset(&job->meta, 0, sizeof(metadata_type));
+        fill_metadata(job->meta);
+        job->meta.overflow_count = overflow_count_ + insert_buffer_.size();
+        
+        // the data files have the length of the bucket arrays at the time of the snapshot
+        for (size_t i = 0; i < bucket_arrays_.size(); i++) {
+            const mmap_st& mmap = bucket_arrays_[i].second;
+            
+            job->lengths.push_back(mmap.length);
+            job->pages.push_back(std::unique_ptr<page_snapshot>(new page_snapshot(mmap.mmap_addr, mmap.length, -1, kPageSize)));
+        }
+        
+        for (size_t i = 0; i < job->pages.size(); i++) {
+            bucket_arrays_[i].first.set_snapshot(job->pages[i].get());
+        }
+        overflow_map_.set_frozen_image(job->overflow.get());
+        insert_buffer_.set_frozen_image(job->buffer.get());
+        
+        snapshot_ = std::move(job);
+        snapshot_thread_ = std::thread(write_snapshot, snapshot_.get());
+    }
+    
+    /**
+     *  @brief   Wait for the snapshot in progress.
+     *
+     *  Returns once the snapshot taken by the last call to snapshot() is completely written. Does nothing if there is no snapshot in progress.
+     *
+     *  @exception std::runtime_error The snapshot could not be written.
+     */
+    void wait_snapshot()
+    {
+        finish_snapshot();
+        
+        if (!snapshot_error_.empty()) {
+            std::string error;
+            error.swap(snapshot_error_);
+            throw std::runtime_error("bucket_map::snapshot: " + error);
+        }
+    }
+    
+    /**
+     *  @brief   Check if a snapshot is being written.
+     *
+     *  @return True if snapshot() was called, and wait_snapshot() was not called since.
+     */
+    inline bool snapshot_in_progress() const
+    {
+        return snapshot_ != nullptr;
+    }
+    
+    /**
+     *  @brief   Start logging the mutations.
+     *
+     *  From now on, the map appends its mutations to the mutation log stored in @a directory (see mutation_log): the elements added with insert(), add() and the batched versions, and the elements modified through at().
+     *  As at() returns a reference, the new value of an element is only logged at the next insertion, at the next flush(), or by sync_mutation_log().
+     *  A log_follower tailing the log applies the same mutations to another map. The imports (import_from()) and the resizes are not logged.
+     *  A map whose log was started after its creation is replicated by exporting it (export_to()), importing the export in the replica, and following the log from mutation_log_sequence().
+     *  The log is not persisted with the map: it has to be started again when the map is reopened, and its sequence numbers then continue after the last complete record.
+     *
+     *  @param directory    The directory of the segments of the log.
+     *  @param options      The size and the number of the segments.
+     *
+     *  @exception std::runtime_error The map is opened read-only, or the log cannot be opened.
+     */
+    void start_mutation_log(const std::string& directory, const mutation_log_options& options = mutation_log_options())
+    {
+        check_writable("start_mutation_log");
+        stop_mutation_log();
+        
+        log_.reset(new mutation_log_type(directory, options));
+    }
+    
+    /**
+     *  @brief   Stop logging the mutations.
+     *
+     *  The pending records are written to the log. Does nothing if the mutations are not logged.
+     */
+    void stop_mutation_log()
+    {
+        if (!log_) {
+            return;
+        }
+        sync_mutation_log();
+        log_.reset();
+    }
+    
+    /**
+     *  @brief   Make the mutations visible to the followers.
+     *
+     *  Logs the values of the elements modified through at(), and writes the buffered records to the log, without syncing them to the disk (flush() does).
+     */
+    void sync_mutation_log()
+    {
+        if (!log_) {
+            return;
+        }
+        log_pending_updates();
+        log_->sync(false);
+    }
+    
+    /**
+     *  @brief   Return the sequence number of the next logged mutation, or 0 if the mutations are not logged.
+     */
+    uint64_t mutation_log_sequence() const
+    {
+        return log_ ? log_->next_sequence() : 0;
+    }
+    
+    /**
+     *  @brief   Return the number of bytes that the next checkpoint will write back.
+     */
+    size_t dirty_bytes() const
+    {
+        std::lock_guard<std::mutex> lock(mapping_mutex_);
+        size_t c = 0;
+        
+        for (auto &t : dirty_trackers_) {
+            c += t->dirty_count() * t->page_size();
+        }
+        return c;
+    }
+    
+    /**
+     *  @brief   Grow the container so that it can hold @a n elements.
+     *
+     *  Doubles the number of buckets until the load of the map with @a n elements would be below resize_policy::target_load. A resize in progress is finished first.
+     *  Once this returns, inserting up to @a n elements will not trigger a resize because of the load (it still can if the overflow bucket gets too large).
+     *
+     *  @param n        The expected number of elements.
+     *  @param threads  The number of threads splitting the buckets.
+     */
+    void reserve(size_t n, unsigned int threads = 1)
+    {
+        check_writable("reserve");
+        drain_insert_buffer();
+        
+        if (is_resizing_) {
+            full_resize();
+        }
+        
+        while (options_.resize.target_load * bucket_space_ < n) {
+            start_resize();
+            
+            if (threads > 1) {
+                parallel_resize(threads);
+            }else{
+                full_resize();
+            }
+        }
+    }
+    
+    /**
+     *  @brief   Check if the container has to be resized.
+     *
+     *  @return True if a resize is in progress, or if the triggers of the resize policy are reached.
+     */
+    bool needs_resize() const
+    {
+        return is_resizing_ || should_resize();
+    }
+    
+    /**
+     *  @brief   Check if the container is resizing.
+     *
+     *  @return True if a resize is in progress.
+     */
+    bool is_resizing() const
+    {
+        return is_resizing_;
+    }
+    
+    /**
+     *  @brief   Perform some of the resize work.
+     *
+     *  Starts a resize if the triggers of the resize policy are reached, and splits at most @a max_steps buckets.
+     *  This is meant to be called during quiet periods, when resize_policy::automatic is false.
+     *
+     *  @param max_steps    The maximum number of buckets to split.
+     *
+     *  @return The number of buckets that remain to be split.
+     */
+    size_t advance_resize(size_t max_steps)
+    {
+        check_writable("advance_resize");
+        drain_insert_buffer();
+        
+        if (!is_resizing_) {
+            if (!should_resize()) {
+                return 0;
+            }
+            start_resize();
+        }
+        
+        for (size_t i = 0; i < max_steps && is_resizing_; i++) {
+            resize_step();
+        }
+        
+        return is_resizing_ ? ((static_cast<size_t>(1) << mask_size_) - resize_counter_) : 0;
+    }
+    
+    /**
+     *  @brief   Return the resize policy.
+     *
+     *  @return A const reference to the resize policy of the map.
+     */
+    const resize_policy& get_resize_policy() const
+    {
+        return options_.resize;
+    }
+    
+    /**
+     *  @brief   Change the resize policy.
+     *
+     *  The new policy is stored with the map at the next flush.
+     *
+     *  @param policy   The new resize policy.
+     */
+    void set_resize_policy(const resize_policy& policy)
+    {
+        options_.resize = policy;
+    }
+    
+    /**
+     *  @brief   Return the preallocation policy.
+     *
+     *  @return A const reference to the preallocation policy of the map.
+     */
+    const preallocation_policy& get_preallocation_policy() const
+    {
+        return options_.preallocation;
+    }
+    
+    /**
+     *  @brief   Change the preallocation policy.
+     *
+     *  The new policy applies to the data files created by the next resizes. It is not stored with the map.
+     *
+     *  @param policy   The new preallocation policy.
+     */
+    void set_preallocation_policy(const preallocation_policy& policy)
+    {
+        options_.preallocation = policy;
+    }
+    
+    /**
+     *  @brief   Return the page fault statistics of the insertions.
+     *
+     *  The statistics are only collected while preallocation_policy::count_faults is set.
+     *
+     *  @return A copy of the statistics.
+     */
+    fault_stats get_fault_stats() const
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        return fault_stats_;
+    }
+    
+    /**
+     *  @brief   Reset the page fault statistics.
+     */
+    void reset_fault_stats()
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        fault_stats_ = fault_stats();
+    }
+    
+    /**
+     *  @brief   Return the overflow map.
+     *
+     *  Getter of the overflow map.
+     *
+     *  @return A const reference to the overflow map.
+     */
+    const overflow_map_type& get_overflow_map() const
+    {
+        return overflow_map_;
+    }
+    
+    /**
+     *  @brief   Return the layout options.
+     *
+     *  @return A const reference to the layout options of the map.
+     */
+    const bucket_map_options& options() const
+    {
+        return options_;
+    }
+    
+    /**
+     *  @brief   Return the memory used by the overflow map.
+     *
+     *  @return The number of bytes allocated by the overflow map.
+     */
+    size_t overflow_memory_usage() const
+    {
+        return overflow_map_.memory_usage();
+    }
+    
+    size_t arrays_count() const
+    {
+        return bucket_arrays_.size();
+    }
+    
+    /**
+     *  @brief Returns the number of times the map has started doubling its number of buckets.
+     *
+     *  Unlike arrays_count(), this does not depend on the addressing mode.
+     */
+    size_t doublings_count() const
+    {
+        return mask_size_ - original_mask_size_ + (is_resizing_ ? 1 : 0);
+    }
+    
+    /**
+     *  @brief Returns the number of buckets in use.
+     *
+     *  During a resize, this includes the buckets split so far.
+     */
+    size_t bucket_count() const
+    {
+        return (static_cast<size_t>(1) << mask_size_) + (is_resizing_ ? resize_counter_ : 0);
+    }
+    
+    /**
+     *  @brief   Partition the buckets.
+     *
+     *  Splits the buckets in at most @a k disjoint ranges of consecutive buckets, covering all of them.
+     *  The ranges are aligned on the OS pages, so that every page is read by a single range.
+     *
+     *  @param k    The number of partitions.
+     *
+     *  @return The ranges, in increasing order.
+     */
+    std::vector<bucket_range> partitions(size_t k) const
+    {
+        std::vector<bucket_range> ranges;
+        size_t n = bucket_count();
+        
+        if (k == 0) {
+            k = 1;
+        }
+        
+        size_t step = (n + k - 1)/k;
+        step = (step + kSiblingGroupSize - 1) & ~(kSiblingGroupSize-1);
+        
+        for (size_t begin = 0; begin < n; begin += step) {
+            bucket_range r;
+            r.begin = begin;
+            r.end = std::min(n, begin + step);
+            ranges.push_back(r);
+        }
+        return ranges;
+    }
+    
+    /**
+     *  @brief   Apply a function to the elements of a range of buckets.
+     *
+     *  Calls @a fn(element) on every element stored in the buckets of @a range, and on every element of the overflow bucket and of the insert buffer attached to them.
+     *  The buckets are read sequentially, with a readahead window of kScanReadaheadSize bytes.
+     *  The map must not be modified during the scan.
+     *
+     *  @param range    A range of buckets, as returned by partitions().
+     *  @param fn       A function object taking a const_reference.
+     */
+    template <class F>
+    void for_each(const bucket_range& range, F fn) const
+    {
+        const size_t window = kScanReadaheadSize/kPageSize;
+        
+        advise_range(range.begin, range.end, SEQUENTIAL_ADVICE);
+        advise_range(range.begin, std::min(range.end, range.begin + window), WILLNEED_ADVICE);
+        
+        for (size_t w = range.begin; w < range.end; w += window) {
+            size_t w_end = std::min(range.end, w + window);
+            
+            // read the next window in the background while this one is scanned
+            advise_range(w_end, std::min(range.end, w_end + window), WILLNEED_ADVICE);
+            
+            for_each_segment(w, w_end, [&](uint8_t ba_index, size_t b_begin, size_t b_end)
+            {
+                for (size_t i = b_begin; i < b_end; i++) {
+                    const bucket_type b = get_bucket(ba_index, i);
+                    
+                    for (auto it = b.begin(); it != b.end(); ++it) {
+                        fn(static_cast<const_reference>(*it));
+                    }
+                }
+            });
+        }
+        
+        advise_range(range.begin, range.end, RANDOM_ADVICE);
+        
+        if (overflow_count_ > 0) {
+            for (size_t i = range.begin; i < range.end; i++) {
+                overflow_map_.for_each_in_bucket(i, fn);
+            }
+        }
+        
+        if (insert_buffer_.size() > 0) {
+            for (size_t i = range.begin; i < range.end; i++) {
+                insert_buffer_.for_each_in_bucket(i, fn);
+            }
+        }
+    }
+    
+    /**
+     *  @brief   Apply a function to all the elements, using several threads.
+     *
+     *  The buckets are partitioned in @a threads ranges, each of them scanned by its own thread with for_each(const bucket_range&, F).
+     *  @a fn is called concurrently, and must be thread-safe. The map must not be modified during the scan.
+     *
+     *  @param fn       A function object taking a const_reference.
+     *  @param threads  The number of threads.
+     */
+    template <class F>
+    void parallel_for_each(F fn, unsigned int threads) const
+    {
+        std::vector<bucket_range> ranges = partitions(threads);
+        std::vector<std::thread> workers;
+        
+        for (size_t i = 1; i < ranges.size(); i++) {
+            bucket_range r = ranges[i];
+            workers.push_back(std::thread([this, r, &fn]()
+            {
+                for_each(r, fn);
+            }));
+        }
+        
+        // the calling thread takes the first range
+        if (!ranges.empty()) {
+            for_each(ranges[0], fn);
+        }
+        
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+    
+    /**
+     *  @brief   Rewrite a map in a clean state.
+     *
+     *  Reads the map stored at @a source (opened read-only, so it is not modified), and writes its elements to a new map at @a dest.
+     *  The new map is sized for options.target_load, with a fresh number of initial buckets: it lives in a single data file, has no resize in progress, and its overflow bucket only holds the elements that did not fit in their buckets.
+     *  Its layout options and its resize policy are those of the source (except resize_policy::target_load).
+     *
+     *  The source is scanned by options.threads threads, over ranges of buckets. The elements are indexed in memory and sorted by bucket of the new map, so the new buckets are written in order.
+     *  If the index of all the elements exceeds options.memory_budget, the compaction runs in several passes, each of them scanning the whole source and writing a range of the new buckets.
+     *
+     *  With options.drop_duplicates, only one element of every key is kept: the last one in storage order, the elements of the buckets coming in bucket order and then the elements of the overflow bucket.
+     *  As the map appends the elements to their buckets, and only puts them in the overflow bucket once their buckets are full, this is the last value added with add() with kSingleChoicePlacement and kOverflowMap.
+     *  With kTwoChoicePlacement (the values of a key can be in either candidate bucket) or kSiblingSpill (an element can be spilled to any free slot of the sibling buckets), the storage order is not the insertion order, and options.drop_duplicates is rejected.
+     *  When the compaction needs several passes, the new map is sized for all the elements of the source, duplicates included.
+     *
+     *  @param source   The path of the map to compact.
+     *  @param dest     The path of the new map. There must be nothing at this path.
+     *  @param options  The parameters of the compaction.
+     *  @param hf       Hasher function object. It must be the one the source map was built with.
+     *  @param eql      Comparison function object.
+     *
+     *  @return The number of elements of the new map.
+     *
+     *  @exception std::runtime_error   The source map cannot be opened, or there is already something at @a dest.
+     *  @exception std::invalid_argument options.drop_duplicates is set, and the source map does not use kSingleChoicePlacement and kOverflowMap.
+     */
+    static size_t compact(const std::string &source, const std::string &dest, const compaction_options& options = compaction_options(), const hasher& hf = hasher(), const key_equal& eql = key_equal())
+    {
+        struct stat buffer;
+        if (stat(dest.data(), &buffer) == 0) {
+            throw std::runtime_error("bucket_map::compact: " + dest + " already exists");
+        }
+        
+        bucket_map src(source, kReadOnly, hf, eql);
+        
+        if (options.drop_duplicates && (src.options_.placement != kSingleChoicePlacement || src.options_.overflow != kOverflowMap)) {
+            throw std::invalid_argument("bucket_map::compact: the last value of a key is only known with kSingleChoicePlacement and kOverflowMap");
+        }
+        
+        size_t budget = std::max(options.memory_budget, sizeof(compaction_entry));
+        size_t passes = std::max(static_cast<size_t>(1), (src.size()*sizeof(compaction_entry) + budget - 1)/budget);
+        
+        bucket_map_options dest_options = src.options_;
+        dest_options.resize.target_load = options.target_load;
+        dest_options.resize.automatic = false; // the buckets must not move during the compaction
+        dest_options.insert_buffer_size = 0;
+        
+        std::vector<compaction_entry> entries;
+        std::unique_ptr<bucket_map> dst;
+        
+        if (passes == 1) {
+            // index everything, and size the new map for the elements that are kept
+            src.collect_compaction_entries(options.threads, [](size_t){ return true; }, entries);
+            
+            if (options.drop_duplicates) {
+                sort_compaction_entries(entries, ~static_cast<size_t>(0));
+                src.drop_duplicate_entries(entries);
+            }
+            
+            dst.reset(new bucket_map(dest, std::max(entries.size(), static_cast<size_t>(1)), dest_options, hf, eql));
+            dst->write_compaction_entries(entries);
+        }else{
+            dst.reset(new bucket_map(dest, src.size(), dest_options, hf, eql));
+            
+            size_t n = dst->bucket_count();
+            size_t step = (n + passes - 1)/passes;
+            
+            for (size_t begin = 0; begin < n; begin += step) {
+                size_t end = std::min(n, begin + step);
+                const bucket_map* d = dst.get();
+                
+                entries.clear();
+                src.collect_compaction_entries(options.threads, [d, begin, end](size_t h)
+                {
+                    size_t i = d->linear_bucket_index(h);
+                    return i >= begin && i < end;
+                }, entries);
+                
+                if (options.drop_duplicates) {
+                    // every key lives in a single pass
+                    sort_compaction_entries(entries, ~static_cast<size_t>(0));
+                    src.drop_duplicate_entries(entries);
+                }
+                dst->write_compaction_entries(entries);
+            }
+        }
+        
+        resize_policy policy = src.options_.resize;
+        policy.target_load = options.target_load;
+        dst->set_resize_policy(policy);
+        dst->options_.insert_buffer_size = src.options_.insert_buffer_size;
+        
+        dst->flush();
+        
+        return dst->size();
+    }
+    
+    /**
+     *  @brief   Export the map to a file.
+     *
+     *  Writes the content of the map to the single file @a path, as a stream of chunks: a header describing the geometry of the map, followed by chunks carrying the pages of ranges of kExportChunkSize/kPageSize consecutive buckets, and then by chunks carrying the elements of the overflow bucket and of the insert buffer.
+     *  Every chunk is prefixed by its length and a CRC-32C of its content (see checksum.h). As the position of every chunk is known in advance, the chunks are built and written in parallel by @a threads threads, each of them copying its own ranges of buckets.
+     *  The map is not modified (it can be opened read-only), and must not be modified during the export.
+     *
+     *  @param path     The path of the export file. An existing file is replaced.
+     *  @param threads  The number of threads.
+     *
+     *  @return The number of exported elements.
+     *
+     *  @exception std::runtime_error The file cannot be written.
+     */
+    size_t export_to(const std::string& path, unsigned int threads = 1) const
+    {
+        export_header header;
+        memset(&header, 0, sizeof(export_header));
+        
+        header.magic = kExportMagic;
+        header.version = kExportFormatVersion;
+        header.slot_size = sizeof(value_type);
+        header.page_size = kPageSize;
+        header.placement = options_.placement;
+        header.overflow = options_.overflow;
+        header.multi_value = options_.multi_value;
+        header.is_resizing = is_resizing_;
+        header.original_mask_size = original_mask_size_;
+        header.mask_size = mask_size_;
+        header.resize_counter = resize_counter_;
+        header.bucket_count = bucket_count(); // the new buckets past the split ones are empty, and may not be backed by the file
+        header.chunk_buckets = kExportChunkSize/kPageSize;
+        header.overflow_records = overflow_count_;
+        header.buffered_records = insert_buffer_.size();
+        header.stored_count = e_count_ - insert_buffer_.size();
+        header.crc = crc32c(0, &header, offsetof(export_header, crc));
+        
+        // the records are in memory: serialize them first, chain by chain
+        std::vector<unsigned char> records((header.overflow_records + header.buffered_records)*kExportRecordSize);
+        unsigned char* out = records.data();
+        
+        auto serialize = [&out](size_t bucket, size_t hash, const value_type& v)
+        {
+            uint64_t fields[2] = {bucket, hash};
+            memcpy(out, fields, sizeof(fields));
+            memcpy(out + sizeof(fields), &v, sizeof(value_type));
+            out += kExportRecordSize;
+        };
+        overflow_map_.for_each_chained(serialize);
+        insert_buffer_.for_each_chained(serialize);
+        
+        int fd = open(path.data(), O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+        
+        if (fd < 0) {
+            throw std::runtime_error("bucket_map::export_to: unable to create " + path);
+        }
+        
+        size_t chunk_count = export_chunk_count(header);
+        std::atomic<size_t> next(0);
+        std::atomic<int> error(0);
+        
+        if (ftruncate(fd, export_file_size(header)) != 0 || !write_all(fd, &header, sizeof(export_header), 0)) {
+            error = errno;
+        }
+        
+        auto worker = [&]()
+        {
+            std::vector<unsigned char> buffer(sizeof(export_chunk_header) + kExportChunkSize + kExportRecordSize);
+            unsigned char* payload = buffer.data() + sizeof(export_chunk_header);
+            
+            for (size_t i = next++; i < chunk_count && error == 0; i = next++) {
+                export_chunk c = locate_export_chunk(header, i);
+                
+                if (c.type == kPageChunk) {
+                    unsigned char* p = payload;
+                    
+                    advise_range(c.begin, c.begin + c.count, WILLNEED_ADVICE);
+                    for_each_segment(c.begin, c.begin + c.count, [&](uint8_t ba_index, size_t b_begin, size_t b_end)
+                    {
+                        memcpy(p, static_cast<const unsigned char*>(bucket_arrays_[ba_index].second.mmap_addr) + b_begin*kPageSize, (b_end-b_begin)*kPageSize);
+                        p += (b_end-b_begin)*kPageSize;
+                    });
+                }else{
+                    size_t first = c.begin + ((c.type == kBufferChunk) ? header.overflow_records : 0);
+                    memcpy(payload, records.data() + first*kExportRecordSize, c.length);
+                }
+                
+                export_chunk_header* h = reinterpret_cast<export_chunk_header*>(buffer.data());
+                memset(h, 0, sizeof(export_chunk_header));
+                h->magic = kExportChunkMagic;
+                h->type = c.type;
+                h->begin = c.begin;
+                h->count = c.count;
+                h->length = c.length;
+                h->payload_crc = crc32c(0, payload, c.length);
+                h->header_crc = crc32c(0, h, offsetof(export_chunk_header, header_crc));
+                
+                if (!write_all(fd, buffer.data(), sizeof(export_chunk_header) + c.length, c.offset)) {
+                    error = errno;
+                }
+            }
+        };
+        
+        std::vector<std::thread> workers;
+        
+        for (unsigned int t = 1; t < threads && t < chunk_count; t++) {
+            workers.push_back(std::thread(worker));
+        }
+        worker();
+        
+        for (auto &w : workers) {
+            w.join();
+        }
+        
+        if (error == 0 && fdatasync(fd) != 0) {
+            error = errno;
+        }
+        close(fd);
+        
+        if (error != 0) {
+            throw std::runtime_error("bucket_map::export_to: unable to write " + path + ": " + strerror(error));
+        }
+        return e_count_;
+    }
+    
+    /**
+     *  @brief   Import the elements of an export file.
+     *
+     *  Adds the elements of the file written by export_to() at @a path to the map. The chunks are read and checked in parallel by @a threads threads.
+     *
+     *  If the map is empty, and has the placement and overflow strategies of the exported map, it takes the geometry of the exported map (the number of buckets, and the state of its resize): the pages are copied to their buckets without rehashing their elements, and the overflow bucket is rebuilt as it was.
+     *  Otherwise, the map is grown to hold all the elements (see reserve()), and the elements decoded by the threads are inserted with insert_batch().
+     *  In both cases, the elements that were in the insert buffer of the exported map are inserted with insert_batch(). The other options of the map are kept.
+     *
+     *  If a chunk is corrupted, the elements of the previous chunks may already have been added.
+     *
+     *  @param path     The path of the export file.
+     *  @param threads  The number of threads.
+     *
+     *  @return The number of imported elements.
+     *
+     *  @exception std::runtime_error The map is opened read-only, the file cannot be read, it is truncated or corrupted (a checksum does not match), or its elements do not have the size of the elements of the map.
+     */
+    size_t import_from(const std::string& path, unsigned int threads = 1)
+    {
+        check_writable("import_from");
+        
+        // the imported elements are not logged, whatever happens
+        struct log_suspension
+        {
+            std::unique_ptr<mutation_log_type>& log;
+            std::unique_ptr<mutation_log_type> saved;
+            
+            ~log_suspension()
+            {
+                log = std::move(saved);
+            }
+        } suspension{log_, std::move(log_)};
+        
+        int fd = open(path.data(), O_RDONLY);
+        
+        if (fd < 0) {
+            throw std::runtime_error("bucket_map::import_from: unable to open " + path);
+        }
+        
+        export_header header;
+        struct stat buffer;
+        
+        if (!read_all(fd, &header, sizeof(export_header), 0) || header.magic != kExportMagic || header.crc != crc32c(0, &header, offsetof(export_header, crc))) {
+            close(fd);
+            throw std::runtime_error("bucket_map::import_from: " + path + " is not an export file, or its header is corrupted");
+        }
+        if (header.version != kExportFormatVersion || header.slot_size != sizeof(value_type) || header.page_size != kPageSize) {
+            close(fd);
+            throw std::runtime_error("bucket_map::import_from: the exported elements do not have the expected size");
+        }
+        if (fstat(fd, &buffer) != 0 || static_cast<size_t>(buffer.st_size) != export_file_size(header)) {
+            close(fd);
+            throw std::runtime_error("bucket_map::import_from: " + path + " is truncated");
+        }
+        
+        bool direct = (size() == 0 && header.placement == options_.placement && header.overflow == options_.overflow);
+        
+        if (direct) {
+            adopt_export_geometry(header);
+        }else{
+            reserve(size() + header.stored_count + header.buffered_records, threads);
+        }
+        
+        size_t chunk_count = export_chunk_count(header);
+        size_t page_chunks = (header.bucket_count + header.chunk_buckets - 1)/header.chunk_buckets;
+        
+        // the records are applied in order, once all the chunks are read
+        std::vector<std::vector<unsigned char>> records(chunk_count - page_chunks);
+        std::atomic<size_t> next(0);
+        std::atomic<int> error(0);
+        std::mutex insert_mutex;
+        
+        auto worker = [&]()
+        {
+            std::vector<unsigned char> buffer(kExportPayloadOffset + kExportChunkSize + kExportRecordSize);
+            unsigned char* payload = buffer.data() + kExportPayloadOffset;
+            export_chunk_header* h = reinterpret_cast<export_chunk_header*>(payload - sizeof(export_chunk_header));
+            std::vector<value_type> elements;
+            
+            for (size_t i = next++; i < chunk_count && error == 0; i = next++) {
+                export_chunk c = locate_export_chunk(header, i);
+                
+                if (!read_all(fd, h, sizeof(export_chunk_header) + c.length, c.offset)) {
+                    error = (errno != 0) ? errno : EIO;
+                    break;
+                }
+                if (h->magic != kExportChunkMagic || h->header_crc != crc32c(0, h, offsetof(export_chunk_header, header_crc))
+                    || h->type != c.type || h->begin != c.begin || h->count != c.count || h->length != c.length
+                    || h->payload_crc != crc32c(0, payload, c.length)) {
+                    error = -1;
+                    break;
+                }
+                
+                if (c.type != kPageChunk) {
+                    records[i - page_chunks].assign(payload, payload + c.length);
+                }else if (direct) {
+                    place_exported_pages(c, payload);
+                }else{
+                    bucket_array_type pages(payload, c.count, kPageSize);
+                    elements.clear();
+                    
+                    for (size_t j = 0; j < c.count; j++) {
+                        const bucket_type b = pages.bucket(j);
+                        
+                        for (auto it = b.begin(); it != b.end(); ++it) {
+                            elements.push_back(*it);
+                        }
+                    }
+                    
+                    std::lock_guard<std::mutex> lock(insert_mutex);
+                    insert_batch(elements.begin(), elements.end());
+                }
+            }
+        };
+        
+        std::vector<std::thread> workers;
+        
+        for (unsigned int t = 1; t < threads && t < chunk_count; t++) {
+            workers.push_back(std::thread(worker));
+        }
+        worker();
+        
+        for (auto &w : workers) {
+            w.join();
+        }
+        close(fd);
+        
+        if (error == -1) {
+            throw std::runtime_error("bucket_map::import_from: " + path + " is corrupted");
+        }else if (error != 0) {
+            throw std::runtime_error("bucket_map::import_from: unable to read " + path + ": " + strerror(error));
+        }
+        
+        if (direct) {
+            e_count_ = header.stored_count;
+        }
+        
+        std::vector<value_type> elements;
+        
+        for (size_t i = 0; i < records.size(); i++) {
+            bool overflow = locate_export_chunk(header, page_chunks + i).type == kOverflowChunk;
+            
+            for (size_t r = 0; r < records[i].size(); r += kExportRecordSize) {
+                uint64_t fields[2];
+                typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type v;
+                
+                memcpy(fields, records[i].data() + r, sizeof(fields));
+                memcpy(&v, records[i].data() + r + sizeof(fields), sizeof(value_type));
+                
+                if (overflow && direct) {
+                    append_overflow_bucket(fields[0], fields[1], *reinterpret_cast<const value_type*>(&v));
+                }else{
+                    elements.push_back(*reinterpret_cast<const value_type*>(&v));
+                }
+            }
+        }
+        insert_batch(elements.begin(), elements.end());
+        
+        return header.stored_count + header.buffered_records;
+    }
+
+private:
+    static inline size_t alt_hash(size_t h)
+    {
+        // hash of the second candidate bucket: the finalizer of MurmurHash3,
+        // so that its low order bits are independent from the ones of h
+        uint64_t x = h;
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return static_cast<size_t>(x);
+    }
+    
+    inline std::pair<uint8_t, size_t> bucket_coordinates(size_t h) const
+    {
+        return index_coordinates(linear_bucket_index(h));
+    }
+    
+    // linear index of the bucket of hash value h
+    inline size_t linear_bucket_index(size_t h) const
+    {
+        size_t index = h & ((static_cast<size_t>(1) << mask_size_)-1);
+        
+        if (is_resizing_) {
+            // we must be careful here
+            // the coordinates depend on the value of resize_counter_
+            // if h & (1 << mask_size_)-1 is less than resize_counter_, it means that the
+            // bucket, before rebuild, was splitted
+            // otherwise, do as before
+            if (index < resize_counter_) {
+                // if the mask_size_-th bit is 0, do as before,
+                // otherwise, we know that the bucket is in the last array
+                index |= (h & (static_cast<size_t>(1) << mask_size_));
+            }
+        }
+        
+        return index;
+    }
+    
+    // coordinates of the bucket with linear index i:
+    // the buckets are numbered as if the data files were concatenated
+    inline std::pair<uint8_t, size_t> index_coordinates(size_t i) const
+    {
+        if (options_.addressing == kContiguousAddressing) {
+            return std::make_pair(0, i);
+        }
+        
+        if ((i >> original_mask_size_) == 0) {
+            return std::make_pair(0, i);
+        }
+        
+        // the highest set bit of i gives the array
+        uint8_t c = (8*sizeof(unsigned long long) - 1) - __builtin_clzll(i);
+        
+        return std::make_pair(c - original_mask_size_+1, i ^ (static_cast<size_t>(1) << c));
+    }
+    
+    // prefetch the candidate buckets of hash value h
+    inline void prefetch_candidates(size_t h) const
+    {
+        get_bucket(bucket_coordinates(h)).prefetch_lines();
+        
+        if (options_.placement == kTwoChoicePlacement) {
+            get_bucket(bucket_coordinates(alt_hash(h))).prefetch_lines();
+        }
+    }
+    
+    // allocate the blocks of a range of a new data file, and fault its pages in, as set by the preallocation policy
+    void prepare_data_range(const mmap_st& mmap, size_t offset, size_t length)
+    {
+        const preallocation_policy& policy = options_.preallocation;
+        
+        if (policy.allocate && preallocate_mmap(mmap, offset, length) != 0) {
+            throw std::runtime_error("bucket_map: unable to allocate the data file: " + std::string(strerror(errno)));
+        }
+        
+        if (policy.zero_fill == kSynchronousZeroFill) {
+            populate_mmap(mmap, offset, length);
+        }else if (policy.zero_fill == kBackgroundZeroFill) {
+            // a single file is filled at a time
+            stop_zero_fill();
+            
+            zero_fill_thread_ = std::thread([this, mmap, offset, length]()
+            {
+                for (size_t pos = 0; pos < length && !stop_zero_fill_.load(std::memory_order_relaxed); pos += kZeroFillChunkSize) {
+                    populate_mmap(mmap, offset + pos, std::min(kZeroFillChunkSize, length - pos));
+                }
+            });
+        }
+    }
+    
+    // stop the background zero-fill, before its mapping is unmapped or moved
+    void stop_zero_fill()
+    {
+        if (zero_fill_thread_.joinable()) {
+            stop_zero_fill_ = true;
+            zero_fill_thread_.join();
+            stop_zero_fill_ = false;
+        }
+    }
+    
+    // count the page faults taken by the calling thread during an insertion, if the policy asks for it
+    class fault_counter
+    {
+    public:
+        explicit fault_counter(bucket_map& map)
+        : map_(map), enabled_(map.options_.preallocation.count_faults)
+        {
+            if (enabled_) {
+                thread_usage(start_);
+            }
+        }
+        
+        ~fault_counter()
+        {
+            if (!enabled_) {
+                return;
+            }
+            
+            struct rusage end;
+            thread_usage(end);
+            
+            size_t minor = static_cast<size_t>(end.ru_minflt - start_.ru_minflt);
+            size_t major = static_cast<size_t>(end.ru_majflt - start_.ru_majflt);
+            
+            std::lock_guard<std::mutex> lock(map_.stats_mutex_);
+            fault_stats& stats = map_.fault_stats_;
+            
+            stats.insertions++;
+            stats.minor_faults += minor;
+            stats.major_faults += major;
+            stats.max_faults = std::max(stats.max_faults, minor + major);
+        }
+        
+    private:
+        static void thread_usage(struct rusage& usage)
+        {
+#ifdef RUSAGE_THREAD
+            getrusage(RUSAGE_THREAD, &usage);
+#else
+            getrusage(RUSAGE_SELF, &usage);
+#endif
+        }
+        
+        bucket_map& map_;
+        bool enabled_;
+        struct rusage start_;
+    };
+    
+    // add a bucket array of N buckets, mapped by mmap, with its dirty page tracker
+    void push_bucket_array(const mmap_st& mmap, size_t N)
+    {
+        bucket_arrays_.push_back(std::make_pair(bucket_array_type(mmap.mmap_addr, N, kPageSize), mmap));
+        dirty_trackers_.push_back(std::unique_ptr<dirty_tracker>(new dirty_tracker(N*kPageSize, kOSPageSize)));
+        bucket_arrays_.back().first.set_dirty_tracker(dirty_trackers_.back().get());
+    }
+    
+    // number of buckets of the new half of a map of N buckets that are backed by its file
+    // while the bucket split_index is the next to be split: the whole chunk being filled, and the next one
+    static size_t resize_backing_count(size_t split_index, size_t N)
+    {
+        size_t chunk = std::max(kResizeGrowthChunkSize/kPageSize, N/kResizeGrowthChunks);
+        
+        return std::min(N, (split_index/chunk + 2) * chunk);
+    }
+    
+    // extend the last bucket array (and its file) to count buckets
+    // the caller must hold mapping_mutex_, and the tracker of the array must already cover count buckets
+    void extend_bucket_array(size_t count)
+    {
+        mmap_st mmap = bucket_arrays_.back().second;
+        size_t length = mmap.length;
+        
+        if (count*kPageSize <= length) {
+            return;
+        }
+        if (count*kPageSize > mmap.reserved_length) {
+            // the mapping will move: the zero-fill must not read it anymore
+            stop_zero_fill();
+        }
+        
+        // the snapshot keeps reading the old mapping (it maps the same file) until it is written
+        mmap_st retired;
+        
+        if (extend_mmap_retaining(&mmap, count*kPageSize, snapshot_ ? &retired : NULL) != 0) {
+            throw std::runtime_error("bucket_map: unable to extend the data file");
+        }
+        if (snapshot_ && retired.mmap_addr != NULL) {
+            snapshot_->retired_mappings.push_back(retired);
+        }
+        bucket_arrays_.pop_back();
+        bucket_arrays_.push_back(std::make_pair(bucket_array_type(mmap.mmap_addr, count, kPageSize), mmap));
+        bucket_arrays_.back().first.set_dirty_tracker(dirty_trackers_.back().get());
+        
+        // an array created after the snapshot was taken is not part of it
+        if (snapshot_ && bucket_arrays_.size() <= snapshot_->pages.size()) {
+            bucket_arrays_.back().first.set_snapshot(snapshot_->pages[bucket_arrays_.size() - 1].get());
+        }
+        prepare_data_range(mmap, length, count*kPageSize - length);
+    }
+    
+    // back the buckets of the new half needed by the next splits
+    void grow_resizing_array()
+    {
+        size_t N = static_cast<size_t>(1) << mask_size_;
+        size_t count = resize_backing_count(resize_counter_, N) + ((options_.addressing == kContiguousAddressing) ? N : 0);
+        
+        if (bucket_arrays_.back().first.bucket_count() < count) {
+            std::lock_guard<std::mutex> lock(mapping_mutex_);
+            extend_bucket_array(count);
+        }
+    }
+    
+    // an element of a batch, with its hash value and the linear index of its bucket
+    template <class It>
+    struct batch_entry
+    {
+        size_t index;
+        size_t hash;
+        It it;
+    };
+    
+    // sort the entries of a batch by bucket index,
+    // with a LSD radix sort on the index_bits low order bits of the indices
+    template <class E>
+    static void sort_by_bucket(std::vector<E>& entries, size_t index_bits)
+    {
+        constexpr size_t kRadixBits = 8;
+        constexpr size_t kRadix = 1 << kRadixBits;
+        
+        std::vector<E> sorted(entries.size());
+        
+        for (size_t shift = 0; shift < index_bits; shift += kRadixBits) {
+            size_t offsets[kRadix+1] = {0};
+            
+            for (const auto &e : entries) {
+                offsets[((e.index >> shift) & (kRadix-1)) + 1]++;
+            }
+            if (offsets[((entries[0].index >> shift) & (kRadix-1)) + 1] == entries.size()) {
+                continue; // all the entries have the same digit
+            }
+            for (size_t d = 1; d <= kRadix; d++) {
+                offsets[d] += offsets[d-1];
+            }
+            for (const auto &e : entries) {
+                sorted[offsets[(e.index >> shift) & (kRadix-1)]++] = e;
+            }
+            entries.swap(sorted);
+        }
+    }
+    
+    // mark the page of an element as dirty for the two next checkpoints,
+    // if it is stored in a bucket
+    void mark_deferred(const value_type* elt)
+    {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(elt);
+        
+        for (size_t i = 0; i < bucket_arrays_.size(); i++) {
+            const unsigned char* base = static_cast<const unsigned char*>(bucket_arrays_[i].second.mmap_addr);
+            
+            if (p >= base && p < base + bucket_arrays_[i].second.length) {
+                dirty_trackers_[i]->mark_deferred(p - base);
+                return;
+            }
+        }
+    }
+    
+    // call fn(array index, first position, end position) on the pieces of
+    // the linear range [begin, end) lying in each bucket array
+    template <class F>
+    void for_each_segment(size_t begin, size_t end, F fn) const
+    {
+        while (begin < end) {
+            std::pair<uint8_t, size_t> coords = index_coordinates(begin);
+            
+            // linear index following the last bucket of the array
+            size_t array_end = end;
+            
+            if (options_.addressing == kSegmentedAddressing) {
+                array_end = static_cast<size_t>(1) << (original_mask_size_ + ((coords.first == 0) ? 0 : coords.first - 1));
+                array_end = std::min(end, (coords.first == 0) ? array_end : 2*array_end);
+            }
+            
+            fn(coords.first, coords.second, coords.second + (array_end - begin));
+            begin = array_end;
+        }
+    }
+    
+    void advise_range(size_t begin, size_t end, advice_flag advice) const
+    {
+        for_each_segment(begin, end, [&](uint8_t ba_index, size_t b_begin, size_t b_end)
+        {
+            advise_mmap(bucket_arrays_[ba_index].second, b_begin*kPageSize, (b_end-b_begin)*kPageSize, advice);
+        });
+    }
+    
+    inline size_t get_overflow_bucket_index(size_t h) const
+    {
+        size_t index = (h&((static_cast<size_t>(1) << mask_size_)-1));
+        
+        if (is_resizing_) {
+            // we must be careful here
+            // the coordinates depend on the value of resize_counter_
+            // if index is less than resize_counter_, it means that the
+            // bucket, before rebuild, was splitted
+            // otherwise, do as before
+            if (index < resize_counter_) {
+                // if the mask_size_-th bit is 0, do as before,
+                // otherwise, recompute the index accordingly
+                
+                if ((h & ((static_cast<size_t>(1) << mask_size_))) != 0) {
+                    return (h&((static_cast<size_t>(1) << (mask_size_+1))-1));
+                }
+            }
+        }
+
+        return index;
+    }
+    
+    inline bucket_type get_bucket(uint8_t ba_index, size_t b_pos)
+    {
+        // the coordinates are computed from the hash values or from bucket ranges: they are in range by construction
+        assert(ba_index < bucket_arrays_.size());
+        
+        return bucket_arrays_[ba_index].first.bucket_unchecked(b_pos);
+    }
+    
+    inline const bucket_type get_bucket(uint8_t ba_index, size_t b_pos) const
+    {
+        assert(ba_index < bucket_arrays_.size());
+        
+        return bucket_arrays_[ba_index].first.bucket_unchecked(b_pos);
+    }
+    
+    inline bucket_type get_bucket(const std::pair<uint8_t, size_t> &p)
+    {
+        return get_bucket(p.first, p.second);
+    }
+    
+    inline const bucket_type get_bucket(const std::pair<uint8_t, size_t> &p) const
+    {
+        return get_bucket(p.first, p.second);
+    }
+
+    
+    const value_type* find_element(const key_type& key, size_t h) const
+    {
+        // first, look if it is not in the overflow map or in the insert buffer
+        const value_type* elt = overflow_map_.find(key, h);
+        
+        if (elt == NULL && insert_buffer_.size() > 0) {
+            elt = insert_buffer_.find(key, h);
+        }
+        
+        if (elt != NULL) {
+            return elt;
+        }
+        
+        // otherwise, get the appropriate coordinates
+        std::pair<uint8_t, size_t> coords = bucket_coordinates(h);
+        
+        // get the bucket
+        auto bucket = get_bucket(coords);
+        
+        if (options_.placement == kTwoChoicePlacement) {
+            std::pair<uint8_t, size_t> alt_coords = bucket_coordinates(alt_hash(h));
+            
+            if (alt_coords != coords) {
+                auto alt_bucket = get_bucket(alt_coords);
+                
+                // fetch both pages at once
+                bucket.prefetch_lines();
+                alt_bucket.prefetch_lines();
+                
+                elt = find_in_group(coords, bucket, key);
+                
+                if (elt == NULL) {
+                    elt = find_in_group(alt_coords, alt_bucket, key);
+                }
+                return elt;
+            }
+        }
+        
+        return find_in_group(coords, bucket, key);
+    }
+    
+    const value_type* find_in_group(const std::pair<uint8_t, size_t> &coords, const bucket_type& bucket, const key_type& key) const
+    {
+        const value_type* elt = find_in_bucket(bucket, key);
+        
+        // look in the siblings the bucket spilled into
+        uint8_t hint = bucket.hint();
+        
+        if (elt == NULL && hint != 0) {
+            size_t base = coords.second & ~(kSiblingGroupSize-1);
+            
+            for (size_t j = 0; j < kSiblingGroupSize && elt == NULL; j++) {
+                if ((hint & (1 << j)) != 0) {
+                    elt = find_in_bucket(get_bucket(coords.first, base + j), key);
+                }
+            }
+        }
+        return elt;
+    }
+    
+    const value_type* find_in_bucket(const bucket_type& bucket, const key_type& key) const
+    {
+        // scan throught the bucket to find the element
+        for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+            if(eql_(slot_traits::key(*it), key))
+            {
+                return it;
+            }
+        }
+        
+        return NULL;
+    }
+
+    // call fn on every element with the given key, and return their number
+    template <class F>
+    size_t for_each_element(const key_type& key, size_t h, F fn) const
+    {
+        size_t count = overflow_map_.for_each_match(key, h, fn) + insert_buffer_.for_each_match(key, h, fn);
+
+        // the buckets to search: the candidates and the siblings they spilled into.
+        // the two candidates can share siblings, or be siblings of each other: visit every bucket once
+        std::pair<uint8_t, size_t> visited[2*kSiblingGroupSize];
+        size_t visited_count = 0;
+
+        std::pair<uint8_t, size_t> candidates[2] = {bucket_coordinates(h), bucket_coordinates(h)};
+        size_t candidates_count = 1;
+
+        if (options_.placement == kTwoChoicePlacement) {
+            candidates[1] = bucket_coordinates(alt_hash(h));
+            candidates_count = 2;
+
+            get_bucket(candidates[0]).prefetch_lines();
+            get_bucket(candidates[1]).prefetch_lines();
+        }
+
+        for (size_t c = 0; c < candidates_count; c++) {
+            auto bucket = get_bucket(candidates[c]);
+            uint8_t hint = bucket.hint();
+            size_t base = candidates[c].second & ~(kSiblingGroupSize-1);
+
+            for (size_t j = 0; j <= kSiblingGroupSize; j++) {
+                std::pair<uint8_t, size_t> p;
+
+                if (j == 0) {
+                    p = candidates[c];
+                }else if ((hint & (1 << (j-1))) != 0) {
+                    p = std::make_pair(candidates[c].first, base + j-1);
+                }else{
+                    continue;
+                }
+
+                if (std::find(visited, visited + visited_count, p) != visited + visited_count) {
+                    continue;
+                }
+                visited[visited_count++] = p;
+
+                auto b = get_bucket(p);
+                for (auto it = b.begin(); it != b.end(); ++it) {
+                    if(eql_(slot_traits::key(*it), key))
+                    {
+                        fn(*it);
+                        count++;
+                    }
                 }
             }
         }
+        return count;
+    }
 
-        return index;
+    value_type* find_element(const key_type& key, size_t h)
+    {
+        return const_cast<value_type*>(static_cast<const bucket_map*>(this)->find_element(key, h));
+    }
+    
+    void append_overflow_bucket(size_t bucket_index, size_t hkey, const value_type& v)
+    {
+        overflow_map_.insert(bucket_index, hkey, v);
+        overflow_count_++;
+    }
+
+    void append_overflow_bucket(size_t hkey, const value_type& v)
+    {        
+        size_t index = get_overflow_bucket_index(hkey);
+        append_overflow_bucket(index, hkey, v);
+    }
+    
+    // number of initialized buckets of an array, when the buckets before
+    // split_index are split
+    inline size_t active_bucket_count(uint8_t ba_index, size_t split_index) const
+    {
+        if (is_resizing_ && ba_index == bucket_arrays_.size()-1) {
+            if (options_.addressing == kContiguousAddressing) {
+                return (static_cast<size_t>(1) << mask_size_) + split_index;
+            }
+            return split_index;
+        }
+        return bucket_arrays_[ba_index].first.bucket_count();
+    }
+    
+    // append an element to a bucket, or to one of its siblings if allowed
+    bool append_element(const std::pair<uint8_t, size_t> &coords, const value_type& v, size_t split_index)
+    {
+        auto bucket = get_bucket(coords);
+        
+        if (bucket.append(v)) {
+            return true;
+        }
+        
+        if (options_.overflow != kSiblingSpill) {
+            return false;
+        }
+        
+        size_t base = coords.second & ~(kSiblingGroupSize-1);
+        size_t limit = active_bucket_count(coords.first, split_index);
+        
+        for (size_t j = 1; j < kSiblingGroupSize; j++) {
+            size_t offset = (coords.second + j) & (kSiblingGroupSize-1);
+            
+            if (base + offset >= limit) {
+                continue;
+            }
+            
+            if (get_bucket(coords.first, base + offset).append(v)) {
+                bucket.set_hint(bucket.hint() | (1 << offset));
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void insert_element(size_t h, const value_type& value)
+    {
+        // get the appropriate coordinates
+        std::pair<uint8_t, size_t> coords = bucket_coordinates(h);
+        
+        if (options_.placement == kTwoChoicePlacement) {
+            std::pair<uint8_t, size_t> alt_coords = bucket_coordinates(alt_hash(h));
+            
+            bool chosen = false;
+            
+            if (options_.multi_value && alt_coords != coords) {
+                // keep the values of a key together: prefer the candidate that already holds the key
+                if (find_in_group(coords, get_bucket(coords), slot_traits::key(value)) != NULL) {
+                    chosen = true;
+                }else if (find_in_group(alt_coords, get_bucket(alt_coords), slot_traits::key(value)) != NULL) {
+                    std::swap(coords, alt_coords);
+                    chosen = true;
+                }
+            }
+            
+            // otherwise, choose the less loaded of the two candidates
+            if (!chosen && get_bucket(alt_coords).size() < get_bucket(coords).size()) {
+                std::swap(coords, alt_coords);
+            }
+            
+            if (append_element(coords, value, resize_counter_) || append_element(alt_coords, value, resize_counter_)) {
+                return;
+            }
+        }else if (append_element(coords, value, resize_counter_)) {
+            return;
+        }
+        
+        // add to the overflow bucket
+        append_overflow_bucket(h, value);
+    }
+    
+    inline bool should_resize() const
+    {
+        const resize_policy& policy = options_.resize;
+        
+        // return yes if the map should be resized to reduce the load and/or the size of the overflow bucket
+        if(e_count_ > policy.threshold_load*bucket_space_ )
+        {
+            if (overflow_count_ >= policy.max_overflow_size) {
+                return true;
+            }else if (overflow_count_ >= policy.max_overflow_ratio * e_count_){
+                return true;
+            }
+        }
+        
+        if(overflow_count_ >= 10*policy.max_overflow_size)
+        {
+            return true;
+        }
+        
+        
+        return false;
+    }
+    
+    // an element of the map being compacted, and its position in storage order
+    struct compaction_entry
+    {
+        size_t hash;
+        size_t bucket;      // linear index of the bucket, or of the bucket the overflow element is attached to
+        size_t position;    // position in the bucket, or in the overflow chain of the bucket
+        bool overflow;
+        const value_type* elt;
+    };
+    
+    static inline bool storage_order(const compaction_entry& a, const compaction_entry& b)
+    {
+        if (a.overflow != b.overflow) {
+            return b.overflow;
+        }
+        if (a.bucket != b.bucket) {
+            return a.bucket < b.bucket;
+        }
+        return a.position < b.position;
+    }
+    
+    // sort by (hash & mask, hash, storage order): the elements of a key are adjacent, in storage order
+    static void sort_compaction_entries(std::vector<compaction_entry>& entries, size_t mask)
+    {
+        std::sort(entries.begin(), entries.end(), [mask](const compaction_entry& a, const compaction_entry& b)
+        {
+            if ((a.hash & mask) != (b.hash & mask)) {
+                return (a.hash & mask) < (b.hash & mask);
+            }
+            if (a.hash != b.hash) {
+                return a.hash < b.hash;
+            }
+            return storage_order(a, b);
+        });
+    }
+    
+    // keep the last element of every key (the entries are sorted by sort_compaction_entries)
+    void drop_duplicate_entries(std::vector<compaction_entry>& entries) const
+    {
+        size_t out = 0;
+        
+        for (size_t i = 0; i < entries.size(); ) {
+            size_t run_end = i + 1;
+            
+            while (run_end < entries.size() && entries[run_end].hash == entries[i].hash) {
+                run_end++;
+            }
+            
+            // different keys can share a hash value: compare the keys of the run
+            for (size_t j = i; j < run_end; j++) {
+                bool last = true;
+                
+                for (size_t k = j + 1; k < run_end && last; k++) {
+                    last = !eql_(slot_traits::key(*entries[j].elt), slot_traits::key(*entries[k].elt));
+                }
+                if (last) {
+                    entries[out++] = entries[j];
+                }
+            }
+            i = run_end;
+        }
+        entries.resize(out);
+    }
+    
+    // index the elements whose hash value passes the filter, scanning the buckets with several threads
+    template <class Filter>
+    void collect_compaction_entries(unsigned int threads, Filter filter, std::vector<compaction_entry>& entries) const
+    {
+        std::vector<bucket_range> ranges = partitions(threads);
+        std::vector<std::vector<compaction_entry>> results(ranges.size());
+        std::vector<std::thread> workers;
+        
+        auto scan = [this, &filter](const bucket_range& r, std::vector<compaction_entry>& out)
+        {
+            size_t linear = r.begin;
+            
+            advise_range(r.begin, r.end, SEQUENTIAL_ADVICE);
+            
+            for_each_segment(r.begin, r.end, [&](uint8_t ba_index, size_t b_begin, size_t b_end)
+            {
+                for (size_t i = b_begin; i < b_end; i++, linear++) {
+                    const bucket_type b = get_bucket(ba_index, i);
+                    size_t position = 0;
+                    
+                    for (auto it = b.begin(); it != b.end(); ++it, position++) {
+                        size_t h = hf_(slot_traits::key(*it));
+                        
+                        if (filter(h)) {
+                            out.push_back(compaction_entry{h, linear, position, false, &(*it)});
+                        }
+                    }
+                }
+            });
+            
+            advise_range(r.begin, r.end, RANDOM_ADVICE);
+            
+            if (overflow_count_ > 0) {
+                for (size_t i = r.begin; i < r.end; i++) {
+                    size_t position = 0;
+                    
+                    overflow_map_.for_each_in_bucket(i, [&](const value_type& v)
+                    {
+                        size_t h = hf_(slot_traits::key(v));
+                        
+                        if (filter(h)) {
+                            out.push_back(compaction_entry{h, i, position, true, &v});
+                        }
+                        position++;
+                    });
+                }
+            }
+        };
+        
+        for (size_t i = 1; i < ranges.size(); i++) {
+            workers.push_back(std::thread(scan, ranges[i], std::ref(results[i])));
+        }
+        if (!ranges.empty()) {
+            scan(ranges[0], results[0]);
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+        
+        for (auto &r : results) {
+            entries.insert(entries.end(), r.begin(), r.end());
+        }
+    }
+    
+    // insert the entries in the order of the buckets of this map
+    void write_compaction_entries(std::vector<compaction_entry>& entries)
+    {
+        size_t mask = (static_cast<size_t>(1) << mask_size_) - 1;
+        
+        sort_compaction_entries(entries, mask);
+        
+        for (auto &e : entries) {
+            insert_element(e.hash, *e.elt);
+        }
+        e_count_ += entries.size();
+    }
+    
+    // number of chunks of an export file
+    static size_t export_chunk_count(const export_header& header)
+    {
+        size_t per_chunk = kExportChunkSize/kExportRecordSize;
+        
+        return (header.bucket_count + header.chunk_buckets - 1)/header.chunk_buckets
+        + (header.overflow_records + per_chunk - 1)/per_chunk
+        + (header.buffered_records + per_chunk - 1)/per_chunk;
+    }
+    
+    // size (in bytes) of an export file
+    static size_t export_file_size(const export_header& header)
+    {
+        return sizeof(export_header) + export_chunk_count(header)*sizeof(export_chunk_header)
+        + header.bucket_count*kPageSize + (header.overflow_records + header.buffered_records)*kExportRecordSize;
+    }
+    
+    // the content and the offset of the i-th chunk of an export file:
+    // all the chunks of a kind are full, except the last one
+    static export_chunk locate_export_chunk(const export_header& header, size_t i)
+    {
+        size_t per_chunk = kExportChunkSize/kExportRecordSize;
+        size_t page_chunks = (header.bucket_count + header.chunk_buckets - 1)/header.chunk_buckets;
+        size_t overflow_chunks = (header.overflow_records + per_chunk - 1)/per_chunk;
+        export_chunk c;
+        
+        if (i < page_chunks) {
+            c.type = kPageChunk;
+            c.begin = i*header.chunk_buckets;
+            c.count = std::min(header.chunk_buckets, header.bucket_count - c.begin);
+            c.length = c.count*kPageSize;
+            c.offset = sizeof(export_header) + i*(sizeof(export_chunk_header) + header.chunk_buckets*kPageSize);
+            return c;
+        }
+        
+        size_t offset = sizeof(export_header) + page_chunks*sizeof(export_chunk_header) + header.bucket_count*kPageSize;
+        size_t records = header.overflow_records;
+        
+        c.type = kOverflowChunk;
+        i -= page_chunks;
+        
+        if (i >= overflow_chunks) {
+            c.type = kBufferChunk;
+            i -= overflow_chunks;
+            offset += overflow_chunks*sizeof(export_chunk_header) + header.overflow_records*kExportRecordSize;
+            records = header.buffered_records;
+        }
+        
+        c.begin = i*per_chunk;
+        c.count = std::min(per_chunk, records - c.begin);
+        c.length = c.count*kExportRecordSize;
+        c.offset = offset + i*(sizeof(export_chunk_header) + per_chunk*kExportRecordSize);
+        return c;
+    }
+    
+    // give the (empty) map the geometry of an exported map, with new data files
+    void adopt_export_geometry(const export_header& header)
+    {
+        std::lock_guard<std::mutex> lock(mapping_mutex_);
+        
+        size_t old_count = bucket_arrays_.size();
+        
+        unmap_bucket_arrays();
+        bucket_arrays_.clear();
+        dirty_trackers_.clear();
+        
+        for (size_t i = 0; i < old_count; i++) {
+            std::string fn = base_filename_ + "/data." + std::to_string(i);
+            remove(fn.data());
+        }
+        
+        original_mask_size_ = header.original_mask_size;
+        mask_size_ = header.mask_size;
+        is_resizing_ = header.is_resizing;
+        resize_counter_ = header.resize_counter;
+        
+        size_t half = static_cast<size_t>(1) << mask_size_;
+        
+        if (header.bucket_count > (is_resizing_ ? 2*half : half) || header.bucket_count < half) {
+            throw std::runtime_error("bucket_map::import_from: the geometry of the exported map is invalid");
+        }
+        
+        map_bucket_arrays(true);
+        
+        // the exported range can go past the backed part of the new half
+        if (is_resizing_) {
+            extend_bucket_array((options_.addressing == kContiguousAddressing) ? header.bucket_count : header.bucket_count - half);
+        }
+    }
+    
+    // copy the pages of a chunk of an export file to their buckets
+    void place_exported_pages(const export_chunk& c, const unsigned char* pages)
+    {
+        for_each_segment(c.begin, c.begin + c.count, [&](uint8_t ba_index, size_t b_begin, size_t b_end)
+        {
+            size_t offset = b_begin*kPageSize;
+            size_t length = (b_end-b_begin)*kPageSize;
+            
+            memcpy(static_cast<unsigned char*>(bucket_arrays_[ba_index].second.mmap_addr) + offset, pages, length);
+            pages += length;
+            
+            for (size_t o = offset; o < offset + length; o += kOSPageSize) {
+                dirty_trackers_[ba_index]->mark_dirty(o);
+            }
+        });
+    }
+    
+    // a key is logged once, however many times it was returned by at()
+    // the values of the previous keys were modified by now: log them when there are too many
+    void add_pending_update(const key_type& key)
+    {
+        for (auto &k : pending_updates_) {
+            if (eql_(k, key)) {
+                return;
+            }
+        }
+        if (pending_updates_.size() >= kMaxPendingUpdates) {
+            log_pending_updates();
+        }
+        pending_updates_.push_back(key);
+    }
+    
+    // log the current values of the elements returned by at()
+    void log_pending_updates()
+    {
+        for (auto &key : pending_updates_) {
+            const value_type* elt = find_element(key, hf_(key));
+            
+            if (elt != NULL) {
+                log_->append(kUpdateMutation, *elt);
+            }
+        }
+        pending_updates_.clear();
+    }
+    
+    // copy the page of an element to the snapshot in progress (if any), before it is modified
+    void preserve_element(const value_type* elt)
+    {
+        if (!snapshot_) {
+            return;
+        }
+        for (size_t i = 0; i < snapshot_->pages.size(); i++) {
+            bucket_arrays_[i].first.preserve(elt);
+        }
+        overflow_map_.preserve(elt);
+        insert_buffer_.preserve(elt);
+    }
+    
+    // wait for the snapshot thread, and remove the copy-on-write hooks
+    // the error of the snapshot (if any) is kept for wait_snapshot()
+    void finish_snapshot()
+    {
+        if (!snapshot_) {
+            return;
+        }
+        snapshot_thread_.join();
+        
+        for (size_t i = 0; i < snapshot_->pages.size(); i++) {
+            bucket_arrays_[i].first.set_snapshot(NULL);
+        }
+        overflow_map_.set_frozen_image(NULL);
+        insert_buffer_.set_frozen_image(NULL);
+        
+        if (!snapshot_->error.empty()) {
+            snapshot_error_ = snapshot_->error;
+        }
+        snapshot_.reset();
+    }
+    
+    // body of the snapshot thread: create the data files, write the bucket pages, then the overflow bucket, then the metadata
+    static void write_snapshot(snapshot_job* job)
+    {
+        // the pages modified until their file is set are kept in memory: set every file, even on error
+        for (size_t i = 0; i < job->pages.size(); i++) {
+            std::string path = job->path + "/data." + std::to_string(i);
+            int fd = open(path.data(), O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+            
+            job->fds.push_back(fd);
+            
+            if (fd < 0 || ftruncate(fd, static_cast<off_t>(job->lengths[i])) != 0) {
+                job->error = "unable to create " + path;
+                fd = -1;
+            }
+            job->pages[i]->set_file(fd);
+        }
+        if (!job->error.empty()) {
+            return;
+        }
+        
+        // the overflow blocks are only copied in memory
+        job->overflow->copy_all();
+        job->buffer->copy_all();
+        
+        for (size_t i = 0; i < job->pages.size(); i++) {
+            job->pages[i]->copy_all();
+            job->pages[i]->wait_all();
+            
+            if (job->pages[i]->error() != 0 || fdatasync(job->fds[i]) != 0) {
+                job->error = "unable to write the data files";
+                return;
+            }
+        }
+        
+        auto write_file = [job](const std::string& name, const void* buf, size_t length, const void* trailer, size_t trailer_length) -> bool
+        {
+            int fd = open((job->path + "/" + name).data(), O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+            
+            if (fd < 0) {
+                return false;
+            }
+            bool success = write_all(fd, buf, length, 0) && write_all(fd, trailer, trailer_length, length) && fdatasync(fd) == 0;
+            close(fd);
+            
+            return success;
+        };
+        
+        // the buffered elements are saved in the overflow bucket, at the index they will be inserted at
+        std::vector<overflow_record> records;
+        records.reserve(job->meta.overflow_count);
+        
+        auto save = [&records](size_t bucket, size_t hash, const value_type& v)
+        {
+            records.push_back(overflow_record(bucket, std::pair<size_t,value_type>(hash, v)));
+        };
+        job->overflow->for_each_chained(save);
+        job->buffer->for_each_chained(save);
+        
+        // as in flush(), the overflow elements are followed by the generation
+        if (!records.empty() && !write_file("overflow.bin", records.data(), records.size()*sizeof(overflow_record), &job->meta.generation, sizeof(uint64_t))) {
+            job->error = "unable to write overflow.bin";
+            return;
+        }
+        if (!write_file("meta.bin", &job->meta, sizeof(metadata_type), NULL, 0)) {
+            job->error = "unable to write meta.bin";
+        }
+    }
+    
+    // the metadata describing the current state of the map
+    void fill_metadata(metadata_type& meta) const
+    {
+        meta.original_mask_size = original_mask_size_;
+        meta.is_resizing = is_resizing_;
+        meta.resize_counter = resize_counter_;
+        meta.overflow_count = overflow_count_;
+        meta.e_count = e_count_;
+        meta.bucket_arrays_count = mask_size_ - original_mask_size_ + (is_resizing_ ? 2 : 1); // number of doublings, plus one
+        meta.placement = options_.placement;
+        meta.overflow = options_.overflow;
+        meta.addressing = options_.addressing;
+        meta.resize_threshold_load = options_.resize.threshold_load;
+        meta.resize_max_overflow_size = options_.resize.max_overflow_size;
+        meta.resize_max_overflow_ratio = options_.resize.max_overflow_ratio;
+        meta.resize_step_iterations = options_.resize.step_iterations;
+        meta.resize_target_load = options_.resize.target_load;
+        meta.resize_automatic = options_.resize.automatic;
+        meta.slot_size = sizeof(value_type);
+        meta.multi_value = options_.multi_value;
+        meta.insert_buffer_size = options_.insert_buffer_size;
+        meta.generation = generation_;
+        meta.format_version = kBucketMapFormatVersion;
+        meta.size_width = 8*sizeof(size_t);
+        meta.mask_size = mask_size_;
+        meta.bucket_size = bucket_array_type::optimal_bucket_size(kPageSize);
+    }
+    
+    // replace the element with the key of v by v (see log_follower)
+    void apply_logged_update(const value_type& v)
+    {
+        check_writable("apply_logged_update");
+        
+        value_type* elt = find_element(slot_traits::key(v), hf_(slot_traits::key(v)));
+        
+        if (elt == NULL) {
+            throw std::runtime_error("log_follower: the updated element is not in the map");
+        }
+        if (log_) {
+            log_pending_updates();
+            log_->append(kUpdateMutation, v);
+        }
+        
+        preserve_element(elt);
+        memcpy(static_cast<void*>(elt), &v, sizeof(value_type));
+        mark_deferred(elt);
+    }
+    
+    // positioned writes and reads of a whole buffer
+    static bool write_all(int fd, const void* buf, size_t length, size_t offset)
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(buf);
+        
+        while (length > 0) {
+            ssize_t r = pwrite(fd, p, length, offset);
+            
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                return false;
+            }
+            p += r;
+            length -= r;
+            offset += r;
+        }
+        return true;
+    }
+    
+    static bool read_all(int fd, void* buf, size_t length, size_t offset)
+    {
+        unsigned char* p = static_cast<unsigned char*>(buf);
+        
+        errno = 0;
+        while (length > 0) {
+            ssize_t r = pread(fd, p, length, offset);
+            
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                return false;
+            }
+            p += r;
+            length -= r;
+            offset += r;
+        }
+        return true;
     }
     
-    inline bucket_type get_bucket(uint8_t ba_index, size_t b_pos)
+    void finalize_resize()
     {
-        if (ba_index >= bucket_arrays_.size()) {
-            throw std::out_of_range("bucket_map::get_bucket");
-        }
+        size_t mask = static_cast<size_t>(1) << mask_size_;
+        release_split_windows(0, mask, mask);
+        
+        mask_size_++;
+        resize_counter_ = 0;
+        is_resizing_ = false;
         
-        return bucket_arrays_[ba_index].first.bucket(b_pos);
+//        std::cout << "Done resizing!" << std::endl;
+
     }
     
-    inline const bucket_type get_bucket(uint8_t ba_index, size_t b_pos) const
+    void online_resize()
     {
-        if (ba_index >= bucket_arrays_.size()) {
-            throw std::out_of_range("bucket_map::get_bucket");
+        for (size_t i = 0; i < options_.resize.step_iterations && is_resizing_; i++) {
+            resize_step();
         }
-        
-        return bucket_arrays_[ba_index].first.bucket(b_pos);
     }
     
-    inline bucket_type get_bucket(const std::pair<uint8_t, size_t> &p)
-    {
-        return get_bucket(p.first, p.second);
-    }
+    // destination of an element of the bucket being split
+    enum split_destination {
+        kSplitToOld = 1,
+        kSplitToNew = 2,
+        kSplitToBoth = kSplitToOld | kSplitToNew
+    };
     
-    inline const bucket_type get_bucket(const std::pair<uint8_t, size_t> &p) const
+    inline int split_destinations(size_t h, const split_context& ctx) const
     {
-        return get_bucket(p.first, p.second);
+        // with several candidates per element, only the ones pointing to
+        // the bucket being split are relevant
+        int dest = 0;
+        size_t x = h;
+        
+        for (int i = 0; i < ((options_.placement == kTwoChoicePlacement) ? 2 : 1); i++) {
+            if ((x & (ctx.mask-1)) == ctx.index) {
+                dest |= ((x & ctx.mask) == 0) ? kSplitToOld : kSplitToNew;
+            }
+            x = alt_hash(h);
+        }
+        return dest;
     }
-
     
-    mapped_type& at_overflow_bucket(size_t hkey)
+    // index of the overflow bucket of h, once the current bucket is split
+    inline size_t split_overflow_bucket_index(size_t h, const split_context& ctx) const
     {
-        size_t index = get_overflow_bucket_index(hkey);
-        auto& submap = overflow_map_.at(index);
-        return submap.at(hkey).second;
-    }
-
-    const mapped_type& at_overflow_bucket(size_t hkey) const
-    {
-        size_t index = get_overflow_bucket_index(hkey);
-        auto& submap = overflow_map_.at(index);
-        return submap.at(hkey).second;
+        if ((h & (ctx.mask-1)) == ctx.index || ctx.overflow_mutex != NULL) {
+            // when splitting concurrently, we do not know whether the bucket
+            // of h is split yet: use its index after the resize
+            return h & ((ctx.mask << 1)-1);
+        }
+        return get_overflow_bucket_index(h);
     }
-
-    bool get_overflow_bucket(size_t hkey, mapped_type& v) const
+    
+    // remove from b the elements belonging to the bucket being split, and put them in ctx.buffer
+    void collect_split_elements(bucket_type b, split_context& ctx)
     {
-        size_t index = get_overflow_bucket_index(hkey);
+        size_t c_kept = 0;
+        auto it_kept = b.begin();
         
-        auto const it = overflow_map_.find(index);
+        // the kept elements are moved before the size is set
+        preserve_element(&*it_kept);
         
-        if (it != overflow_map_.end()) {
-            auto const map_it = it->second.find(hkey);
+        for (auto it = b.begin(); it != b.end(); ++it) {
+            size_t h = hf_(slot_traits::key(*it));
             
-            if (map_it != it->second.end()) {
-                v = map_it->second.second;
-                return true;
+            if (split_destinations(h, ctx) == 0) {
+                // the element was spilled here by another bucket: keep it
+                if (it_kept != it) {
+                    memcpy(it_kept, it, sizeof(value_type));
+                }
+                ++it_kept;
+                c_kept++;
+            }else{
+                ctx.buffer.push_back(std::pair<size_t, value_type>(h, *it));
             }
         }
-        
-        return false;
+        b.set_size(c_kept);
     }
     
-    void append_overflow_bucket(size_t bucket_index, size_t hkey, const value_type& v)
+    void place_split_element(size_t h, const value_type& elt, const std::pair<uint8_t, size_t> &old_coords, const std::pair<uint8_t, size_t> &new_coords, const split_context& ctx)
     {
-        auto const it = overflow_map_.find(bucket_index);
+        bool success = false;
+        int dest = split_destinations(h, ctx);
         
-        if (it != overflow_map_.end()) {
-            it->second.insert(std::make_pair(hkey, v));
-        }else{
-            overflow_submap_type m;
-
-            m.insert(std::make_pair(hkey, v));
-            
-            overflow_map_.insert(std::make_pair( bucket_index , m)); // move ????
-
+        if (dest == kSplitToBoth) {
+            // try the less loaded bucket first
+            if (get_bucket(new_coords).size() < get_bucket(old_coords).size()) {
+                success = append_element(new_coords, elt, ctx.index) || append_element(old_coords, elt, ctx.index);
+            }else{
+                success = append_element(old_coords, elt, ctx.index) || append_element(new_coords, elt, ctx.index);
+            }
+        }else if (dest == kSplitToOld) { // high order bit of the key is 0
+            success = append_element(old_coords, elt, ctx.index);
+        }else if (dest == kSplitToNew) {
+            success = append_element(new_coords, elt, ctx.index);
         }
         
-        overflow_count_++;
-    }
-
-    void append_overflow_bucket(size_t hkey, const value_type& v)
-    {        
-        size_t index = get_overflow_bucket_index(hkey);
-        append_overflow_bucket(index, hkey, v);
+        if (!success) { // add the overflow bucket
+            if (ctx.overflow_mutex != NULL) {
+                std::lock_guard<std::mutex> lock(*ctx.overflow_mutex);
+                append_overflow_bucket(split_overflow_bucket_index(h, ctx), h, elt);
+            }else{
+                append_overflow_bucket(split_overflow_bucket_index(h, ctx), h, elt);
+            }
+        }
     }
     
-    inline bool should_resize() const
+    // split the bucket ctx.index of the old buckets in two
+    void split_bucket(split_context& ctx)
     {
-        // return yes if the map should be resized to reduce the load and/or the size of the overflow bucket
-        if(e_count_ > kBucketMapResizeThresholdLoad*bucket_space_ )
-        {
-            if (overflow_count_ >= kBucketMapResizeMaxOverflowSize) {
-                return true;
-            }else if (overflow_count_ >= kBucketMapResizeMaxOverflowRatio * e_count_){
-                return true;
+        // read a bucket and rewrite some of its content somewhere else
+        std::pair<uint8_t, size_t> coords = index_coordinates(ctx.index);
+        std::pair<uint8_t, size_t> new_coords = index_coordinates(ctx.mask | ctx.index);
+        auto b = get_bucket(coords);
+        
+        auto new_bucket = get_bucket(new_coords);
+        new_bucket.set_size(0);
+        new_bucket.set_hint(0);
+        
+        // take out the elements of the bucket, including the ones it spilled in its siblings
+        ctx.buffer.clear();
+        collect_split_elements(b, ctx);
+        
+        uint8_t hint = b.hint();
+        
+        if (hint != 0) {
+            size_t base = coords.second & ~(kSiblingGroupSize-1);
+            
+            for (size_t j = 0; j < kSiblingGroupSize; j++) {
+                if ((hint & (1 << j)) != 0) {
+                    collect_split_elements(get_bucket(coords.first, base + j), ctx);
+                }
             }
+            b.set_hint(0);
         }
         
-        if(overflow_count_ >= 10*kBucketMapResizeMaxOverflowSize)
+        // then, the elements of the overflow bucket
+        auto extract = [&](size_t h, const value_type& elt)
         {
-            return true;
-        }
+            ctx.buffer.push_back(std::pair<size_t, value_type>(h, elt));
+        };
         
+        if (ctx.overflow_mutex != NULL) {
+            std::lock_guard<std::mutex> lock(*ctx.overflow_mutex);
+            overflow_count_ -= overflow_map_.extract_bucket(ctx.index, extract);
+        }else{
+            overflow_count_ -= overflow_map_.extract_bucket(ctx.index, extract);
+        }
         
-        return false;
+        // and put them back in one of the two buckets
+        // the elements that still do not fit are put back in the overflow map
+        for (auto &elt : ctx.buffer) {
+            place_split_element(elt.first, elt.second, coords, new_coords, ctx);
+        }
     }
     
-    void finalize_resize()
+    // the buckets are split in increasing order: at every window boundary, read the next windows
+    // of split buckets and of new buckets ahead, and give the random access advice back to the previous ones
+    void advise_split_windows(size_t index, size_t begin, size_t end, size_t mask) const
     {
-        mask_size_++;
-        resize_counter_ = 0;
-        is_resizing_ = false;
+        const size_t window = kResizeReadaheadSize/kPageSize;
         
-//        std::cout << "Done resizing!" << std::endl;
-
+        if (index % window != 0 && index != begin) {
+            return;
+        }
+        
+        size_t ahead_end = std::min(end, index + 2*window);
+        
+        advise_range(index, ahead_end, SEQUENTIAL_ADVICE);
+        advise_range(index, ahead_end, WILLNEED_ADVICE);
+        advise_range(mask + index, mask + ahead_end, SEQUENTIAL_ADVICE);
+        advise_range(mask + index, mask + ahead_end, WILLNEED_ADVICE);
+        
+        if (index >= begin + window) {
+            advise_range(index - window, index, RANDOM_ADVICE);
+            advise_range(mask + (index - window), mask + index, RANDOM_ADVICE);
+        }
     }
     
-    void online_resize()
+    // give the random access advice back to the last windows of a range of split buckets
+    void release_split_windows(size_t begin, size_t end, size_t mask) const
     {
-        for (size_t i = 0; i < kBucketMapResizeStepIterations && is_resizing_; i++) {
-            resize_step();
-        }
+        const size_t window = kResizeReadaheadSize/kPageSize;
+        size_t last = std::max(begin, (end > 2*window) ? end - 2*window : 0);
+        
+        advise_range(last, end, RANDOM_ADVICE);
+        advise_range(mask + last, mask + end, RANDOM_ADVICE);
     }
     
     void resize_step()
     {
-        // read a bucket and rewrite some of its content somewhere else
-        
-        // get the bucket pointed by resize_counter_
-        std::pair<uint8_t, size_t> coords = bucket_coordinates(resize_counter_);
-        auto b = get_bucket(coords);
-
-        size_t mask = (1 << mask_size_);
-        auto new_bucket = bucket_arrays_.back().first.bucket(resize_counter_);
-        new_bucket.set_size(0);
+        // split the bucket pointed by resize_counter_
+        split_context_.index = resize_counter_;
+        split_context_.mask = (static_cast<size_t>(1) << mask_size_);
+        split_context_.overflow_mutex = NULL;
         
-        size_t c_old = 0;
-        auto it_old = b.begin();
+        advise_split_windows(resize_counter_, 0, split_context_.mask, split_context_.mask);
+        split_bucket(split_context_);
         
-        for (auto it = b.begin(); it != b.end(); ++it) {
-            if ((hf_(it->first) & mask) == 0) { // high order bit of the key is 0
-                // keep it here
-                memcpy(it_old, it, sizeof(value_type));
-                ++it_old;
-                c_old++;
-            }else{
-                // append it to the other bucket
-                bool success = new_bucket.append(*it);
-                
-                if (!success) {
-                    // append the pair to the overflow bucket
-                    size_t h = hf_(it->first);
-
-                    append_overflow_bucket(h&((1 << (mask_size_+1))-1), h, *it);
-                }
-            }
+        // check if we are done
+        if (resize_counter_ == (split_context_.mask -1)) {
+            finalize_resize();
+        }else{
+            resize_counter_ ++;
+            grow_resizing_array();
         }
-        // set the new size of the old bucket
-        b.set_size(c_old);
         
+        bucket_space_ += bucket_arrays_.back().first.bucket_size();
+    }
+    
+    // split all the remaining buckets, using several threads
+    void parallel_resize(unsigned int threads)
+    {
+        size_t mask = (static_cast<size_t>(1) << mask_size_);
+        
+        // every thread splits a range of whole sibling groups, in order
+        size_t groups = (mask - resize_counter_ + kSiblingGroupSize - 1)/kSiblingGroupSize;
+        size_t groups_per_thread = (groups + threads - 1)/threads;
         
-        // now, try to put as many elements from the overflow bucket as possible
-        auto const bucket_it = overflow_map_.find(resize_counter_);
+        if (resize_counter_ % kSiblingGroupSize != 0 || groups < 2*threads) {
+            full_resize();
+            return;
+        }
+        
+        // the threads split buckets all over the new half
+        {
+            std::lock_guard<std::mutex> lock(mapping_mutex_);
+            extend_bucket_array((options_.addressing == kContiguousAddressing) ? 2*mask : mask);
+        }
         
-        bool success;
+        std::mutex overflow_mutex;
+        std::vector<std::thread> workers;
         
-        if (bucket_it != overflow_map_.end()) {
-            // initialize the current bucket
-            overflow_submap_type current_of_bucket(std::move(bucket_it->second));
-            
-            // erase the old value
-            overflow_map_.erase(resize_counter_);
+        for (unsigned int t = 0; t < threads; t++) {
+            size_t begin = resize_counter_ + t*groups_per_thread*kSiblingGroupSize;
+            size_t end = std::min(mask, begin + groups_per_thread*kSiblingGroupSize);
             
-            overflow_count_ -= current_of_bucket.size();
+            if (begin >= end) {
+                break;
+            }
             
-            // enumerate the bucket's content and try to append the values to the buckets
-            for (auto &elt: current_of_bucket) {
-
-                if (((elt.first) & mask) == 0) { // high order bit of the key is 0
-                    success = b.append(elt.second);
-                    if (!success) { // add the overflow bucket
-                        append_overflow_bucket(resize_counter_, elt.first, elt.second);
-                    }
-               }else{
-                    success = new_bucket.append(elt.second);
-                   if (!success) { // add the overflow bucket
-                       append_overflow_bucket(mask ^ resize_counter_, elt.first, elt.second);
-                   }
-                }
+            workers.push_back(std::thread([this, begin, end, mask, &overflow_mutex]()
+            {
+                split_context ctx;
+                ctx.mask = mask;
+                ctx.overflow_mutex = &overflow_mutex;
                 
-            }
-
+                for (ctx.index = begin; ctx.index < end; ctx.index++) {
+                    advise_split_windows(ctx.index, begin, end, mask);
+                    split_bucket(ctx);
+                }
+                release_split_windows(begin, end, mask);
+            }));
         }
-
         
-        // check if we are done
-        if (resize_counter_ == (mask -1)) {
-            finalize_resize();
-        }else{
-            resize_counter_ ++;
+        for (auto &w : workers) {
+            w.join();
         }
         
-        bucket_space_ += bucket_arrays_.back().first.bucket_size();
+        bucket_space_ += (mask - resize_counter_) * bucket_arrays_.back().first.bucket_size();
+        finalize_resize();
     }
     
     void init_from_file()
@@ -1103,75 +3887,264 @@ private:
         // start by reading the meta data
         struct stat buffer;
         
-        std::string meta_path = base_filename_ + "/meta.bin";
-
-        if (stat (meta_path.data(), &buffer) != 0) { // the meta data file is not there
-            throw std::runtime_error("bucket_map constructor: metadata file does not exist");
+        metadata_type meta;
+        read_metadata(meta);
+        
+        if (meta.slot_size != 0 && meta.slot_size != sizeof(value_type)) { // 0 if the map was created before the slot size was stored
+            throw std::runtime_error("bucket_map constructor: the stored elements do not have the expected size");
+        }
+        if (meta.format_version > kBucketMapFormatVersion) {
+            throw std::runtime_error("bucket_map constructor: unsupported metadata version " + std::to_string(meta.format_version));
+        }
+        if (meta.size_width != 0 && meta.size_width != 8*sizeof(size_t)) { // 0 if the map was created before the widths were stored
+            throw std::runtime_error("bucket_map constructor: the map was written with " + std::to_string(meta.size_width) + "-bit sizes");
         }
-
-        mmap_st meta_mmap = create_mmap(meta_path.data(), sizeof(metadata_type));
         
-        metadata_type *meta_ptr = (metadata_type *)meta_mmap.mmap_addr;
+        // the buckets of the maps created before the hint byte was reserved can have one more element
+        size_t bucket_size = bucket_array_type::optimal_bucket_size(kPageSize);
+        size_t legacy_bucket_size = (kPageSize - sizeof(typename bucket_array_type::counter_type))/sizeof(typename bucket_array_type::value_type);
         
-        original_mask_size_     = meta_ptr->original_mask_size;
-        is_resizing_            = meta_ptr->is_resizing;
-        resize_counter_         = meta_ptr->resize_counter;
-        e_count_                = meta_ptr->e_count;
+        if (meta.bucket_size != 0 && meta.bucket_size != bucket_size) {
+            throw std::runtime_error("bucket_map constructor: the buckets of the map have " + std::to_string(meta.bucket_size) + " elements instead of " + std::to_string(bucket_size));
+        }
+        if (meta.format_version == 0 && legacy_bucket_size != bucket_size) {
+            throw std::runtime_error("bucket_map constructor: the map was written with an older bucket layout");
+        }
         
-        mask_size_ = original_mask_size_ + meta_ptr->bucket_arrays_count -1;
+        generation_             = meta.generation;
+        original_mask_size_     = meta.original_mask_size;
+        is_resizing_            = meta.is_resizing;
+        resize_counter_         = meta.resize_counter;
+        e_count_                = meta.e_count;
+        options_.placement      = static_cast<placement_strategy>(meta.placement);
+        options_.overflow       = static_cast<overflow_strategy>(meta.overflow);
+        options_.addressing     = static_cast<addressing_mode>(meta.addressing);
+        options_.multi_value    = meta.multi_value;
+        options_.insert_buffer_size = meta.insert_buffer_size;
         
-        size_t N = 1 << (original_mask_size_);
+        if (meta.resize_target_load > 0) { // otherwise, the map was created without a stored policy: keep the defaults
+            options_.resize.threshold_load      = meta.resize_threshold_load;
+            options_.resize.max_overflow_size   = meta.resize_max_overflow_size;
+            options_.resize.max_overflow_ratio  = meta.resize_max_overflow_ratio;
+            options_.resize.step_iterations     = meta.resize_step_iterations;
+            options_.resize.target_load         = meta.resize_target_load;
+            options_.resize.automatic           = meta.resize_automatic;
+        }
         
-        bucket_space_ = 0;
-
-        for (uint8_t i = 0; i < meta_ptr->bucket_arrays_count; i++) {
-            size_t length = N  * kPageSize;
-            
-            std::string fn = base_filename_ + "/data." + std::to_string(i);
-            
-            if (stat (fn.data(), &buffer) != 0) { // the file is not there
-                throw std::runtime_error("bucket_map constructor: " + std::to_string(i) + "-th data file does not exist.");
-            }
-
-            mmap_st mmap = create_mmap(fn.data(),length);
-            
-            bucket_arrays_.push_back(std::make_pair(bucket_array_type(mmap.mmap_addr, N, kPageSize), mmap));
-            
-            if (is_resizing_ == false || i < meta_ptr->bucket_arrays_count-1) {
-                bucket_space_ += bucket_arrays_[i].first.bucket_size() * bucket_arrays_[i].first.bucket_count();
-            }else{
-                bucket_space_ += resize_counter_*bucket_arrays_[i].first.bucket_size() * bucket_arrays_[i].first.bucket_count();
-            }
-
-            if (i > 0) {
-                N <<= 1;
-            }
+        // while resizing, the last doubling is not accounted in the mask yet
+        mask_size_ = original_mask_size_ + meta.bucket_arrays_count - (is_resizing_ ? 2 : 1);
+        
+        if (meta.format_version > 0 && meta.mask_size != mask_size_) {
+            throw std::runtime_error("bucket_map constructor: inconsistent metadata");
         }
-
+        if (mask_size_ >= 8*sizeof(size_t) - 1) {
+            throw std::runtime_error("bucket_map constructor: invalid bucket count");
+        }
+        
+        map_bucket_arrays(false);
+        
         // read the overflow bucket
         
-        if (meta_ptr->overflow_count > 0) {
+        if (meta.overflow_count > 0) {
             std::string overflow_path = base_filename_ + "/overflow.bin";
 
             if (stat (overflow_path.data(), &buffer) != 0) { // the overflow file is not there
                 throw std::runtime_error("bucket_map constructor: Overflow file does not exist.");
             }
             
-            mmap_st over_mmap = create_mmap(overflow_path.data(), (meta_ptr->overflow_count)*sizeof(typename overflow_map_type::value_type));
-            
             typedef std::pair<size_t, std::pair<size_t,value_type>> pair_type;
+            
+            size_t length = (meta.overflow_count)*sizeof(pair_type);
+            
+            // the overflow file of a newer flush has a different trailer (older maps have no trailer)
+            if (static_cast<size_t>(buffer.st_size) >= length + sizeof(uint64_t)) {
+                uint64_t file_generation = 0;
+                FILE* f = fopen(overflow_path.data(), "rb");
+                
+                if (f == NULL || fseek(f, length, SEEK_SET) != 0 || fread(&file_generation, sizeof(uint64_t), 1, f) != 1 || file_generation != meta.generation) {
+                    if (f != NULL) {
+                        fclose(f);
+                    }
+                    throw std::runtime_error("bucket_map constructor: the overflow file does not match the metadata");
+                }
+                fclose(f);
+            }
+
+            mmap_st over_mmap = read_only_ ? open_readonly_mmap(overflow_path.data(), length) : create_mmap(overflow_path.data(), length);
+            
+            if (over_mmap.mmap_addr == NULL) {
+                throw std::runtime_error("bucket_map constructor: unable to map the overflow file");
+            }
+            
             pair_type* elt_ptr = (pair_type*) over_mmap.mmap_addr;
             
-            for (size_t i = 0; i < meta_ptr->overflow_count; i++) {
+            for (size_t i = 0; i < meta.overflow_count; i++) {
                 append_overflow_bucket(elt_ptr[i].first, elt_ptr[i].second.first, elt_ptr[i].second.second);
             }
             
             // close the overflow mmap
             close_mmap(over_mmap);
         }
+    }
+    
+    // map the data files of the geometry given by original_mask_size_, mask_size_ and is_resizing_,
+    // that must exist unless create is true
+    void map_bucket_arrays(bool create)
+    {
+        struct stat buffer;
+        size_t arrays_count = mask_size_ - original_mask_size_ + (is_resizing_ ? 2 : 1);
+        
+        size_t N = static_cast<size_t>(1) << (original_mask_size_);
+        
+        if (options_.addressing == kContiguousAddressing) {
+            // a single file with all the buckets, and the backed part of the new half
+            size_t half = static_cast<size_t>(1) << mask_size_;
+            N = half + (is_resizing_ ? resize_backing_count(resize_counter_, half) : 0);
+            
+            std::string fn = base_filename_ + "/data.0";
+            
+            if (!create && stat (fn.data(), &buffer) != 0) { // the file is not there
+                throw std::runtime_error("bucket_map constructor: data file does not exist.");
+            }
+            
+            push_bucket_array(map_data_file(fn, N * kPageSize, kContiguousReservationSize), N);
+            
+            if (is_resizing_) {
+                dirty_trackers_.back()->resize(2 * half * kPageSize);
+            }
+            
+            if (create) {
+                prepare_data_range(bucket_arrays_.back().second, 0, N * kPageSize);
+            }
+        }
+        
+        for (size_t i = 0; options_.addressing == kSegmentedAddressing && i < arrays_count; i++) {
+            size_t length = N  * kPageSize;
+            
+            std::string fn = base_filename_ + "/data." + std::to_string(i);
+            
+            if (!create && stat (fn.data(), &buffer) != 0) { // the file is not there
+                throw std::runtime_error("bucket_map constructor: " + std::to_string(i) + "-th data file does not exist.");
+            }
 
-        // close the metadata map
-        close_mmap(meta_mmap);
+            if (is_resizing_ && i == arrays_count-1) {
+                // the array being filled by the resize
+                size_t count = resize_backing_count(resize_counter_, N);
+                
+                push_bucket_array(map_data_file(fn, count * kPageSize, length), count);
+                dirty_trackers_.back()->resize(length);
+            }else{
+                push_bucket_array(map_data_file(fn, length, 0), N);
+            }
+            
+            if (create) {
+                prepare_data_range(bucket_arrays_.back().second, 0, bucket_arrays_.back().second.length);
+            }
+            
+            if (i > 0) {
+                N <<= 1;
+            }
+        }
+        
+        // the split buckets of the new array are accounted for, not the others
+        bucket_space_ = bucket_arrays_[0].first.bucket_size() * ((static_cast<size_t>(1) << mask_size_) + (is_resizing_ ? resize_counter_ : 0));
+    }
+    
+    // read the metadata file, without mapping it: flush() replaces it atomically
+    void read_metadata(metadata_type& meta) const
+    {
+        std::string meta_path = base_filename_ + "/meta.bin";
+        
+        // the files of older maps are shorter: the missing fields are zero
+        memset(&meta, 0, sizeof(metadata_type));
+        
+        FILE* f = fopen(meta_path.data(), "rb");
+        
+        if (f == NULL) { // the meta data file is not there
+            throw std::runtime_error("bucket_map constructor: metadata file does not exist");
+        }
+        
+        size_t r = fread(&meta, 1, sizeof(metadata_type), f);
+        fclose(f);
+        
+        if (r == 0) {
+            throw std::runtime_error("bucket_map constructor: unable to read the metadata file");
+        }
+    }
+    
+    // map a data file: read-only maps neither create, stretch nor write the files
+    mmap_st map_data_file(const std::string& fn, size_t length, size_t reserved_length)
+    {
+        if (read_only_) {
+            mmap_st mmap = open_readonly_mmap(fn.data(), length);
+            
+            if (mmap.mmap_addr == NULL) {
+                throw std::runtime_error("bucket_map: unable to map " + fn + " for reading");
+            }
+            return mmap;
+        }
+        
+        if (reserved_length > 0) {
+            return create_reserved_mmap(fn.data(), length, reserved_length);
+        }
+        return create_mmap(fn.data(), length);
+    }
+    
+    // load a consistent version of a read-only map, while a writer may be replacing its files:
+    // the map is reloaded until the metadata did not change while the other files were read
+    void load_read_only()
+    {
+        for (size_t attempt = 1; ; attempt++) {
+            try {
+                unload();
+                init_from_file();
+                
+                metadata_type meta;
+                read_metadata(meta);
+                
+                if (meta.generation == generation_) {
+                    return;
+                }
+            } catch (std::runtime_error &e) {
+                if (attempt >= kReadOnlyLoadAttempts) {
+                    throw;
+                }
+            }
+            
+            if (attempt >= kReadOnlyLoadAttempts) {
+                throw std::runtime_error("bucket_map: the map was modified too often to be loaded");
+            }
+        }
+    }
+    
+    // reset the map to an empty state, with no mapped file
+    void unload()
+    {
+        unmap_bucket_arrays();
+        bucket_arrays_.clear();
+        dirty_trackers_.clear();
+        
+        overflow_map_.clear();
+        insert_buffer_.clear();
+        overflow_count_ = 0;
+        e_count_ = 0;
+    }
+    
+    void unmap_bucket_arrays()
+    {
+        finish_snapshot();
+        stop_zero_fill();
+        
+        for (auto it = bucket_arrays_.rbegin(); it != bucket_arrays_.rend(); ++it) {
+            close_mmap(it->second);
+        }
+    }
+    
+    inline void check_writable(const char* function) const
+    {
+        if (read_only_) {
+            throw std::runtime_error(std::string("bucket_map::") + function + ": the map is opened read-only");
+        }
     }
     
     const bucket_array_type& get_bucket_array(size_t i) const
@@ -0,0 +1,190 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "bucket_map.hpp"
+#include "slot_traits.hpp"
+
+/** @file bucket_set.hpp
+ * @brief Header that defines the bucket_set class, an on-disk set of keys.
+ *
+ *
+ */
+
+namespace ssdmap {
+
+/** @class bucket_set
+ *  @brief An on-disk set implementation, storing keys only.
+ *
+ *  A bucket_set is a bucket_map whose buckets only contain keys (there is no mapped value), so that a page holds twice as many 64 bits keys as a bucket_map<uint64_t, uint64_t> would.
+ *  It shares the resize, overflow, persistence and iteration mechanisms of bucket_map, and its directory has the same layout.
+ *  A directory written by a bucket_set cannot be opened by a bucket_map (and conversely) unless their elements have the same size.
+ *
+ *  @tparam Key     Type of the keys. It must be trivially copyable. Aliased as member type bucket_set::key_type and bucket_set::value_type.
+ *  @tparam Hash    The hash function of the keys. This defaults to key_hash<Key>.
+ *  @tparam Pred    The equality predicate on the keys. This defaults to key_equal_to<Key>.
+ */
+
+template <class Key, class Hash = key_hash<Key>, class Pred = key_equal_to<Key>>
+class bucket_set : private bucket_map<Key, Key, Hash, Pred, set_slot_traits<Key>>
+{
+    typedef bucket_map<Key, Key, Hash, Pred, set_slot_traits<Key>> base_type;
+
+public:
+    typedef typename base_type::key_type        key_type;           /**< @brief The first template parameter (Key)	*/
+    typedef typename base_type::value_type      value_type;         /**< @brief The first template parameter (Key)	*/
+    typedef typename base_type::hasher          hasher;             /**< @brief The second template parameter (Hash)	*/
+    typedef typename base_type::key_equal       key_equal;          /**< @brief The third template parameter (Pred)	*/
+    typedef typename base_type::const_reference const_reference;    /**< @brief const value_type&	*/
+    typedef typename base_type::size_type       size_type;
+    typedef typename base_type::const_iterator  const_iterator;
+
+    /**
+     *  @brief Constructor
+     *
+     *  Opens the set stored at @a path, or creates a new one able to contain @a setup_size keys.
+     *  See the corresponding constructor of bucket_map.
+     *
+     *  @exception std::runtime_error The input path is invalid.
+     */
+    bucket_set(const std::string &path, const size_type setup_size, const bucket_map_options& options = bucket_map_options(), const hasher& hf = hasher(),
+               const key_equal& eql = key_equal())
+    : base_type(path, setup_size, options, hf, eql)
+    {}
+
+    /**
+     *  @brief Constructor
+     *
+     *  Opens the set stored at @a path. If no valid directory is found, an exception is raised.
+     *
+     *  @exception std::runtime_error The input path is invalid.
+     */
+    explicit bucket_set(const std::string &path, const hasher& hf = hasher(),
+                        const key_equal& eql = key_equal())
+    : base_type(path, hf, eql)
+    {}
+
+    /**
+     *  @brief Constructor
+     *
+     *  Opens the set stored at @a path, for reading and writing or for reading only. See the corresponding constructor of bucket_map.
+     *
+     *  @exception std::runtime_error The input path is invalid.
+     */
+    bucket_set(const std::string &path, open_mode mode, const hasher& hf = hasher(),
+               const key_equal& eql = key_equal())
+    : base_type(path, mode, hf, eql)
+    {}
+
+    using base_type::size;
+    using base_type::begin;
+    using base_type::end;
+    using base_type::bucket_space;
+    using base_type::load;
+    using base_type::overflow_size;
+    using base_type::overflow_ratio;
+    using base_type::flush;
+    using base_type::full_resize;
+    using base_type::reserve;
+    using base_type::needs_resize;
+    using base_type::is_resizing;
+    using base_type::advance_resize;
+    using base_type::get_resize_policy;
+    using base_type::set_resize_policy;
+    using base_type::checkpoint;
+    using base_type::start_checkpointer;
+    using base_type::stop_checkpointer;
+    using base_type::get_checkpoint_stats;
+    using base_type::snapshot;
+    using base_type::wait_snapshot;
+    using base_type::snapshot_in_progress;
+    using base_type::options;
+    using base_type::overflow_memory_usage;
+    using base_type::doublings_count;
+    using base_type::bucket_count;
+    using base_type::partitions;
+    using base_type::for_each;
+    using base_type::parallel_for_each;
+    using base_type::count;
+    using base_type::insert_batch;
+    using base_type::drain_insert_buffer;
+    using base_type::buffered_size;
+    using base_type::set_insert_buffer_size;
+    using base_type::refresh;
+    using base_type::is_read_only;
+    using base_type::compact;
+
+    /**
+     *  @brief Insert a key
+     *
+     *  Adds @a key to the set. As in bucket_map, the key is not looked up first: inserting a key twice stores it twice.
+     *
+     *  @param[in]  key     The key to be inserted.
+     */
+    void insert(const key_type& key)
+    {
+        base_type::insert(key);
+    }
+
+    //@{
+    /**
+     *  @brief Check if a key is in the set
+     *
+     *  @param[in]  key     The key to be searched for.
+     *
+     *  @retval true    if @a key was found
+     *  @retval false   if @a key was not found
+     */
+    bool contains(const key_type& key) const
+    {
+        return base_type::contains(key);
+    }
+
+    /**
+     *  @brief Check if several keys are in the set
+     *
+     *  Writes, for every key of the range [@a first, @a last), whether it is in the set to @a out.
+     *  The lookups are batched as in bucket_map::find_batch(): the buckets of consecutive keys are prefetched together.
+     *
+     *  @param[in]  first   Forward iterator to the first key.
+     *  @param[in]  last    Forward iterator following the last key.
+     *  @param[out] out     Output iterator to which the results (convertible from bool) are written.
+     *
+     *  @return The number of keys found.
+     */
+    template <class ForwardIt, class OutputIt>
+    size_t contains(ForwardIt first, ForwardIt last, OutputIt out) const
+    {
+        size_t found = 0;
+
+        base_type::find_batch(first, last, [&](const key_type&, const value_type* elt)
+        {
+            *out = (elt != NULL);
+            ++out;
+            found += (elt != NULL) ? 1 : 0;
+        });
+        return found;
+    }
+    //@}
+};
+
+} // namespace ssdmap
@@ -0,0 +1,87 @@
+/* * ssdmap - Implementation of a disk-resident map designed for SSDs.
+ * Copyright (C) 2016 Raphael Bost
+ *
+ * This file is part of ssdmap.
+ *
+ * ssdmap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ssdmap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "checksum.h"
+
+#include <string.h>
+
+#if defined(__SSE4_2__)
+
+#include <nmmintrin.h>
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t c = ~crc;
+    
+    for (; length > 0 && ((uintptr_t)p & 7) != 0; length--, p++) {
+        c = _mm_crc32_u8((uint32_t)c, *p);
+    }
+    for (; length >= 8; length -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; length > 0; length--, p++) {
+        c = _mm_crc32_u8((uint32_t)c, *p);
+    }
+    
+    return ~(uint32_t)c;
+}
+
+#else
+
+#define CRC32C_POLYNOMIAL 0x82f63b78 /* reversed Castagnoli polynomial */
+
+static uint32_t crc32c_table[256];
+static int crc32c_table_ready = 0;
+
+static void init_crc32c_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLYNOMIAL : c >> 1;
+        }
+        crc32c_table[i] = c;
+    }
+    /* the table is the same whichever thread builds it */
+    __atomic_store_n(&crc32c_table_ready, 1, __ATOMIC_RELEASE);
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t c = ~crc;
+    
+    if (!__atomic_load_n(&crc32c_table_ready, __ATOMIC_ACQUIRE)) {
+        init_crc32c_table();
+    }
+    
+    for (; length > 0; length--, p++) {
+        c = crc32c_table[(c ^ *p) & 0xff] ^ (c >> 8);
+    }
+    
+    return ~c;
+}
+
+#endif
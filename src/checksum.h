@@ -0,0 +1,53 @@
+/* * ssdmap - Implementation of a disk-resident map designed for SSDs.
+ * Copyright (C) 2016 Raphael Bost
+ *
+ * This file is part of ssdmap.
+ *
+ * ssdmap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ssdmap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/** @file checksum.h
+ * @brief Header defining the checksum used by the files written by the library.
+ *
+ *  The checksum is the CRC-32C (Castagnoli). It is computed with the SSE 4.2 crc32 instruction when the compiler targets it (the library is built with -march=native), and with a table otherwise.
+ *
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  @brief Compute the CRC-32C of a buffer
+ *
+ *  Checksums can be chained: the checksum of the concatenation of two buffers is crc32c(crc32c(0, a, a_length), b, b_length).
+ *
+ *  @param crc      The checksum of the preceding data, or 0.
+ *  @param data     The buffer.
+ *  @param length   The length (in bytes) of the buffer.
+ *
+ *  @return The checksum of the data.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,359 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "bucket_map.hpp"
+
+/** @file coroutine_lookup.hpp
+ * @brief Header that defines the interleaved_lookup class, a lookup engine based on C++20 coroutines.
+ *
+ *  This header is empty if the compiler does not support coroutines (build with `scons coroutines=1`).
+ *
+ */
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#define SSDMAP_HAS_COROUTINES 1
+
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+namespace ssdmap {
+
+constexpr size_t kInterleavedLookupGroupSize = 16; /**< @brief Default number of lookups in flight in an interleaved_lookup. */
+constexpr size_t kMaxCachedLookupFrames = 256; /**< @brief Maximum number of coroutine frames kept for reuse by a thread. */
+
+/** @class lookup_coroutine
+ *  @brief A lookup suspended while the memory it needs is prefetched.
+ *
+ *  The coroutine frames are recycled by the thread that allocated them, so that a stream of lookups does not go through the allocator.
+ */
+class lookup_coroutine
+{
+public:
+    struct promise_type
+    {
+        std::exception_ptr exception_;
+        
+        lookup_coroutine get_return_object()
+        {
+            return lookup_coroutine(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        
+        // the scheduler starts the lookup
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+        
+        // the frame is destroyed by the scheduler
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+        
+        void return_void()
+        {
+        }
+        
+        void unhandled_exception()
+        {
+            exception_ = std::current_exception();
+        }
+        
+        static void* operator new(size_t size)
+        {
+            frame_cache& c = thread_frame_cache();
+            
+            if (size == c.size && !c.frames.empty()) {
+                void* p = c.frames.back();
+                c.frames.pop_back();
+                return p;
+            }
+            if (c.size == 0) {
+                c.size = size;
+            }
+            return ::operator new(size);
+        }
+        
+        static void operator delete(void* p, size_t size)
+        {
+            frame_cache& c = thread_frame_cache();
+            
+            if (size == c.size && c.frames.size() < kMaxCachedLookupFrames) {
+                c.frames.push_back(p);
+            }else{
+                ::operator delete(p);
+            }
+        }
+    };
+
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    lookup_coroutine()
+    : handle_(nullptr)
+    {}
+
+    explicit lookup_coroutine(handle_type h)
+    : handle_(h)
+    {}
+
+    lookup_coroutine(lookup_coroutine&& c) noexcept
+    : handle_(c.handle_)
+    {
+        c.handle_ = nullptr;
+    }
+
+    lookup_coroutine& operator=(lookup_coroutine&& c) noexcept
+    {
+        if (this != &c) {
+            reset();
+            handle_ = c.handle_;
+            c.handle_ = nullptr;
+        }
+        return *this;
+    }
+
+    lookup_coroutine(const lookup_coroutine&) = delete;
+    lookup_coroutine& operator=(const lookup_coroutine&) = delete;
+
+    ~lookup_coroutine()
+    {
+        reset();
+    }
+
+    /**
+     *  @brief Check if the coroutine is attached to a lookup.
+     */
+    inline bool valid() const
+    {
+        return handle_ != nullptr;
+    }
+
+    /**
+     *  @brief Run the lookup until its next suspension point.
+     *
+     *  @return True if the lookup is over.
+     *
+     *  @exception Any exception thrown by the lookup (e.g. by the hash function).
+     */
+    bool resume()
+    {
+        handle_.resume();
+        
+        if (!handle_.done()) {
+            return false;
+        }
+        if (handle_.promise().exception_) {
+            std::rethrow_exception(handle_.promise().exception_);
+        }
+        return true;
+    }
+
+    /**
+     *  @brief Destroy the lookup.
+     */
+    void reset()
+    {
+        if (handle_) {
+            handle_.destroy();
+            handle_ = nullptr;
+        }
+    }
+
+private:
+    struct frame_cache
+    {
+        size_t size = 0;
+        std::vector<void*> frames;
+        
+        ~frame_cache()
+        {
+            for (void* p : frames) {
+                ::operator delete(p);
+            }
+        }
+    };
+
+    static frame_cache& thread_frame_cache()
+    {
+        thread_local frame_cache c;
+        return c;
+    }
+
+    handle_type handle_;
+};
+
+/** @class interleaved_lookup
+ *  @brief Interleaved execution of the lookups of a bucket_map.
+ *
+ *  Every lookup is a coroutine that computes the coordinates of its candidate buckets, prefetches their cache lines, and suspends.
+ *  A scheduler keeps a group of lookups in flight and resumes them in turn: by the time a lookup is resumed, the memory it waited for has been fetched while the other lookups were running.
+ *  A lookup suspends again before reading the sibling buckets its bucket spilled into.
+ *
+ *  Compared to bucket_map::find_batch(), that prefetches a fixed window of keys and searches them in order, the lookups are not synchronized: a lookup that completes is immediately replaced by the next key.
+ *
+ *  @tparam Map The type of the map, an instance of bucket_map.
+ */
+template <class Map>
+class interleaved_lookup
+{
+public:
+    typedef typename Map::key_type      key_type;
+    typedef typename Map::value_type    value_type;
+    typedef typename Map::bucket_type   bucket_type;
+
+    /**
+     *  @brief Look up several keys, with interleaved coroutines
+     *
+     *  Calls @a fn(key, elt) on every key of the range [@a first, @a last), where @a elt is a pointer to an element with that key, or NULL if there is none.
+     *  The keys are looked up concurrently (on the calling thread), so @a fn is called in completion order, not in the order of the keys.
+     *  The map must not be modified during the call.
+     *
+     *  @param  map         The map.
+     *  @param  first       Input iterator to the first key.
+     *  @param  last        Input iterator following the last key.
+     *  @param  fn          A function object taking a key and a const value_type*.
+     *  @param  group_size  The number of lookups in flight.
+     *  @param  warm_pages  If true, the lookups also ask the kernel to read the pages of their buckets (madvise(MADV_WILLNEED)) before suspending, so that a cold page is read in the background. This costs a system call per lookup, and only helps maps that do not fit in memory.
+     */
+    template <class InputIt, class F>
+    static void find(const Map& map, InputIt first, InputIt last, F fn, size_t group_size = kInterleavedLookupGroupSize, bool warm_pages = false)
+    {
+        std::vector<lookup_coroutine> group(group_size == 0 ? 1 : group_size);
+        size_t running = 0;
+        
+        for (size_t i = 0; i < group.size() && first != last; i++, ++first) {
+            group[i] = lookup(map, *first, fn, warm_pages);
+            running++;
+        }
+        
+        while (running > 0) {
+            for (auto &c : group) {
+                if (!c.valid() || !c.resume()) {
+                    continue;
+                }
+                
+                // the lookup is over: start the next one in its slot
+                if (first != last) {
+                    c = lookup(map, *first, fn, warm_pages);
+                    ++first;
+                }else{
+                    c.reset();
+                    running--;
+                }
+            }
+        }
+    }
+
+private:
+    static inline void prefetch(const bucket_type& bucket, bool warm_pages)
+    {
+        if (warm_pages) {
+            bucket.prefetch();
+        }
+        bucket.prefetch_lines();
+    }
+
+    // prefetch the siblings a bucket spilled into
+    static inline bool prefetch_siblings(const Map& map, const std::pair<uint8_t, size_t>& coords, const bucket_type& bucket)
+    {
+        uint8_t hint = bucket.hint();
+        size_t base = coords.second & ~(kSiblingGroupSize-1);
+        
+        for (size_t j = 0; j < kSiblingGroupSize; j++) {
+            if ((hint & (1 << j)) != 0) {
+                map.get_bucket(coords.first, base + j).prefetch_lines();
+            }
+        }
+        return hint != 0;
+    }
+
+    static inline const value_type* find_in_siblings(const Map& map, const std::pair<uint8_t, size_t>& coords, const bucket_type& bucket, const key_type& key)
+    {
+        uint8_t hint = bucket.hint();
+        size_t base = coords.second & ~(kSiblingGroupSize-1);
+        const value_type* elt = NULL;
+        
+        for (size_t j = 0; j < kSiblingGroupSize && elt == NULL; j++) {
+            if ((hint & (1 << j)) != 0) {
+                elt = map.find_in_bucket(map.get_bucket(coords.first, base + j), key);
+            }
+        }
+        return elt;
+    }
+
+    template <class F>
+    static lookup_coroutine lookup(const Map& map, key_type key, F& fn, bool warm_pages)
+    {
+        size_t h = map.hf_(key);
+        
+        std::pair<uint8_t, size_t> coords = map.bucket_coordinates(h);
+        std::pair<uint8_t, size_t> alt_coords = coords;
+        
+        const bucket_type bucket = map.get_bucket(coords);
+        prefetch(bucket, warm_pages);
+        
+        if (map.options_.placement == kTwoChoicePlacement) {
+            alt_coords = map.bucket_coordinates(Map::alt_hash(h));
+            
+            if (alt_coords != coords) {
+                prefetch(map.get_bucket(alt_coords), warm_pages);
+            }
+        }
+        
+        co_await std::suspend_always();
+        
+        // the overflow bucket and the insert buffer are in memory
+        const value_type* elt = map.overflow_map_.find(key, h);
+        
+        if (elt == NULL && map.insert_buffer_.size() > 0) {
+            elt = map.insert_buffer_.find(key, h);
+        }
+        
+        if (elt == NULL) {
+            elt = map.find_in_bucket(bucket, key);
+        }
+        
+        if (elt == NULL && prefetch_siblings(map, coords, bucket)) {
+            co_await std::suspend_always();
+            elt = find_in_siblings(map, coords, bucket, key);
+        }
+        
+        if (elt == NULL && alt_coords != coords) {
+            const bucket_type alt_bucket = map.get_bucket(alt_coords);
+            elt = map.find_in_bucket(alt_bucket, key);
+            
+            if (elt == NULL && prefetch_siblings(map, alt_coords, alt_bucket)) {
+                co_await std::suspend_always();
+                elt = find_in_siblings(map, alt_coords, alt_bucket, key);
+            }
+        }
+        
+        fn(static_cast<const key_type&>(key), elt);
+    }
+};
+
+} // namespace ssdmap
+
+#endif
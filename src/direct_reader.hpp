@@ -0,0 +1,564 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "bucket_map.hpp"
+#include "uring_util.h"
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/** @file direct_reader.hpp
+ * @brief Header that defines the direct_reader class, a lookup engine reading the buckets with direct I/O.
+ *
+ */
+
+namespace ssdmap {
+
+constexpr size_t kDirectReadQueueDepth = 64; /**< @brief Default number of keys whose buckets are read in a single submission. */
+constexpr size_t kDirectReadThreads = 8; /**< @brief Number of threads of the pread() engine. */
+
+/**
+ *  @brief I/O engine of a direct_reader.
+ *
+ */
+enum read_engine : uint8_t {
+    kAutoEngine = 0,    /**< @brief io_uring if the kernel supports it, the pread() thread pool otherwise. */
+    kUringEngine = 1,   /**< @brief The reads of a batch are sent as one io_uring submission. */
+    kPreadEngine = 2    /**< @brief The reads are done with pread() by a pool of kDirectReadThreads threads. */
+};
+
+/** @class pread_pool
+ *  @brief A pool of threads running pread() requests.
+ *
+ *  The requests are identified by a tag, returned with their result in completion order.
+ *  This is the fallback of direct_reader when io_uring is not available.
+ */
+class pread_pool
+{
+public:
+    /**
+     *  @brief Constructor
+     *
+     *  Starts @a thread_count threads.
+     *
+     *  @param  thread_count    The number of threads.
+     */
+    explicit pread_pool(size_t thread_count)
+    : stop_(false)
+    {
+        for (size_t i = 0; i < thread_count; i++) {
+            threads_.push_back(std::thread(&pread_pool::run, this));
+        }
+    }
+    
+    /**
+     *  @brief Destructor
+     *
+     *  Waits for the queued requests and stops the threads.
+     */
+    ~pread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        request_cv_.notify_all();
+        
+        for (auto &t : threads_) {
+            t.join();
+        }
+    }
+    
+    /**
+     *  @brief Queue a read request.
+     *
+     *  Queues a request reading @a length bytes at @a offset in the file @a fd into @a buf.
+     *  The request is run by one of the threads as soon as possible.
+     *
+     *  @param  fd      The file descriptor to read from.
+     *  @param  buf     The destination buffer.
+     *  @param  length  The number of bytes to read.
+     *  @param  offset  The offset (in bytes) of the read in the file.
+     *  @param  tag     A value returned with the completion of the request.
+     */
+    void queue_read(int fd, void* buf, size_t length, off_t offset, uint64_t tag)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_.push_back(request{fd, buf, length, offset, tag});
+        }
+        request_cv_.notify_one();
+    }
+    
+    /**
+     *  @brief Wait for completions.
+     *
+     *  Blocks until at least one request is completed, and appends the tags and results of all the completed requests to @a completions.
+     *  The result of a request is the number of bytes read, or -errno.
+     *
+     *  @param  completions The vector the completions are appended to.
+     */
+    void wait(std::vector<std::pair<uint64_t, int>>& completions)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        completion_cv_.wait(lock, [this]{ return !completions_.empty(); });
+        
+        completions.insert(completions.end(), completions_.begin(), completions_.end());
+        completions_.clear();
+    }
+
+private:
+    struct request
+    {
+        int fd;
+        void* buf;
+        size_t length;
+        off_t offset;
+        uint64_t tag;
+    };
+    
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        
+        while (true) {
+            request_cv_.wait(lock, [this]{ return stop_ || !requests_.empty(); });
+            
+            if (requests_.empty()) {
+                return; // stop_ is set
+            }
+            
+            request r = requests_.front();
+            requests_.pop_front();
+            lock.unlock();
+            
+            ssize_t res = pread(r.fd, r.buf, r.length, r.offset);
+            int result = (res < 0) ? -errno : static_cast<int>(res);
+            
+            lock.lock();
+            completions_.push_back(std::make_pair(r.tag, result));
+            completion_cv_.notify_one();
+        }
+    }
+    
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable request_cv_;
+    std::condition_variable completion_cv_;
+    std::deque<request> requests_;
+    std::vector<std::pair<uint64_t, int>> completions_;
+    bool stop_;
+};
+
+/** @class direct_reader
+ *  @brief Batched lookups reading the buckets with direct I/O.
+ *
+ *  The lookups of bucket_map go through the memory map, and the page faults of a thread are served one at a time: a batch of lookups on a cold map runs at queue depth 1.
+ *  A direct_reader opens the data files of a map with O_DIRECT and, for a batch of keys, sends the reads of all their buckets to the device at once (as one io_uring submission, or to a pool of threads doing pread() if io_uring is not available).
+ *  The buckets are searched as the reads complete.
+ *
+ *  A read fetches the whole OS page containing a bucket, so the siblings a bucket spilled into come with it.
+ *  The overflow bucket and the insert buffer are in memory, and are searched before any read is issued.
+ *
+ *  The reads bypass the page cache, and do not pollute it.
+ *  The kernel writes back the dirty pages of the range of a direct read before reading it, so the reader sees the changes made through the memory map, but reading a map that is being modified is slow: the reader is meant for maps opened read-only, or that are not modified during the lookups.
+ *  The map must not be modified during a call to find_batch().
+ *
+ *  @tparam Map The type of the map, an instance of bucket_map.
+ */
+template <class Map>
+class direct_reader
+{
+public:
+    typedef typename Map::key_type      key_type;
+    typedef typename Map::value_type    value_type;
+    typedef typename Map::bucket_type   bucket_type;
+    
+    /**
+     *  @brief Constructor
+     *
+     *  Opens the data files of @a map with O_DIRECT (or without it, if the file system does not support direct I/O), and sets up the I/O engine.
+     *
+     *  @param  map         The map. It must outlive the reader.
+     *  @param  queue_depth The maximum number of keys whose buckets are read in a single submission.
+     *  @param  engine      The I/O engine.
+     *
+     *  @exception std::runtime_error   A data file could not be opened, or @a engine is kUringEngine and io_uring is not available.
+     */
+    direct_reader(const Map& map, size_t queue_depth = kDirectReadQueueDepth, read_engine engine = kAutoEngine)
+    : map_(map), queue_depth_(queue_depth == 0 ? 1 : queue_depth), buffers_(NULL), pool_(NULL)
+    {
+        ring_.fd = -1;
+        
+        if (engine != kPreadEngine) {
+            int err = uring_init(&ring_, static_cast<unsigned>(2*queue_depth_));
+            
+            if (err < 0 && engine == kUringEngine) {
+                throw std::runtime_error("direct_reader: io_uring is not available (" + std::string(strerror(-err)) + ")");
+            }
+        }
+        engine_ = (ring_.fd >= 0) ? kUringEngine : kPreadEngine;
+        
+        if (engine_ == kPreadEngine) {
+            pool_ = new pread_pool(kDirectReadThreads);
+        }
+        
+        // two candidate pages per key
+        if (posix_memalign(&buffers_, kOSPageSize, 2*queue_depth_*kOSPageSize) != 0) {
+            release();
+            throw std::bad_alloc();
+        }
+        
+        try {
+            open_data_files();
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+    
+    direct_reader(const direct_reader&) = delete;
+    direct_reader& operator=(const direct_reader&) = delete;
+    
+    /**
+     *  @brief Destructor
+     *
+     *  Closes the data files and releases the I/O engine.
+     */
+    ~direct_reader()
+    {
+        release();
+    }
+    
+    /**
+     *  @brief Return the I/O engine.
+     *
+     *  @return kUringEngine or kPreadEngine.
+     */
+    inline read_engine engine() const
+    {
+        return engine_;
+    }
+    
+    /**
+     *  @brief Look up several keys
+     *
+     *  Calls @a fn(key, elt) on every key of the range [@a first, @a last), where @a elt is a pointer to an element with that key, or NULL if there is none.
+     *  The keys are processed by groups of queue_depth keys, whose bucket reads are submitted together. Within a group, @a fn is called in completion order.
+     *  @a elt points to the reader's buffers: it is only valid during the call to @a fn.
+     *
+     *  @param  first   Input iterator to the first key.
+     *  @param  last    Input iterator following the last key.
+     *  @param  fn      A function object taking a key and a const value_type*.
+     *
+     *  @exception std::runtime_error   A read failed.
+     */
+    template <class InputIt, class F>
+    void find_batch(InputIt first, InputIt last, F fn)
+    {
+        // the map might have grown since the last call
+        open_data_files();
+        
+        while (first != last) {
+            keys_.clear();
+            reads_.clear();
+            
+            // look in memory first, and queue the reads of the other keys
+            for (; first != last && keys_.size() < queue_depth_; ++first) {
+                const key_type& key = *first;
+                size_t h = map_.hf_(key);
+                
+                const value_type* elt = map_.overflow_map_.find(key, h);
+                
+                if (elt == NULL && map_.insert_buffer_.size() > 0) {
+                    elt = map_.insert_buffer_.find(key, h);
+                }
+                if (elt != NULL) {
+                    fn(key, elt);
+                    continue;
+                }
+                
+                queue_key(key, h);
+            }
+            
+            if (!reads_.empty()) {
+                run_reads(fn);
+            }
+        }
+    }
+
+private:
+    struct pending_key
+    {
+        key_type key;
+        std::pair<uint8_t, size_t> coords[2];
+        uint8_t candidate_count;
+        uint8_t remaining_reads;
+        bool done;
+    };
+    
+    struct page_read
+    {
+        size_t key_index;
+        uint8_t candidate; // the read page contains the candidate buckets [candidate, candidate_end)
+        uint8_t candidate_end;
+    };
+    
+    // page of the candidate bucket (a bucket and its siblings are read together)
+    static inline bool same_page(const std::pair<uint8_t, size_t>& a, const std::pair<uint8_t, size_t>& b)
+    {
+        return a.first == b.first && (a.second / kSiblingGroupSize) == (b.second / kSiblingGroupSize);
+    }
+    
+    void queue_key(const key_type& key, size_t h)
+    {
+        pending_key p;
+        p.key = key;
+        p.coords[0] = map_.bucket_coordinates(h);
+        p.candidate_count = 1;
+        p.done = false;
+        
+        if (map_.options_.placement == kTwoChoicePlacement) {
+            std::pair<uint8_t, size_t> alt_coords = map_.bucket_coordinates(Map::alt_hash(h));
+            
+            if (alt_coords != p.coords[0]) {
+                p.coords[1] = alt_coords;
+                p.candidate_count = 2;
+            }
+        }
+        
+        size_t index = keys_.size();
+        
+        if (p.candidate_count == 2 && !same_page(p.coords[0], p.coords[1])) {
+            reads_.push_back(page_read{index, 0, 1});
+            reads_.push_back(page_read{index, 1, 2});
+            p.remaining_reads = 2;
+        }else{
+            reads_.push_back(page_read{index, 0, p.candidate_count});
+            p.remaining_reads = 1;
+        }
+        
+        keys_.push_back(p);
+    }
+    
+    template <class F>
+    void run_reads(F& fn)
+    {
+        for (size_t r = 0; r < reads_.size(); r++) {
+            const pending_key& p = keys_[reads_[r].key_index];
+            const std::pair<uint8_t, size_t>& coords = p.coords[reads_[r].candidate];
+            
+            queue_read(fds_[coords.first], page_buffer(r), kOSPageSize, (coords.second / kSiblingGroupSize) * kOSPageSize, r);
+        }
+        submit();
+        
+        size_t completed = 0;
+        int error = 0;
+        
+        while (completed < reads_.size()) {
+            completions_.clear();
+            wait_completions(completions_);
+            
+            for (auto &c : completions_) {
+                completed++;
+                
+                if (c.second < 0) {
+                    error = c.second;
+                    continue;
+                }
+                if (error == 0 && !process_read(c.first, static_cast<size_t>(c.second), fn)) {
+                    error = -EIO; // short read
+                }
+            }
+        }
+        
+        // all the reads are completed: the buffers can be reused even if one of them failed
+        if (error != 0) {
+            throw std::runtime_error("direct_reader::find_batch: read failed (" + std::string(strerror(-error)) + ")");
+        }
+    }
+    
+    // search the candidate buckets in a page that was read, and call fn if the lookup is over
+    template <class F>
+    bool process_read(size_t r, size_t length, F& fn)
+    {
+        const page_read& read = reads_[r];
+        pending_key& p = keys_[read.key_index];
+        
+        p.remaining_reads--;
+        
+        if (p.done) {
+            // found in the page of the other candidate
+            return true;
+        }
+        
+        for (uint8_t c = read.candidate; c < read.candidate_end; c++) {
+            if ((p.coords[c].second % kSiblingGroupSize + 1) * kPageSize > length) {
+                return false;
+            }
+        }
+        
+        const value_type* elt = NULL;
+        
+        for (uint8_t c = read.candidate; c < read.candidate_end && elt == NULL; c++) {
+            elt = find_in_page(p.coords[c], page_buffer(r), length, p.key);
+        }
+        
+        if (elt != NULL || p.remaining_reads == 0) {
+            p.done = true;
+            fn(static_cast<const key_type&>(p.key), elt);
+        }
+        return true;
+    }
+    
+    // search a bucket and the siblings it spilled into, in the buffer holding their OS page
+    const value_type* find_in_page(const std::pair<uint8_t, size_t>& coords, unsigned char* page, size_t length, const key_type& key) const
+    {
+        auto array = const_cast<typename Map::bucket_array_type*>(&map_.bucket_arrays_[coords.first].first);
+        const bucket_type bucket(page + (coords.second % kSiblingGroupSize) * kPageSize, array);
+        const value_type* elt = map_.find_in_bucket(bucket, key);
+        uint8_t hint = bucket.hint();
+        
+        for (size_t j = 0; j < kSiblingGroupSize && elt == NULL; j++) {
+            if ((hint & (1 << j)) != 0 && (j+1) * kPageSize <= length) {
+                elt = map_.find_in_bucket(bucket_type(page + j*kPageSize, array), key);
+            }
+        }
+        return elt;
+    }
+    
+    inline unsigned char* page_buffer(size_t r) const
+    {
+        return static_cast<unsigned char*>(buffers_) + r*kOSPageSize;
+    }
+    
+    void queue_read(int fd, void* buf, size_t length, off_t offset, uint64_t tag)
+    {
+        if (engine_ == kUringEngine) {
+            // the ring has room for all the reads of a group
+            uring_queue_read(&ring_, fd, buf, static_cast<unsigned>(length), static_cast<uint64_t>(offset), tag);
+        }else{
+            pool_->queue_read(fd, buf, length, offset, tag);
+        }
+    }
+    
+    void submit()
+    {
+        if (engine_ == kUringEngine) {
+            int err = uring_submit(&ring_, 0);
+            
+            if (err < 0) {
+                throw std::runtime_error("direct_reader::find_batch: io_uring submission failed (" + std::string(strerror(-err)) + ")");
+            }
+        }
+    }
+    
+    void wait_completions(std::vector<std::pair<uint64_t, int>>& completions)
+    {
+        if (engine_ == kPreadEngine) {
+            pool_->wait(completions);
+            return;
+        }
+        
+        uint64_t tag;
+        int result;
+        
+        while (completions.empty()) {
+            while (uring_reap(&ring_, &tag, &result)) {
+                completions.push_back(std::make_pair(tag, result));
+            }
+            if (completions.empty()) {
+                // also submits what the previous call could not
+                int err = uring_submit(&ring_, 1);
+                
+                if (err < 0) {
+                    throw std::runtime_error("direct_reader::find_batch: io_uring wait failed (" + std::string(strerror(-err)) + ")");
+                }
+            }
+        }
+    }
+    
+    void open_data_files()
+    {
+        std::lock_guard<std::mutex> lock(map_.mapping_mutex_);
+        
+        for (size_t i = fds_.size(); i < map_.bucket_arrays_.size(); i++) {
+            std::string fn = map_.base_filename_ + "/data." + std::to_string(i);
+            
+            int fd = open(fn.c_str(), O_RDONLY | O_DIRECT);
+            
+            if (fd == -1 && errno == EINVAL) {
+                // the file system does not support direct I/O
+                fd = open(fn.c_str(), O_RDONLY);
+            }
+            if (fd == -1) {
+                throw std::runtime_error("direct_reader: unable to open " + fn + " (" + std::string(strerror(errno)) + ")");
+            }
+            fds_.push_back(fd);
+        }
+    }
+    
+    void release()
+    {
+        for (int fd : fds_) {
+            close(fd);
+        }
+        fds_.clear();
+        
+        uring_release(&ring_);
+        
+        delete pool_;
+        pool_ = NULL;
+        
+        free(buffers_);
+        buffers_ = NULL;
+    }
+    
+    const Map& map_;
+    size_t queue_depth_;
+    read_engine engine_;
+    
+    std::vector<int> fds_;
+    void* buffers_;
+    
+    uring_st ring_;
+    pread_pool* pool_;
+    
+    std::vector<pending_key> keys_;
+    std::vector<page_read> reads_;
+    std::vector<std::pair<uint64_t, int>> completions_;
+};
+
+} // namespace ssdmap
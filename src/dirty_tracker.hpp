@@ -0,0 +1,220 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <cstring>
+
+/** @file dirty_tracker.hpp
+ * @brief Header that defines the dirty_tracker class, a bitmap of the modified pages of a memory map.
+ *
+ *
+ */
+
+namespace ssdmap {
+
+/** @class dirty_tracker
+ *  @brief A concurrent bitmap of the modified pages of a memory range.
+ *
+ *  Writers mark the pages they modified, and a single consumer (typically a checkpointing thread) periodically extracts the runs of consecutive dirty pages and clears them.
+ *  Marking is lock-free and can be done concurrently with the extraction: a page must be marked *after* it was modified, so that a concurrent extraction either sees the mark, or clears it after the modification.
+ *
+ *  Pages modified through references handed to the user (whose write happens after the mark) can be marked as deferred: they are extracted by the two following extractions.
+ */
+class dirty_tracker
+{
+public:
+    typedef size_t size_type;
+
+    /**
+     *  @brief Constructor
+     *
+     *  @param  length      The length (in bytes) of the tracked range.
+     *  @param  page_size   The size (in bytes) of the tracked pages. Must be a power of 2.
+     */
+    dirty_tracker(size_type length, size_type page_size)
+    : page_shift_(__builtin_ctzll(page_size)), page_count_(0), word_count_(0)
+    {
+        resize(length);
+    }
+
+    dirty_tracker(const dirty_tracker&) = delete;
+    dirty_tracker& operator=(const dirty_tracker&) = delete;
+
+    /**
+     *  @brief Change the length of the tracked range.
+     *
+     *  The marks of the pages that are still in the range are kept.
+     *  This function must not be called concurrently with any other member function.
+     *
+     *  @param  length  The new length (in bytes) of the tracked range.
+     */
+    void resize(size_type length)
+    {
+        size_type page_count = (length + page_size() - 1) >> page_shift_;
+        size_type word_count = (page_count + 63)/64;
+
+        std::unique_ptr<std::atomic<uint64_t>[]> dirty(new std::atomic<uint64_t>[word_count]);
+        std::unique_ptr<std::atomic<uint64_t>[]> deferred(new std::atomic<uint64_t>[word_count]);
+
+        for (size_type i = 0; i < word_count; i++) {
+            dirty[i].store((i < word_count_) ? dirty_[i].load() : 0);
+            deferred[i].store((i < word_count_) ? deferred_[i].load() : 0);
+        }
+
+        dirty_.swap(dirty);
+        deferred_.swap(deferred);
+        page_count_ = page_count;
+        word_count_ = word_count;
+    }
+
+    /**
+     *  @brief Return the size of the tracked pages.
+     */
+    inline size_type page_size() const
+    {
+        return static_cast<size_type>(1) << page_shift_;
+    }
+
+    /**
+     *  @brief Return the number of tracked pages.
+     */
+    inline size_type page_count() const
+    {
+        return page_count_;
+    }
+
+    /**
+     *  @brief Mark the page containing a byte as dirty.
+     *
+     *  @param  offset  The offset (in bytes) of the modified byte in the tracked range.
+     */
+    inline void mark_dirty(size_type offset)
+    {
+        set_bit(dirty_, offset >> page_shift_);
+    }
+
+    /**
+     *  @brief Mark the page containing a byte as dirty, for the two following extractions.
+     *
+     *  @param  offset  The offset (in bytes) of the byte that will be modified in the tracked range.
+     */
+    inline void mark_deferred(size_type offset)
+    {
+        set_bit(dirty_, offset >> page_shift_);
+        set_bit(deferred_, offset >> page_shift_);
+    }
+
+    /**
+     *  @brief Check if a page is dirty.
+     *
+     *  @param  offset  The offset (in bytes) of a byte of the page.
+     */
+    inline bool is_dirty(size_type offset) const
+    {
+        size_type page = offset >> page_shift_;
+        return (dirty_[page/64].load(std::memory_order_relaxed) & (1ULL << (page%64))) != 0;
+    }
+
+    /**
+     *  @brief Return the number of dirty pages.
+     */
+    size_type dirty_count() const
+    {
+        size_type c = 0;
+        for (size_type i = 0; i < word_count_; i++) {
+            c += __builtin_popcountll(dirty_[i].load(std::memory_order_relaxed));
+        }
+        return c;
+    }
+
+    /**
+     *  @brief Extract the dirty pages.
+     *
+     *  Clears the dirty pages (except the deferred ones, that are kept for the next extraction), and calls @a fn(offset, length) on every run of consecutive dirty pages, in increasing order.
+     *
+     *  @param  fn  A function object called with the offset and the length (in bytes) of every run.
+     *
+     *  @return The number of extracted pages.
+     */
+    template <class F>
+    size_type extract_runs(F fn)
+    {
+        size_type count = 0;
+        size_type run_begin = 0;
+        size_type run_length = 0;
+
+        for (size_type i = 0; i < word_count_; i++) {
+            uint64_t w = dirty_[i].exchange(0, std::memory_order_acquire);
+            uint64_t d = deferred_[i].exchange(0, std::memory_order_acquire);
+
+            if (d != 0) {
+                // the deferred pages stay dirty for one more extraction
+                dirty_[i].fetch_or(d, std::memory_order_relaxed);
+            }
+
+            while (w != 0) {
+                size_type page = 64*i + __builtin_ctzll(w);
+                w &= w - 1;
+                count++;
+
+                if (run_length > 0 && run_begin + run_length == page) {
+                    run_length++;
+                }else{
+                    if (run_length > 0) {
+                        fn(run_begin << page_shift_, run_length << page_shift_);
+                    }
+                    run_begin = page;
+                    run_length = 1;
+                }
+            }
+        }
+        if (run_length > 0) {
+            fn(run_begin << page_shift_, run_length << page_shift_);
+        }
+        return count;
+    }
+
+private:
+    inline void set_bit(std::unique_ptr<std::atomic<uint64_t>[]>& bitmap, size_type page)
+    {
+        std::atomic<uint64_t>& w = bitmap[page/64];
+        uint64_t bit = 1ULL << (page%64);
+
+        // most writes hit pages that are already dirty: avoid the locked instruction
+        if ((w.load(std::memory_order_relaxed) & bit) == 0) {
+            w.fetch_or(bit, std::memory_order_release);
+        }
+    }
+
+    size_type page_shift_;
+    size_type page_count_;
+    size_type word_count_;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> dirty_;
+    std::unique_ptr<std::atomic<uint64_t>[]> deferred_;
+};
+
+} // namespace ssdmap
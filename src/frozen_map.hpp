@@ -0,0 +1,509 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "bucket_map.hpp"
+#include "mmap_util.h"
+#include "checksum.h"
+
+#include <vector>
+#include <string>
+#include <limits>
+#include <stdexcept>
+#include <cstring>
+
+#include <sys/stat.h>
+
+/** @file frozen_map.hpp
+ * @brief Header that defines the frozen_map class, an immutable map indexed by a minimal perfect hash function.
+ *
+ */
+
+namespace ssdmap {
+
+constexpr size_t kFrozenMapBucketLoad = 4; /**< @brief Average number of keys per bucket of the minimal perfect hash function (the index takes 4/kFrozenMapBucketLoad bytes per key). */
+constexpr float kFrozenMapTableLoad = 0.99f; /**< @brief Load of the range of positions of the perfect hash function: the few positions past the number of elements are remapped to the unused records. */
+constexpr size_t kFrozenMapBuildAttempts = 8; /**< @brief Number of seeds tried before frozen_map::build() gives up. */
+constexpr uint64_t kFrozenMapMagic = 0x315a5246504d5353ULL; /**< @brief First 8 bytes of a frozen map file ("SSMPFRZ1"). */
+constexpr uint32_t kFrozenMapFormatVersion = 1; /**< @brief Version of the frozen map file format. */
+
+/** @class frozen_map
+ *  @brief An immutable, read-optimized map stored in a single file.
+ *
+ *  A frozen_map is built once from the elements of a bucket_map (or any range of elements with distinct keys), and then only read.
+ *  The elements are packed in an array of fixed-size records, without any free space, and indexed by a minimal perfect hash function (hash and displace, as in CHD and PTHash): the keys are hashed into buckets of about kFrozenMapBucketLoad keys, and each bucket stores a 32 bits displacement that sends its keys to distinct positions.
+ *  The positions range over slightly more than the number of elements (see kFrozenMapTableLoad), which makes the last keys much faster to place: the positions past the end of the records are remapped to the records left unused.
+ *  A lookup reads the displacement of its bucket and exactly one record, whose key is compared to the searched key (keys that are not in the map are sent to an arbitrary record).
+ *
+ *  The file is mapped read-only: the records are returned without copy, and several processes share the same page cache.
+ *  Its layout is a header, the displacements, the remapped positions, and the records (aligned on a page).
+ *
+ *  @tparam Key     Type of the keys.
+ *  @tparam T       Type of the mapped values.
+ *  @tparam Hash    Hash function of the keys, as in bucket_map. Two distinct keys with the same hash value cannot be stored in the same frozen_map.
+ *  @tparam Pred    Equality predicate on the keys.
+ *  @tparam Traits  The slot traits, describing what is stored in the records (see bucket_map).
+ */
+template <class Key, class T, class Hash = key_hash<Key>, class Pred = key_equal_to<Key>, class Traits = map_slot_traits<Key, T>>
+class frozen_map {
+public:
+    typedef Key                                 key_type;       /**< @brief The first template parameter (Key)	*/
+    typedef T                                   mapped_type;    /**< @brief The second template parameter (T)	*/
+    typedef Traits                              slot_traits;    /**< @brief The fifth template parameter (Traits)	*/
+    typedef typename Traits::value_type         value_type;     /**< @brief Type of the stored elements	*/
+    typedef Hash                                hasher;         /**< @brief The third template parameter (Hash)	*/
+    typedef Pred                                key_equal;      /**< @brief The fourth template parameter (Pred)	*/
+    typedef const value_type*                   const_iterator; /**< @brief Iterator over the records	*/
+    typedef size_t                              size_type;      /**< @brief size_t	*/
+
+    /**
+     *  @brief Open a frozen map.
+     *
+     *  @param  path    The path of the file written by build() or freeze().
+     *  @param  hf      The hash function. It must be the one the map was built with.
+     *  @param  eql     The equality predicate on the keys.
+     *
+     *  @exception std::runtime_error The file cannot be mapped, or is not a frozen map with elements of this size.
+     */
+    explicit frozen_map(const std::string& path, const hasher& hf = hasher(), const key_equal& eql = key_equal())
+    : hf_(hf), eql_(eql)
+    {
+        struct stat buffer;
+        
+        if (stat(path.data(), &buffer) != 0 || static_cast<size_t>(buffer.st_size) < sizeof(header_type)) {
+            throw std::runtime_error("frozen_map: unable to open " + path);
+        }
+        
+        mmap_ = open_readonly_mmap(path.data(), static_cast<size_t>(buffer.st_size));
+        
+        if (mmap_.mmap_addr == NULL) {
+            throw std::runtime_error("frozen_map: unable to map " + path);
+        }
+        
+        const unsigned char* base = static_cast<const unsigned char*>(mmap_.mmap_addr);
+        memcpy(&header_, base, sizeof(header_type));
+        
+        if (!valid_header(header_, mmap_.length)) {
+            close_mmap(mmap_);
+            throw std::runtime_error("frozen_map: " + path + " is not a frozen map of this type");
+        }
+        
+        displacements_ = reinterpret_cast<const uint32_t*>(base + header_.index_offset);
+        remap_ = reinterpret_cast<const uint64_t*>(base + header_.remap_offset);
+        records_ = reinterpret_cast<const value_type*>(base + header_.records_offset);
+    }
+    
+    frozen_map(const frozen_map&) = delete;
+    frozen_map& operator=(const frozen_map&) = delete;
+    
+    /**
+     *  @brief Destructor
+     */
+    ~frozen_map()
+    {
+        close_mmap(mmap_);
+    }
+    
+    /**
+     *  @brief Build a frozen map from a range of elements.
+     *
+     *  Writes the elements of the range [@a first, @a last) to a new frozen map file at @a path (an existing file is replaced).
+     *  The range is read twice: once to build the index from the hash values of the keys, and once to write the records.
+     *  The memory used by the build is about 16 bytes per element.
+     *
+     *  @param  path    The path of the file.
+     *  @param  first   Forward iterator to the first element.
+     *  @param  last    Forward iterator following the last element.
+     *  @param  hf      The hash function.
+     *
+     *  @return The number of elements of the map.
+     *
+     *  @exception std::runtime_error Two elements have the same key (or the same hash value), or the range changed between the two passes.
+     */
+    template <class ForwardIt>
+    static size_t build(const std::string& path, ForwardIt first, ForwardIt last, const hasher& hf = hasher())
+    {
+        std::vector<uint64_t> hashes;
+        
+        for (ForwardIt it = first; it != last; ++it) {
+            hashes.push_back(static_cast<uint64_t>(hf(slot_traits::key(*it))));
+        }
+        
+        header_type header;
+        memset(&header, 0, sizeof(header_type));
+        header.magic = kFrozenMapMagic;
+        header.version = kFrozenMapFormatVersion;
+        header.slot_size = sizeof(value_type);
+        header.count = hashes.size();
+        header.bucket_count = std::max<uint64_t>(1, (hashes.size() + kFrozenMapBucketLoad - 1)/kFrozenMapBucketLoad);
+        header.table_size = std::max<uint64_t>(hashes.size(), static_cast<uint64_t>(std::ceil(hashes.size()/kFrozenMapTableLoad)));
+        
+        std::vector<uint32_t> displacements;
+        std::vector<uint64_t> remap;
+        bool success = false;
+        
+        for (size_t attempt = 0; attempt < kFrozenMapBuildAttempts && !success; attempt++) {
+            header.seed = mix(0x5851F42D4C957F2DULL + attempt);
+            success = build_index(hashes, header, displacements, remap);
+        }
+        if (!success) {
+            throw std::runtime_error("frozen_map::build: unable to index the elements (duplicate keys?)");
+        }
+        std::vector<uint64_t>().swap(hashes);
+        
+        header.index_offset = sizeof(header_type);
+        header.remap_offset = (header.index_offset + header.bucket_count*sizeof(uint32_t) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+        header.records_offset = (header.remap_offset + remap.size()*sizeof(uint64_t) + kOSPageSize - 1) & ~(kOSPageSize - 1);
+        header.crc = crc32c(0, &header, offsetof(header_type, crc));
+        
+        remove(path.data());
+        mmap_st map = create_mmap(path.data(), header.records_offset + header.count*sizeof(value_type));
+        unsigned char* base = static_cast<unsigned char*>(map.mmap_addr);
+        
+        memcpy(base + header.index_offset, displacements.data(), header.bucket_count*sizeof(uint32_t));
+        memcpy(base + header.remap_offset, remap.data(), remap.size()*sizeof(uint64_t));
+        
+        size_t n = 0;
+        
+        for (ForwardIt it = first; it != last && n < header.count; ++it, n++) {
+            size_t r = record_index(hf(slot_traits::key(*it)), header, displacements.data(), remap.data());
+            memcpy(static_cast<void*>(base + header.records_offset + r*sizeof(value_type)), &(*it), sizeof(value_type));
+        }
+        
+        if (n != header.count) {
+            close_mmap(map);
+            remove(path.data());
+            throw std::runtime_error("frozen_map::build: the range changed during the build");
+        }
+        
+        // the header is written last
+        memcpy(base, &header, sizeof(header_type));
+        flush_mmap(map, SYNC_FLAG);
+        close_mmap(map);
+        
+        return n;
+    }
+    
+    /**
+     *  @brief Build a frozen map from a map.
+     *
+     *  Same as build(path, map.begin(), map.end(), hf).
+     *  The keys of @a map must be distinct (see bucket_map_options::multi_value), and @a map must not be modified during the call.
+     *
+     *  @param  map     The map, typically a bucket_map with the same key, hash and element types.
+     *  @param  path    The path of the file.
+     *  @param  hf      The hash function.
+     *
+     *  @return The number of elements of the map.
+     *
+     *  @exception std::runtime_error Two elements have the same key (or the same hash value).
+     */
+    template <class Map>
+    static size_t freeze(const Map& map, const std::string& path, const hasher& hf = hasher())
+    {
+        return build(path, map.begin(), map.end(), hf);
+    }
+    
+    /**
+     *  @brief Return the number of elements.
+     */
+    inline size_t size() const
+    {
+        return header_.count;
+    }
+    
+    /**
+     *  @brief Return the size (in bytes) of the file.
+     */
+    inline size_t file_size() const
+    {
+        return mmap_.length;
+    }
+    
+    /**
+     *  @brief Return an iterator to the first record.
+     */
+    inline const_iterator begin() const
+    {
+        return records_;
+    }
+    
+    /**
+     *  @brief Return an iterator following the last record.
+     */
+    inline const_iterator end() const
+    {
+        return records_ + header_.count;
+    }
+    
+    /**
+     *  @brief Find an element.
+     *
+     *  @param  key Key to be searched for.
+     *
+     *  @return A pointer to the element with key @a key, or NULL if there is none.
+     */
+    inline const value_type* find(const key_type& key) const
+    {
+        if (header_.count == 0) {
+            return NULL;
+        }
+        
+        const value_type* elt = records_ + record_index(hf_(key), header_, displacements_, remap_);
+        
+        return eql_(slot_traits::key(*elt), key) ? elt : NULL;
+    }
+    
+    /**
+     *  @brief Get the value of an element.
+     *
+     *  @param  key Key of the element.
+     *  @param  v   Set to the mapped value of the element, if there is one.
+     *
+     *  @return True if an element with key @a key was found.
+     */
+    inline bool get(const key_type& key, mapped_type& v) const
+    {
+        const value_type* elt = find(key);
+        
+        if (elt == NULL) {
+            return false;
+        }
+        v = elt->second;
+        return true;
+    }
+    
+    /**
+     *  @brief Count the elements with a key (0 or 1).
+     */
+    inline size_t count(const key_type& key) const
+    {
+        return (find(key) != NULL) ? 1 : 0;
+    }
+    
+private:
+    struct header_type
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t slot_size;
+        uint64_t count;
+        uint64_t bucket_count;
+        uint64_t table_size; // range of the positions
+        uint64_t seed;
+        uint64_t index_offset;
+        uint64_t remap_offset;
+        uint64_t records_offset;
+        uint32_t reserved;
+        uint32_t crc; // crc32c of the previous fields
+    };
+    static_assert(sizeof(header_type) == 80, "frozen_map: unexpected header size");
+    
+    static inline uint64_t mix(uint64_t x)
+    {
+        // splitmix64 finalizer: the hash values of the keys can be weak (std::hash is the identity on integers)
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+    
+    // x mapped to [0, n) (faster than x % n)
+    static inline uint64_t reduce(uint64_t x, uint64_t n)
+    {
+        return static_cast<uint64_t>((static_cast<unsigned __int128>(x) * n) >> 64);
+    }
+    
+    // bucket of a mixed hash value: as in PTHash, 60% of the keys go to 30% of the buckets,
+    // which are placed first, when most positions are free
+    static inline uint64_t bucket(uint64_t h, uint64_t bucket_count)
+    {
+        uint64_t dense = (bucket_count*3)/10;
+        
+        if (dense == 0) {
+            return reduce(h, bucket_count);
+        }
+        // the low order bits choose the group, the high order bits the bucket in the group
+        return (static_cast<uint32_t>(h) < 0x99999999U) ? reduce(h, dense) : dense + reduce(h, bucket_count - dense);
+    }
+    
+    // second hash value of a key, independent of its bucket
+    static inline uint64_t position_hash(uint64_t h)
+    {
+        return mix(h ^ 0x9E3779B97F4A7C15ULL);
+    }
+    
+    // position of a key with displacement d: the displacement is xored to the position hash of the key
+    static inline size_t position(uint64_t ph, uint64_t displacement_hash, uint64_t n)
+    {
+        return static_cast<size_t>(reduce(ph ^ displacement_hash, n));
+    }
+    
+    static inline size_t record_index(size_t hash, const header_type& header, const uint32_t* displacements, const uint64_t* remap)
+    {
+        uint64_t h = mix(static_cast<uint64_t>(hash) ^ header.seed);
+        size_t p = position(position_hash(h), mix(displacements[bucket(h, header.bucket_count)]), header.table_size);
+        
+        return (p < header.count) ? p : static_cast<size_t>(remap[p - header.count]);
+    }
+    
+    static bool valid_header(const header_type& header, size_t length)
+    {
+        return header.magic == kFrozenMapMagic && header.version == kFrozenMapFormatVersion && header.slot_size == sizeof(value_type)
+        && header.crc == crc32c(0, &header, offsetof(header_type, crc))
+        && header.bucket_count > 0 && header.table_size >= header.count
+        && header.index_offset + header.bucket_count*sizeof(uint32_t) <= header.remap_offset
+        && header.remap_offset + (header.table_size - header.count)*sizeof(uint64_t) <= header.records_offset
+        && header.records_offset + header.count*sizeof(value_type) <= length;
+    }
+    
+    // find a displacement for every bucket, the largest buckets first,
+    // and remap the positions past the last record to the unused records
+    static bool build_index(const std::vector<uint64_t>& hashes, const header_type& header, std::vector<uint32_t>& displacements, std::vector<uint64_t>& remap)
+    {
+        uint64_t n = header.table_size;
+        uint64_t seed = header.seed;
+        uint64_t bucket_count = header.bucket_count;
+        
+        displacements.assign(bucket_count, 0);
+        remap.assign(header.table_size - header.count, 0);
+        
+        if (header.count == 0) {
+            return true;
+        }
+        
+        // group the mixed hash values by bucket
+        std::vector<size_t> offsets(bucket_count + 1, 0);
+        std::vector<uint64_t> grouped(n);
+        
+        for (uint64_t h : hashes) {
+            offsets[bucket(mix(h ^ seed), bucket_count) + 1]++;
+        }
+        for (size_t b = 0; b < bucket_count; b++) {
+            offsets[b+1] += offsets[b];
+        }
+        {
+            std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+            
+            for (uint64_t h : hashes) {
+                uint64_t x = mix(h ^ seed);
+                grouped[fill[bucket(x, bucket_count)]++] = position_hash(x);
+            }
+        }
+        
+        // sort the buckets by decreasing size (counting sort)
+        size_t max_size = 0;
+        
+        for (size_t b = 0; b < bucket_count; b++) {
+            max_size = std::max(max_size, offsets[b+1] - offsets[b]);
+        }
+        
+        std::vector<size_t> size_offsets(max_size + 2, 0);
+        std::vector<size_t> order(bucket_count);
+        
+        for (size_t b = 0; b < bucket_count; b++) {
+            size_offsets[max_size - (offsets[b+1] - offsets[b]) + 1]++;
+        }
+        for (size_t s = 0; s <= max_size; s++) {
+            size_offsets[s+1] += size_offsets[s];
+        }
+        for (size_t b = 0; b < bucket_count; b++) {
+            order[size_offsets[max_size - (offsets[b+1] - offsets[b])]++] = b;
+        }
+        
+        std::vector<uint64_t> taken((n + 63)/64, 0);
+        std::vector<size_t> slots;
+        
+        for (size_t b : order) {
+            const uint64_t* first = grouped.data() + offsets[b];
+            const uint64_t* last = grouped.data() + offsets[b+1];
+            
+            if (first == last) {
+                break; // the remaining buckets are empty
+            }
+            
+            // equal hash values can never be separated
+            for (const uint64_t* p = first; p != last; ++p) {
+                for (const uint64_t* q = first; q != p; ++q) {
+                    if (*p == *q) {
+                        return false;
+                    }
+                }
+            }
+            
+            bool placed = false;
+            
+            for (uint64_t d = 0; d < std::numeric_limits<uint32_t>::max() && !placed; d++) {
+                uint64_t dh = mix(d);
+                slots.clear();
+                placed = true;
+                
+                for (const uint64_t* p = first; p != last && placed; ++p) {
+                    size_t s = position(*p, dh, n);
+                    
+                    if ((taken[s/64] & (1ULL << (s%64))) != 0 || std::find(slots.begin(), slots.end(), s) != slots.end()) {
+                        placed = false;
+                    }else{
+                        slots.push_back(s);
+                    }
+                }
+                
+                if (placed) {
+                    for (size_t s : slots) {
+                        taken[s/64] |= 1ULL << (s%64);
+                    }
+                    displacements[b] = static_cast<uint32_t>(d);
+                }
+            }
+            
+            if (!placed) {
+                return false;
+            }
+        }
+        
+        // there are as many used positions past the records as unused records
+        size_t unused = 0;
+        
+        for (size_t p = header.count; p < n; p++) {
+            if ((taken[p/64] & (1ULL << (p%64))) == 0) {
+                continue;
+            }
+            while ((taken[unused/64] & (1ULL << (unused%64))) != 0) {
+                unused++;
+            }
+            remap[p - header.count] = unused++;
+        }
+        return true;
+    }
+    
+    mmap_st mmap_;
+    header_type header_;
+    const uint32_t* displacements_;
+    const uint64_t* remap_;
+    const value_type* records_;
+    
+    hasher hf_;
+    key_equal eql_;
+};
+
+} // namespace ssdmap
@@ -0,0 +1,115 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include <array>
+#include <cstring>
+#include <functional>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** @file key_traits.hpp
+ * @brief Header that defines the default hash function and equality predicate of the keys of bucket_map and bucket_set.
+ *
+ *
+ */
+
+namespace ssdmap {
+
+/** @struct key_hash
+ *  @brief Default hash function of the keys.
+ *
+ *  This is std::hash<Key>, except for the fixed-size byte arrays.
+ *
+ *  @tparam Key Type of the keys.
+ */
+template <class Key>
+struct key_hash : public std::hash<Key>
+{
+};
+
+/** @struct key_equal_to
+ *  @brief Default equality predicate of the keys.
+ *
+ *  This is std::equal_to<Key>, except for the fixed-size byte arrays.
+ *
+ *  @tparam Key Type of the keys.
+ */
+template <class Key>
+struct key_equal_to : public std::equal_to<Key>
+{
+};
+
+/** @struct key_hash<std::array<uint8_t, N>>
+ *  @brief Hash function of the fixed-size byte keys.
+ *
+ *  The keys are expected to be uniformly random (cryptographic tokens, digests, ...): the hash value is simply made of their first 8 bytes, and no computation is done.
+ *  Do not use it on structured keys (counters, text, ...), as the buckets would be very unevenly loaded.
+ *
+ *  @tparam N   Size (in bytes) of the keys. It must be at least 8.
+ */
+template <size_t N>
+struct key_hash<std::array<uint8_t, N>>
+{
+    static_assert(N >= sizeof(size_t), "The byte keys must be at least as large as the hash values");
+
+    inline size_t operator()(const std::array<uint8_t, N>& key) const
+    {
+        size_t h;
+        memcpy(&h, key.data(), sizeof(size_t));
+        return h;
+    }
+};
+
+/** @struct key_equal_to<std::array<uint8_t, N>>
+ *  @brief Equality predicate of the fixed-size byte keys.
+ *
+ *  Compares 16 bytes at a time with SSE2 when N is a multiple of 16, and uses memcmp() otherwise (with a constant size, the compiler inlines it).
+ *
+ *  @tparam N   Size (in bytes) of the keys.
+ */
+template <size_t N>
+struct key_equal_to<std::array<uint8_t, N>>
+{
+    inline bool operator()(const std::array<uint8_t, N>& a, const std::array<uint8_t, N>& b) const
+    {
+#ifdef __SSE2__
+        if (N % 16 == 0) {
+            __m128i diff = _mm_setzero_si128();
+
+            for (size_t i = 0; i < N; i += 16) {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a.data() + i));
+                __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b.data() + i));
+                diff = _mm_or_si128(diff, _mm_xor_si128(x, y));
+            }
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF;
+        }
+#endif
+        return memcmp(a.data(), b.data(), N) == 0;
+    }
+};
+
+} // namespace ssdmap
@@ -18,10 +18,14 @@
  */
 
 
+// fallocate()
+#define _GNU_SOURCE
+
 #include "mmap_util.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -31,27 +35,24 @@
 
 #include <errno.h>
 
-mmap_st create_mmap(const char *pathname, size_t length)
+static int open_stretched_file(const char *pathname, size_t length)
 {
     off_t result;
-    mmap_st map;
-    
-    map.length = 0;
-    map.mmap_addr = NULL;
+    int fd;
     
     if (length == 0) {
         perror("Invalid length");
         exit(EXIT_FAILURE);
     }
-    map.fd = open(pathname, O_RDWR | O_CREAT, (mode_t)0600); // permissions set to rw-----
-    if (map.fd == -1) {
+    fd = open(pathname, O_RDWR | O_CREAT, (mode_t)0600); // permissions set to rw-----
+    if (fd == -1) {
         perror("Error opening file for writing");
         exit(EXIT_FAILURE);
     }
 
-    result = lseek(map.fd, length-1, SEEK_SET);
+    result = lseek(fd, length-1, SEEK_SET);
     if (result == -1) {
-        close(map.fd);
+        close(fd);
         perror("Error calling lseek() to 'stretch' the file");
         exit(EXIT_FAILURE);
     }
@@ -60,19 +61,31 @@ mmap_st create_mmap(const char *pathname, size_t length)
     // stretch the file if needed
     char buf[1]="";
     
-    result = read(map.fd, buf,1);
+    result = read(fd, buf,1);
     if (result != 1) {
         // the file was not streched
 //        printf("Stretch!\n");
 
-        result = write(map.fd, buf, 1);
+        result = write(fd, buf, 1);
         if (result != 1) {
-            close(map.fd);
+            close(fd);
             perror("Error writing last byte of the file");
             exit(EXIT_FAILURE);
         }
     }
+    
+    return fd;
+}
 
+mmap_st create_mmap(const char *pathname, size_t length)
+{
+    mmap_st map;
+    
+    map.length = 0;
+    map.reserved_length = 0;
+    map.mmap_addr = NULL;
+    
+    map.fd = open_stretched_file(pathname, length);
     
     // mmap the file
     map.mmap_addr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, map.fd, 0);
@@ -89,10 +102,189 @@ mmap_st create_mmap(const char *pathname, size_t length)
     }
     
     map.length = length;
+    map.reserved_length = length;
 
     return map;
 }
 
+mmap_st open_readonly_mmap(const char *pathname, size_t length)
+{
+    mmap_st map;
+    struct stat st;
+    void *addr;
+    
+    map.length = 0;
+    map.reserved_length = 0;
+    map.mmap_addr = NULL;
+    
+    if (length == 0) {
+        map.fd = -1;
+        return map;
+    }
+    
+    map.fd = open(pathname, O_RDONLY);
+    if (map.fd == -1) {
+        return map;
+    }
+    
+    // the file is not stretched: it must already be long enough
+    if (fstat(map.fd, &st) == -1 || (size_t)st.st_size < length) {
+        close(map.fd);
+        map.fd = -1;
+        return map;
+    }
+    
+    addr = mmap(0, length, PROT_READ, MAP_SHARED, map.fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error mmapping the file");
+        close(map.fd);
+        map.fd = -1;
+        return map;
+    }
+    
+    // we will use random access in our use case
+    if(madvise(addr, length, MADV_RANDOM) == -1)
+    {
+        printf("Bad advice ...\n");
+    }
+    
+    map.mmap_addr = addr;
+    map.length = length;
+    map.reserved_length = length;
+    
+    return map;
+}
+
+static void* reserve_address_space(size_t length)
+{
+    // PROT_NONE and MAP_NORESERVE: nothing is committed, we only take the address range
+    void *addr = mmap(0, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    
+    if (addr == MAP_FAILED) {
+        perror("Error reserving the address space");
+        return NULL;
+    }
+    return addr;
+}
+
+static int map_file_range(void *reservation, int fd, size_t offset, size_t length)
+{
+    // the offset of a mapping must be aligned on the system's page size
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page_size-1);
+    
+    void *addr = mmap((char*)reservation + start, length - start, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, start);
+    
+    if (addr == MAP_FAILED) {
+        perror("Error mmapping the file");
+        return -1;
+    }
+    
+    // we will use random access in our use case
+    if(madvise(addr, length - start, MADV_RANDOM) == -1)
+    {
+        printf("Bad advice ...\n");
+    }
+    return 0;
+}
+
+mmap_st create_reserved_mmap(const char *pathname, size_t length, size_t reserved_length)
+{
+    mmap_st map;
+    
+    map.length = 0;
+    map.reserved_length = 0;
+    map.mmap_addr = NULL;
+    
+    if (reserved_length < length) {
+        reserved_length = length;
+    }
+    
+    map.fd = open_stretched_file(pathname, length);
+    
+    map.mmap_addr = reserve_address_space(reserved_length);
+    if (map.mmap_addr == NULL) {
+        close(map.fd);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (map_file_range(map.mmap_addr, map.fd, 0, length) != 0) {
+        munmap(map.mmap_addr, reserved_length);
+        close(map.fd);
+        exit(EXIT_FAILURE);
+    }
+    
+    map.length = length;
+    map.reserved_length = reserved_length;
+    
+    return map;
+}
+
+int extend_mmap(mmap_st *map, size_t new_length)
+{
+    return extend_mmap_retaining(map, new_length, NULL);
+}
+
+int extend_mmap_retaining(mmap_st *map, size_t new_length, mmap_st *retired)
+{
+    struct stat st;
+    
+    if (retired != NULL) {
+        retired->mmap_addr = NULL;
+        retired->length = 0;
+        retired->reserved_length = 0;
+        retired->fd = -1;
+    }
+    
+    if (new_length <= map->length) {
+        return 0;
+    }
+    
+    // stretch the file
+    if (fstat(map->fd, &st) == -1) {
+        perror("Error reading the file size");
+        return -1;
+    }
+    if ((size_t)st.st_size < new_length && ftruncate(map->fd, (off_t)new_length) == -1) {
+        perror("Error calling ftruncate() to 'stretch' the file");
+        return -1;
+    }
+    
+    if (new_length <= map->reserved_length) {
+        // map the new range right after the current one
+        if (map_file_range(map->mmap_addr, map->fd, map->length, new_length) != 0) {
+            return -1;
+        }
+    }else{
+        // the reservation is exhausted: move to a new one
+        size_t reserved_length = 2*new_length;
+        void *reservation = reserve_address_space(reserved_length);
+        
+        if (reservation == NULL) {
+            return -1;
+        }
+        if (map_file_range(reservation, map->fd, 0, new_length) != 0) {
+            munmap(reservation, reserved_length);
+            return -1;
+        }
+        
+        if (retired == NULL) {
+            munmap(map->mmap_addr, map->reserved_length);
+        }else{
+            // the old mapping stays valid until the caller closes it
+            *retired = *map;
+            retired->fd = dup(map->fd);
+        }
+        
+        map->mmap_addr = reservation;
+        map->reserved_length = reserved_length;
+    }
+    
+    map->length = new_length;
+    
+    return 0;
+}
+
 int flush_mmap(mmap_st map, flush_flag sync_flag)
 {
     int ret;
@@ -106,12 +298,122 @@ int flush_mmap(mmap_st map, flush_flag sync_flag)
     return ret;
 }
 
+int flush_mmap_range(mmap_st map, size_t offset, size_t length, flush_flag sync_flag)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page_size-1);
+    size_t end = offset + length;
+    int ret;
+    
+    if (end > map.length) {
+        end = map.length;
+    }
+    if (start >= end) {
+        return 0;
+    }
+    
+    ret = msync((char*)map.mmap_addr + start, end - start, ((sync_flag == ASYNC_FLAG) ? MS_ASYNC : MS_SYNC));
+    
+    if (ret == -1) {
+        perror("Error syncing the map.");
+    }
+    
+    return ret;
+}
+
+int advise_mmap(mmap_st map, size_t offset, size_t length, advice_flag advice)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page_size-1);
+    size_t end = offset + length;
+    int flag;
+    
+    if (end > map.length) {
+        end = map.length;
+    }
+    if (start >= end) {
+        return 0;
+    }
+    
+    switch (advice) {
+        case SEQUENTIAL_ADVICE: flag = MADV_SEQUENTIAL; break;
+        case WILLNEED_ADVICE:   flag = MADV_WILLNEED; break;
+        default:                flag = MADV_RANDOM;
+    }
+    
+    if (madvise((char*)map.mmap_addr + start, end - start, flag) == -1) {
+        perror("Error advising the map.");
+        return -1;
+    }
+    return 0;
+}
+
+int preallocate_mmap(mmap_st map, size_t offset, size_t length)
+{
+    size_t end = offset + length;
+    int ret;
+    
+    if (end > map.length) {
+        end = map.length;
+    }
+    if (offset >= end) {
+        return 0;
+    }
+    
+#ifdef __linux__
+    if (fallocate(map.fd, 0, (off_t)offset, (off_t)(end - offset)) == 0) {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP) {
+        return -1;
+    }
+#endif
+    // posix_fallocate returns the error number instead of setting errno
+    ret = posix_fallocate(map.fd, (off_t)offset, (off_t)(end - offset));
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+int populate_mmap(mmap_st map, size_t offset, size_t length)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page_size-1);
+    size_t end = offset + length;
+    size_t p;
+    
+    if (end > map.length) {
+        end = map.length;
+    }
+    if (start >= end) {
+        return 0;
+    }
+    
+#ifdef MADV_POPULATE_WRITE
+    if (madvise((char*)map.mmap_addr + start, end - start, MADV_POPULATE_WRITE) == 0) {
+        return 0;
+    }
+#endif
+    // write fault every page without changing its content
+    for (p = start; p < end; p += page_size) {
+        __atomic_fetch_or((uint64_t*)((char*)map.mmap_addr + p), (uint64_t)0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
 int close_mmap(mmap_st map)
 {
     int ret = 0;
     size_t offset = 0;
     size_t step = 1 << 30; // 1 GB step
     
+    // also release the unused part of the reservation
+    if (map.reserved_length > map.length) {
+        map.length = map.reserved_length;
+    }
+    
     for (; offset < map.length; offset += step) {
         if (map.length - offset >= step) {
             if (munmap(map.mmap_addr+offset, step) == -1) {
@@ -44,6 +44,7 @@ typedef struct
 {
     void *mmap_addr;    /**< @brief The mapped memory adress    */
     size_t length;      /**< @brief The number of mapped bytes  */
+    size_t reserved_length; /**< @brief The size of the address space reserved for the map (at least length) */
     int fd;             /**< @brief The file descriptor of the mapped file */
 }mmap_st;
 
@@ -62,6 +63,62 @@ typedef struct
  */
 mmap_st create_mmap(const char *pathname, size_t length);
 
+/**
+ *  @brief Map an existing file for reading only
+ *
+ *  Opens the file at path @a pathname read-only (O_RDONLY), and maps its first @a length bytes with PROT_READ and MAP_SHARED: the processes mapping the same file share the same pages of the page cache, and see the changes made by a writer process.
+ *  The file is neither created nor stretched.
+ *
+ *  @param pathname The path of the mapped file.
+ *  @param length   Size (in bytes) of the mapped memory. @a length must be stricly larger than 0, or the function will fail.
+ *
+ *  @return A mmap_st structure representing the memory map. Contrary to create_mmap(), this function does not exit on failure: if the file does not exist, is shorter than @a length, or cannot be mapped, the mmap_addr field of the return value is set to NULL, and its length to 0.
+ */
+mmap_st open_readonly_mmap(const char *pathname, size_t length);
+
+/**
+ *  @brief Initialize a new memory map in a larger address space reservation
+ *
+ *  Reserves @a reserved_length bytes of address space (without committing any memory), and maps the first @a length bytes of the file at path @a pathname at the beginning of the reservation.
+ *  The file is created and stretched as in create_mmap().
+ *  The map can then be grown in place using extend_mmap().
+ *
+ *  @param pathname         The path of the mapped file.
+ *  @param length           Size (in bytes) of the mapped memory. @a length must be stricly larger than 0, or the function will fail.
+ *  @param reserved_length  Size (in bytes) of the address space reservation. If it is smaller than @a length, @a length bytes are reserved.
+ *
+ *  @return A mmap_st structure representing the memory map. If the function failed, the mmap_addr field of the return value will be set to NULL, and its length to 0.
+ */
+mmap_st create_reserved_mmap(const char *pathname, size_t length, size_t reserved_length);
+
+/**
+ *  @brief Grow a memory map
+ *
+ *  Extends the mapped file and the memory map to @a new_length bytes.
+ *  If the map's reservation is large enough, the new pages are mapped right after the existing ones, and the map does not move.
+ *  Otherwise, a new reservation of twice the size is made, the whole file is mapped there, and the mmap_addr field of @a map is updated.
+ *
+ *  @param  map         A pointer to the mmap_st structure representing the memory map.
+ *  @param  new_length  The new size (in bytes) of the map. Nothing is done if it is not larger than the current length.
+ *
+ *  @return zero on success, -1 on error.
+ */
+int extend_mmap(mmap_st *map, size_t new_length);
+
+/**
+ *  @brief Grow a memory map, keeping the old mapping if the map moves
+ *
+ *  Same as extend_mmap(), but when the map has to move to a new reservation, the old mapping is not unmapped: it is described by @a retired (with its own file descriptor), and still reads the pages of the file until it is closed with close_mmap().
+ *  If the map does not move, the mmap_addr field of @a retired is set to NULL.
+ *
+ *  @param  map         A pointer to the mmap_st structure representing the memory map.
+ *  @param  new_length  The new size (in bytes) of the map. Nothing is done if it is not larger than the current length.
+ *  @param  retired     Set to the old mapping if the map moved. If it is NULL, the old mapping is unmapped, as with extend_mmap().
+ *
+ *  @return zero on success, -1 on error.
+ */
+int extend_mmap_retaining(mmap_st *map, size_t new_length, mmap_st *retired);
+
 /**
  *  @brief Arguments flags for the flush_mmap function
  *
@@ -82,6 +139,74 @@ typedef enum{
 int flush_mmap(mmap_st map, flush_flag sync_flag);
     
     
+/**
+ *  @brief Flush the changes made to a range of the memory map to the mapped file.
+ *
+ *  The range is extended to the system's page boundaries, and clamped to the mapped length.
+ *
+ *  @param  map         The mmap_st structure representing a memory map.
+ *  @param  offset      The offset (in bytes) of the range in the map.
+ *  @param  length      The length (in bytes) of the range.
+ *  @param  sync_flag   One of the flags specified by the flush_flag enum.
+ *
+ *  @return zero on success, -1 on error, and errno is set appropriately according to msync(2).
+ */
+int flush_mmap_range(mmap_st map, size_t offset, size_t length, flush_flag sync_flag);
+
+/**
+ *  @brief Arguments flags for the advise_mmap function
+ *
+ */
+typedef enum{
+    RANDOM_ADVICE = 0,      /**< @brief Expect page references in random order (the default for the maps created by this library). */
+    SEQUENTIAL_ADVICE = 1,  /**< @brief Expect page references in sequential order: the kernel reads ahead aggressively and frees the pages soon after they are accessed. */
+    WILLNEED_ADVICE = 2     /**< @brief Expect access in the near future: the kernel starts reading the pages in the background. */
+} advice_flag;
+
+/**
+ *  @brief Give advice about the use of a range of a memory map.
+ *
+ *  The range is extended to the system's page boundaries, and clamped to the mapped length.
+ *
+ *  @param  map         The mmap_st structure representing a memory map.
+ *  @param  offset      The offset (in bytes) of the range in the map.
+ *  @param  length      The length (in bytes) of the range.
+ *  @param  advice      One of the flags specified by the advice_flag enum.
+ *
+ *  @return zero on success, -1 on error, and errno is set appropriately according to madvise(2).
+ */
+int advise_mmap(mmap_st map, size_t offset, size_t length, advice_flag advice);
+
+/**
+ *  @brief Allocate the disk blocks of a range of the mapped file.
+ *
+ *  The files are stretched without writing to them, so their pages have no blocks until they are first written.
+ *  This function allocates the blocks (as unwritten extents, that read as zeros) so that the first write to a page does not have to allocate it.
+ *  The range is clamped to the mapped length.
+ *
+ *  @param  map         The mmap_st structure representing a memory map.
+ *  @param  offset      The offset (in bytes) of the range in the map.
+ *  @param  length      The length (in bytes) of the range.
+ *
+ *  @return zero on success, -1 on error, and errno is set appropriately according to fallocate(2) (or posix_fallocate(3) on systems without fallocate).
+ */
+int preallocate_mmap(mmap_st map, size_t offset, size_t length);
+
+/**
+ *  @brief Fault in the pages of a range of a memory map, for writing.
+ *
+ *  After this call, the first write to a page of the range does not page fault.
+ *  The content of the pages is not modified: on kernels without MADV_POPULATE_WRITE, every page is touched with an atomic no-op (a fetch-or with zero), so the function can run concurrently with writes to the same pages.
+ *  The range is extended to the system's page boundaries, and clamped to the mapped length.
+ *
+ *  @param  map         The mmap_st structure representing a memory map.
+ *  @param  offset      The offset (in bytes) of the range in the map.
+ *  @param  length      The length (in bytes) of the range.
+ *
+ *  @return zero on success.
+ */
+int populate_mmap(mmap_st map, size_t offset, size_t length);
+
 /**
  *  @brief Close a memory map.
  *
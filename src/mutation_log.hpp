@@ -0,0 +1,649 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#pragma once
+
+#include "checksum.h"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/** @file mutation_log.hpp
+ * @brief Header that defines the mutation_log class, a stream of the mutations of a map, and the log_follower class, that applies it to another map.
+ *
+ */
+
+namespace ssdmap {
+
+constexpr size_t kMutationLogSegmentSize = 1 << 26; /**< @brief Default maximum size (in bytes) of a segment of a mutation log. */
+constexpr size_t kMutationLogBufferSize = 1 << 16; /**< @brief Size (in bytes) of the buffer of the records not yet written to the segment. */
+constexpr size_t kLogFollowerBatchSize = 1 << 14; /**< @brief Default maximum number of records applied by a call to log_follower::poll(). */
+constexpr uint64_t kMutationLogMagic = 0x31474f4c50414d53ULL; /**< @brief First bytes of a segment ("SMAPLOG1"). */
+
+/**
+ *  @brief Type of a record of a mutation log.
+ *
+ */
+enum mutation_type : uint32_t {
+    kAddMutation = 0,       /**< @brief An element was added (bucket_map::insert(), bucket_map::add(), and the batched versions). */
+    kUpdateMutation = 1     /**< @brief The mapped value of an element was modified through bucket_map::at(). */
+};
+
+/**
+ *  @brief Parameters of a mutation log.
+ *
+ */
+struct mutation_log_options
+{
+    size_t segment_size;    /**< @brief Maximum size (in bytes) of a segment: a new segment is started when the current one is full. Defaults to kMutationLogSegmentSize. */
+    size_t max_segments;    /**< @brief Maximum number of segments kept: the oldest segment is deleted when a new one exceeds this number, or 0 to keep all of them. Defaults to 0. */
+    
+    mutation_log_options()
+    : segment_size(kMutationLogSegmentSize), max_segments(0)
+    {}
+};
+
+/** @class mutation_log
+ *  @brief An ordered stream of mutations, written to rotating segment files.
+ *
+ *  Every mutation is a fixed-size record holding its sequence number, its type, the element, and a CRC-32C of the three.
+ *  The records are appended to the current segment of the log directory, a file named after the sequence number of its first record.
+ *  They are buffered, and only visible to the readers once written by sync() (or when the buffer is full).
+ *
+ *  When a log is reopened, the records torn by a crash at the end of its last segment are discarded, and the sequence numbers continue after the last complete record.
+ *
+ *  @tparam T   The type of the elements. It must be trivially copyable.
+ */
+template <class T>
+class mutation_log
+{
+public:
+    /**
+     *  @brief Size (in bytes) of a record.
+     */
+    static constexpr size_t kRecordSize = 2*sizeof(uint64_t) + sizeof(T);
+
+    /**
+     *  @brief Constructor
+     *
+     *  Opens the log stored in @a directory (created if needed), and positions it after its last complete record.
+     *  A last segment left without its header by a crash is created again.
+     *
+     *  @param directory    The directory of the segments.
+     *  @param options      The size and the number of the segments.
+     *
+     *  @exception std::runtime_error The directory or the last segment cannot be opened, or the segments store elements of a different size.
+     */
+    mutation_log(const std::string& directory, const mutation_log_options& options = mutation_log_options())
+    : directory_(directory), options_(options), fd_(-1), segment_first_(0), segment_records_(0), next_sequence_(0)
+    {
+        struct stat buffer;
+        
+        if (stat(directory_.data(), &buffer) != 0 && mkdir(directory_.data(), (mode_t)0700) != 0) {
+            throw std::runtime_error("mutation_log: unable to create the directory " + directory_);
+        }
+        
+        buffer_.reserve(kMutationLogBufferSize);
+        
+        std::vector<uint64_t> segments = list_segments(directory_);
+        
+        if (segments.empty()) {
+            open_segment(0);
+        }else{
+            reopen_segment(segments.back());
+        }
+    }
+    
+    /**
+     *  @brief Destructor
+     *
+     *  Writes the buffered records, and closes the current segment.
+     */
+    ~mutation_log()
+    {
+        try {
+            sync(false);
+        } catch (std::runtime_error &e) {
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+    
+    mutation_log(const mutation_log&) = delete;
+    mutation_log& operator=(const mutation_log&) = delete;
+    
+    /**
+     *  @brief Append a record
+     *
+     *  @param type The type of the mutation.
+     *  @param v    The element added or modified.
+     *
+     *  @return The sequence number of the record.
+     *
+     *  @exception std::runtime_error A segment cannot be written.
+     */
+    uint64_t append(mutation_type type, const T& v)
+    {
+        if (segment_records_ > 0 && kSegmentHeaderSize + (segment_records_+1)*kRecordSize > options_.segment_size) {
+            sync(false);
+            close(fd_);
+            fd_ = -1;
+            open_segment(next_sequence_);
+        }
+        
+        size_t offset = buffer_.size();
+        buffer_.resize(offset + kRecordSize);
+        encode_record(&buffer_[offset], next_sequence_, type, v);
+        segment_records_++;
+        
+        if (buffer_.size() + kRecordSize > kMutationLogBufferSize) {
+            write_buffer();
+        }
+        return next_sequence_++;
+    }
+    
+    /**
+     *  @brief Write the buffered records to the current segment.
+     *
+     *  @param durable  If true, the segment is also synced to the disk (fdatasync).
+     *
+     *  @exception std::runtime_error The segment cannot be written.
+     */
+    void sync(bool durable)
+    {
+        write_buffer();
+        
+        if (durable && fdatasync(fd_) != 0) {
+            throw std::runtime_error("mutation_log: unable to sync " + segment_path(directory_, segment_first_));
+        }
+    }
+    
+    /**
+     *  @brief Return the sequence number of the next record.
+     */
+    inline uint64_t next_sequence() const
+    {
+        return next_sequence_;
+    }
+    
+    /**
+     *  @brief Return the path of the segment whose first record has sequence number @a first.
+     */
+    static std::string segment_path(const std::string& directory, uint64_t first)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.log", static_cast<unsigned long long>(first));
+        return directory + "/" + name;
+    }
+    
+    /**
+     *  @brief Return the sequence numbers of the first records of the segments of a log, in increasing order.
+     */
+    static std::vector<uint64_t> list_segments(const std::string& directory)
+    {
+        std::vector<uint64_t> segments;
+        DIR* dir = opendir(directory.data());
+        
+        if (dir == NULL) {
+            return segments;
+        }
+        
+        for (struct dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+            unsigned long long first;
+            char suffix[8];
+            
+            if (strlen(entry->d_name) == 24 && sscanf(entry->d_name, "%20llu.%3s", &first, suffix) == 2 && strcmp(suffix, "log") == 0) {
+                segments.push_back(first);
+            }
+        }
+        closedir(dir);
+        
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+    
+    /**
+     *  @brief Check the header of a segment
+     *
+     *  @param fd       The file descriptor of the segment.
+     *  @param first    The sequence number of the first record of the segment.
+     *
+     *  @return True if the header is valid, and the segment stores records of this type.
+     */
+    static bool check_segment_header(int fd, uint64_t first)
+    {
+        segment_header h;
+        
+        if (pread(fd, &h, sizeof(segment_header), 0) != static_cast<ssize_t>(sizeof(segment_header))) {
+            return false;
+        }
+        return h.magic == kMutationLogMagic && h.record_size == kRecordSize && h.first == first
+        && h.crc == crc32c(0, &h, offsetof(segment_header, crc));
+    }
+    
+    /**
+     *  @brief Decode a record
+     *
+     *  @param p        The address of the record.
+     *  @param sequence Set to the sequence number of the record.
+     *  @param type     Set to the type of the record.
+     *  @param v        Set to the element of the record.
+     *
+     *  @return True if the checksum of the record is valid.
+     */
+    static bool decode_record(const unsigned char* p, uint64_t& sequence, mutation_type& type, T& v)
+    {
+        uint32_t fields[2];
+        
+        memcpy(&sequence, p, sizeof(uint64_t));
+        memcpy(fields, p + sizeof(uint64_t), sizeof(fields));
+        
+        uint32_t crc = crc32c(0, p, sizeof(uint64_t) + sizeof(uint32_t));
+        crc = crc32c(crc, p + 2*sizeof(uint64_t), sizeof(T));
+        
+        if (crc != fields[1]) {
+            return false;
+        }
+        type = static_cast<mutation_type>(fields[0]);
+        memcpy(static_cast<void*>(&v), p + 2*sizeof(uint64_t), sizeof(T));
+        return true;
+    }
+    
+    /**
+     *  @brief Size (in bytes) of the header of a segment.
+     */
+    static constexpr size_t kSegmentHeaderSize = 32;
+
+private:
+    typedef struct
+    {
+        uint64_t magic;
+        uint64_t first;         // sequence number of the first record
+        uint32_t record_size;
+        uint32_t crc;           // of the preceding fields
+        uint64_t reserved;
+    } segment_header;
+    
+    static_assert(sizeof(segment_header) == kSegmentHeaderSize, "Invalid segment header size");
+    
+    static void encode_record(unsigned char* p, uint64_t sequence, mutation_type type, const T& v)
+    {
+        uint32_t fields[2] = {type, 0};
+        
+        memcpy(p, &sequence, sizeof(uint64_t));
+        memcpy(p + sizeof(uint64_t), fields, sizeof(fields));
+        memcpy(p + 2*sizeof(uint64_t), static_cast<const void*>(&v), sizeof(T));
+        
+        // the checksum covers everything but itself
+        fields[1] = crc32c(0, p, sizeof(uint64_t) + sizeof(uint32_t));
+        fields[1] = crc32c(fields[1], p + 2*sizeof(uint64_t), sizeof(T));
+        memcpy(p + sizeof(uint64_t), fields, sizeof(fields));
+    }
+    
+    // create an empty segment, and return its file descriptor
+    // the header is written to a temporary file renamed into place: the segment never appears without it
+    int create_segment(uint64_t first) const
+    {
+        std::string path = segment_path(directory_, first);
+        std::string temp_path = path + ".tmp";
+        
+        int fd = open(temp_path.data(), O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
+        
+        if (fd < 0) {
+            throw std::runtime_error("mutation_log: unable to create " + path);
+        }
+        
+        segment_header h;
+        memset(&h, 0, sizeof(segment_header));
+        h.magic = kMutationLogMagic;
+        h.first = first;
+        h.record_size = kRecordSize;
+        h.crc = crc32c(0, &h, offsetof(segment_header, crc));
+        
+        if (pwrite(fd, &h, sizeof(segment_header), 0) != static_cast<ssize_t>(sizeof(segment_header)) || rename(temp_path.data(), path.data()) != 0) {
+            close(fd);
+            remove(temp_path.data());
+            throw std::runtime_error("mutation_log: unable to write " + path);
+        }
+        return fd;
+    }
+    
+    // a segment left short or with a torn header by a crash, before it had any record
+    static bool is_torn_segment(int fd, size_t size)
+    {
+        segment_header h;
+        
+        if (size < kSegmentHeaderSize) {
+            return true;
+        }
+        if (size > kSegmentHeaderSize || pread(fd, &h, sizeof(segment_header), 0) != static_cast<ssize_t>(sizeof(segment_header))) {
+            return false;
+        }
+        return h.magic != kMutationLogMagic || h.crc != crc32c(0, &h, offsetof(segment_header, crc));
+    }
+    
+    // start a new segment, and delete the oldest ones
+    void open_segment(uint64_t first)
+    {
+        fd_ = create_segment(first);
+        
+        segment_first_ = first;
+        segment_records_ = 0;
+        next_sequence_ = first;
+        
+        if (options_.max_segments > 0) {
+            std::vector<uint64_t> segments = list_segments(directory_);
+            
+            for (size_t i = 0; i + options_.max_segments < segments.size(); i++) {
+                remove(segment_path(directory_, segments[i]).data());
+            }
+        }
+    }
+    
+    // continue the last segment, after its last complete record
+    void reopen_segment(uint64_t first)
+    {
+        std::string path = segment_path(directory_, first);
+        struct stat buffer;
+        
+        fd_ = open(path.data(), O_RDWR);
+        
+        if (fd_ < 0 || fstat(fd_, &buffer) != 0) {
+            throw std::runtime_error("mutation_log: " + path + " is not a valid segment");
+        }
+        if (!check_segment_header(fd_, first)) {
+            if (!is_torn_segment(fd_, static_cast<size_t>(buffer.st_size))) {
+                throw std::runtime_error("mutation_log: " + path + " is not a valid segment");
+            }
+            
+            // a crash left the segment without its header, before its first record: create it again
+            close(fd_);
+            fd_ = create_segment(first);
+            buffer.st_size = kSegmentHeaderSize;
+        }
+        
+        size_t count = (static_cast<size_t>(buffer.st_size) - kSegmentHeaderSize)/kRecordSize;
+        std::vector<unsigned char> records(count*kRecordSize);
+        
+        if (count > 0 && pread(fd_, records.data(), records.size(), kSegmentHeaderSize) != static_cast<ssize_t>(records.size())) {
+            throw std::runtime_error("mutation_log: unable to read " + path);
+        }
+        
+        size_t valid = 0;
+        
+        for (; valid < count; valid++) {
+            uint64_t sequence;
+            mutation_type type;
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type v;
+            
+            if (!decode_record(&records[valid*kRecordSize], sequence, type, *reinterpret_cast<T*>(&v)) || sequence != first + valid) {
+                break;
+            }
+        }
+        
+        // drop the torn records
+        if (ftruncate(fd_, kSegmentHeaderSize + valid*kRecordSize) != 0) {
+            throw std::runtime_error("mutation_log: unable to truncate " + path);
+        }
+        
+        segment_first_ = first;
+        segment_records_ = valid;
+        next_sequence_ = first + valid;
+    }
+    
+    void write_buffer()
+    {
+        if (buffer_.empty()) {
+            return;
+        }
+        
+        size_t offset = kSegmentHeaderSize + (segment_records_*kRecordSize - buffer_.size());
+        const unsigned char* p = buffer_.data();
+        size_t length = buffer_.size();
+        
+        while (length > 0) {
+            ssize_t r = pwrite(fd_, p, length, offset);
+            
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                throw std::runtime_error("mutation_log: unable to write " + segment_path(directory_, segment_first_));
+            }
+            p += r;
+            length -= r;
+            offset += r;
+        }
+        buffer_.clear();
+    }
+    
+    std::string directory_;
+    mutation_log_options options_;
+    
+    int fd_;
+    uint64_t segment_first_;    // sequence number of the first record of the current segment
+    size_t segment_records_;    // number of records of the current segment, buffered ones included
+    uint64_t next_sequence_;
+    
+    std::vector<unsigned char> buffer_;
+};
+
+/** @class log_follower
+ *  @brief Tail a mutation log, and apply its records to a map.
+ *
+ *  The follower reads the records written to the segments of a log (possibly by another process), from a given sequence number, and applies them to its map: the added elements are inserted in batches with insert_batch(), and the updates replace the mapped value of the element with the same key.
+ *  Applying the whole log of a map to an empty map with the same options, or the log following an export to the map the export was imported into (see bucket_map::mutation_log_sequence()), yields a map with the same content.
+ *
+ *  The position of the follower is not stored: a replica that restarts has to give the sequence number it reached (next_sequence()) to the constructor.
+ *
+ *  @tparam Map The type of the map, an instance of bucket_map.
+ */
+template <class Map>
+class log_follower
+{
+public:
+    typedef typename Map::value_type    value_type;
+    typedef mutation_log<value_type>    log_type;
+    
+    /**
+     *  @brief Constructor
+     *
+     *  @param map              The map the records are applied to.
+     *  @param directory        The directory of the log.
+     *  @param next_sequence    The sequence number of the first record to apply.
+     */
+    log_follower(Map& map, const std::string& directory, uint64_t next_sequence = 0)
+    : map_(map), directory_(directory), next_sequence_(next_sequence), fd_(-1), segment_first_(0)
+    {
+    }
+    
+    ~log_follower()
+    {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+    
+    log_follower(const log_follower&) = delete;
+    log_follower& operator=(const log_follower&) = delete;
+    
+    /**
+     *  @brief Apply the next records
+     *
+     *  Reads up to @a max_records of the records written to the log since the last call, and applies them to the map.
+     *  A record torn by a concurrent write ends the batch: it is read again by the next call.
+     *
+     *  @param max_records  The maximum number of records to apply.
+     *
+     *  @return The number of applied records (0 if the follower reached the end of the log).
+     *
+     *  @exception std::runtime_error The segment holding the next record was deleted, or a segment is corrupted.
+     */
+    size_t poll(size_t max_records = kLogFollowerBatchSize)
+    {
+        if (!open_next_segment()) {
+            return 0;
+        }
+        
+        struct stat buffer;
+        
+        if (fstat(fd_, &buffer) != 0) {
+            throw std::runtime_error("log_follower: unable to read " + log_type::segment_path(directory_, segment_first_));
+        }
+        
+        size_t available = (static_cast<size_t>(buffer.st_size) - log_type::kSegmentHeaderSize)/log_type::kRecordSize;
+        size_t position = next_sequence_ - segment_first_;
+        
+        if (available <= position) {
+            // the end of this segment: the log may continue in the next one
+            if (has_next_segment()) {
+                close(fd_);
+                fd_ = -1;
+                return poll(max_records);
+            }
+            return 0;
+        }
+        
+        size_t count = std::min(max_records, available - position);
+        std::vector<unsigned char> records(count*log_type::kRecordSize);
+        ssize_t r = pread(fd_, records.data(), records.size(), log_type::kSegmentHeaderSize + position*log_type::kRecordSize);
+        
+        count = (r > 0) ? static_cast<size_t>(r)/log_type::kRecordSize : 0;
+        
+        std::vector<value_type> batch;
+        size_t applied = 0;
+        
+        for (; applied < count; applied++) {
+            uint64_t sequence;
+            mutation_type type;
+            typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type storage;
+            value_type& v = *reinterpret_cast<value_type*>(&storage);
+            
+            if (!log_type::decode_record(&records[applied*log_type::kRecordSize], sequence, type, v) || sequence != next_sequence_ + applied) {
+                if (has_next_segment()) {
+                    throw std::runtime_error("log_follower: " + log_type::segment_path(directory_, segment_first_) + " is corrupted");
+                }
+                break; // not completely written yet
+            }
+            
+            if (type == kAddMutation) {
+                batch.push_back(v);
+                continue;
+            }
+            
+            // the elements added before must be there
+            map_.insert_batch(batch.begin(), batch.end());
+            batch.clear();
+            map_.apply_logged_update(v);
+        }
+        map_.insert_batch(batch.begin(), batch.end());
+        
+        next_sequence_ += applied;
+        return applied;
+    }
+    
+    /**
+     *  @brief Apply all the records written so far.
+     *
+     *  @return The number of applied records.
+     */
+    size_t catch_up()
+    {
+        size_t total = 0;
+        
+        for (size_t n = poll(); n > 0; n = poll()) {
+            total += n;
+        }
+        return total;
+    }
+    
+    /**
+     *  @brief Return the sequence number of the next record to apply.
+     */
+    inline uint64_t next_sequence() const
+    {
+        return next_sequence_;
+    }
+
+private:
+    // open the segment holding the next record, if it exists
+    bool open_next_segment()
+    {
+        if (fd_ >= 0) {
+            return true;
+        }
+        
+        std::vector<uint64_t> segments = log_type::list_segments(directory_);
+        auto it = std::upper_bound(segments.begin(), segments.end(), next_sequence_);
+        
+        if (it == segments.begin()) {
+            if (!segments.empty()) {
+                throw std::runtime_error("log_follower: the log does not go back to sequence " + std::to_string(next_sequence_));
+            }
+            return false;
+        }
+        
+        segment_first_ = *(--it);
+        std::string path = log_type::segment_path(directory_, segment_first_);
+        
+        fd_ = open(path.data(), O_RDONLY);
+        
+        if (fd_ < 0) {
+            // deleted in the meantime
+            throw std::runtime_error("log_follower: the log does not go back to sequence " + std::to_string(next_sequence_));
+        }
+        if (!log_type::check_segment_header(fd_, segment_first_)) {
+            // the segments appear with their headers: this one is torn, until the writer reopens the log
+            close(fd_);
+            fd_ = -1;
+            throw std::runtime_error("log_follower: " + path + " is not a valid segment");
+        }
+        return true;
+    }
+    
+    bool has_next_segment() const
+    {
+        std::vector<uint64_t> segments = log_type::list_segments(directory_);
+        return !segments.empty() && segments.back() > segment_first_;
+    }
+    
+    Map& map_;
+    std::string directory_;
+    uint64_t next_sequence_;
+    
+    int fd_;
+    uint64_t segment_first_;
+};
+
+} // namespace ssdmap
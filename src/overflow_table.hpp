@@ -0,0 +1,1013 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <limits>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "slot_traits.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** @file overflow_table.hpp
+ * @brief Header that defines the overflow_table class, the in-memory store of the elements that do not fit in their bucket.
+ *
+ *
+ */
+
+
+/*
+ * Architecture of the overflow table
+ *
+
+    ctrl_   |h2|h2|E |D |h2|E |...|h2|   one control byte per slot, scanned 16 at a time
+    slots_  |i0|i1|  |  |i4|  |...|ik|   32 bits index of the entry in the arena
+
+    arena   [ block 0 | block 1 | ... ]  fixed size blocks of entries, never moved
+    entry   | bucket | hash | next | value |
+
+    heads_  bucket -> (first entry, last entry) of the chain of entries attached to a bucket
+ */
+
+namespace ssdmap {
+
+/** @class overflow_table
+ *  @brief A flat open-addressing table storing the overflowing elements of a bucket_map.
+ *
+ *  The table is keyed by the element's key (not by its hash), so two distinct keys with the same hash value never replace each other.
+ *  Each element is also attached to the index of the bucket it overflowed from: the elements of one bucket are chained together, so that they can be extracted at once when the bucket is split.
+ *  Lookups use Swiss-table-style control bytes: each slot has a byte containing 7 bits of the hash value, and groups of 16 control bytes are compared at once.
+ *  The elements themselves are stored in an arena of fixed size blocks, so they are never moved when the table grows.
+ *  A point-in-time image of the elements can be taken without copying them (see frozen_image): the blocks are copied when they are first modified.
+ *  As for the buckets, several elements with the same key can be inserted: find() returns one of them.
+ *
+ *  @tparam Value   Type of the stored elements.
+ *  @tparam Key     Type of the keys.
+ *  @tparam Pred    Equality predicate on the keys.
+ *  @tparam Traits  Slot traits giving the key of an element with Traits::key(). This defaults to map_slot_traits: Value::first is the key of the element.
+ */
+
+template <class Value, class Key, class Pred = std::equal_to<Key>, class Traits = map_slot_traits<Key, typename Value::second_type>>
+class overflow_table {
+public:
+    typedef Value                   value_type;     /**< @brief The first template parameter (Value)	*/
+    typedef Key                     key_type;       /**< @brief The second template parameter (Key)	*/
+    typedef Pred                    key_equal;      /**< @brief The third template parameter (Pred)	*/
+    typedef size_t                  size_type;      /**< @brief size_t	*/
+    typedef uint32_t                index_type;     /**< @brief Type of the indices in the arena	*/
+
+private:
+    struct entry
+    {
+        size_t      bucket; // the bucket the element overflowed from
+        size_t      hash;   // the full hash of the key
+        index_type  next;   // next element of the same bucket, or next free entry
+        value_type  value;
+    };
+
+    typedef typename std::aligned_storage<sizeof(entry), alignof(entry)>::type entry_storage;
+
+    struct chain
+    {
+        index_type  head;
+        index_type  tail;
+    };
+
+    static constexpr size_t kGroupWidth = 16;
+    static constexpr size_t kArenaBlockShift = 10;
+    static constexpr size_t kArenaBlockSize = 1 << kArenaBlockShift;
+    static constexpr index_type kNullIndex = std::numeric_limits<index_type>::max();
+    static constexpr size_t kNoBucket = std::numeric_limits<size_t>::max();
+
+    static constexpr int8_t kEmpty = -128;  // 0b10000000
+    static constexpr int8_t kDeleted = -2;  // 0b11111110
+
+public:
+
+    class const_iterator /**< @brief Forward iterator over the elements of the table	*/
+    {
+    private:
+        const overflow_table    *table_;
+        size_type               slot_;
+
+        typedef     std::forward_iterator_tag   iterator_category;
+
+        void skip_empty()
+        {
+            while (slot_ < table_->capacity_ && table_->ctrl_[slot_] < 0) {
+                slot_++;
+            }
+        }
+
+    public:
+        const_iterator()
+        : table_(NULL), slot_(0)
+        {}
+
+        const_iterator(const overflow_table* t, size_type slot)
+        : table_(t), slot_(slot)
+        {
+            skip_empty();
+        }
+
+        const_iterator& operator++() //prefix increment
+        {
+            slot_++;
+            skip_empty();
+            return (*this);
+        }
+
+        const_iterator operator++(int) //postfix increment
+        {
+            const_iterator cpy(*this);
+            ++(*this);
+            return cpy;
+        }
+
+        const value_type& operator*() const
+        {
+            return table_->get_entry(table_->slots_[slot_]).value;
+        }
+
+        const value_type* operator->() const
+        {
+            return &(table_->get_entry(table_->slots_[slot_]).value);
+        }
+
+        /**
+         *  @brief Return the index of the bucket the pointed element is attached to.
+         */
+        size_t bucket() const
+        {
+            return table_->get_entry(table_->slots_[slot_]).bucket;
+        }
+
+        /**
+         *  @brief Return the hash value of the pointed element.
+         */
+        size_t hash() const
+        {
+            return table_->get_entry(table_->slots_[slot_]).hash;
+        }
+
+        friend bool operator==(const const_iterator& a, const const_iterator& b)
+        {
+            return (a.table_ == b.table_) && (a.slot_ == b.slot_);
+        }
+        friend bool operator!=(const const_iterator& a, const const_iterator& b)
+        {
+            return !(a == b);
+        }
+    };
+
+    /** @class frozen_image
+     *  @brief A copy-on-write image of the elements of a table, as they were when the image was created.
+     *
+     *  Creating an image only records the addresses of the blocks of the arena. Once the image is set on the table (see set_frozen_image()), every modification of an entry first copies its block, if it was not copied yet.
+     *  A background thread copies the other blocks (copy_all()), and can then visit the elements of the image (for_each_chained()) while the table is modified.
+     *  Every block is copied exactly once. The elements must be trivially copyable.
+     */
+    class frozen_image
+    {
+    public:
+        /**
+         *  @brief Constructor
+         *
+         *  The table must not be modified during the call.
+         *
+         *  @param  t   The table.
+         */
+        explicit frozen_image(const overflow_table& t)
+        : size_(t.arena_size_), state_(new std::atomic<uint8_t>[t.arena_.size()]), copies_(t.arena_.size())
+        {
+            blocks_.reserve(t.arena_.size());
+            by_address_.reserve(t.arena_.size());
+
+            for (size_type b = 0; b < t.arena_.size(); b++) {
+                blocks_.push_back(t.arena_[b].get());
+                by_address_.push_back(std::make_pair(t.arena_[b].get(), b));
+                state_[b].store(kNotCopied);
+            }
+            std::sort(by_address_.begin(), by_address_.end());
+        }
+
+        frozen_image(const frozen_image&) = delete;
+        frozen_image& operator=(const frozen_image&) = delete;
+
+        /**
+         *  @brief Copy the block containing an element, if it was not copied yet.
+         *
+         *  Must be called *before* the element is modified. Does nothing if the element is not in a block of the image.
+         *
+         *  @param  v   The address of the element.
+         */
+        void preserve(const void* v)
+        {
+            auto it = std::upper_bound(by_address_.begin(), by_address_.end(), std::make_pair(static_cast<const entry_storage*>(v), blocks_.size()));
+
+            if (it != by_address_.begin()) {
+                --it;
+                if (static_cast<const entry_storage*>(v) < it->first + kArenaBlockSize) {
+                    copy_block(it->second);
+                }
+            }
+        }
+
+        /**
+         *  @brief Copy all the blocks that were not copied yet, and wait for the ones being copied by the writers.
+         */
+        void copy_all()
+        {
+            for (size_type b = 0; b < blocks_.size(); b++) {
+                copy_block(b);
+            }
+        }
+
+        /**
+         *  @brief Visit the elements of the image, bucket by bucket.
+         *
+         *  Calls @a fn(bucket, hash, value) on every element of the image. As with overflow_table::for_each_chained(), the elements attached to the same bucket are visited together, in insertion order.
+         *  Must be called after copy_all().
+         *
+         *  @param  fn      A function object called on every element.
+         */
+        template <class F>
+        void for_each_chained(F fn) const
+        {
+            // the first entry of a chain is the only one that is not the next of another entry
+            std::vector<bool> linked(size_, false);
+
+            for (index_type i = 0; i < size_; i++) {
+                const entry& e = get_entry(i);
+
+                if (e.bucket != kNoBucket && e.next != kNullIndex) {
+                    linked[e.next] = true;
+                }
+            }
+            for (index_type i = 0; i < size_; i++) {
+                if (get_entry(i).bucket == kNoBucket || linked[i]) {
+                    continue;
+                }
+                for (index_type index = i; index != kNullIndex; index = get_entry(index).next) {
+                    const entry& e = get_entry(index);
+                    fn(e.bucket, e.hash, static_cast<const value_type&>(e.value));
+                }
+            }
+        }
+
+    private:
+        friend class overflow_table;
+
+        static constexpr uint8_t kNotCopied = 0;
+        static constexpr uint8_t kCopying = 1;
+        static constexpr uint8_t kCopied = 2;
+
+        // copy a block, or wait for the thread copying it
+        void copy_block(size_type b)
+        {
+            if (b >= blocks_.size()) {
+                return;
+            }
+            uint8_t expected = kNotCopied;
+
+            if (state_[b].compare_exchange_strong(expected, kCopying, std::memory_order_acq_rel)) {
+                copies_[b].reset(new entry_storage[kArenaBlockSize]);
+                memcpy(static_cast<void*>(copies_[b].get()), blocks_[b], kArenaBlockSize*sizeof(entry_storage));
+                state_[b].store(kCopied, std::memory_order_release);
+                return;
+            }
+            while (state_[b].load(std::memory_order_acquire) != kCopied) {
+                std::this_thread::yield();
+            }
+        }
+
+        inline const entry& get_entry(index_type index) const
+        {
+            return *reinterpret_cast<const entry*>(&copies_[index >> kArenaBlockShift][index & (kArenaBlockSize-1)]);
+        }
+
+        index_type size_; // number of entries of the arena when the image was created
+        std::vector<const entry_storage*> blocks_;
+        std::vector<std::pair<const entry_storage*, size_type>> by_address_;
+        std::unique_ptr<std::atomic<uint8_t>[]> state_;
+        std::vector<std::unique_ptr<entry_storage[]>> copies_;
+    };
+
+    /**
+     *  @brief Constructor
+     *
+     *  Constructs an empty table. No memory is allocated until the first insertion.
+     *
+     *  @param  eql     Comparison function object for the keys.
+     */
+    explicit overflow_table(const key_equal& eql = key_equal())
+    : capacity_(0), size_(0), deleted_(0), arena_size_(0), free_list_(kNullIndex), heads_capacity_(0), heads_size_(0), eql_(eql), frozen_(NULL)
+    {
+    }
+
+    overflow_table(const overflow_table&) = delete;
+    overflow_table& operator=(const overflow_table&) = delete;
+
+    /**
+     *  @brief Destructor
+     */
+    ~overflow_table()
+    {
+        clear();
+    }
+
+    /**
+     *  @brief Return the number of elements in the table.
+     */
+    inline size_type size() const
+    {
+        return size_;
+    }
+
+    /**
+     *  @brief Test whether the table is empty.
+     */
+    inline bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    /**
+     *  @brief Return the number of slots of the table.
+     */
+    inline size_type capacity() const
+    {
+        return capacity_;
+    }
+
+    /**
+     *  @brief Return the memory used by the table.
+     *
+     *  Returns the number of bytes allocated for the control bytes, the slots, the arena and the bucket chains, plus the size of the table object itself.
+     *
+     *  @return The memory footprint (in bytes) of the table.
+     */
+    size_type memory_usage() const
+    {
+        return sizeof(overflow_table)
+        + ctrl_.capacity()*sizeof(int8_t)
+        + slots_.capacity()*sizeof(index_type)
+        + arena_.capacity()*sizeof(typename decltype(arena_)::value_type)
+        + arena_.size()*kArenaBlockSize*sizeof(entry_storage)
+        + heads_keys_.capacity()*sizeof(size_t)
+        + heads_chains_.capacity()*sizeof(chain);
+    }
+
+    /**
+     *  @brief Returns iterator to beginning.
+     */
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+
+    /**
+     *  @brief Returns iterator to end.
+     */
+    const_iterator end() const
+    {
+        return const_iterator(this, capacity_);
+    }
+
+    //@{
+    /**
+     *  @brief Find an element
+     *
+     *  Searches the table for an element with key @a key. If several elements have this key, one of them is returned.
+     *
+     *  @param  key     The key to be searched for.
+     *  @param  hash    The hash value of @a key.
+     *
+     *  @return A pointer to the element if it was found, NULL otherwise.
+     */
+    value_type* find(const key_type& key, size_t hash)
+    {
+        size_type slot = find_slot(key, hash);
+        if (slot == capacity_) {
+            return NULL;
+        }
+        return &(get_entry(slots_[slot]).value);
+    }
+
+    const value_type* find(const key_type& key, size_t hash) const
+    {
+        size_type slot = find_slot(key, hash);
+        if (slot == capacity_) {
+            return NULL;
+        }
+        return &(get_entry(slots_[slot]).value);
+    }
+    //@}
+
+    /**
+     *  @brief Visit all the elements with a key
+     *
+     *  Calls @a fn(value) on every element with key @a key, in no particular order. The table must not be modified during the call.
+     *
+     *  @param  key     The key to be searched for.
+     *  @param  hash    The hash value of @a key.
+     *  @param  fn      A function object called on every matching element.
+     *
+     *  @return The number of matching elements.
+     */
+    template <class F>
+    size_type for_each_match(const key_type& key, size_t hash, F fn) const
+    {
+        if (size_ == 0) {
+            return 0;
+        }
+        int8_t tag = h2(hash);
+        size_type g = first_group(hash);
+        size_type count = 0;
+
+        // same probing as find_slot(), but without stopping at the first match
+        for (size_type i = 1; i <= capacity_/kGroupWidth; i++) {
+            uint32_t m = match_group(g, tag);
+
+            while (m != 0) {
+                const entry& e = get_entry(slots_[g + lowest_bit(m)]);
+                if (e.hash == hash && eql_(Traits::key(e.value), key)) {
+                    fn(static_cast<const value_type&>(e.value));
+                    count++;
+                }
+                m &= m-1;
+            }
+            if (match_group(g, kEmpty) != 0) {
+                break;
+            }
+            g = next_group(g, i);
+        }
+        return count;
+    }
+
+    /**
+     *  @brief Insert an element
+     *
+     *  Inserts @a v in the table, and attaches it to bucket @a bucket. Elements with an already present key are inserted anyway.
+     *
+     *  @param  bucket  The index of the bucket the element overflowed from.
+     *  @param  hash    The hash value of the element's key.
+     *  @param  v       The element to be inserted.
+     *
+     *  @exception std::length_error The arena cannot address more elements.
+     */
+    void insert(size_t bucket, size_t hash, const value_type& v)
+    {
+        if ((size_ + deleted_ + 1)*8 > capacity_*7) {
+            rehash(((size_+1)*8 > capacity_*7/2) ? std::max<size_type>(2*capacity_, size_type(kGroupWidth)) : capacity_);
+        }
+
+        index_type index = allocate_entry();
+        preserve_entry(index);
+        entry *e = &get_entry(index);
+
+        e->bucket = bucket;
+        e->hash = hash;
+        e->next = kNullIndex;
+        new (&(e->value)) value_type(v);
+
+        link_entry(bucket, index);
+
+        size_type slot = find_insert_slot(hash);
+        if (ctrl_[slot] == kDeleted) {
+            deleted_--;
+        }
+        set_ctrl(slot, h2(hash));
+        slots_[slot] = index;
+        size_++;
+    }
+
+    /**
+     *  @brief Visit the elements attached to a bucket.
+     *
+     *  Calls @a fn(value) on all the elements attached to bucket @a bucket, in insertion order. The table must not be modified during the call.
+     *
+     *  @param  bucket  The index of the bucket.
+     *  @param  fn      A function object called on every element.
+     */
+    template <class F>
+    void for_each_in_bucket(size_t bucket, F fn) const
+    {
+        if (heads_size_ == 0) {
+            return;
+        }
+        size_type p = heads_position(bucket);
+
+        if (heads_keys_[p] == kNoBucket) {
+            return;
+        }
+
+        for (index_type index = heads_chains_[p].head; index != kNullIndex; index = get_entry(index).next) {
+            fn(static_cast<const value_type&>(get_entry(index).value));
+        }
+    }
+
+    /**
+     *  @brief Visit all the elements, bucket by bucket.
+     *
+     *  Calls @a fn(bucket, hash, value) on every element of the table. Contrary to the iterators, that follow the slots of the table, the elements attached to the same bucket are visited together, in insertion order. The table must not be modified during the call.
+     *
+     *  @param  fn      A function object called on every element.
+     */
+    template <class F>
+    void for_each_chained(F fn) const
+    {
+        for (size_type p = 0; p < heads_capacity_ && heads_size_ > 0; p++) {
+            if (heads_keys_[p] == kNoBucket) {
+                continue;
+            }
+            for (index_type index = heads_chains_[p].head; index != kNullIndex; index = get_entry(index).next) {
+                const entry& e = get_entry(index);
+                fn(e.bucket, e.hash, static_cast<const value_type&>(e.value));
+            }
+        }
+    }
+
+    /**
+     *  @brief Extract the elements attached to a bucket.
+     *
+     *  Removes from the table all the elements attached to bucket @a bucket, and calls @a fn(hash, value) on each of them, in insertion order.
+     *  @a fn is allowed to insert new elements in the table, including in bucket @a bucket.
+     *
+     *  @param  bucket  The index of the bucket.
+     *  @param  fn      A function object called on every extracted element.
+     *
+     *  @return The number of extracted elements.
+     */
+    template <class F>
+    size_type extract_bucket(size_t bucket, F fn)
+    {
+        index_type index = unlink_chain(bucket);
+        size_type count = 0;
+
+        while (index != kNullIndex) {
+            entry& e = get_entry(index);
+            index_type next = e.next;
+
+            erase_slot(slot_of(e.hash, index));
+            fn(e.hash, static_cast<const value_type&>(e.value));
+            free_entry(index);
+
+            index = next;
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     *  @brief Replace the content of the table by a copy of another table.
+     *
+     *  The storage of @a t is copied block by block, which is much faster than inserting its elements one by one. The copy visits its elements in the same order as @a t.
+     *  The elements must be trivially copyable.
+     *
+     *  @param  t   The copied table.
+     */
+    void copy_from(const overflow_table& t)
+    {
+        clear();
+
+        ctrl_ = t.ctrl_;
+        slots_ = t.slots_;
+        capacity_ = t.capacity_;
+        size_ = t.size_;
+        deleted_ = t.deleted_;
+
+        arena_.reserve(t.arena_.size());
+        for (const auto &block : t.arena_) {
+            arena_.push_back(std::unique_ptr<entry_storage[]>(new entry_storage[kArenaBlockSize]));
+            memcpy(static_cast<void*>(arena_.back().get()), block.get(), kArenaBlockSize*sizeof(entry_storage));
+        }
+        arena_size_ = t.arena_size_;
+        free_list_ = t.free_list_;
+
+        heads_keys_ = t.heads_keys_;
+        heads_chains_ = t.heads_chains_;
+        heads_capacity_ = t.heads_capacity_;
+        heads_size_ = t.heads_size_;
+    }
+
+    /**
+     *  @brief Set the image of the table.
+     *
+     *  Once set, every modification of the table first preserves the modified entries in @a image (see frozen_image::preserve()).
+     *  The image is not owned by the table.
+     *
+     *  @param  image   An image of the table, or NULL when no image is being taken.
+     */
+    inline void set_frozen_image(frozen_image* image)
+    {
+        frozen_ = image;
+    }
+
+    /**
+     *  @brief Preserve an element in the image of the table.
+     *
+     *  Must be called *before* an element returned by find() is modified. Does nothing if no image is set, or if @a v is not an element of the table.
+     *
+     *  @param  v   The address of the modified element.
+     */
+    inline void preserve(const value_type* v)
+    {
+        if (frozen_ != NULL) {
+            frozen_->preserve(v);
+        }
+    }
+
+    /**
+     *  @brief Remove all the elements, and release the memory.
+     */
+    void clear()
+    {
+        // the image still needs the blocks
+        if (frozen_ != NULL) {
+            frozen_->copy_all();
+        }
+
+        for (size_type i = 0; i < capacity_; i++) {
+            if (ctrl_[i] >= 0) {
+                get_entry(slots_[i]).value.~value_type();
+            }
+        }
+
+        std::vector<int8_t>().swap(ctrl_);
+        std::vector<index_type>().swap(slots_);
+        std::vector<std::unique_ptr<entry_storage[]>>().swap(arena_);
+        std::vector<size_t>().swap(heads_keys_);
+        std::vector<chain>().swap(heads_chains_);
+
+        capacity_ = 0;
+        size_ = 0;
+        deleted_ = 0;
+        arena_size_ = 0;
+        free_list_ = kNullIndex;
+        heads_capacity_ = 0;
+        heads_size_ = 0;
+    }
+
+private:
+
+    static inline size_t mix(size_t hash)
+    {
+        // the low order bits of the hash values are used to choose the buckets of the map:
+        // all the elements overflowing from the same bucket share them
+        uint64_t m = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(m ^ (m >> 32));
+    }
+
+    static inline int8_t h2(size_t hash)
+    {
+        return static_cast<int8_t>(mix(hash) & 0x7F);
+    }
+
+    static inline size_t h1(size_t hash)
+    {
+        return mix(hash) >> 7;
+    }
+
+    inline void set_ctrl(size_type slot, int8_t c)
+    {
+        ctrl_[slot] = c;
+    }
+
+    // bitmask of the slots of the group starting at g whose control byte is c
+    inline uint32_t match_group(size_type g, int8_t c) const
+    {
+#ifdef __SSE2__
+        __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&ctrl_[g]));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c))));
+#else
+        uint32_t m = 0;
+        for (size_type i = 0; i < kGroupWidth; i++) {
+            if (ctrl_[g+i] == c) {
+                m |= (1U << i);
+            }
+        }
+        return m;
+#endif
+    }
+
+    // bitmask of the slots of the group starting at g that are empty or deleted
+    inline uint32_t match_free(size_type g) const
+    {
+#ifdef __SSE2__
+        __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&ctrl_[g]));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmplt_epi8(ctrl, _mm_set1_epi8(-1))));
+#else
+        uint32_t m = 0;
+        for (size_type i = 0; i < kGroupWidth; i++) {
+            if (ctrl_[g+i] < -1) {
+                m |= (1U << i);
+            }
+        }
+        return m;
+#endif
+    }
+
+    static inline size_type lowest_bit(uint32_t m)
+    {
+        return static_cast<size_type>(__builtin_ctz(m));
+    }
+
+    // iterate over the groups with a triangular probing sequence:
+    // as the number of groups is a power of 2, every group is visited
+    inline size_type first_group(size_t hash) const
+    {
+        return (h1(hash) & (capacity_/kGroupWidth - 1))*kGroupWidth;
+    }
+
+    inline size_type next_group(size_type g, size_type i) const
+    {
+        return (g + i*kGroupWidth) & (capacity_-1);
+    }
+
+    size_type find_slot(const key_type& key, size_t hash) const
+    {
+        if (size_ == 0) {
+            return capacity_;
+        }
+        int8_t tag = h2(hash);
+        size_type g = first_group(hash);
+
+        for (size_type i = 1; i <= capacity_/kGroupWidth; i++) {
+            uint32_t m = match_group(g, tag);
+
+            while (m != 0) {
+                size_type slot = g + lowest_bit(m);
+                const entry& e = get_entry(slots_[slot]);
+                if (e.hash == hash && eql_(Traits::key(e.value), key)) {
+                    return slot;
+                }
+                m &= m-1;
+            }
+            if (match_group(g, kEmpty) != 0) {
+                break;
+            }
+            g = next_group(g, i);
+        }
+        return capacity_;
+    }
+
+    // find the slot of the entry at index in the arena
+    size_type slot_of(size_t hash, index_type index) const
+    {
+        int8_t tag = h2(hash);
+        size_type g = first_group(hash);
+
+        for (size_type i = 1; i <= capacity_/kGroupWidth; i++) {
+            uint32_t m = match_group(g, tag);
+
+            while (m != 0) {
+                size_type slot = g + lowest_bit(m);
+                if (slots_[slot] == index) {
+                    return slot;
+                }
+                m &= m-1;
+            }
+            g = next_group(g, i);
+        }
+        throw std::logic_error("overflow_table: corrupted table");
+    }
+
+    size_type find_insert_slot(size_t hash) const
+    {
+        size_type g = first_group(hash);
+
+        for (size_type i = 1; ; i++) {
+            uint32_t m = match_free(g);
+            if (m != 0) {
+                return g + lowest_bit(m);
+            }
+            g = next_group(g, i);
+        }
+    }
+
+    void erase_slot(size_type slot)
+    {
+        // a slot can be marked as empty if its group was never full:
+        // in that case, no probing sequence went through the group
+        size_type g = slot & ~(kGroupWidth-1);
+        if (match_group(g, kEmpty) != 0) {
+            set_ctrl(slot, kEmpty);
+        }else{
+            set_ctrl(slot, kDeleted);
+            deleted_++;
+        }
+        size_--;
+    }
+
+    void rehash(size_type new_capacity)
+    {
+        std::vector<int8_t> old_ctrl(new_capacity, kEmpty);
+        std::vector<index_type> old_slots(new_capacity);
+
+        old_ctrl.swap(ctrl_);
+        old_slots.swap(slots_);
+
+        size_type old_capacity = capacity_;
+        capacity_ = new_capacity;
+        deleted_ = 0;
+
+        for (size_type i = 0; i < old_capacity; i++) {
+            if (old_ctrl[i] >= 0) {
+                size_t hash = get_entry(old_slots[i]).hash;
+                size_type slot = find_insert_slot(hash);
+                set_ctrl(slot, old_ctrl[i]);
+                slots_[slot] = old_slots[i];
+            }
+        }
+    }
+
+    inline entry& get_entry(index_type index)
+    {
+        return *reinterpret_cast<entry*>(&arena_[index >> kArenaBlockShift][index & (kArenaBlockSize-1)]);
+    }
+
+    inline const entry& get_entry(index_type index) const
+    {
+        return *reinterpret_cast<const entry*>(&arena_[index >> kArenaBlockShift][index & (kArenaBlockSize-1)]);
+    }
+
+    index_type allocate_entry()
+    {
+        if (free_list_ != kNullIndex) {
+            index_type index = free_list_;
+            free_list_ = get_entry(index).next;
+            return index;
+        }
+
+        if (arena_size_ == kNullIndex) {
+            throw std::length_error("overflow_table: too many elements");
+        }
+
+        if ((arena_size_ >> kArenaBlockShift) == arena_.size()) {
+            arena_.push_back(std::unique_ptr<entry_storage[]>(new entry_storage[kArenaBlockSize]));
+        }
+        return arena_size_++;
+    }
+
+    void free_entry(index_type index)
+    {
+        preserve_entry(index);
+
+        entry& e = get_entry(index);
+        e.value.~value_type();
+        e.bucket = kNoBucket; // see frozen_image::for_each_chained()
+        e.next = free_list_;
+        free_list_ = index;
+    }
+
+    inline void preserve_entry(index_type index)
+    {
+        if (frozen_ != NULL) {
+            frozen_->copy_block(index >> kArenaBlockShift);
+        }
+    }
+
+    // the bucket chains are indexed by a linear probing map from bucket indices to chains
+
+    size_type heads_position(size_t bucket) const
+    {
+        size_type p = static_cast<size_type>(mix(bucket)) & (heads_capacity_-1);
+
+        while (heads_keys_[p] != kNoBucket && heads_keys_[p] != bucket) {
+            p = (p+1) & (heads_capacity_-1);
+        }
+        return p;
+    }
+
+    void grow_heads()
+    {
+        size_type new_capacity = std::max<size_type>(2*heads_capacity_, size_type(kGroupWidth));
+
+        std::vector<size_t> old_keys(new_capacity, kNoBucket);
+        std::vector<chain> old_chains(new_capacity);
+        old_keys.swap(heads_keys_);
+        old_chains.swap(heads_chains_);
+
+        size_type old_capacity = heads_capacity_;
+        heads_capacity_ = new_capacity;
+
+        for (size_type i = 0; i < old_capacity; i++) {
+            if (old_keys[i] != kNoBucket) {
+                size_type p = heads_position(old_keys[i]);
+                heads_keys_[p] = old_keys[i];
+                heads_chains_[p] = old_chains[i];
+            }
+        }
+    }
+
+    void link_entry(size_t bucket, index_type index)
+    {
+        if ((heads_size_ + 1)*4 > heads_capacity_*3) {
+            grow_heads();
+        }
+
+        size_type p = heads_position(bucket);
+
+        if (heads_keys_[p] == kNoBucket) {
+            heads_keys_[p] = bucket;
+            heads_chains_[p].head = index;
+            heads_chains_[p].tail = index;
+            heads_size_++;
+        }else{
+            preserve_entry(heads_chains_[p].tail);
+            get_entry(heads_chains_[p].tail).next = index;
+            heads_chains_[p].tail = index;
+        }
+    }
+
+    // detach the chain of a bucket and return its first entry
+    index_type unlink_chain(size_t bucket)
+    {
+        if (heads_size_ == 0) {
+            return kNullIndex;
+        }
+        size_type p = heads_position(bucket);
+
+        if (heads_keys_[p] == kNoBucket) {
+            return kNullIndex;
+        }
+        index_type head = heads_chains_[p].head;
+
+        // backward shift deletion
+        size_type hole = p;
+        size_type q = p;
+        while (true) {
+            q = (q+1) & (heads_capacity_-1);
+            if (heads_keys_[q] == kNoBucket) {
+                break;
+            }
+            size_type ideal = static_cast<size_type>(mix(heads_keys_[q])) & (heads_capacity_-1);
+
+            // move the element at q in the hole if its ideal position is not in (hole, q]
+            if (((q - ideal) & (heads_capacity_-1)) >= ((q - hole) & (heads_capacity_-1))) {
+                heads_keys_[hole] = heads_keys_[q];
+                heads_chains_[hole] = heads_chains_[q];
+                hole = q;
+            }
+        }
+        heads_keys_[hole] = kNoBucket;
+        heads_size_--;
+
+        return head;
+    }
+
+    std::vector<int8_t>                             ctrl_;
+    std::vector<index_type>                         slots_;
+    size_type                                       capacity_;
+    size_type                                       size_;
+    size_type                                       deleted_;
+
+    std::vector<std::unique_ptr<entry_storage[]>>   arena_;
+    index_type                                      arena_size_;
+    index_type                                      free_list_;
+
+    std::vector<size_t>                             heads_keys_;
+    std::vector<chain>                              heads_chains_;
+    size_type                                       heads_capacity_;
+    size_type                                       heads_size_;
+
+    key_equal                                       eql_;
+
+    frozen_image*                                   frozen_;
+};
+
+} // namespace ssdmap
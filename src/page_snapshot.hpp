@@ -0,0 +1,253 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/** @file page_snapshot.hpp
+ * @brief Header that defines the page_snapshot class, a copy-on-write image of a memory range.
+ *
+ *
+ */
+
+namespace ssdmap {
+
+/** @class page_snapshot
+ *  @brief A copy-on-write image of a memory range, written to a file.
+ *
+ *  When the snapshot is created, every page of the range is owed to the file, at the same offset.
+ *  A background thread copies the pages in order (copy_all()) while the writers keep modifying the range: before modifying a page, a writer calls preserve(), which copies the page first if it was not copied yet.
+ *  Every page is copied exactly once, with its content at the time of the snapshot. Once a page was copied, preserve() is a single load.
+ *  The file can be given after the snapshot was taken (see set_file()): the pages copied before are kept in memory until then, so that the file is not created by the thread taking the snapshot.
+ */
+class page_snapshot
+{
+public:
+    typedef size_t size_type;
+
+    /**
+     *  @brief Constructor
+     *
+     *  @param  base        The beginning of the range.
+     *  @param  length      The length (in bytes) of the range.
+     *  @param  fd          The file the pages are copied to, or -1 if it is given later with set_file(). It is not owned by the snapshot.
+     *  @param  page_size   The size (in bytes) of the copied pages. Must be a power of 2.
+     */
+    page_snapshot(const void* base, size_type length, int fd, size_type page_size)
+    : base_(static_cast<const unsigned char*>(base)), length_(length), fd_(fd), has_file_(fd >= 0), page_shift_(__builtin_ctzll(page_size)),
+    page_count_((length + page_size - 1) >> page_shift_), word_count_((page_count_ + 63)/64),
+    claimed_(new std::atomic<uint64_t>[word_count_]), copied_(new std::atomic<uint64_t>[word_count_]), error_(0)
+    {
+        for (size_type i = 0; i < word_count_; i++) {
+            claimed_[i].store(0);
+            copied_[i].store(0);
+        }
+    }
+
+    page_snapshot(const page_snapshot&) = delete;
+    page_snapshot& operator=(const page_snapshot&) = delete;
+
+    /**
+     *  @brief Return the number of pages of the snapshot.
+     */
+    inline size_type page_count() const
+    {
+        return page_count_;
+    }
+
+    /**
+     *  @brief Copy the page containing a byte, if it was not copied yet.
+     *
+     *  Must be called *before* the page is modified. If another thread is copying the page, waits for the copy to complete.
+     *  Offsets past the end of the snapshot (pages added after it was taken) are ignored.
+     *
+     *  @param  offset  The offset (in bytes) of the byte that will be modified.
+     */
+    inline void preserve(size_type offset)
+    {
+        size_type page = offset >> page_shift_;
+
+        if (page >= page_count_) {
+            return;
+        }
+
+        uint64_t bit = 1ULL << (page%64);
+
+        if ((copied_[page/64].load(std::memory_order_acquire) & bit) == 0) {
+            copy_pages(page/64, bit, true);
+        }
+    }
+
+    /**
+     *  @brief Set the file the pages are copied to.
+     *
+     *  Writes the pages that were copied in memory since the snapshot was taken. Must be called once, before copy_all(), if the snapshot was created without a file.
+     *
+     *  @param  fd  The file the pages are copied to. It is not owned by the snapshot. If it is negative, the copies fail (see error()).
+     */
+    void set_file(int fd)
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        fd_ = fd;
+
+        for (auto &copy : pending_) {
+            write_range(copy.second.data(), copy.first, copy.second.size());
+        }
+        std::vector<std::pair<size_type, std::vector<unsigned char>>>().swap(pending_);
+
+        has_file_.store(true, std::memory_order_release);
+    }
+
+    /**
+     *  @brief Copy all the pages that were not copied yet.
+     *
+     *  Does not wait for the pages being copied by the writers (see wait_all()).
+     */
+    void copy_all()
+    {
+        for (size_type i = 0; i < word_count_; i++) {
+            copy_pages(i, word_mask(i), false);
+        }
+    }
+
+    /**
+     *  @brief Wait until every page has been copied.
+     *
+     *  Must be called after copy_all(): the pages are then all claimed, and some of them may still be copied by the writers.
+     */
+    void wait_all() const
+    {
+        for (size_type i = 0; i < word_count_; i++) {
+            while (copied_[i].load(std::memory_order_acquire) != word_mask(i)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     *  @brief Return the error of the first failed write (an errno value), or 0 if all the writes succeeded.
+     */
+    inline int error() const
+    {
+        return error_.load();
+    }
+
+private:
+    inline uint64_t word_mask(size_type i) const
+    {
+        size_type pages = page_count_ - 64*i;
+        return (pages >= 64) ? ~0ULL : ((1ULL << pages) - 1);
+    }
+
+    // claim the pages of mask in word i, copy the ones we won, and (if wait is set) wait for the others
+    void copy_pages(size_type i, uint64_t mask, bool wait)
+    {
+        uint64_t previous = claimed_[i].fetch_or(mask, std::memory_order_acq_rel);
+        uint64_t won = mask & ~previous;
+        uint64_t w = won;
+
+        // write the runs of consecutive pages
+        while (w != 0) {
+            size_type first = __builtin_ctzll(w);
+            size_type end = first;
+
+            while (end < 64 && (w & (1ULL << end)) != 0) {
+                end++;
+            }
+            w &= (end < 64) ? ~((1ULL << end) - 1) : 0;
+
+            write_pages(64*i + first, end - first);
+        }
+
+        if (won != 0) {
+            copied_[i].fetch_or(won, std::memory_order_release);
+        }
+
+        uint64_t others = mask & previous;
+
+        while (wait && (copied_[i].load(std::memory_order_acquire) & others) != others) {
+            std::this_thread::yield();
+        }
+    }
+
+    void write_pages(size_type page, size_type count)
+    {
+        size_type offset = page << page_shift_;
+        size_type length = std::min(count << page_shift_, length_ - offset);
+
+        if (!has_file_.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+
+            // keep the pages until the file is set
+            if (!has_file_.load(std::memory_order_relaxed)) {
+                pending_.push_back(std::make_pair(offset, std::vector<unsigned char>(base_ + offset, base_ + offset + length)));
+                return;
+            }
+        }
+        write_range(base_ + offset, offset, length);
+    }
+
+    void write_range(const unsigned char* p, size_type offset, size_type length)
+    {
+        while (length > 0) {
+            ssize_t r = pwrite(fd_, p, length, static_cast<off_t>(offset));
+
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                int expected = 0;
+                error_.compare_exchange_strong(expected, (r < 0) ? errno : EIO);
+                return;
+            }
+            p += r;
+            offset += static_cast<size_type>(r);
+            length -= static_cast<size_type>(r);
+        }
+    }
+
+    const unsigned char* base_;
+    size_type length_;
+    int fd_;
+    std::atomic<bool> has_file_;
+    std::mutex pending_mutex_;
+    std::vector<std::pair<size_type, std::vector<unsigned char>>> pending_; // pages copied before the file was set
+    size_type page_shift_;
+    size_type page_count_;
+    size_type word_count_;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> claimed_;
+    std::unique_ptr<std::atomic<uint64_t>[]> copied_;
+    std::atomic<int> error_;
+};
+
+} // namespace ssdmap
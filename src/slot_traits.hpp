@@ -0,0 +1,75 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <utility>
+
+/** @file slot_traits.hpp
+ * @brief Header that defines the slot traits, describing what is stored in the slots of the buckets.
+ *
+ *
+ */
+
+namespace ssdmap {
+
+/** @struct map_slot_traits
+ *  @brief Slots storing a key and a mapped value, as in bucket_map.
+ *
+ *  @tparam Key Type of the keys.
+ *  @tparam T   Type of the mapped values.
+ */
+template <class Key, class T>
+struct map_slot_traits
+{
+    typedef std::pair<const Key, T>     value_type;     /**< @brief Type of the content of a slot	*/
+    typedef Key                         key_type;       /**< @brief Type of the keys	*/
+
+    /**
+     *  @brief Return the key of a slot.
+     */
+    static inline const key_type& key(const value_type& v)
+    {
+        return v.first;
+    }
+};
+
+/** @struct set_slot_traits
+ *  @brief Slots storing a key only, as in bucket_set.
+ *
+ *  @tparam Key Type of the keys.
+ */
+template <class Key>
+struct set_slot_traits
+{
+    typedef Key                         value_type;     /**< @brief Type of the content of a slot	*/
+    typedef Key                         key_type;       /**< @brief Type of the keys	*/
+
+    /**
+     *  @brief Return the key of a slot.
+     */
+    static inline const key_type& key(const value_type& v)
+    {
+        return v;
+    }
+};
+
+} // namespace ssdmap
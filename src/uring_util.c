@@ -0,0 +1,244 @@
+/* * ssdmap - Implementation of a disk-resident map designed for SSDs.
+ * Copyright (C) 2016 Raphael Bost
+ *
+ * This file is part of ssdmap.
+ *
+ * ssdmap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ssdmap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "uring_util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SSDMAP_HAS_IO_URING 1
+#endif
+#endif
+
+#ifdef SSDMAP_HAS_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static void reset_ring(uring_st *ring)
+{
+    memset(ring, 0, sizeof(uring_st));
+    ring->fd = -1;
+}
+
+int uring_init(uring_st *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    
+    reset_ring(ring);
+    memset(&p, 0, sizeof(p));
+    
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    
+    if (fd < 0) {
+        return -errno;
+    }
+    
+    // IORING_OP_READ came with the kernel 5.6, just before IORING_FEAT_FAST_POLL:
+    // use the feature flag to rule out older kernels
+    if ((p.features & IORING_FEAT_FAST_POLL) == 0) {
+        close(fd);
+        return -ENOSYS;
+    }
+    
+    ring->fd = fd;
+    ring->entries = p.sq_entries;
+    
+    ring->sq_ring_length = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_length = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        // both rings share the same mapping
+        if (ring->cq_ring_length > ring->sq_ring_length) {
+            ring->sq_ring_length = ring->cq_ring_length;
+        }
+        ring->cq_ring_length = ring->sq_ring_length;
+    }
+    
+    ring->sq_ring = mmap(NULL, ring->sq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    
+    if (ring->sq_ring == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        reset_ring(ring);
+        return -err;
+    }
+    
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }else{
+        ring->cq_ring = mmap(NULL, ring->cq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        
+        if (ring->cq_ring == MAP_FAILED) {
+            int err = errno;
+            munmap(ring->sq_ring, ring->sq_ring_length);
+            close(fd);
+            reset_ring(ring);
+            return -err;
+        }
+    }
+    
+    ring->sqes_length = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    
+    if (ring->sqes == MAP_FAILED) {
+        int err = errno;
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_length);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_length);
+        close(fd);
+        reset_ring(ring);
+        return -err;
+    }
+    
+    unsigned char *sq = (unsigned char *)ring->sq_ring;
+    unsigned char *cq = (unsigned char *)ring->cq_ring;
+    
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = cq + p.cq_off.cqes;
+    
+    return 0;
+}
+
+int uring_queue_read(uring_st *ring, int fd, void *buf, unsigned length, uint64_t offset, uint64_t user_data)
+{
+    // we are the only producer of the submission queue: the tail can be read without synchronization
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    
+    if (tail - head >= ring->entries) {
+        return -1;
+    }
+    
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = ((struct io_uring_sqe *)ring->sqes) + index;
+    
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    
+    ring->sq_array[index] = index;
+    
+    // publish the entry
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    
+    return 0;
+}
+
+int uring_submit(uring_st *ring, unsigned wait_nr)
+{
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait_nr, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    
+    if (ret < 0) {
+        return -errno;
+    }
+    
+    ring->pending -= (unsigned)ret;
+    return ret;
+}
+
+int uring_reap(uring_st *ring, uint64_t *user_data, int *result)
+{
+    // we are the only consumer of the completion queue
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    
+    if (head == tail) {
+        return 0;
+    }
+    
+    struct io_uring_cqe *cqe = ((struct io_uring_cqe *)ring->cqes) + (head & *ring->cq_mask);
+    
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    
+    // give the entry back to the kernel
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    
+    return 1;
+}
+
+void uring_release(uring_st *ring)
+{
+    if (ring->fd < 0) {
+        return;
+    }
+    
+    munmap(ring->sqes, ring->sqes_length);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_length);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_length);
+    close(ring->fd);
+    
+    reset_ring(ring);
+}
+
+#else
+
+int uring_init(uring_st *ring, unsigned entries)
+{
+    memset(ring, 0, sizeof(uring_st));
+    ring->fd = -1;
+    
+    return -ENOSYS;
+}
+
+int uring_queue_read(uring_st *ring, int fd, void *buf, unsigned length, uint64_t offset, uint64_t user_data)
+{
+    return -1;
+}
+
+int uring_submit(uring_st *ring, unsigned wait_nr)
+{
+    return -ENOSYS;
+}
+
+int uring_reap(uring_st *ring, uint64_t *user_data, int *result)
+{
+    return 0;
+}
+
+void uring_release(uring_st *ring)
+{
+}
+
+#endif
@@ -0,0 +1,136 @@
+/* * ssdmap - Implementation of a disk-resident map designed for SSDs.
+ * Copyright (C) 2016 Raphael Bost
+ *
+ * This file is part of ssdmap.
+ *
+ * ssdmap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ssdmap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/** @file uring_util.h
+ * @brief Header defining a minimal io_uring interface, used to submit batches of reads.
+ *
+ *  The ring is set up with the raw system calls, so that the library does not depend on liburing.
+ *  On systems without io_uring, uring_init() fails and the callers fall back to another I/O engine.
+ *
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  @brief  Representation of an io_uring instance.
+ *
+ *
+ *  This structure stores the file descriptor of the ring and the addresses of its shared submission and completion queues.
+ *  A ring must only be used by one thread at a time.
+ *
+ */
+typedef struct
+{
+    int fd;                 /**< @brief The file descriptor of the ring, -1 if the ring is not initialized */
+    unsigned entries;       /**< @brief The number of entries of the submission queue */
+    unsigned pending;       /**< @brief The number of queued requests not yet submitted to the kernel */
+
+    void *sq_ring;          /**< @brief The mapped submission queue ring */
+    size_t sq_ring_length;  /**< @brief The length of the submission queue ring mapping */
+    void *cq_ring;          /**< @brief The mapped completion queue ring (can be the same mapping as sq_ring) */
+    size_t cq_ring_length;  /**< @brief The length of the completion queue ring mapping */
+    void *sqes;             /**< @brief The mapped array of submission queue entries */
+    size_t sqes_length;     /**< @brief The length of the submission queue entries mapping */
+
+    unsigned *sq_head;      /**< @brief The head of the submission queue (written by the kernel) */
+    unsigned *sq_tail;      /**< @brief The tail of the submission queue */
+    unsigned *sq_mask;      /**< @brief The index mask of the submission queue */
+    unsigned *sq_array;     /**< @brief The indirection array of the submission queue */
+    unsigned *cq_head;      /**< @brief The head of the completion queue */
+    unsigned *cq_tail;      /**< @brief The tail of the completion queue (written by the kernel) */
+    unsigned *cq_mask;      /**< @brief The index mask of the completion queue */
+    void *cqes;             /**< @brief The array of completion queue entries */
+}uring_st;
+
+/**
+ *  @brief Initialize an io_uring instance
+ *
+ *  Sets up a ring with (at least) @a entries submission queue entries, and maps its queues.
+ *  The function fails if the kernel does not support io_uring, or is too old to support the IORING_OP_READ operation.
+ *
+ *  @param ring     A pointer to the uring_st structure to initialize.
+ *  @param entries  The number of submission queue entries.
+ *
+ *  @return zero on success, a negative error number (-errno) on failure. On failure, the fd field of @a ring is set to -1.
+ */
+int uring_init(uring_st *ring, unsigned entries);
+
+/**
+ *  @brief Queue a read request
+ *
+ *  Adds a request reading @a length bytes at offset @a offset of the file @a fd into @a buf to the submission queue.
+ *  The request is only sent to the kernel by uring_submit().
+ *
+ *  @param ring         A pointer to the ring.
+ *  @param fd           The file descriptor to read from.
+ *  @param buf          The destination buffer. It must stay valid until the completion of the request.
+ *  @param length       The number of bytes to read.
+ *  @param offset       The offset (in bytes) of the read in the file.
+ *  @param user_data    A value returned with the completion of the request.
+ *
+ *  @return zero on success, -1 if the submission queue is full.
+ */
+int uring_queue_read(uring_st *ring, int fd, void *buf, unsigned length, uint64_t offset, uint64_t user_data);
+
+/**
+ *  @brief Submit the queued requests
+ *
+ *  Sends the queued requests to the kernel, and waits until at least @a wait_nr requests are completed.
+ *
+ *  @param ring     A pointer to the ring.
+ *  @param wait_nr  The number of completions to wait for (0 to return immediately).
+ *
+ *  @return the number of submitted requests on success, a negative error number (-errno) on failure.
+ */
+int uring_submit(uring_st *ring, unsigned wait_nr);
+
+/**
+ *  @brief Reap a completion
+ *
+ *  Pops a completion from the completion queue, if there is one. This function does not block.
+ *
+ *  @param ring         A pointer to the ring.
+ *  @param user_data    Set to the user_data of the completed request.
+ *  @param result       Set to the result of the completed request: the number of bytes read, or a negative error number (-errno).
+ *
+ *  @return 1 if a completion was reaped, 0 if the completion queue is empty.
+ */
+int uring_reap(uring_st *ring, uint64_t *user_data, int *result);
+
+/**
+ *  @brief Release an io_uring instance.
+ *
+ *  Unmaps the queues and closes the ring. The requests must all be completed.
+ *
+ *  @param ring     A pointer to the ring.
+ */
+void uring_release(uring_st *ring);
+
+#ifdef __cplusplus
+}
+#endif
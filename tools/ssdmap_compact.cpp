@@ -0,0 +1,102 @@
+//
+// ssdmap - Implementation of a disk-resident map designed for SSDs.
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of ssdmap.
+//
+// ssdmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ssdmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ssdmap.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// ssdmap_compact: rewrite a map in a clean state (see bucket_map::compact())
+//
+// The element types are not stored with a map: this tool handles the maps
+// from uint64_t to uint64_t, and (with -s) the sets of uint64_t.
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "bucket_map.hpp"
+#include "bucket_set.hpp"
+
+using namespace ssdmap;
+
+static void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [-d] [-s] [-l load] [-t threads] [-m megabytes] source dest\n";
+    std::cerr << "  -d          drop the duplicate keys, keeping the last value (maps with a single candidate bucket and no spill only)\n";
+    std::cerr << "  -s          the source is a bucket_set<uint64_t> (default: bucket_map<uint64_t,uint64_t>)\n";
+    std::cerr << "  -l load     load of the new map (default: " << kBucketMapTargetLoad << ")\n";
+    std::cerr << "  -t threads  number of threads scanning the source (default: number of hardware threads)\n";
+    std::cerr << "  -m MB       memory budget of a pass, in megabytes (default: " << (kCompactionMemoryBudget >> 20) << ")\n";
+}
+
+int main(int argc, char * const argv[]) {
+    compaction_options options;
+    bool set = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "dsl:t:m:h")) != -1) {
+        switch (c) {
+            case 'd':
+                options.drop_duplicates = true;
+                break;
+            case 's':
+                set = true;
+                break;
+            case 'l':
+                options.target_load = strtof(optarg, NULL);
+                break;
+            case 't':
+                options.threads = static_cast<unsigned int>(strtoul(optarg, NULL, 10));
+                break;
+            case 'm':
+                options.memory_budget = static_cast<size_t>(strtoull(optarg, NULL, 10)) << 20;
+                break;
+            default:
+                usage(argv[0]);
+                return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2 || options.target_load <= 0 || options.target_load > 1 || options.threads == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::string source = argv[optind];
+    std::string dest = argv[optind+1];
+
+    try {
+        auto begin = std::chrono::high_resolution_clock::now();
+        size_t n;
+
+        if (set) {
+            n = bucket_set<uint64_t>::compact(source, dest, options);
+        }else{
+            n = bucket_map<uint64_t, uint64_t>::compact(source, dest, options);
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+        double time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count();
+
+        std::cout << "Compacted " << source << " into " << dest << ": " << n << " elements, " << time_ms << " ms" << std::endl;
+    } catch (std::exception &e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}